@@ -12,26 +12,202 @@
 
 #define CONVCODE_DEBUG_STATES 0
 
+#ifdef __GNUC__
+#define CONVCODE_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define CONVCODE_ALWAYS_INLINE inline
+#endif
+
+/*
+ * Statistics, see get_convcode_stats().  STATS_START() gets the cycle
+ * count if timing is on and STATS_END() adds the cycles since then to
+ * the given count.
+ */
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define CONVCODE_HAVE_CYCLES 1
+#endif
+
+#if defined(CONVCODE_STATS) && defined(CONVCODE_HAVE_CYCLES)
+#define CONVCODE_STATS_CYCLES 1
+#endif
+
+/* Also used for timing the kernels, see tune_decode_kernel(). */
+#ifdef CONVCODE_HAVE_CYCLES
+static CONVCODE_ALWAYS_INLINE uint64_t
+read_cycles(void)
+{
+#ifdef __aarch64__
+    uint64_t v;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+#else
+    return __builtin_ia32_rdtsc();
+#endif
+}
+#endif
+
+#ifdef CONVCODE_STATS
+#define STATS_ADD(ce, name, n) ((ce)->stats.name += (n))
+#ifdef CONVCODE_STATS_CYCLES
+#define STATS_START(ce) ((ce)->stats_timing ? read_cycles() : 0)
+#define STATS_END(ce, name, start)				\
+    do {							\
+	if ((ce)->stats_timing)					\
+	    (ce)->stats.name += read_cycles() - (start);	\
+    } while (0)
+#endif
+#else
+#define STATS_ADD(ce, name, n) do { } while (0)
+#endif
+
+#ifndef STATS_START
+#define STATS_START(ce) 0
+#define STATS_END(ce, name, start) do { (void) (start); } while (0)
+#endif
+
+int
+get_convcode_stats(struct convcode *ce, struct convcode_stats *stats)
+{
+#ifdef CONVCODE_STATS
+    *stats = ce->stats;
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+void
+reset_convcode_stats(struct convcode *ce)
+{
+    memset(&ce->stats, 0, sizeof(ce->stats));
+}
+
+int
+set_convcode_stats_timing(struct convcode *ce, bool enable)
+{
+#ifdef CONVCODE_STATS_CYCLES
+    ce->stats_timing = enable;
+    return 0;
+#else
+    return !!enable;
+#endif
+}
+
+#ifdef CONVCODE_STATS
+/* Add the counts from one coder into another's. */
+static void
+add_stats(struct convcode_stats *to, const struct convcode_stats *from)
+{
+    to->symbols_decoded += from->symbols_decoded;
+    to->acs_butterflies += from->acs_butterflies;
+    to->traceback_steps += from->traceback_steps;
+    to->output_calls += from->output_calls;
+    to->renormalizations += from->renormalizations;
+    to->trellis_overflows += from->trellis_overflows;
+    to->merged_bits += from->merged_bits;
+    to->decode_cycles += from->decode_cycles;
+    to->traceback_cycles += from->traceback_cycles;
+    to->encode_cycles += from->encode_cycles;
+}
+#endif
+
 /*
  * The trellis is a two-dimensional matrix, but the size is dynamic
  * based upon how it is created.  So we use a one-dimensional matrix
- * and do our own indexing with the below two functions/macros.
+ * and do our own indexing with the below functions/macros.
  */
-static convcode_state *
+static uint64_t *
 get_trellis_column(struct convcode *ce, unsigned int column)
 {
-    return ce->trellis + column * ce->num_states * sizeof(*ce->trellis);
+    /* In streaming mode the trellis is a ring, see decode_window_flush(). */
+    column += ce->trellis_start;
+    if (column >= ce->trellis_size)
+	column -= ce->trellis_size;
+    /* A growable trellis is in chunks, see set_decode_trellis_growth(). */
+    if (ce->trellis_chunks)
+	return (ce->trellis_chunks[column >> ce->trellis_chunk_shift] +
+		(column & ((1U << ce->trellis_chunk_shift) - 1)) *
+		ce->trellis_col_words);
+    return ce->trellis + column * ce->trellis_col_words;
+}
+
+#define trellis_decision(ce, column, state) \
+    ((get_trellis_column(ce, column)[(state) / 64] >> ((state) % 64)) & 1)
+
+/*
+ * Rebuild the state we came from to get to state in the given
+ * column from the decision bit.
+ */
+static convcode_state
+trellis_prev_state(struct convcode *ce, unsigned int column,
+		   convcode_state state)
+{
+    convcode_state pstate = state >> 1;
+
+    if (trellis_decision(ce, column, state))
+	pstate |= ce->num_states >> 1;
+    return pstate;
+}
+
+/*
+ * After a column's decision has been used in a traceback, it's not
+ * needed any more, so the decoded bit is stored in the first bit of
+ * the column to play it back forward.
+ */
+static void
+trellis_set_bit(struct convcode *ce, unsigned int column, unsigned int bit)
+{
+    uint64_t *col = get_trellis_column(ce, column);
+
+    col[0] = (col[0] & ~(uint64_t) 1) | bit;
+}
+
+/*
+ * The path values are metric_width bits wide.  These are for the
+ * places that aren't performance critical.
+ */
+static unsigned int
+get_path_value(struct convcode *ce, const void *values, unsigned int state)
+{
+    switch (ce->metric_width) {
+    case 8:
+	return ((const uint8_t *) values)[state];
+    case 16:
+	return ((const uint16_t *) values)[state];
+    default:
+	return ((const uint32_t *) values)[state];
+    }
 }
 
-#define trellis_entry(ce, column, row) get_trellis_column(ce, column)[row]
+static void
+set_path_value(struct convcode *ce, void *values, unsigned int state,
+	       unsigned int val)
+{
+    switch (ce->metric_width) {
+    case 8:
+	((uint8_t *) values)[state] = val;
+	break;
+    case 16:
+	((uint16_t *) values)[state] = val;
+	break;
+    default:
+	((uint32_t *) values)[state] = val;
+	break;
+    }
+}
 
 void
 reinit_convencode(struct convcode *ce, unsigned int start_state)
 {
     ce->enc_state = start_state;
+    ce->enc_puncture_pos = 0;
     ce->enc_out.out_bits = 0;
     ce->enc_out.out_bit_pos = 0;
     ce->enc_out.total_out_bits = 0;
+    ce->enc_out.buf_pos = 0;
+    ce->enc_out.buf_bits = 0;
+    ce->enc_out.buf_nbits = 0;
 }
 
 int
@@ -43,18 +219,32 @@ reinit_convdecode(struct convcode *ce, unsigned int start_state,
     if (start_state >= ce->num_states)
 	return 1;
 
+    ce->dec_start_state = start_state;
+    ce->dec_init_val = init_other_states;
     ce->dec_out.out_bits = 0;
     ce->dec_out.out_bit_pos = 0;
     ce->dec_out.total_out_bits = 0;
+    ce->dec_out.buf_pos = 0;
+    ce->dec_out.buf_bits = 0;
+    ce->dec_out.buf_nbits = 0;
+    ce->dec_puncture_pos = 0;
 
-    if (ce->num_states > 0) {
-	ce->curr_path_values[start_state] = 0;
+    if (ce->curr_path_values) {
+	/* Leave room for the paths to grow, see set_decode_metric_width(). */
+	if (ce->metric_width < 32 && init_other_states > ce->metric_max / 4)
+	    init_other_states = ce->metric_max / 4;
+
+	set_path_value(ce, ce->curr_path_values, start_state, 0);
 	for (i = 0; i < ce->num_states; i++) {
 	    if (i == start_state)
 		continue;
-	    ce->curr_path_values[i] = init_other_states;
+	    set_path_value(ce, ce->curr_path_values, i, init_other_states);
 	}
+	ce->metric_offset = 0;
 	ce->ctrellis = 0;
+	ce->trellis_start = 0;
+	ce->merge_count = 0;
+	ce->regex_symbols = 0;
     }
     ce->leftover_bits = 0;
     return 0;
@@ -81,40 +271,167 @@ reverse_bits(unsigned int k, unsigned int val)
     return rv;
 }
 
-/* Is the number of set bits in the value odd?  Return 1 if true, 0 if false */
 static unsigned int
-num_bits_is_odd(unsigned int v)
+num_bits_set(unsigned int v)
 {
-    unsigned int rv = 0;
+    unsigned int count = 0;
 
     while (v) {
-	if (v & 1)
-	    rv = !rv;
+	count += v & 1;
 	v >>= 1;
     }
-    return rv;
+    return count;
+}
+
+/* Is the number of set bits in the value odd?  Return 1 if true, 0 if false */
+static unsigned int
+num_bits_is_odd(unsigned int v)
+{
+    return __builtin_parity(v);
+}
+
+static unsigned int
+trellis_num_chunks(struct convcode *ce)
+{
+    return (ce->trellis_size + (1U << ce->trellis_chunk_shift) - 1)
+	>> ce->trellis_chunk_shift;
+}
+
+/*
+ * The arrays allocated on first use whose size depends on
+ * trellis_size have to go when it changes.
+ */
+static void
+free_trellis_sized(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+
+    if (ce->batch_trellis) {
+	o->free(o, ce->batch_trellis);
+	ce->batch_trellis = NULL;
+    }
+    if (ce->bitslice_trellis) {
+	o->free(o, ce->bitslice_trellis);
+	ce->bitslice_trellis = NULL;
+    }
+    if (ce->llr_alpha) {
+	o->free(o, ce->llr_alpha);
+	ce->llr_alpha = NULL;
+    }
+    if (ce->reduced_paths) {
+	o->free(o, ce->reduced_paths);
+	ce->reduced_paths = NULL;
+    }
+}
+
+static void
+free_trellis_chunks(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int i, n;
+
+    if (!ce->trellis_chunks)
+	return;
+    n = trellis_num_chunks(ce);
+    for (i = ce->trellis_fixed_chunks; i < n; i++) {
+	if (ce->trellis_chunks[i])
+	    o->free(o, ce->trellis_chunks[i]);
+    }
+    o->free(o, ce->trellis_chunks);
+    ce->trellis_chunks = NULL;
+    ce->trellis_fixed_chunks = 0;
+    ce->trellis_size = ce->fixed_trellis_size;
+}
+
+static void
+free_par_coders(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int i;
+
+    if (!ce->par_coders)
+	return;
+    for (i = 0; i < ce->num_par_coders; i++) {
+	if (ce->par_coders[i])
+	    free_convcode(ce->par_coders[i]);
+    }
+    o->free(o, ce->par_coders);
+    ce->par_coders = NULL;
+    ce->num_par_coders = 0;
 }
 
 void
 free_convcode(struct convcode *ce)
 {
     convcode_os_funcs *o = ce->o;
+    struct convcode_code *code = ce->code;
+
+    if (code)
+	free_convcode_code(code);
+    if (!o)
+	return;
+    if (ce->batch_trellis)
+	o->free(o, ce->batch_trellis);
+    if (ce->batch_curr_path_values)
+	o->free(o, ce->batch_curr_path_values);
+    if (ce->batch_next_path_values)
+	o->free(o, ce->batch_next_path_values);
+    if (ce->batch_branch_metrics)
+	o->free(o, ce->batch_branch_metrics);
+    if (ce->bitslice_trellis)
+	o->free(o, ce->bitslice_trellis);
+    if (ce->bitslice_curr_path_values)
+	o->free(o, ce->bitslice_curr_path_values);
+    if (ce->bitslice_next_path_values)
+	o->free(o, ce->bitslice_next_path_values);
+    if (ce->llr_alpha)
+	o->free(o, ce->llr_alpha);
+    if (ce->llr_beta[0])
+	o->free(o, ce->llr_beta[0]);
+    if (ce->llr_beta[1])
+	o->free(o, ce->llr_beta[1]);
+    if (ce->reduced_paths)
+	o->free(o, ce->reduced_paths);
+    if (ce->reduced_work)
+	o->free(o, ce->reduced_work);
+    if (ce->regex_hist)
+	o->free(o, ce->regex_hist);
+    free_par_coders(ce);
+    free_trellis_chunks(ce);
+    if (ce->alloc_mem)
+	o->free(o, ce->alloc_mem);
+}
+
+static int
+set_metric_limits(struct convcode *ce, unsigned int bits)
+{
+    switch (bits) {
+    case 8:
+	ce->metric_max = UINT8_MAX;
+	break;
+    case 16:
+	ce->metric_max = UINT16_MAX;
+	break;
+    case 32:
+	ce->metric_max = UINT32_MAX;
+	break;
+    default:
+	return 1;
+    }
+    ce->metric_width = bits;
 
-    if (ce->convert[0])
-	o->free(o, ce->convert[0]);
-    if (ce->convert[1])
-	o->free(o, ce->convert[1]);
-    if (ce->next_state[0])
-	o->free(o, ce->next_state[0]);
-    if (ce->next_state[1])
-	o->free(o, ce->next_state[1]);
-    if (ce->trellis)
-	o->free(o, ce->trellis);
-    if (ce->curr_path_values)
-	o->free(o, ce->curr_path_values);
-    if (ce->next_path_values)
-	o->free(o, ce->next_path_values);
-    o->free(o, ce);
+    /*
+     * The 32-bit values have always been allowed to get up to
+     * CONVCODE_DEFAULT_INIT_VAL and beyond, so let them.  The narrow
+     * ones start at a quarter of the maximum at most and can go to
+     * half, so there is plenty of room above for the spread between
+     * the paths.
+     */
+    if (bits == 32)
+	ce->metric_renorm = UINT32_MAX - UINT32_MAX / 4;
+    else
+	ce->metric_renorm = ce->metric_max / 2;
+    return 0;
 }
 
 int
@@ -136,6 +453,8 @@ setup_convcode1(struct convcode *ce, unsigned int k,
     ce->do_tail = do_tail;
     ce->recursive = recursive;
     ce->uncertainty_100 = 100;
+    ce->dec_init_val = CONVCODE_DEFAULT_INIT_VAL;
+    set_metric_limits(ce, 32);
 
     /*
      * Polynomials come in as the first bit being the high bit.  We
@@ -146,14 +465,91 @@ setup_convcode1(struct convcode *ce, unsigned int k,
     for (i = 0; i < ce->num_polys; i++)
 	ce->polys[i] = reverse_bits(k, polynomials[i]);
 
-    if (max_decode_len_bits > 0)
+    if (max_decode_len_bits > 0) {
 	ce->trellis_size = max_decode_len_bits + k * ce->num_polys;
+	ce->trellis_col_words = (ce->num_states + 63) / 64;
+	/* Don't bother with a branch metric table bigger than the states. */
+	if ((1U << ce->num_polys) <= ce->num_states * 2)
+	    ce->branch_metrics_size = 1 << ce->num_polys;
+    }
 
     return 0;
 }
 
-void
-setup_convcode2(struct convcode *ce)
+/*
+ * Return the bit that got us here from pstate (prev state) to cstate
+ * (curr state).  For non-recursive mode, that's always the low bit of
+ * cstate.  For recursive mode, you have to look at pstate to see what
+ * it's next state is for each bit.
+ */
+static int
+get_prev_bit(struct convcode *ce, convcode_state pstate, convcode_state cstate)
+{
+    if (!ce->recursive)
+	return cstate & 1;
+
+    if (ce->next_state[0][pstate] == cstate)
+	return 0;
+    else
+	return 1;
+#if 0
+    /* For debugging */
+    else if (ce->next_state[1][pstate] == cstate)
+	return 1;
+    else
+	printf("ERR!: %x %x %x %x\n", pstate, cstate);
+    return 0;
+#endif
+}
+
+/*
+ * Encode a byte a bit at a time from the given state with the convert
+ * and next_state arrays, for building the byte_convert arrays.
+ */
+static uint64_t
+encode_byte_bits(struct convcode *ce, convcode_state *state, unsigned int byte)
+{
+    uint64_t out = 0;
+    unsigned int i, bit;
+
+    for (i = 0; i < 8; i++) {
+	bit = (byte >> i) & 1;
+	out |= (uint64_t) ce->convert[bit][*state] << (i * ce->num_polys);
+	*state = ce->next_state[bit][*state];
+    }
+    return out;
+}
+
+/*
+ * Can the butterfly decode kernels be used for this code?  See the
+ * discussion above decode_bits_scalar_bfly_n().
+ */
+static bool
+code_is_butterfly(struct convcode *ce)
+{
+    unsigned int all = (1 << ce->num_polys) - 1, half = ce->num_states / 2;
+    unsigned int i, out;
+
+    if (ce->recursive || half == 0)
+	return false;
+    for (i = 0; i < half; i++) {
+	out = ce->convert[0][i];
+	if (ce->prev_convert[0][2 * i] != out ||
+	    ce->prev_convert[1][2 * i] != (out ^ all) ||
+	    ce->prev_convert[0][2 * i + 1] != (out ^ all) ||
+	    ce->prev_convert[1][2 * i + 1] != out)
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * Fill in the convert, next_state, byte_convert, byte_next_state, and
+ * prev_convert tables.  The byte tables and prev_convert are skipped
+ * if they weren't allocated.
+ */
+static void
+setup_code_tables(struct convcode *ce)
 {
     unsigned int val, i, j;
     convcode_state state_mask = ce->num_states - 1;
@@ -210,6 +606,39 @@ setup_convcode2(struct convcode *ce)
 	    ce->next_state[1][i] = ((i << 1) | bval1) & state_mask;
 	}
     }
+
+    if (ce->byte_convert[0]) {
+	convcode_state state;
+
+	for (i = 0; i < ce->num_states; i++) {
+	    state = i;
+	    ce->byte_convert[0][i] = encode_byte_bits(ce, &state, 0);
+	    ce->byte_next_state[0][i] = state;
+	}
+	for (i = 0; i < 256; i++) {
+	    state = 0;
+	    ce->byte_convert[1][i] = encode_byte_bits(ce, &state, i);
+	    ce->byte_next_state[1][i] = state;
+	}
+    }
+
+    /*
+     * The output for getting into each state from its two possible
+     * previous states, so the decoder can work on a run of states
+     * without chasing next_state.
+     */
+    if (ce->prev_convert[0]) {
+	for (i = 0; i < ce->num_states; i++) {
+	    convcode_state pstate1 = i >> 1;
+	    convcode_state pstate2 = pstate1 | (ce->num_states >> 1);
+
+	    ce->prev_convert[0][i] =
+		ce->convert[get_prev_bit(ce, pstate1, i)][pstate1];
+	    ce->prev_convert[1][i] =
+		ce->convert[get_prev_bit(ce, pstate2, i)][pstate2];
+	}
+	ce->butterfly = code_is_butterfly(ce);
+    }
 #if CONVCODE_DEBUG_STATES
     printf("S0:");
     for (i = 0; i < ce->num_states; i++)
@@ -227,25 +656,160 @@ setup_convcode2(struct convcode *ce)
 #endif
 }
 
-struct convcode *
-alloc_convcode(convcode_os_funcs *o,
-	       unsigned int k, convcode_state *polynomials,
-	       unsigned int num_polynomials,
-	       unsigned int max_decode_len_bits,
-	       bool do_tail, bool recursive,
-	       convcode_output enc_output, void *enc_out_user_data,
-	       convcode_output dec_output, void *dec_out_user_data)
+void
+setup_convcode2(struct convcode *ce)
 {
-    struct convcode *ce;
+    setup_code_tables(ce);
+    set_decode_kernel(ce, CONVCODE_KERNEL_AUTO);
+}
+
+/*
+ * Round a size or offset up to CONVCODE_ALIGN.
+ */
+static unsigned long
+align_size(unsigned long size)
+{
+    return (size + CONVCODE_ALIGN - 1) & ~((unsigned long) CONVCODE_ALIGN - 1);
+}
+
+/*
+ * Reserve size bytes at *pos in mem, returning the address (or NULL
+ * if mem is NULL) and moving *pos to the next aligned offset.
+ */
+static void *
+layout_array(unsigned char *mem, unsigned long *pos, unsigned long size)
+{
+    void *rv = NULL;
+
+    if (mem)
+	rv = mem + *pos;
+    *pos = align_size(*pos + size);
+    return rv;
+}
+
+/*
+ * Lay out the tables setup_code_tables() fills in at *pos in mem, see
+ * layout_array().  prev_convert is only needed for decoding.
+ */
+static void
+layout_code_tables(struct convcode *ce, unsigned char *mem,
+		   unsigned long *pos, bool decode)
+{
+    if (decode) {
+	ce->prev_convert[0] = layout_array(mem, pos,
+					   sizeof(*ce->prev_convert[0])
+					   * ce->num_states);
+	ce->prev_convert[1] = layout_array(mem, pos,
+					   sizeof(*ce->prev_convert[1])
+					   * ce->num_states);
+    }
+    ce->convert[0] = layout_array(mem, pos, sizeof(*ce->convert[0])
+				  * ce->num_states);
+    ce->convert[1] = layout_array(mem, pos, sizeof(*ce->convert[1])
+				  * ce->num_states);
+    ce->next_state[0] = layout_array(mem, pos, sizeof(*ce->next_state[0])
+				     * ce->num_states);
+    ce->next_state[1] = layout_array(mem, pos, sizeof(*ce->next_state[1])
+				     * ce->num_states);
+    if (ce->num_polys <= 8) {
+	ce->byte_convert[0] = layout_array(mem, pos,
+					   sizeof(*ce->byte_convert[0])
+					   * ce->num_states);
+	ce->byte_convert[1] = layout_array(mem, pos,
+					   sizeof(*ce->byte_convert[1]) * 256);
+	ce->byte_next_state[0] = layout_array(mem, pos,
+					      sizeof(*ce->byte_next_state[0])
+					      * ce->num_states);
+	ce->byte_next_state[1] = layout_array(mem, pos,
+					      sizeof(*ce->byte_next_state[1])
+					      * 256);
+    }
+}
+
+/*
+ * Lay out the arrays for a coder set up by setup_convcode1() in mem
+ * after the structure and return the total size.  If mem is NULL this
+ * just computes the size.  If tables is false the code tables come
+ * from a struct convcode_code and aren't laid out.  The arrays used
+ * for every decoded symbol come first so they are close together, the
+ * trellis is last.
+ */
+static unsigned long
+layout_convcode(struct convcode *ce, unsigned char *mem, bool tables)
+{
+    unsigned long pos = align_size(sizeof(*ce));
+
+    if (tables)
+	layout_code_tables(ce, mem, &pos, ce->trellis_size != 0);
+    if (ce->trellis_size) {
+	if (ce->branch_metrics_size)
+	    ce->branch_metrics = layout_array(mem, &pos,
+					      sizeof(*ce->branch_metrics)
+					      * ce->branch_metrics_size);
+	ce->curr_path_values = layout_array(mem, &pos, sizeof(uint32_t)
+					    * ce->num_states);
+	ce->next_path_values = layout_array(mem, &pos, sizeof(uint32_t)
+					    * ce->num_states);
+	ce->trellis = layout_array(mem, &pos, sizeof(*ce->trellis) *
+				   ce->trellis_size * ce->trellis_col_words);
+	ce->merge_states = layout_array(mem, &pos, sizeof(*ce->merge_states)
+					* 2 * ce->trellis_col_words);
+    }
+    return pos;
+}
+
+unsigned long
+convcode_size(unsigned int k, unsigned int num_polynomials,
+	      unsigned int max_decode_len_bits)
+{
+    convcode_state polys[CONVCODE_MAX_POLYNOMIALS] = { 0 };
+    struct convcode ce;
+
+    if (setup_convcode1(&ce, k, polys, num_polynomials,
+			max_decode_len_bits, false, false))
+	return 0;
+    return layout_convcode(&ce, NULL, true);
+}
 
-    ce = o->zalloc(o, sizeof(*ce));
-    if (!ce)
+unsigned long
+convcode_size_from_code(struct convcode_code *code,
+			unsigned int max_decode_len_bits)
+{
+    struct convcode ce;
+
+    if (setup_convcode1(&ce, code->k, code->polys, code->num_polys,
+			max_decode_len_bits, false, code->recursive))
+	return 0;
+    return layout_convcode(&ce, NULL, false);
+}
+
+/*
+ * Build a coder in mem.  If code is set the tables come from it and
+ * the coder takes a reference to it, otherwise they are calculated
+ * into mem.
+ */
+static struct convcode *
+init_convcode_tables(void *mem, convcode_os_funcs *o,
+		     struct convcode_code *code,
+		     unsigned int k, convcode_state *polynomials,
+		     unsigned int num_polynomials,
+		     unsigned int max_decode_len_bits,
+		     bool do_tail, bool recursive,
+		     convcode_output enc_output, void *enc_out_user_data,
+		     convcode_output dec_output, void *dec_out_user_data)
+{
+    struct convcode *ce = mem;
+    unsigned long size;
+    unsigned int i;
+
+    if ((uintptr_t) mem % CONVCODE_ALIGN)
 	return NULL;
     if (setup_convcode1(ce, k, polynomials, num_polynomials,
-			max_decode_len_bits, do_tail, recursive)) {
-	o->free(o, ce);
+			max_decode_len_bits, do_tail, recursive))
 	return NULL;
-    }
+    size = layout_convcode(ce, mem, !code);
+    memset((unsigned char *) mem + align_size(sizeof(*ce)), 0,
+	   size - align_size(sizeof(*ce)));
 
     ce->o = o;
     ce->enc_out.output = enc_output;
@@ -253,50 +817,199 @@ alloc_convcode(convcode_os_funcs *o,
     ce->dec_out.output = dec_output;
     ce->dec_out.user_data = dec_out_user_data;
 
-    ce->convert[0] = o->zalloc(o, sizeof(*ce->convert) * ce->num_states);
-    if (!ce->convert[0])
-	goto out_err;
-
-    ce->convert[1] = o->zalloc(o, sizeof(*ce->convert) * ce->num_states);
-    if (!ce->convert[1])
-	goto out_err;
-
-    ce->next_state[0] = o->zalloc(o, sizeof(*ce->next_state) * ce->num_states);
-    if (!ce->next_state[0])
-	goto out_err;
-
-    ce->next_state[1] = o->zalloc(o, sizeof(*ce->next_state) * ce->num_states);
-    if (!ce->next_state[1])
-	goto out_err;
-
-    if (max_decode_len_bits > 0) {
-	/* Add on a bit for the stuff at the end. */
-	ce->trellis = o->zalloc(o, sizeof(*ce->trellis) *
-				ce->trellis_size * ce->num_states);
-	if (!ce->trellis)
-	    goto out_err;
-
-	ce->curr_path_values = o->zalloc(o, sizeof(*ce->curr_path_values)
-					 * ce->num_states);
-	if (!ce->curr_path_values)
-	    goto out_err;
-	ce->next_path_values = o->zalloc(o, sizeof(*ce->next_path_values)
-					 * ce->num_states);
-	if (!ce->next_path_values)
-	    goto out_err;
+    if (code) {
+	for (i = 0; i < 2; i++) {
+	    ce->convert[i] = code->convert[i];
+	    ce->next_state[i] = code->next_state[i];
+	    ce->byte_convert[i] = code->byte_convert[i];
+	    ce->byte_next_state[i] = code->byte_next_state[i];
+	    if (ce->trellis_size)
+		ce->prev_convert[i] = code->prev_convert[i];
+	}
+	if (ce->trellis_size)
+	    ce->butterfly = code->butterfly;
+	convcode_code_ref(code);
+	ce->code = code;
+	set_decode_kernel(ce, CONVCODE_KERNEL_AUTO);
+    } else {
+	setup_convcode2(ce);
     }
-
-    setup_convcode2(ce);
     reinit_convcode(ce);
 
     return ce;
-
- out_err:
-    free_convcode(ce);
-    return NULL;
 }
 
-void
+struct convcode *
+init_convcode(void *mem, convcode_os_funcs *o,
+	      unsigned int k, convcode_state *polynomials,
+	      unsigned int num_polynomials,
+	      unsigned int max_decode_len_bits,
+	      bool do_tail, bool recursive,
+	      convcode_output enc_output, void *enc_out_user_data,
+	      convcode_output dec_output, void *dec_out_user_data)
+{
+    return init_convcode_tables(mem, o, NULL, k, polynomials,
+				num_polynomials, max_decode_len_bits,
+				do_tail, recursive,
+				enc_output, enc_out_user_data,
+				dec_output, dec_out_user_data);
+}
+
+struct convcode *
+init_convcode_from_code(void *mem, convcode_os_funcs *o,
+			struct convcode_code *code,
+			unsigned int max_decode_len_bits,
+			bool do_tail,
+			convcode_output enc_output, void *enc_out_user_data,
+			convcode_output dec_output, void *dec_out_user_data)
+{
+    return init_convcode_tables(mem, o, code, code->k, code->polys,
+				code->num_polys, max_decode_len_bits,
+				do_tail, code->recursive,
+				enc_output, enc_out_user_data,
+				dec_output, dec_out_user_data);
+}
+
+/*
+ * Allocate size bytes from o, aligned to CONVCODE_ALIGN.  The OS
+ * functions don't align, so this allocates extra to do it.  The
+ * pointer to free is returned in *alloc_mem.
+ */
+static void *
+alloc_aligned(convcode_os_funcs *o, unsigned long size, void **alloc_mem)
+{
+    unsigned char *mem = o->zalloc(o, size + CONVCODE_ALIGN - 1);
+
+    *alloc_mem = mem;
+    if (!mem)
+	return NULL;
+    return mem + (align_size((uintptr_t) mem) - (uintptr_t) mem);
+}
+
+static struct convcode *
+alloc_convcode_tables(convcode_os_funcs *o, struct convcode_code *code,
+		      unsigned long size,
+		      unsigned int k, convcode_state *polynomials,
+		      unsigned int num_polynomials,
+		      unsigned int max_decode_len_bits,
+		      bool do_tail, bool recursive,
+		      convcode_output enc_output, void *enc_out_user_data,
+		      convcode_output dec_output, void *dec_out_user_data)
+{
+    struct convcode *ce;
+    void *mem, *alloc_mem;
+
+    if (!size)
+	return NULL;
+    mem = alloc_aligned(o, size, &alloc_mem);
+    if (!mem)
+	return NULL;
+    ce = init_convcode_tables(mem, o, code, k, polynomials, num_polynomials,
+			      max_decode_len_bits, do_tail, recursive,
+			      enc_output, enc_out_user_data,
+			      dec_output, dec_out_user_data);
+    if (!ce) {
+	o->free(o, alloc_mem);
+	return NULL;
+    }
+    ce->alloc_mem = alloc_mem;
+    return ce;
+}
+
+struct convcode *
+alloc_convcode(convcode_os_funcs *o,
+	       unsigned int k, convcode_state *polynomials,
+	       unsigned int num_polynomials,
+	       unsigned int max_decode_len_bits,
+	       bool do_tail, bool recursive,
+	       convcode_output enc_output, void *enc_out_user_data,
+	       convcode_output dec_output, void *dec_out_user_data)
+{
+    return alloc_convcode_tables(o, NULL,
+				 convcode_size(k, num_polynomials,
+					       max_decode_len_bits),
+				 k, polynomials, num_polynomials,
+				 max_decode_len_bits, do_tail, recursive,
+				 enc_output, enc_out_user_data,
+				 dec_output, dec_out_user_data);
+}
+
+struct convcode *
+alloc_convcode_from_code(convcode_os_funcs *o, struct convcode_code *code,
+			 unsigned int max_decode_len_bits,
+			 bool do_tail,
+			 convcode_output enc_output, void *enc_out_user_data,
+			 convcode_output dec_output, void *dec_out_user_data)
+{
+    return alloc_convcode_tables(o, code,
+				 convcode_size_from_code(code,
+							 max_decode_len_bits),
+				 code->k, code->polys, code->num_polys,
+				 max_decode_len_bits, do_tail, code->recursive,
+				 enc_output, enc_out_user_data,
+				 dec_output, dec_out_user_data);
+}
+
+struct convcode_code *
+alloc_convcode_code(convcode_os_funcs *o,
+		    unsigned int k, convcode_state *polynomials,
+		    unsigned int num_polynomials, bool recursive)
+{
+    struct convcode_code *code;
+    struct convcode ce;
+    unsigned long size;
+    void *alloc_mem;
+    unsigned int i;
+
+    /*
+     * Calculate the tables with a scratch coder pointing into the
+     * code's memory.
+     */
+    if (setup_convcode1(&ce, k, polynomials, num_polynomials, 0,
+			false, recursive))
+	return NULL;
+    size = align_size(sizeof(*code));
+    layout_code_tables(&ce, NULL, &size, true);
+    code = alloc_aligned(o, size, &alloc_mem);
+    if (!code)
+	return NULL;
+    size = align_size(sizeof(*code));
+    layout_code_tables(&ce, (unsigned char *) code, &size, true);
+    setup_code_tables(&ce);
+
+    code->refcount = 1;
+    code->o = o;
+    code->alloc_mem = alloc_mem;
+    code->k = k;
+    for (i = 0; i < num_polynomials; i++)
+	code->polys[i] = polynomials[i];
+    code->num_polys = num_polynomials;
+    code->recursive = recursive;
+    code->butterfly = ce.butterfly;
+    for (i = 0; i < 2; i++) {
+	code->convert[i] = ce.convert[i];
+	code->next_state[i] = ce.next_state[i];
+	code->byte_convert[i] = ce.byte_convert[i];
+	code->byte_next_state[i] = ce.byte_next_state[i];
+	code->prev_convert[i] = ce.prev_convert[i];
+    }
+    return code;
+}
+
+void
+convcode_code_ref(struct convcode_code *code)
+{
+    __atomic_add_fetch(&code->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void
+free_convcode_code(struct convcode_code *code)
+{
+    if (__atomic_sub_fetch(&code->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+	code->o->free(code->o, code->alloc_mem);
+}
+
+void
 set_encode_output_per_symbol(struct convcode *ce, bool val)
 {
     ce->enc_out.output_symbol_size = val;
@@ -308,19 +1021,216 @@ set_decode_max_uncertainty(struct convcode *ce, uint8_t max_uncertainty)
     ce->uncertainty_100 = max_uncertainty;
 }
 
+int
+set_puncture_pattern(struct convcode *ce, const uint16_t *pattern,
+		     unsigned int period)
+{
+    unsigned int i;
+
+    if (period > CONVCODE_MAX_PUNCTURE_PERIOD)
+	return 1;
+    for (i = 0; i < period; i++) {
+	if (!pattern[i] || pattern[i] >> ce->num_polys)
+	    return 1;
+    }
+
+    ce->puncture_period = period;
+    ce->puncture_offset[0] = 0;
+    for (i = 0; i < period; i++) {
+	ce->puncture[i] = pattern[i];
+	ce->puncture_offset[i + 1] = (ce->puncture_offset[i] +
+				      num_bits_set(pattern[i]));
+    }
+    ce->enc_puncture_pos = 0;
+    ce->dec_puncture_pos = 0;
+    return 0;
+}
+
+/*
+ * Take the punctured bits out of nsyms symbols of encoded output,
+ * returning the bits that are sent and how many there are in len.
+ */
+static uint64_t
+puncture_output(struct convcode *ce, uint64_t bits, unsigned int nsyms,
+		unsigned int *len)
+{
+    uint64_t out = 0;
+    unsigned int i, j, olen = 0, keep;
+
+    for (i = 0; i < nsyms; i++) {
+	keep = ce->puncture[ce->enc_puncture_pos];
+	for (j = 0; j < ce->num_polys; j++, bits >>= 1) {
+	    if (keep & (1 << j))
+		out |= (bits & 1) << olen++;
+	}
+	if (++ce->enc_puncture_pos == ce->puncture_period)
+	    ce->enc_puncture_pos = 0;
+    }
+    *len = olen;
+    return out;
+}
+
+static int
+set_output_buffer(struct convcode_outdata *of, unsigned char *buf,
+		  unsigned int size, convcode_output_buffer full,
+		  void *user_data)
+{
+    if (buf && (size == 0 || size % 8))
+	return 1;
+    of->buf = buf;
+    of->buf_size = size;
+    of->buf_full = full;
+    of->buf_user_data = user_data;
+    of->buf_pos = 0;
+    of->buf_bits = 0;
+    of->buf_nbits = 0;
+    return 0;
+}
+
+int
+set_encode_output_buffer(struct convcode *ce, unsigned char *buf,
+			 unsigned int size, convcode_output_buffer full,
+			 void *user_data)
+{
+    return set_output_buffer(&ce->enc_out, buf, size, full, user_data);
+}
+
+int
+set_decode_output_buffer(struct convcode *ce, unsigned char *buf,
+			 unsigned int size, convcode_output_buffer full,
+			 void *user_data)
+{
+    return set_output_buffer(&ce->dec_out, buf, size, full, user_data);
+}
+
+/*
+ * The output buffer is full and there is more to put in it, hand it
+ * to the full function and start over.
+ */
+static int
+output_buffer_full(struct convcode *ce, struct convcode_outdata *of)
+{
+    int rv;
+
+    if (!of->buf_full)
+	return 1;
+    STATS_ADD(ce, output_calls, 1);
+    rv = of->buf_full(ce, of->buf_user_data, of->buf, of->buf_size * 8);
+    of->buf_pos = 0;
+    return rv;
+}
+
+/*
+ * Store 64 bits low bit first, like all the other bit data.
+ */
+static void
+store_word(unsigned char *p, uint64_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &word, sizeof(word));
+#else
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+	p[i] = word >> (i * 8);
+#endif
+}
+
+/*
+ * Put len bits into the output buffer.  Only whole 64-bit words are
+ * stored until output_buffer_flush().
+ */
+static int
+output_buffer_bits(struct convcode *ce, struct convcode_outdata *of,
+		   uint64_t bits, unsigned int len)
+{
+    unsigned int used = 64 - of->buf_nbits;
+    uint64_t word;
+    int rv;
+
+    of->total_out_bits += len;
+    if (len < used) {
+	of->buf_bits |= bits << of->buf_nbits;
+	of->buf_nbits += len;
+	return 0;
+    }
+
+    word = of->buf_bits | (bits << of->buf_nbits);
+    if (of->buf_pos == of->buf_size) {
+	rv = output_buffer_full(ce, of);
+	if (rv)
+	    return rv;
+    }
+    store_word(of->buf + of->buf_pos, word);
+    of->buf_pos += 8;
+    of->buf_bits = used < 64 ? bits >> used : 0;
+    of->buf_nbits = len - used;
+    return 0;
+}
+
+/*
+ * Store the bits that aren't a whole word yet and hand the buffer to
+ * the full function, at the end of an operation.
+ */
+static int
+output_buffer_flush(struct convcode *ce, struct convcode_outdata *of)
+{
+    unsigned int i, nbits = of->buf_nbits;
+    int rv;
+
+    if (nbits) {
+	if (of->buf_pos == of->buf_size) {
+	    rv = output_buffer_full(ce, of);
+	    if (rv)
+		return rv;
+	}
+	for (i = 0; i < (nbits + 7) / 8; i++)
+	    of->buf[of->buf_pos + i] = of->buf_bits >> (i * 8);
+	of->buf_bits = 0;
+	of->buf_nbits = 0;
+    }
+    if (!of->buf_full || (of->buf_pos == 0 && nbits == 0))
+	return 0;
+    STATS_ADD(ce, output_calls, 1);
+    rv = of->buf_full(ce, of->buf_user_data, of->buf, of->buf_pos * 8 + nbits);
+    of->buf_pos = 0;
+    return rv;
+}
+
+/*
+ * Send out whatever is left at the end of an operation.
+ */
+static int
+output_flush(struct convcode *ce, struct convcode_outdata *of)
+{
+    if (of->buf)
+	return output_buffer_flush(ce, of);
+    if (of->out_bit_pos > 0) {
+	STATS_ADD(ce, output_calls, 1);
+	return of->output(ce, of->user_data, of->out_bits, of->out_bit_pos);
+    }
+    return 0;
+}
+
 static int
 output_bits(struct convcode *ce, struct convcode_outdata *of,
-	    unsigned int bits, unsigned int len)
+	    uint64_t bits, unsigned int len)
 {
     int rv = 0;
 
-    if (of->output_symbol_size)
+    if (of->buf)
+	return output_buffer_bits(ce, of, bits, len);
+
+    if (of->output_symbol_size) {
+	STATS_ADD(ce, output_calls, 1);
 	return of->output(ce, of->user_data, bits, len);
+    }
 
     of->out_bits |= bits << of->out_bit_pos;
     while (of->out_bit_pos + len >= 8) {
 	unsigned int used = 8 - of->out_bit_pos;
 
+	STATS_ADD(ce, output_calls, 1);
 	rv = of->output(ce, of->user_data, of->out_bits, 8);
 	if (rv)
 	    return rv;
@@ -340,30 +1250,66 @@ static int
 encode_bit(struct convcode *ce, unsigned int bit)
 {
     convcode_state state = ce->enc_state;
+    uint64_t bits = ce->convert[bit][state];
+    unsigned int len = ce->num_polys;
+
     ce->enc_state = ce->next_state[bit][state];
-    return output_bits(ce, &ce->enc_out,
-		       ce->convert[bit][state], ce->num_polys);
+    if (ce->puncture_period)
+	bits = puncture_output(ce, bits, 1, &len);
+    return output_bits(ce, &ce->enc_out, bits, len);
+}
+
+/*
+ * Encode a whole byte with the byte_convert and byte_next_state
+ * arrays, returning the 8 * num_polys output bits.
+ */
+static uint64_t
+encode_byte(struct convcode *ce, unsigned char byte)
+{
+    convcode_state state = ce->enc_state;
+
+    ce->enc_state = (ce->byte_next_state[0][state] ^
+		     ce->byte_next_state[1][byte]);
+    return ce->byte_convert[0][state] ^ ce->byte_convert[1][byte];
 }
 
 int
 convencode_data(struct convcode *ce,
 		const unsigned char *bytes, unsigned int nbits)
 {
+    bool by_byte = ce->byte_convert[0] && (ce->enc_out.buf ||
+					   !ce->enc_out.output_symbol_size);
+    uint64_t start = STATS_START(ce);
     unsigned int i, j;
-    int rv;
+    int rv = 0;
 
     for (i = 0; nbits > 0; i++) {
 	unsigned char byte = bytes[i];
 
+	if (by_byte && nbits >= 8) {
+	    uint64_t bits = encode_byte(ce, byte);
+	    unsigned int len = ce->num_polys * 8;
+
+	    if (ce->puncture_period)
+		bits = puncture_output(ce, bits, 8, &len);
+	    rv = output_bits(ce, &ce->enc_out, bits, len);
+	    if (rv)
+		goto out;
+	    nbits -= 8;
+	    continue;
+	}
+
 	for (j = 0; nbits > 0 && j < 8; j++) {
 	    rv = encode_bit(ce, byte & 1);
 	    byte >>= 1;
 	    if (rv)
-		return rv;
+		goto out;
 	    nbits--;
 	}
     }
-    return 0;
+ out:
+    STATS_END(ce, encode_cycles, start);
+    return rv;
 }
 
 int
@@ -379,9 +1325,9 @@ convencode_finish(struct convcode *ce, unsigned int *total_out_bits)
 		return rv;
 	}
     }
-    if (ce->enc_out.out_bit_pos > 0)
-	ce->enc_out.output(ce, ce->enc_out.user_data,
-			   ce->enc_out.out_bits, ce->enc_out.out_bit_pos);
+    rv = output_flush(ce, &ce->enc_out);
+    if (rv)
+	return rv;
     if (total_out_bits)
 	*total_out_bits = ce->enc_out.total_out_bits;
     return 0;
@@ -402,6 +1348,8 @@ convencode_block_bit(struct convcode *ce, unsigned int bit,
 
     outbits = ce->convert[bit][state];
     bits_left = ce->num_polys;
+    if (ce->puncture_period)
+	outbits = puncture_output(ce, outbits, 1, &bits_left);
 
     /* Now comes the messy job of putting the bits into outbytes. */
     while (bits_left > nbytebits) {
@@ -424,13 +1372,64 @@ convencode_block_bit(struct convcode *ce, unsigned int bit,
     *ioutbitpos = outbitpos;
 }
 
+/*
+ * Encode whole bytes with the byte arrays.  The output is collected
+ * in a 64-bit accumulator and written out a byte at a time.  Like
+ * convencode_block_bit(), the output is or-ed into outbytes.
+ */
+static void
+convencode_block_bytes(struct convcode *ce,
+		       const unsigned char *bytes, unsigned int nbytes,
+		       unsigned char **ioutbytes, unsigned int *ioutbitpos)
+{
+    unsigned char *outbytes = *ioutbytes;
+    unsigned int accbits = *ioutbitpos;
+    unsigned int obits = ce->num_polys * 8;
+    uint64_t acc = 0, out;
+    unsigned int i, j;
+
+    for (i = 0; i < nbytes; i++) {
+	out = encode_byte(ce, bytes[i]);
+	if (ce->puncture_period)
+	    out = puncture_output(ce, out, 8, &obits);
+	acc |= out << accbits;
+	if (accbits + obits > 64) {
+	    /* Only with 8 polynomials, the top of out didn't fit. */
+	    for (j = 0; j < 8; j++) {
+		*outbytes++ |= acc;
+		acc >>= 8;
+	    }
+	    acc = out >> (64 - accbits);
+	    accbits = accbits + obits - 64;
+	} else {
+	    accbits += obits;
+	}
+	while (accbits >= 8) {
+	    *outbytes++ |= acc;
+	    acc >>= 8;
+	    accbits -= 8;
+	}
+    }
+    if (accbits)
+	*outbytes |= acc;
+    *ioutbytes = outbytes;
+    *ioutbitpos = accbits;
+}
+
 void
 convencode_block_partial(struct convcode *ce,
 			 const unsigned char *bytes, unsigned int nbits,
 			 unsigned char **outbytes, unsigned int *outbitpos)
 {
+    uint64_t start = STATS_START(ce);
     unsigned int i, j;
 
+    if (ce->byte_convert[0] && nbits >= 8) {
+	convencode_block_bytes(ce, bytes, nbits / 8, outbytes, outbitpos);
+	bytes += nbits / 8;
+	nbits %= 8;
+    }
+
     for (i = 0; nbits > 0; i++) {
 	unsigned char byte = bytes[i];
 
@@ -441,6 +1440,7 @@ convencode_block_partial(struct convcode *ce,
 	    byte >>= 1;
 	}
     }
+    STATS_END(ce, encode_cycles, start);
 }
 
 void
@@ -465,16 +1465,110 @@ convencode_block(struct convcode *ce,
     convencode_block_final(ce, bytes, nbits, outbytes, 0);
 }
 
-static unsigned int
-num_bits_set(unsigned int v)
+/*
+ * The info for a parallel block encode, see convencode_block_parallel().
+ * Only the encoder state changes while encoding, so each segment gets
+ * a copy of the coder that shares its tables.
+ */
+struct convencode_parallel {
+    const unsigned char *bytes;
+    unsigned char *outbytes;
+    unsigned int nbits;
+    unsigned int seglen;
+    unsigned int nsegments;
+    struct convcode *segs;
+};
+
+static void
+encode_segment(void *data, unsigned int n)
 {
-    unsigned int count = 0;
+    struct convencode_parallel *p = data;
+    struct convcode *ce = &p->segs[n];
+    unsigned int start = n * p->seglen, nbits = p->nbits - start;
+    unsigned int i, pos, outbitpos = 0;
+    unsigned long outpos;
+    unsigned char *outbytes;
+
+    if (nbits > p->seglen)
+	nbits = p->seglen;
+    if (ce->puncture_period)
+	outpos = ((unsigned long) start / ce->puncture_period *
+		  ce->puncture_offset[ce->puncture_period]);
+    else
+	outpos = (unsigned long) start * ce->num_polys;
+    outbytes = p->outbytes + outpos / 8;
+
+    if (n > 0) {
+	/* The state is the last k - 1 bits, the newest in bit 0. */
+	ce->enc_state = 0;
+	for (i = 1; i < ce->k; i++) {
+	    pos = start - i;
+	    ce->enc_state |= ((p->bytes[pos / 8] >> (pos % 8)) & 1) << (i - 1);
+	}
+    }
 
-    while (v) {
-	count += v & 1;
-	v >>= 1;
+    if (n == p->nsegments - 1)
+	convencode_block_final(ce, p->bytes + start / 8, nbits, outbytes, 0);
+    else
+	convencode_block_partial(ce, p->bytes + start / 8, nbits,
+				 &outbytes, &outbitpos);
+}
+
+int
+convencode_block_parallel(struct convcode *ce,
+			  const unsigned char *bytes, unsigned int nbits,
+			  unsigned char *outbytes, unsigned int nsegments)
+{
+    convcode_os_funcs *o = ce->o;
+    struct convencode_parallel p;
+    unsigned int i, align = 8;
+
+    if (ce->recursive || nsegments == 0)
+	return 1;
+
+    /*
+     * Segments start on a byte and a puncture period, so their output
+     * starts on a byte, and after at least k - 1 bits so the state can
+     * be found.
+     */
+    if (ce->puncture_period)
+	align *= ce->puncture_period;
+    p.seglen = (nbits + nsegments - 1) / nsegments;
+    if (p.seglen < ce->k - 1)
+	p.seglen = ce->k - 1;
+    p.seglen = (p.seglen + align - 1) / align * align;
+    p.nsegments = (nbits + p.seglen - 1) / p.seglen;
+    if (p.nsegments <= 1 || !o) {
+	convencode_block(ce, bytes, nbits, outbytes);
+	return 0;
     }
-    return count;
+    p.bytes = bytes;
+    p.outbytes = outbytes;
+    p.nbits = nbits;
+
+    p.segs = o->zalloc(o, sizeof(*p.segs) * p.nsegments);
+    if (!p.segs)
+	return 1;
+    for (i = 0; i < p.nsegments; i++) {
+	p.segs[i] = *ce;
+	memset(&p.segs[i].stats, 0, sizeof(p.segs[i].stats));
+    }
+
+    if (o->run_parallel) {
+	o->run_parallel(o, encode_segment, &p, p.nsegments);
+    } else {
+	for (i = 0; i < p.nsegments; i++)
+	    encode_segment(&p, i);
+    }
+
+    ce->enc_state = p.segs[p.nsegments - 1].enc_state;
+    ce->enc_puncture_pos = p.segs[p.nsegments - 1].enc_puncture_pos;
+#ifdef CONVCODE_STATS
+    for (i = 0; i < p.nsegments; i++)
+	add_stats(&ce->stats, &p.segs[i].stats);
+#endif
+    o->free(o, p.segs);
+    return 0;
 }
 
 /*
@@ -507,637 +1601,8022 @@ hamming_distance(struct convcode *ce, unsigned int v1, unsigned int v2,
 }
 
 /*
- * Return the bit that got us here from pstate (prev state) to cstate
- * (curr state).  For non-recursive mode, that's always the low bit of
- * cstate.  For recursive mode, you have to look at pstate to see what
- * it's next state is for each bit.
+ * Computing hamming_distance() for every state is expensive, but for
+ * a given received symbol there are only 1 << num_polys different
+ * encoded outputs to compare against, so the branch metric for each
+ * is the same for every state.
+ *
+ * The metric for an encoded output is computed as a base value (the
+ * cost of expecting all zeros) plus, for each output bit that is set,
+ * the difference between the cost of expecting a one and a zero for
+ * that polynomial.  Unsigned wraparound takes care of the negative
+ * differences, the result is the same as hamming_distance().  This
+ * returns the base and fills in the differences in delta.
+ *
+ * For puncturing, only the polynomials set in keep were sent, and
+ * bits and uncertainty only have those.  The others cost nothing
+ * whatever the encoded output was.
  */
-static int
-get_prev_bit(struct convcode *ce, convcode_state pstate, convcode_state cstate)
+static CONVCODE_ALWAYS_INLINE unsigned int
+branch_costs_n(struct convcode *ce, unsigned int bits,
+	       const uint8_t *uncertainty, unsigned int *delta,
+	       unsigned int num_polys, unsigned int keep)
 {
-    if (!ce->recursive)
-	return cstate & 1;
+    unsigned int i, j = 0, base = 0, same, diff;
 
-    if (ce->next_state[0][pstate] == cstate)
-	return 0;
-    else
-	return 1;
-#if 0
-    /* For debugging */
-    else if (ce->next_state[1][pstate] == cstate)
-	return 1;
-    else
-	printf("ERR!: %x %x %x %x\n", pstate, cstate);
-    return 0;
-#endif
+    for (i = 0; i < num_polys; i++) {
+	if (!(keep & (1 << i))) {
+	    delta[i] = 0;
+	    continue;
+	}
+	if (uncertainty) {
+	    same = uncertainty[j];
+	    diff = ce->uncertainty_100 - uncertainty[j];
+	} else {
+	    same = 0;
+	    diff = 1;
+	}
+	if (bits & 1) {
+	    base += diff;
+	    delta[i] = same - diff;
+	} else {
+	    base += same;
+	    delta[i] = diff - same;
+	}
+	bits >>= 1;
+	j++;
+    }
+    return base;
 }
 
-static int
-decode_bits(struct convcode *ce, unsigned int bits, const uint8_t *uncertainty)
+static unsigned int
+branch_costs(struct convcode *ce, unsigned int bits,
+	     const uint8_t *uncertainty, unsigned int *delta)
+{
+    /* Let the compiler unroll the loop for the common rates. */
+    switch (ce->num_polys) {
+    case 2:
+	return branch_costs_n(ce, bits, uncertainty, delta, 2, ~0U);
+    case 3:
+	return branch_costs_n(ce, bits, uncertainty, delta, 3, ~0U);
+    default:
+	return branch_costs_n(ce, bits, uncertainty, delta, ce->num_polys,
+			      ~0U);
+    }
+}
+
+/*
+ * branch_costs() for the next symbol with puncturing.
+ */
+static unsigned int
+branch_costs_punctured(struct convcode *ce, unsigned int bits,
+		       const uint8_t *uncertainty, unsigned int *delta)
+{
+    unsigned int keep = ce->puncture[ce->dec_puncture_pos];
+
+    if (++ce->dec_puncture_pos == ce->puncture_period)
+	ce->dec_puncture_pos = 0;
+    return branch_costs_n(ce, bits, uncertainty, delta, ce->num_polys, keep);
+}
+
+/*
+ * Like branch_costs_n(), but from signed LLRs, positive if the bit is
+ * more likely a 0.  Expecting a 0 costs 127 - llr and expecting a 1
+ * costs 127 + llr, so it's a 0 to 254 scale with 127 for no idea.
+ * -128 is taken as -127 so the scale is symmetric.
+ */
+static CONVCODE_ALWAYS_INLINE unsigned int
+llr_branch_costs_n(const int8_t *llrs, unsigned int *delta,
+		   unsigned int num_polys, unsigned int keep)
+{
+    unsigned int i, j = 0, base = 0;
+    int llr;
+
+    for (i = 0; i < num_polys; i++) {
+	if (!(keep & (1 << i))) {
+	    delta[i] = 0;
+	    continue;
+	}
+	llr = llrs[j++];
+	if (llr < -127)
+	    llr = -127;
+	base += 127 - llr;
+	delta[i] = 2 * llr;
+    }
+    return base;
+}
+
+/*
+ * branch_costs() and branch_costs_punctured() for LLR input.
+ */
+static unsigned int
+llr_branch_costs(struct convcode *ce, const int8_t *llrs, unsigned int *delta)
+{
+    unsigned int keep;
+
+    if (ce->puncture_period) {
+	keep = ce->puncture[ce->dec_puncture_pos];
+	if (++ce->dec_puncture_pos == ce->puncture_period)
+	    ce->dec_puncture_pos = 0;
+	return llr_branch_costs_n(llrs, delta, ce->num_polys, keep);
+    }
+
+    switch (ce->num_polys) {
+    case 2:
+	return llr_branch_costs_n(llrs, delta, 2, ~0U);
+    case 3:
+	return llr_branch_costs_n(llrs, delta, 3, ~0U);
+    default:
+	return llr_branch_costs_n(llrs, delta, ce->num_polys, ~0U);
+    }
+}
+
+/*
+ * Fill in the branch metric table for every possible encoded output
+ * from the base and deltas.  Each polynomial doubles the part of the
+ * table that is filled in.
+ */
+static CONVCODE_ALWAYS_INLINE void
+fill_branch_metrics(struct convcode *ce, unsigned int base,
+		    const unsigned int *delta, unsigned int num_polys)
+{
+    unsigned int *bm = ce->branch_metrics;
+    unsigned int i, j, n;
+
+    bm[0] = base;
+    for (j = 0, n = 1; j < num_polys; j++, n <<= 1) {
+	for (i = 0; i < n; i++)
+	    bm[n + i] = bm[i] + delta[j];
+    }
+}
+
+/*
+ * For codes with so many polynomials that the table would be bigger
+ * than the state machine, compute the metric directly.
+ */
+static unsigned int
+branch_metric(unsigned int base, const unsigned int *delta, unsigned int v)
 {
-    unsigned int *currp = ce->curr_path_values;
-    unsigned int *nextp = ce->next_path_values;
     unsigned int i;
 
-    if (ce->ctrellis + ce->num_polys > ce->trellis_size)
-	return 1;
+    for (i = 0; v; i++, v >>= 1) {
+	if (v & 1)
+	    base += delta[i];
+    }
+    return base;
+}
 
-    for (i = 0; i < ce->num_states; i++) {
-	convcode_state pstate1 = i >> 1, pstate2, bit;
-	unsigned int dist1, dist2;
+/*
+ * The decode kernels are written as an inline function that takes the
+ * number of states and polynomials, name_n().  This generates the
+ * kernel for any code, name(), and versions for the common codes
+ * where those are constants, so the compiler can unroll the loops.
+ * The polynomials themselves only come in through prev_convert, so
+ * these work for any polynomials.  The table of them is indexed by
+ * decode_kernel_variant().
+ */
+#define DECODE_KERNEL_VARIANTS(name, attrs)				\
+attrs static void							\
+name(struct convcode *ce, unsigned int base, const unsigned int *delta)	\
+{									\
+    name##_n(ce, base, delta, ce->num_states, ce->num_polys);		\
+}									\
+attrs static void							\
+name##_k7r2(struct convcode *ce, unsigned int base,			\
+	    const unsigned int *delta)					\
+{									\
+    name##_n(ce, base, delta, 64, 2);					\
+}									\
+attrs static void							\
+name##_k7r3(struct convcode *ce, unsigned int base,			\
+	    const unsigned int *delta)					\
+{									\
+    name##_n(ce, base, delta, 64, 3);					\
+}									\
+attrs static void							\
+name##_k9r2(struct convcode *ce, unsigned int base,			\
+	    const unsigned int *delta)					\
+{									\
+    name##_n(ce, base, delta, 256, 2);					\
+}									\
+static const convcode_decode_kernel name##_variants[] = {		\
+    name, name##_k7r2, name##_k7r3, name##_k9r2				\
+};
+
+/*
+ * Which of the DECODE_KERNEL_VARIANTS() to use for this code.
+ */
+static unsigned int
+decode_kernel_variant(struct convcode *ce)
+{
+    if (ce->num_states == 64 && ce->num_polys == 2)
+	return 1; /* CCSDS/Voyager, 802.11 */
+    if (ce->num_states == 64 && ce->num_polys == 3)
+	return 2; /* LTE */
+    if (ce->num_states == 256 && ce->num_polys == 2)
+	return 3; /* IS-95, CDMA2000 */
+    return 0;
+}
+
+/*
+ * Run one symbol through the trellis for every state.  This is the
+ * portable version, the SIMD ones below must give exactly the same
+ * results.
+ */
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_scalar_n(struct convcode *ce, unsigned int base,
+		     const unsigned int *delta, unsigned int num_states,
+		     unsigned int num_polys)
+{
+    unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    const unsigned int *bm = ce->branch_metrics;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states >> 1, i;
+
+    if (bm)
+	fill_branch_metrics(ce, base, delta, num_polys);
 
+    for (i = 0; i < num_states; i++) {
 	/*
 	 * This state could have come from two different states, one
 	 * with the top bit set (pstate2) and with with the top bit
 	 * clear (pstate1).  We check both of those.
 	 */
-	pstate2 = pstate1 | (1 << (ce->k - 2));
+	convcode_state pstate1 = i >> 1, pstate2 = pstate1 | half;
+	unsigned int dist1, dist2;
 
 	dist1 = currp[pstate1];
-	bit = get_prev_bit(ce, pstate1, i);
-	dist1 += hamming_distance(ce, ce->convert[bit][pstate1],
-				  bits, uncertainty);
 	dist2 = currp[pstate2];
-	bit = get_prev_bit(ce, pstate2, i);
-	dist2 += hamming_distance(ce, ce->convert[bit][pstate2],
-				  bits, uncertainty);
+	if (bm) {
+	    dist1 += bm[out1[i]];
+	    dist2 += bm[out2[i]];
+	} else {
+	    dist1 += branch_metric(base, delta, out1[i]);
+	    dist2 += branch_metric(base, delta, out2[i]);
+	}
 
 	if (dist2 < dist1) {
-	    trellis_entry(ce, ce->ctrellis, i) = pstate2;
+	    decisions |= (uint64_t) 1 << (i % 64);
 	    nextp[i] = dist2;
 	} else {
-	    trellis_entry(ce, ce->ctrellis, i) = pstate1;
 	    nextp[i] = dist1;
 	}
+	if (i % 64 == 63 || i == num_states - 1) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
     }
-#if CONVCODE_DEBUG_STATES
-    printf("T(%u) %x\n", ce->ctrellis, bits);
-    for (i = 0; i < ce->num_states; i++) {
-	printf(" %4.4u", trellis_entry(ce, ce->ctrellis, i));
-    }
-    printf("\n");
-    for (i = 0; i < ce->num_states; i++) {
-	printf(" %4.4u", nextp[i]);
-    }
-    printf("\n");
-#endif
-    ce->ctrellis++;
-    ce->next_path_values = currp;
-    ce->curr_path_values = nextp;
-    return 0;
 }
+DECODE_KERNEL_VARIANTS(decode_bits_scalar, )
 
 /*
- * Extract nbits bits from bytes at offset curr.
+ * The scalar kernel for 8 and 16-bit path values.  Same as above, but
+ * the path values saturate instead of wrapping.
  */
-static unsigned int
-extract_bits(const unsigned char *bytes, unsigned int curr, unsigned int nbits)
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_scalar_narrow_n(struct convcode *ce, unsigned int base,
+			    const unsigned int *delta, unsigned int num_states,
+			    unsigned int num_polys)
 {
-    unsigned int pos = curr / 8;
-    unsigned int opos = 0;
-    unsigned int bit = curr % 8, bits_left = nbits;
-    unsigned int v = 0, byte_avail;
+    void *currp = ce->curr_path_values;
+    void *nextp = ce->next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    const unsigned int *bm = ce->branch_metrics;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states >> 1, i;
+
+    if (bm)
+	fill_branch_metrics(ce, base, delta, num_polys);
+
+    for (i = 0; i < num_states; i++) {
+	convcode_state pstate1 = i >> 1, pstate2 = pstate1 | half;
+	unsigned int dist1, dist2;
 
-    byte_avail = 8 - bit;
-    while (byte_avail <= bits_left) {
-	v |= ((unsigned int) (bytes[pos] >> bit)) << opos;
-	bits_left -= byte_avail;
-	opos += byte_avail;
-	bit = 0;
-	byte_avail = 8;
-	bytes++;
+	dist1 = get_path_value(ce, currp, pstate1);
+	dist2 = get_path_value(ce, currp, pstate2);
+	if (bm) {
+	    dist1 += bm[out1[i]];
+	    dist2 += bm[out2[i]];
+	} else {
+	    dist1 += branch_metric(base, delta, out1[i]);
+	    dist2 += branch_metric(base, delta, out2[i]);
+	}
+	if (dist1 > ce->metric_max)
+	    dist1 = ce->metric_max;
+	if (dist2 > ce->metric_max)
+	    dist2 = ce->metric_max;
+
+	if (dist2 < dist1) {
+	    decisions |= (uint64_t) 1 << (i % 64);
+	    set_path_value(ce, nextp, i, dist2);
+	} else {
+	    set_path_value(ce, nextp, i, dist1);
+	}
+	if (i % 64 == 63 || i == num_states - 1) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
     }
-    if (bits_left)
-	v |= ((unsigned int) (bytes[pos] >> bit)) << opos;
-    v &= (1 << nbits) - 1;
-    return v;
 }
+DECODE_KERNEL_VARIANTS(decode_bits_scalar_narrow, )
 
-int
-convdecode_data(struct convcode *ce,
-		const unsigned char *bytes, unsigned int nbits,
-		const uint8_t *uncertainty)
+/*
+ * Butterfly kernels
+ *
+ * States 2j and 2j + 1 both come from states j and j + half, so the
+ * ACS can be done a pair (a butterfly) at a time: read the path
+ * values for j and j + half once, from two unit-stride runs, and
+ * write 2j and 2j + 1 next to each other, so the writes are unit
+ * stride too and their decision bits are next to each other in the
+ * trellis column.  The arrays stay in state order, so nothing else
+ * has to know about this.
+ *
+ * For a non-recursive code where every polynomial has its first and
+ * last taps set (most of them), the four branches of a butterfly only
+ * have two outputs between them.  Going from j into 2j gives
+ * convert[0][j], the other state or the other input bit flips every
+ * output bit, and flipping both flips them back.  The metric for the
+ * flipped output is base + bm[all] - the metric, so there's only one
+ * metric to compute per butterfly, and it comes from a unit-stride
+ * run of convert[0].  coder->butterfly says if the code is like that.
+ *
+ * These give exactly the same results as the per-state kernels.
+ */
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_scalar_bfly_n(struct convcode *ce, unsigned int base,
+			  const unsigned int *delta, unsigned int num_states,
+			  unsigned int num_polys)
 {
-    unsigned int curr_bit = 0, i;
-    int rv;
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    const unsigned int *out = ce->convert[0];
+    const unsigned int *bm = ce->branch_metrics;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states >> 1, all = (1 << num_polys) - 1;
+    unsigned int comp, j;
+
+    if (bm) {
+	fill_branch_metrics(ce, base, delta, num_polys);
+	comp = base + bm[all];
+    } else {
+	comp = base + branch_metric(base, delta, all);
+    }
 
-    if (ce->leftover_bits) {
-	unsigned int newbits, extract_size;
+    for (j = 0; j < half; j++) {
+	unsigned int a = currp[j], b = currp[j + half], m, mc;
+	unsigned int x1, x2, y1, y2;
 
-	if (nbits + ce->leftover_bits < ce->num_polys) {
-	    /* Not enough bits for a full symbol, just store these. */
-	    ce->leftover_bits_data |= bytes[0] << ce->leftover_bits;
-	    if (uncertainty) {
-		for (i = 0; i < nbits; i++)
-		    ce->leftover_uncertainty[ce->leftover_bits++] =
-			uncertainty[i];
-	    } else {
-		ce->leftover_bits += nbits;
-	    }
-	    ce->leftover_bits_data &= (1 << ce->leftover_bits) - 1;
-	    return 0;
+	if (bm)
+	    m = bm[out[j]];
+	else
+	    m = branch_metric(base, delta, out[j]);
+	mc = comp - m;
+
+	/* Into 2j from j and j + half, then into 2j + 1. */
+	x1 = a + m;
+	x2 = b + mc;
+	y1 = a + mc;
+	y2 = b + m;
+	if (x2 < x1) {
+	    decisions |= (uint64_t) 1 << (2 * j % 64);
+	    nextp[2 * j] = x2;
+	} else {
+	    nextp[2 * j] = x1;
 	}
-	/* We got enough bits for a full symbol, process it. */
-	extract_size = ce->num_polys - ce->leftover_bits;
-	newbits = extract_bits(bytes, curr_bit, extract_size);
-	curr_bit += extract_size;
-	nbits -= extract_size;
-	ce->leftover_bits_data |= newbits << ce->leftover_bits;
-	if (uncertainty) {
-	    for (i = 0; i < extract_size; i++)
-		ce->leftover_uncertainty[ce->leftover_bits++] =
-		    uncertainty[i];
-	    rv = decode_bits(ce, ce->leftover_bits_data,
-			     ce->leftover_uncertainty);
+	if (y2 < y1) {
+	    decisions |= (uint64_t) 2 << (2 * j % 64);
+	    nextp[2 * j + 1] = y2;
 	} else {
-	    rv = decode_bits(ce, ce->leftover_bits_data, NULL);
+	    nextp[2 * j + 1] = y1;
 	}
-	ce->leftover_bits = 0;
+	if (j % 32 == 31 || j == half - 1) {
+	    column[j / 32] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_scalar_bfly, )
+
+/*
+ * The butterfly kernel for 8 and 16-bit path values, saturating like
+ * decode_bits_scalar_narrow().
+ */
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_scalar_narrow_bfly_n(struct convcode *ce, unsigned int base,
+				 const unsigned int *delta,
+				 unsigned int num_states,
+				 unsigned int num_polys)
+{
+    void *currp = ce->curr_path_values;
+    void *nextp = ce->next_path_values;
+    const unsigned int *out = ce->convert[0];
+    const unsigned int *bm = ce->branch_metrics;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states >> 1, all = (1 << num_polys) - 1;
+    unsigned int max = ce->metric_max, comp, j;
+
+    if (bm) {
+	fill_branch_metrics(ce, base, delta, num_polys);
+	comp = base + bm[all];
+    } else {
+	comp = base + branch_metric(base, delta, all);
     }
 
-    while (nbits >= ce->num_polys) {
-	unsigned int bits = extract_bits(bytes, curr_bit, ce->num_polys);
+    for (j = 0; j < half; j++) {
+	unsigned int a = get_path_value(ce, currp, j);
+	unsigned int b = get_path_value(ce, currp, j + half);
+	unsigned int m, mc, x1, x2, y1, y2;
 
-	if (uncertainty)
-	    rv = decode_bits(ce, bits, uncertainty + curr_bit);
+	if (bm)
+	    m = bm[out[j]];
 	else
-	    rv = decode_bits(ce, bits, NULL);
-	if (rv)
-	    return rv;
-	curr_bit += ce->num_polys;
-	nbits -= ce->num_polys;
-    }
-    ce->leftover_bits = nbits;
-    if (nbits) {
-	ce->leftover_bits_data = bytes[curr_bit / 8] >> (curr_bit % 8);
-	ce->leftover_bits_data &= (1 << nbits) - 1;
-	if (uncertainty) {
-	    for (i = 0; i < ce->leftover_bits; i++)
-		ce->leftover_uncertainty[i] = uncertainty[curr_bit++];
+	    m = branch_metric(base, delta, out[j]);
+	mc = comp - m;
+
+	x1 = a + m;
+	x2 = b + mc;
+	y1 = a + mc;
+	y2 = b + m;
+	if (x1 > max)
+	    x1 = max;
+	if (x2 > max)
+	    x2 = max;
+	if (y1 > max)
+	    y1 = max;
+	if (y2 > max)
+	    y2 = max;
+	if (x2 < x1) {
+	    decisions |= (uint64_t) 1 << (2 * j % 64);
+	    set_path_value(ce, nextp, 2 * j, x2);
+	} else {
+	    set_path_value(ce, nextp, 2 * j, x1);
+	}
+	if (y2 < y1) {
+	    decisions |= (uint64_t) 2 << (2 * j % 64);
+	    set_path_value(ce, nextp, 2 * j + 1, y2);
+	} else {
+	    set_path_value(ce, nextp, 2 * j + 1, y1);
+	}
+	if (j % 32 == 31 || j == half - 1) {
+	    column[j / 32] = decisions;
+	    decisions = 0;
 	}
     }
-    return 0;
 }
+DECODE_KERNEL_VARIANTS(decode_bits_scalar_narrow_bfly, )
 
-int
-convdecode_finish(struct convcode *ce, unsigned int *total_out_bits,
-		  unsigned int *num_errs)
+#if !defined(CONVCODE_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CONVCODE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if !defined(CONVCODE_NO_SIMD) && defined(__ARM_NEON)
+#define CONVCODE_NEON_SIMD 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * The SIMD kernels work on a run of consecutive states at a time.
+ * The two previous states of state i are i / 2 and i / 2 + half the
+ * states, so a run of n states takes a run of n / 2 path values from
+ * each half, each duplicated into two lanes.  The encoded output for
+ * each transition comes from prev_convert, and the branch metric is
+ * built from base and delta (see branch_costs()) with one masked add
+ * per polynomial.
+ */
+
+#ifdef CONVCODE_X86_SIMD
+__attribute__((target("sse4.1")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_sse41_n(struct convcode *ce, unsigned int base,
+		    const unsigned int *delta, unsigned int num_states,
+		    unsigned int num_polys)
 {
-    unsigned int i, extra_bits = 0;
-    unsigned int min_val = ce->curr_path_values[0], cstate = 0;
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m128i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbase = _mm_set1_epi32(base);
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm_set1_epi32(delta[j]);
+	vbit[j] = _mm_set1_epi32(1 << j);
+    }
 
-    /* Find the minimum value in the final path. */
-    for (i = 1; i < ce->num_states; i++) {
-	if (ce->curr_path_values[i] < min_val) {
-	    cstate = i;
-	    min_val = ce->curr_path_values[i];
+    for (i = 0; i < num_states; i += 4) {
+	__m128i d1, d2, o1, o2, m1, m2, min;
+	unsigned int choose1;
+
+	d1 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)
+						(currp + i / 2)));
+	d1 = _mm_or_si128(d1, _mm_slli_epi64(d1, 32));
+	d2 = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)
+						(currp + half + i / 2)));
+	d2 = _mm_or_si128(d2, _mm_slli_epi64(d2, 32));
+	o1 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)
+						(ce->prev_convert[0] + i)));
+	o2 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)
+						(ce->prev_convert[1] + i)));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm_add_epi32(m1, _mm_and_si128(
+			_mm_cmpeq_epi32(_mm_and_si128(o1, vbit[j]), vbit[j]),
+			vdelta[j]));
+	    m2 = _mm_add_epi32(m2, _mm_and_si128(
+			_mm_cmpeq_epi32(_mm_and_si128(o2, vbit[j]), vbit[j]),
+			vdelta[j]));
+	}
+	d1 = _mm_add_epi32(d1, m1);
+	d2 = _mm_add_epi32(d2, m2);
+	min = _mm_min_epu32(d1, d2);
+	_mm_storeu_si128((__m128i *) (nextp + i), min);
+
+	/* Ties go to pstate1, like the scalar version. */
+	choose1 = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(min, d1)));
+	decisions |= (uint64_t) (~choose1 & 0xf) << (i % 64);
+	if (i % 64 == 60 || i + 4 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
 	}
     }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_sse41, __attribute__((target("sse4.1"))))
 
-    /* Go backwards through the trellis to find the full path. */
-    for (i = ce->ctrellis; i > 0; ) {
-	convcode_state pstate; /* Previous state */
+/*
+ * Spread the low 16 bits of v out to the even bits, for interleaving
+ * the decisions of the two halves of a butterfly.
+ */
+static CONVCODE_ALWAYS_INLINE uint64_t
+spread_bits(uint64_t v)
+{
+    v = (v | v << 8) & 0x00ff00ff;
+    v = (v | v << 4) & 0x0f0f0f0f;
+    v = (v | v << 2) & 0x33333333;
+    v = (v | v << 1) & 0x55555555;
+    return v;
+}
 
-	i--;
-	pstate = trellis_entry(ce, i, cstate);
-	/*
-	 * Store the bit values in position 0 so we can play it back
-	 * forward easily.
-	 */
-	trellis_entry(ce, i, 0) = get_prev_bit(ce, pstate, cstate);
-	cstate = pstate;
+/*
+ * decode_bits_scalar_bfly_n() four butterflies at a time.  The new
+ * path values for the even and odd states come out in separate
+ * vectors and are interleaved with a fixed unpack to store them.
+ */
+__attribute__((target("sse4.1")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_sse41_bfly_n(struct convcode *ce, unsigned int base,
+			 const unsigned int *delta, unsigned int num_states,
+			 unsigned int num_polys)
+{
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    const unsigned int *out = ce->convert[0];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j, comp = base;
+    __m128i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbase = _mm_set1_epi32(base), vcomp;
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm_set1_epi32(delta[j]);
+	vbit[j] = _mm_set1_epi32(1 << j);
+	comp += delta[j];
+    }
+    vcomp = _mm_set1_epi32(base + comp);
+
+    for (i = 0; i < half; i += 4) {
+	__m128i a, b, o, m, mc, x1, x2, y1, y2, even, odd;
+	unsigned int choose1e, choose1o;
+
+	a = _mm_loadu_si128((const __m128i *) (currp + i));
+	b = _mm_loadu_si128((const __m128i *) (currp + half + i));
+	o = _mm_loadu_si128((const __m128i *) (out + i));
+	m = vbase;
+	for (j = 0; j < num_polys; j++)
+	    m = _mm_add_epi32(m, _mm_and_si128(
+			_mm_cmpeq_epi32(_mm_and_si128(o, vbit[j]), vbit[j]),
+			vdelta[j]));
+	mc = _mm_sub_epi32(vcomp, m);
+
+	x1 = _mm_add_epi32(a, m);
+	x2 = _mm_add_epi32(b, mc);
+	y1 = _mm_add_epi32(a, mc);
+	y2 = _mm_add_epi32(b, m);
+	even = _mm_min_epu32(x1, x2);
+	odd = _mm_min_epu32(y1, y2);
+	_mm_storeu_si128((__m128i *) (nextp + 2 * i),
+			 _mm_unpacklo_epi32(even, odd));
+	_mm_storeu_si128((__m128i *) (nextp + 2 * i + 4),
+			 _mm_unpackhi_epi32(even, odd));
+
+	choose1e = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(even, x1)));
+	choose1o = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(odd, y1)));
+	decisions |= (spread_bits(~choose1e & 0xf) |
+		      spread_bits(~choose1o & 0xf) << 1) << (2 * i % 64);
+	if (i % 32 == 28 || i + 4 == half) {
+	    column[i / 32] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_sse41_bfly,
+		       __attribute__((target("sse4.1"))))
+
+__attribute__((target("avx2")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx2_n(struct convcode *ce, unsigned int base,
+		   const unsigned int *delta, unsigned int num_states,
+		   unsigned int num_polys)
+{
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m256i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbase = _mm256_set1_epi32(base);
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm256_set1_epi32(delta[j]);
+	vbit[j] = _mm256_set1_epi32(1 << j);
     }
 
-    /* We've stored the values in index 0 of each column, play it forward. */
-    if (ce->do_tail)
-	extra_bits = ce->k - 1;
-    for (i = 0; i < ce->ctrellis - extra_bits; i++) {
-	int rv = output_bits(ce, &ce->dec_out, trellis_entry(ce, i, 0), 1);
-	if (rv)
-	    return rv;
+    for (i = 0; i < num_states; i += 8) {
+	__m256i d1, d2, o1, o2, m1, m2, min;
+	unsigned int choose1;
+
+	d1 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)
+						   (currp + i / 2)));
+	d1 = _mm256_or_si256(d1, _mm256_slli_epi64(d1, 32));
+	d2 = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)
+						   (currp + half + i / 2)));
+	d2 = _mm256_or_si256(d2, _mm256_slli_epi64(d2, 32));
+	o1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)
+						   (ce->prev_convert[0] + i)));
+	o2 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)
+						   (ce->prev_convert[1] + i)));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm256_add_epi32(m1, _mm256_and_si256(
+		    _mm256_cmpeq_epi32(_mm256_and_si256(o1, vbit[j]), vbit[j]),
+		    vdelta[j]));
+	    m2 = _mm256_add_epi32(m2, _mm256_and_si256(
+		    _mm256_cmpeq_epi32(_mm256_and_si256(o2, vbit[j]), vbit[j]),
+		    vdelta[j]));
+	}
+	d1 = _mm256_add_epi32(d1, m1);
+	d2 = _mm256_add_epi32(d2, m2);
+	min = _mm256_min_epu32(d1, d2);
+	_mm256_storeu_si256((__m256i *) (nextp + i), min);
+
+	choose1 = _mm256_movemask_ps(_mm256_castsi256_ps(
+					 _mm256_cmpeq_epi32(min, d1)));
+	decisions |= (uint64_t) (~choose1 & 0xff) << (i % 64);
+	if (i % 64 == 56 || i + 8 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
     }
-    if (ce->dec_out.out_bit_pos > 0)
-	ce->dec_out.output(ce, ce->dec_out.user_data,
-			   ce->dec_out.out_bits, ce->dec_out.out_bit_pos);
-    if (num_errs)
-	*num_errs = min_val;
-    if (total_out_bits)
-	*total_out_bits = ce->dec_out.total_out_bits;
-    return 0;
 }
+DECODE_KERNEL_VARIANTS(decode_bits_avx2, __attribute__((target("avx2"))))
 
-int
-convdecode_block(struct convcode *ce, const unsigned char *bytes,
-		 unsigned int nbits, const uint8_t *uncertainty,
-		 unsigned char *outbytes, unsigned int *output_uncertainty,
-		 unsigned int *num_errs)
+/*
+ * decode_bits_sse41_bfly_n() eight butterflies at a time.  The
+ * unpacks work within 128-bit lanes, so a lane permute puts the
+ * halves back in order.
+ */
+__attribute__((target("avx2")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx2_bfly_n(struct convcode *ce, unsigned int base,
+			const unsigned int *delta, unsigned int num_states,
+			unsigned int num_polys)
 {
-    unsigned int i, extra_bits = 0;
-    unsigned int min_val, cuncertainty, cstate;
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    const unsigned int *out = ce->convert[0];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j, comp = base;
+    __m256i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbase = _mm256_set1_epi32(base), vcomp;
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm256_set1_epi32(delta[j]);
+	vbit[j] = _mm256_set1_epi32(1 << j);
+	comp += delta[j];
+    }
+    vcomp = _mm256_set1_epi32(base + comp);
+
+    for (i = 0; i < half; i += 8) {
+	__m256i a, b, o, m, mc, x1, x2, y1, y2, even, odd, lo, hi;
+	unsigned int choose1e, choose1o;
+
+	a = _mm256_loadu_si256((const __m256i *) (currp + i));
+	b = _mm256_loadu_si256((const __m256i *) (currp + half + i));
+	o = _mm256_loadu_si256((const __m256i *) (out + i));
+	m = vbase;
+	for (j = 0; j < num_polys; j++)
+	    m = _mm256_add_epi32(m, _mm256_and_si256(
+		    _mm256_cmpeq_epi32(_mm256_and_si256(o, vbit[j]), vbit[j]),
+		    vdelta[j]));
+	mc = _mm256_sub_epi32(vcomp, m);
+
+	x1 = _mm256_add_epi32(a, m);
+	x2 = _mm256_add_epi32(b, mc);
+	y1 = _mm256_add_epi32(a, mc);
+	y2 = _mm256_add_epi32(b, m);
+	even = _mm256_min_epu32(x1, x2);
+	odd = _mm256_min_epu32(y1, y2);
+	lo = _mm256_unpacklo_epi32(even, odd);
+	hi = _mm256_unpackhi_epi32(even, odd);
+	_mm256_storeu_si256((__m256i *) (nextp + 2 * i),
+			    _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *) (nextp + 2 * i + 8),
+			    _mm256_permute2x128_si256(lo, hi, 0x31));
+
+	choose1e = _mm256_movemask_ps(_mm256_castsi256_ps(
+					  _mm256_cmpeq_epi32(even, x1)));
+	choose1o = _mm256_movemask_ps(_mm256_castsi256_ps(
+					  _mm256_cmpeq_epi32(odd, y1)));
+	decisions |= (spread_bits(~choose1e & 0xff) |
+		      spread_bits(~choose1o & 0xff) << 1) << (2 * i % 64);
+	if (i % 32 == 24 || i + 8 == half) {
+	    column[i / 32] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx2_bfly, __attribute__((target("avx2"))))
 
-    if (convdecode_data(ce, bytes, nbits, uncertainty))
-	return 1;
+__attribute__((target("avx512f")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx512_n(struct convcode *ce, unsigned int base,
+		     const unsigned int *delta, unsigned int num_states,
+		     unsigned int num_polys)
+{
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m512i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbase = _mm512_set1_epi32(base);
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm512_set1_epi32(delta[j]);
+	vbit[j] = _mm512_set1_epi32(1 << j);
+    }
 
-    /* Find the minimum value in the final path. */
-    min_val = ce->curr_path_values[0];
-    cstate = 0;
-    for (i = 1; i < ce->num_states; i++) {
-	if (ce->curr_path_values[i] < min_val) {
-	    cstate = i;
-	    min_val = ce->curr_path_values[i];
+    for (i = 0; i < num_states; i += 16) {
+	__m512i d1, d2, o1, o2, m1, m2, min;
+	__mmask16 choose2;
+
+	d1 = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i *)
+						      (currp + i / 2)));
+	d1 = _mm512_or_si512(d1, _mm512_slli_epi64(d1, 32));
+	d2 = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i *)
+						      (currp + half + i / 2)));
+	d2 = _mm512_or_si512(d2, _mm512_slli_epi64(d2, 32));
+	o1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)
+						      (ce->prev_convert[0] + i)));
+	o2 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)
+						      (ce->prev_convert[1] + i)));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm512_mask_add_epi32(m1, _mm512_test_epi32_mask(o1, vbit[j]),
+				       m1, vdelta[j]);
+	    m2 = _mm512_mask_add_epi32(m2, _mm512_test_epi32_mask(o2, vbit[j]),
+				       m2, vdelta[j]);
+	}
+	d1 = _mm512_add_epi32(d1, m1);
+	d2 = _mm512_add_epi32(d2, m2);
+	min = _mm512_min_epu32(d1, d2);
+	_mm512_storeu_si512(nextp + i, min);
+
+	choose2 = _mm512_cmpneq_epu32_mask(min, d1);
+	decisions |= (uint64_t) choose2 << (i % 64);
+	if (i % 64 == 48 || i + 16 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
 	}
     }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx512, __attribute__((target("avx512f"))))
 
-    /* Go backwards through the trellis to find the full path. */
-    if (ce->do_tail)
-	extra_bits = ce->k - 1;
-    cuncertainty = min_val;
-    for (i = ce->ctrellis; i > 0; ) {
-	convcode_state pstate; /* Previous state */
-	unsigned int bit, bits, inpos;
-	const uint8_t *u = NULL;
+/*
+ * decode_bits_sse41_bfly_n() sixteen butterflies at a time, with a
+ * two-source permute to interleave the halves.
+ */
+__attribute__((target("avx512f")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx512_bfly_n(struct convcode *ce, unsigned int base,
+			  const unsigned int *delta, unsigned int num_states,
+			  unsigned int num_polys)
+{
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    const unsigned int *out = ce->convert[0];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j, comp = base;
+    __m512i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbase = _mm512_set1_epi32(base), vcomp;
+    __m512i ilo = _mm512_set_epi32(23, 7, 22, 6, 21, 5, 20, 4,
+				   19, 3, 18, 2, 17, 1, 16, 0);
+    __m512i ihi = _mm512_set_epi32(31, 15, 30, 14, 29, 13, 28, 12,
+				   27, 11, 26, 10, 25, 9, 24, 8);
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm512_set1_epi32(delta[j]);
+	vbit[j] = _mm512_set1_epi32(1 << j);
+	comp += delta[j];
+    }
+    vcomp = _mm512_set1_epi32(base + comp);
+
+    for (i = 0; i < half; i += 16) {
+	__m512i a, b, o, m, mc, x1, x2, y1, y2, even, odd;
+	__mmask16 choose2e, choose2o;
+
+	a = _mm512_loadu_si512(currp + i);
+	b = _mm512_loadu_si512(currp + half + i);
+	o = _mm512_loadu_si512(out + i);
+	m = vbase;
+	for (j = 0; j < num_polys; j++)
+	    m = _mm512_mask_add_epi32(m, _mm512_test_epi32_mask(o, vbit[j]),
+				      m, vdelta[j]);
+	mc = _mm512_sub_epi32(vcomp, m);
+
+	x1 = _mm512_add_epi32(a, m);
+	x2 = _mm512_add_epi32(b, mc);
+	y1 = _mm512_add_epi32(a, mc);
+	y2 = _mm512_add_epi32(b, m);
+	even = _mm512_min_epu32(x1, x2);
+	odd = _mm512_min_epu32(y1, y2);
+	_mm512_storeu_si512(nextp + 2 * i,
+			    _mm512_permutex2var_epi32(even, ilo, odd));
+	_mm512_storeu_si512(nextp + 2 * i + 16,
+			    _mm512_permutex2var_epi32(even, ihi, odd));
+
+	choose2e = _mm512_cmpneq_epu32_mask(even, x1);
+	choose2o = _mm512_cmpneq_epu32_mask(odd, y1);
+	decisions |= (spread_bits(choose2e) |
+		      spread_bits(choose2o) << 1) << (2 * i % 64);
+	if (i % 32 == 16 || i + 16 == half) {
+	    column[i / 32] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx512_bfly,
+		       __attribute__((target("avx512f"))))
 
-	i--;
-	pstate = trellis_entry(ce, i, cstate);
-	bit = get_prev_bit(ce, pstate, cstate);
+/*
+ * The 8-bit kernels look the branch metric up with a byte shuffle,
+ * which is why they are limited to 4 polynomials.  The table entries
+ * saturate like the path values do.
+ */
+static CONVCODE_ALWAYS_INLINE void
+fill_branch_lut8(unsigned int base, const unsigned int *delta,
+		 unsigned int num_polys, uint8_t *lut)
+{
+    unsigned int v[16], i, j, n;
 
-	/*
-	 * Store the bit values in the user-supplied data.
-	 */
-	if (extra_bits == 0)
-	    outbytes[i / 8] |= bit << (i % 8);
+    /* Like fill_branch_metrics(), then saturate. */
+    v[0] = base;
+    for (j = 0, n = 1; j < num_polys; j++, n <<= 1) {
+	for (i = 0; i < n; i++)
+	    v[n + i] = v[i] + delta[j];
+    }
+    for (i = 0; i < 16; i++) {
+	if (i >= n)
+	    lut[i] = 0;
+	else
+	    lut[i] = v[i] > 255 ? 255 : v[i];
+    }
+}
 
-	if (output_uncertainty) {
-	    if (extra_bits == 0)
-		output_uncertainty[i] = cuncertainty;
+__attribute__((target("sse4.1")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_sse41_16_n(struct convcode *ce, unsigned int base,
+		       const unsigned int *delta, unsigned int num_states,
+		       unsigned int num_polys)
+{
+    const uint16_t *currp = ce->curr_path_values;
+    uint16_t *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m128i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m128i vbase = _mm_set1_epi16(base), zero = _mm_setzero_si128();
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm_set1_epi16(delta[j]);
+	vbit[j] = _mm_set1_epi16(1 << j);
+    }
 
-	    /*
-	     * Subtract off the distance we had computed to here to get the
-	     * previous uncertainty value.
-	     */
-	    inpos = i * ce->num_polys;
-	    bits = extract_bits(bytes, inpos, ce->num_polys);
-	    if (uncertainty)
-		u = uncertainty + inpos;
-	    cuncertainty -= hamming_distance(ce, ce->convert[bit][pstate],
-					     bits, u);
+    for (i = 0; i < num_states; i += 8) {
+	__m128i d1, d2, o1, o2, m1, m2, min;
+	unsigned int choose1;
+
+	d1 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)
+						(currp + i / 2)));
+	d1 = _mm_or_si128(d1, _mm_slli_epi32(d1, 16));
+	d2 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)
+						(currp + half + i / 2)));
+	d2 = _mm_or_si128(d2, _mm_slli_epi32(d2, 16));
+	o1 = _mm_loadu_si128((const __m128i *) (ce->prev_convert[0] + i));
+	o2 = _mm_loadu_si128((const __m128i *) (ce->prev_convert[1] + i));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm_add_epi16(m1, _mm_and_si128(
+			_mm_cmpeq_epi16(_mm_and_si128(o1, vbit[j]), vbit[j]),
+			vdelta[j]));
+	    m2 = _mm_add_epi16(m2, _mm_and_si128(
+			_mm_cmpeq_epi16(_mm_and_si128(o2, vbit[j]), vbit[j]),
+			vdelta[j]));
 	}
-	if (extra_bits > 0)
-	    extra_bits--;
+	d1 = _mm_adds_epu16(d1, m1);
+	d2 = _mm_adds_epu16(d2, m2);
+	min = _mm_min_epu16(d1, d2);
+	_mm_storeu_si128((__m128i *) (nextp + i), min);
+
+	choose1 = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(min, d1),
+						    zero));
+	decisions |= (uint64_t) (~choose1 & 0xff) << (i % 64);
+	if (i % 64 == 56 || i + 8 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_sse41_16, __attribute__((target("sse4.1"))))
 
-	cstate = pstate;
+__attribute__((target("sse4.1")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_sse41_8_n(struct convcode *ce, unsigned int base,
+		      const unsigned int *delta, unsigned int num_states,
+		      unsigned int num_polys)
+{
+    const uint8_t *currp = ce->curr_path_values;
+    uint8_t *nextp = ce->next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i;
+    uint8_t lut[16];
+    __m128i vlut;
+
+    fill_branch_lut8(base, delta, num_polys, lut);
+    vlut = _mm_loadu_si128((const __m128i *) lut);
+
+    for (i = 0; i < num_states; i += 16) {
+	__m128i d1, d2, o1, o2, min;
+	unsigned int choose1;
+
+	d1 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)
+					       (currp + i / 2)));
+	d1 = _mm_or_si128(d1, _mm_slli_epi16(d1, 8));
+	d2 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)
+					       (currp + half + i / 2)));
+	d2 = _mm_or_si128(d2, _mm_slli_epi16(d2, 8));
+	o1 = _mm_packus_epi16(_mm_loadu_si128((const __m128i *) (out1 + i)),
+			      _mm_loadu_si128((const __m128i *) (out1 + i + 8)));
+	o2 = _mm_packus_epi16(_mm_loadu_si128((const __m128i *) (out2 + i)),
+			      _mm_loadu_si128((const __m128i *) (out2 + i + 8)));
+	d1 = _mm_adds_epu8(d1, _mm_shuffle_epi8(vlut, o1));
+	d2 = _mm_adds_epu8(d2, _mm_shuffle_epi8(vlut, o2));
+	min = _mm_min_epu8(d1, d2);
+	_mm_storeu_si128((__m128i *) (nextp + i), min);
+
+	choose1 = _mm_movemask_epi8(_mm_cmpeq_epi8(min, d1));
+	decisions |= (uint64_t) (~choose1 & 0xffff) << (i % 64);
+	if (i % 64 == 48 || i + 16 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
     }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_sse41_8, __attribute__((target("sse4.1"))))
 
-    if (num_errs)
-	*num_errs = min_val;
+__attribute__((target("avx2")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx2_16_n(struct convcode *ce, unsigned int base,
+		      const unsigned int *delta, unsigned int num_states,
+		      unsigned int num_polys)
+{
+    const uint16_t *currp = ce->curr_path_values;
+    uint16_t *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m256i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m256i vbase = _mm256_set1_epi16(base), zero = _mm256_setzero_si256();
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm256_set1_epi16(delta[j]);
+	vbit[j] = _mm256_set1_epi16(1 << j);
+    }
 
-    return 0;
+    for (i = 0; i < num_states; i += 16) {
+	__m256i d1, d2, o1, o2, m1, m2, min;
+	unsigned int choose1;
+
+	d1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)
+						   (currp + i / 2)));
+	d1 = _mm256_or_si256(d1, _mm256_slli_epi32(d1, 16));
+	d2 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)
+						   (currp + half + i / 2)));
+	d2 = _mm256_or_si256(d2, _mm256_slli_epi32(d2, 16));
+	o1 = _mm256_loadu_si256((const __m256i *) (ce->prev_convert[0] + i));
+	o2 = _mm256_loadu_si256((const __m256i *) (ce->prev_convert[1] + i));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm256_add_epi16(m1, _mm256_and_si256(
+		    _mm256_cmpeq_epi16(_mm256_and_si256(o1, vbit[j]), vbit[j]),
+		    vdelta[j]));
+	    m2 = _mm256_add_epi16(m2, _mm256_and_si256(
+		    _mm256_cmpeq_epi16(_mm256_and_si256(o2, vbit[j]), vbit[j]),
+		    vdelta[j]));
+	}
+	d1 = _mm256_adds_epu16(d1, m1);
+	d2 = _mm256_adds_epu16(d2, m2);
+	min = _mm256_min_epu16(d1, d2);
+	_mm256_storeu_si256((__m256i *) (nextp + i), min);
+
+	/* The pack works per 128-bit lane, so the mask comes out split. */
+	choose1 = _mm256_movemask_epi8(_mm256_packs_epi16(
+					   _mm256_cmpeq_epi16(min, d1), zero));
+	choose1 = (choose1 & 0xff) | ((choose1 >> 8) & 0xff00);
+	decisions |= (uint64_t) (~choose1 & 0xffff) << (i % 64);
+	if (i % 64 == 48 || i + 16 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
 }
+DECODE_KERNEL_VARIANTS(decode_bits_avx2_16, __attribute__((target("avx2"))))
 
-#ifdef CONVCODE_TESTS
+__attribute__((target("avx2")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx2_8_n(struct convcode *ce, unsigned int base,
+		     const unsigned int *delta, unsigned int num_states,
+		     unsigned int num_polys)
+{
+    const uint8_t *currp = ce->curr_path_values;
+    uint8_t *nextp = ce->next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i;
+    uint8_t lut[16];
+    __m256i vlut;
+
+    fill_branch_lut8(base, delta, num_polys, lut);
+    vlut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut));
+
+    for (i = 0; i < num_states; i += 32) {
+	__m256i d1, d2, o1, o2, min;
+	uint32_t choose1;
+
+	d1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)
+						  (currp + i / 2)));
+	d1 = _mm256_or_si256(d1, _mm256_slli_epi16(d1, 8));
+	d2 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)
+						  (currp + half + i / 2)));
+	d2 = _mm256_or_si256(d2, _mm256_slli_epi16(d2, 8));
+	o1 = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+		_mm256_loadu_si256((const __m256i *) (out1 + i)),
+		_mm256_loadu_si256((const __m256i *) (out1 + i + 16))), 0xd8);
+	o2 = _mm256_permute4x64_epi64(_mm256_packus_epi16(
+		_mm256_loadu_si256((const __m256i *) (out2 + i)),
+		_mm256_loadu_si256((const __m256i *) (out2 + i + 16))), 0xd8);
+	d1 = _mm256_adds_epu8(d1, _mm256_shuffle_epi8(vlut, o1));
+	d2 = _mm256_adds_epu8(d2, _mm256_shuffle_epi8(vlut, o2));
+	min = _mm256_min_epu8(d1, d2);
+	_mm256_storeu_si256((__m256i *) (nextp + i), min);
+
+	choose1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(min, d1));
+	decisions |= (uint64_t) (uint32_t) ~choose1 << (i % 64);
+	if (i % 64 == 32 || i + 32 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx2_8, __attribute__((target("avx2"))))
+
+__attribute__((target("avx512bw")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx512_16_n(struct convcode *ce, unsigned int base,
+			const unsigned int *delta, unsigned int num_states,
+			unsigned int num_polys)
+{
+    const uint16_t *currp = ce->curr_path_values;
+    uint16_t *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    __m512i vdelta[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbit[CONVCODE_MAX_POLYNOMIALS];
+    __m512i vbase = _mm512_set1_epi16(base);
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = _mm512_set1_epi16(delta[j]);
+	vbit[j] = _mm512_set1_epi16(1 << j);
+    }
+
+    for (i = 0; i < num_states; i += 32) {
+	__m512i d1, d2, o1, o2, m1, m2, min;
+	__mmask32 choose2;
+
+	d1 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)
+						      (currp + i / 2)));
+	d1 = _mm512_or_si512(d1, _mm512_slli_epi32(d1, 16));
+	d2 = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)
+						      (currp + half + i / 2)));
+	d2 = _mm512_or_si512(d2, _mm512_slli_epi32(d2, 16));
+	o1 = _mm512_loadu_si512(ce->prev_convert[0] + i);
+	o2 = _mm512_loadu_si512(ce->prev_convert[1] + i);
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = _mm512_mask_add_epi16(m1, _mm512_test_epi16_mask(o1, vbit[j]),
+				       m1, vdelta[j]);
+	    m2 = _mm512_mask_add_epi16(m2, _mm512_test_epi16_mask(o2, vbit[j]),
+				       m2, vdelta[j]);
+	}
+	d1 = _mm512_adds_epu16(d1, m1);
+	d2 = _mm512_adds_epu16(d2, m2);
+	min = _mm512_min_epu16(d1, d2);
+	_mm512_storeu_si512(nextp + i, min);
+
+	choose2 = _mm512_cmpneq_epu16_mask(min, d1);
+	decisions |= (uint64_t) choose2 << (i % 64);
+	if (i % 64 == 32 || i + 32 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx512_16,
+		       __attribute__((target("avx512bw"))))
+
+__attribute__((target("avx512bw")))
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_avx512_8_n(struct convcode *ce, unsigned int base,
+		       const unsigned int *delta, unsigned int num_states,
+		       unsigned int num_polys)
+{
+    const uint8_t *currp = ce->curr_path_values;
+    uint8_t *nextp = ce->next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    unsigned int half = num_states / 2, i;
+    uint8_t lut[16];
+    __m512i vlut;
+
+    fill_branch_lut8(base, delta, num_polys, lut);
+    vlut = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) lut));
+
+    /* 64 states at a time, so a decision word per vector. */
+    for (i = 0; i < num_states; i += 64) {
+	__m512i d1, d2, o1, o2, min;
+
+	d1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)
+						     (currp + i / 2)));
+	d1 = _mm512_or_si512(d1, _mm512_slli_epi16(d1, 8));
+	d2 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)
+						     (currp + half + i / 2)));
+	d2 = _mm512_or_si512(d2, _mm512_slli_epi16(d2, 8));
+	o1 = _mm512_inserti64x4(
+		_mm512_castsi256_si512(
+		    _mm512_cvtepi16_epi8(_mm512_loadu_si512(out1 + i))),
+		_mm512_cvtepi16_epi8(_mm512_loadu_si512(out1 + i + 32)), 1);
+	o2 = _mm512_inserti64x4(
+		_mm512_castsi256_si512(
+		    _mm512_cvtepi16_epi8(_mm512_loadu_si512(out2 + i))),
+		_mm512_cvtepi16_epi8(_mm512_loadu_si512(out2 + i + 32)), 1);
+	d1 = _mm512_adds_epu8(d1, _mm512_shuffle_epi8(vlut, o1));
+	d2 = _mm512_adds_epu8(d2, _mm512_shuffle_epi8(vlut, o2));
+	min = _mm512_min_epu8(d1, d2);
+	_mm512_storeu_si512(nextp + i, min);
+
+	column[i / 64] = _mm512_cmpneq_epu8_mask(min, d1);
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_avx512_8,
+		       __attribute__((target("avx512bw"))))
+#endif /* CONVCODE_X86_SIMD */
+
+#ifdef CONVCODE_NEON_SIMD
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_neon_n(struct convcode *ce, unsigned int base,
+		   const unsigned int *delta, unsigned int num_states,
+		   unsigned int num_polys)
+{
+    const unsigned int *currp = ce->curr_path_values;
+    unsigned int *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    uint32x4_t vdelta[CONVCODE_MAX_POLYNOMIALS];
+    uint32x4_t vbit[CONVCODE_MAX_POLYNOMIALS];
+    uint32x4_t vbase = vdupq_n_u32(base), lane_bits;
+    static const uint32_t lane_bits_init[4] = { 1, 2, 4, 8 };
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = vdupq_n_u32(delta[j]);
+	vbit[j] = vdupq_n_u32(1 << j);
+    }
+    lane_bits = vld1q_u32(lane_bits_init);
+
+    for (i = 0; i < num_states; i += 4) {
+	uint32x4_t d1, d2, o1, o2, m1, m2, min, choose2;
+	uint32x2_t t;
+	uint32x2x2_t z;
+
+	z = vzip_u32(vld1_u32(currp + i / 2), vld1_u32(currp + i / 2));
+	d1 = vcombine_u32(z.val[0], z.val[1]);
+	z = vzip_u32(vld1_u32(currp + half + i / 2),
+		     vld1_u32(currp + half + i / 2));
+	d2 = vcombine_u32(z.val[0], z.val[1]);
+	o1 = vmovl_u16(vld1_u16(ce->prev_convert[0] + i));
+	o2 = vmovl_u16(vld1_u16(ce->prev_convert[1] + i));
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = vaddq_u32(m1, vandq_u32(vtstq_u32(o1, vbit[j]), vdelta[j]));
+	    m2 = vaddq_u32(m2, vandq_u32(vtstq_u32(o2, vbit[j]), vdelta[j]));
+	}
+	d1 = vaddq_u32(d1, m1);
+	d2 = vaddq_u32(d2, m2);
+	min = vminq_u32(d1, d2);
+	vst1q_u32(nextp + i, min);
+
+	/* No movemask on NEON, add up a bit per lane instead. */
+	choose2 = vbicq_u32(lane_bits, vceqq_u32(min, d1));
+	t = vpadd_u32(vget_low_u32(choose2), vget_high_u32(choose2));
+	t = vpadd_u32(t, t);
+	decisions |= (uint64_t) vget_lane_u32(t, 0) << (i % 64);
+	if (i % 64 == 60 || i + 4 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_neon, )
+static CONVCODE_ALWAYS_INLINE void
+decode_bits_neon_16_n(struct convcode *ce, unsigned int base,
+		      const unsigned int *delta, unsigned int num_states,
+		      unsigned int num_polys)
+{
+    const uint16_t *currp = ce->curr_path_values;
+    uint16_t *nextp = ce->next_path_values;
+    uint64_t *column = get_trellis_column(ce, ce->ctrellis);
+    uint64_t decisions = 0;
+    unsigned int half = num_states / 2, i, j;
+    uint16x8_t vdelta[CONVCODE_MAX_POLYNOMIALS];
+    uint16x8_t vbit[CONVCODE_MAX_POLYNOMIALS];
+    uint16x8_t vbase = vdupq_n_u16(base), lane_bits;
+    static const uint16_t lane_bits_init[8] = {
+	1, 2, 4, 8, 16, 32, 64, 128
+    };
+
+    for (j = 0; j < num_polys; j++) {
+	vdelta[j] = vdupq_n_u16(delta[j]);
+	vbit[j] = vdupq_n_u16(1 << j);
+    }
+    lane_bits = vld1q_u16(lane_bits_init);
+
+    for (i = 0; i < num_states; i += 8) {
+	uint16x8_t d1, d2, o1, o2, m1, m2, min, choose2;
+	uint16x4_t t;
+	uint16x4x2_t z;
+
+	z = vzip_u16(vld1_u16(currp + i / 2), vld1_u16(currp + i / 2));
+	d1 = vcombine_u16(z.val[0], z.val[1]);
+	z = vzip_u16(vld1_u16(currp + half + i / 2),
+		     vld1_u16(currp + half + i / 2));
+	d2 = vcombine_u16(z.val[0], z.val[1]);
+	o1 = vld1q_u16(ce->prev_convert[0] + i);
+	o2 = vld1q_u16(ce->prev_convert[1] + i);
+	m1 = vbase;
+	m2 = vbase;
+	for (j = 0; j < num_polys; j++) {
+	    m1 = vaddq_u16(m1, vandq_u16(vtstq_u16(o1, vbit[j]), vdelta[j]));
+	    m2 = vaddq_u16(m2, vandq_u16(vtstq_u16(o2, vbit[j]), vdelta[j]));
+	}
+	d1 = vqaddq_u16(d1, m1);
+	d2 = vqaddq_u16(d2, m2);
+	min = vminq_u16(d1, d2);
+	vst1q_u16(nextp + i, min);
+
+	choose2 = vbicq_u16(lane_bits, vceqq_u16(min, d1));
+	t = vpadd_u16(vget_low_u16(choose2), vget_high_u16(choose2));
+	t = vpadd_u16(t, t);
+	t = vpadd_u16(t, t);
+	decisions |= (uint64_t) vget_lane_u16(t, 0) << (i % 64);
+	if (i % 64 == 56 || i + 8 == num_states) {
+	    column[i / 64] = decisions;
+	    decisions = 0;
+	}
+    }
+}
+DECODE_KERNEL_VARIANTS(decode_bits_neon_16, )
+#endif /* CONVCODE_NEON_SIMD */
 
 /*
- * Test code.
- *
- * Compile and run with -t to run tests.
- *
- * To supply your own input and output, run as:
- *
- * ./convcode [-t] [-x] [-s start state] [-i init_val]
- *        -p <poly1> [ -p <poly2> ... ] k <bits>
- *
- * where bits is a sequence of 0 or 1.  The -x option disables the
- * "tail" of the encoder and expectation of the tail in the decoder.
- * (see the convcode.h file about do_tail).  -x works with -t to run
- * the tests that way.  Otherwise, no other options have an effect
- * with -t.
- *
- * The -s and -i options set the start state of the encoder/decoder,
- * and for decoding the init value for the probability matrix for
- * values besides the start state.  See the discussion on tails in
- * convcode.h for detail.
- *
- * For instance, to decode some data with the Voyager coder, do:
- *
- * $ ./convcode -p 0171 -p 0133 7 00110011
- *   0000111010000000111111100111
- *   bits = 28
- *
- * To then decode that data, do:
- *
- * $ ./convcode -p 0171 -p 0133 -d 7 0000111010000000111111100111
- *   00110011
- *   errors = 0
- *   bits = 8
- *
- * The tests themselves are stolen from
- * https://github.com/xukmin/viterbi.git
+ * The batch decode kernels.  These do the same thing as the kernels
+ * above, but for CONVCODE_BATCH_LANES independent frames at once, so
+ * where those work on a run of states in a vector these work on one
+ * state for all the frames.  There is no duplicating or shuffling to
+ * do, each state's path values for all the lanes are together, as
+ * are each output value's branch metrics.
  */
+static void
+decode_batch_scalar(struct convcode *ce, const uint32_t *bm,
+		    uint16_t *decisions)
+{
+    const uint32_t *currp = ce->batch_curr_path_values;
+    uint32_t *nextp = ce->batch_next_path_values;
+    unsigned int half = ce->num_states >> 1, i, j;
 
-#include <stdio.h>
-#include <stdbool.h>
-#include <assert.h>
-#include <time.h>
+    for (i = 0; i < ce->num_states; i++) {
+	const uint32_t *c1 = currp + (i >> 1) * CONVCODE_BATCH_LANES;
+	const uint32_t *c2 = currp + ((i >> 1) | half) * CONVCODE_BATCH_LANES;
+	const uint32_t *b1 = bm + ce->prev_convert[0][i] * CONVCODE_BATCH_LANES;
+	const uint32_t *b2 = bm + ce->prev_convert[1][i] * CONVCODE_BATCH_LANES;
+	uint32_t *n = nextp + i * CONVCODE_BATCH_LANES;
+	uint16_t d = 0;
+
+	for (j = 0; j < CONVCODE_BATCH_LANES; j++) {
+	    uint32_t dist1 = c1[j] + b1[j], dist2 = c2[j] + b2[j];
+
+	    if (dist2 < dist1) {
+		d |= 1 << j;
+		n[j] = dist2;
+	    } else {
+		n[j] = dist1;
+	    }
+	}
+	decisions[i] = d;
+    }
+}
 
-static int
-handle_output(struct convcode *ce, void *output_data, unsigned char byte,
-	      unsigned int nbits)
+#ifdef CONVCODE_X86_SIMD
+__attribute__((target("sse4.1")))
+static void
+decode_batch_sse41(struct convcode *ce, const uint32_t *bm,
+		   uint16_t *decisions)
 {
-    unsigned int i;
+    const uint32_t *currp = ce->batch_curr_path_values;
+    uint32_t *nextp = ce->batch_next_path_values;
+    unsigned int half = ce->num_states >> 1, i, j;
 
-    for (i = 0; i < nbits; i++) {
-	if (byte & 1)
-	    printf("1");
-	else
-	    printf("0");
-	byte >>= 1;
+    for (i = 0; i < ce->num_states; i++) {
+	const uint32_t *c1 = currp + (i >> 1) * CONVCODE_BATCH_LANES;
+	const uint32_t *c2 = currp + ((i >> 1) | half) * CONVCODE_BATCH_LANES;
+	const uint32_t *b1 = bm + ce->prev_convert[0][i] * CONVCODE_BATCH_LANES;
+	const uint32_t *b2 = bm + ce->prev_convert[1][i] * CONVCODE_BATCH_LANES;
+	uint32_t *n = nextp + i * CONVCODE_BATCH_LANES;
+	unsigned int choose1 = 0;
+
+	for (j = 0; j < CONVCODE_BATCH_LANES; j += 4) {
+	    __m128i d1, d2, min;
+
+	    d1 = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (c1 + j)),
+			       _mm_loadu_si128((const __m128i *) (b1 + j)));
+	    d2 = _mm_add_epi32(_mm_loadu_si128((const __m128i *) (c2 + j)),
+			       _mm_loadu_si128((const __m128i *) (b2 + j)));
+	    min = _mm_min_epu32(d1, d2);
+	    _mm_storeu_si128((__m128i *) (n + j), min);
+	    choose1 |= _mm_movemask_ps(_mm_castsi128_ps(
+					_mm_cmpeq_epi32(min, d1))) << j;
+	}
+	decisions[i] = ~choose1;
     }
-    return 0;
 }
 
+__attribute__((target("avx2")))
 static void
-do_encode_data(struct convcode *ce, const char *input, unsigned int *total_bits)
+decode_batch_avx2(struct convcode *ce, const uint32_t *bm,
+		  uint16_t *decisions)
 {
-    unsigned int i, nbits;
-    unsigned char byte = 0;
+    const uint32_t *currp = ce->batch_curr_path_values;
+    uint32_t *nextp = ce->batch_next_path_values;
+    unsigned int half = ce->num_states >> 1, i, j;
 
-    for (i = 0, nbits = 0; input[i]; i++) {
-	if (input[i] == '1')
-	    byte |= 1 << nbits;
-	nbits++;
-	if (nbits == 8) {
-	    convencode_data(ce, &byte, 8);
-	    nbits = 0;
-	    byte = 0;
+    for (i = 0; i < ce->num_states; i++) {
+	const uint32_t *c1 = currp + (i >> 1) * CONVCODE_BATCH_LANES;
+	const uint32_t *c2 = currp + ((i >> 1) | half) * CONVCODE_BATCH_LANES;
+	const uint32_t *b1 = bm + ce->prev_convert[0][i] * CONVCODE_BATCH_LANES;
+	const uint32_t *b2 = bm + ce->prev_convert[1][i] * CONVCODE_BATCH_LANES;
+	uint32_t *n = nextp + i * CONVCODE_BATCH_LANES;
+	unsigned int choose1 = 0;
+
+	for (j = 0; j < CONVCODE_BATCH_LANES; j += 8) {
+	    __m256i d1, d2, min;
+
+	    d1 = _mm256_add_epi32(
+			_mm256_loadu_si256((const __m256i *) (c1 + j)),
+			_mm256_loadu_si256((const __m256i *) (b1 + j)));
+	    d2 = _mm256_add_epi32(
+			_mm256_loadu_si256((const __m256i *) (c2 + j)),
+			_mm256_loadu_si256((const __m256i *) (b2 + j)));
+	    min = _mm256_min_epu32(d1, d2);
+	    _mm256_storeu_si256((__m256i *) (n + j), min);
+	    choose1 |= _mm256_movemask_ps(_mm256_castsi256_ps(
+					_mm256_cmpeq_epi32(min, d1))) << j;
 	}
+	decisions[i] = ~choose1;
     }
-    if (nbits > 0)
-	convencode_data(ce, &byte, nbits);
-    convencode_finish(ce, total_bits);
 }
 
+__attribute__((target("avx512f")))
 static void
-do_decode_data(struct convcode *ce, const char *input, unsigned int *total_bits,
-	       unsigned int *num_errs, uint8_t *uncertainty)
+decode_batch_avx512(struct convcode *ce, const uint32_t *bm,
+		    uint16_t *decisions)
 {
-    unsigned int i, nbits;
-    unsigned char byte = 0;
+    const uint32_t *currp = ce->batch_curr_path_values;
+    uint32_t *nextp = ce->batch_next_path_values;
+    unsigned int half = ce->num_states >> 1, i;
 
-    for (i = 0, nbits = 0; input[i]; i++) {
-	if (input[i] == '1')
-	    byte |= 1 << nbits;
-	nbits++;
-	if (nbits == 8) {
-	    convdecode_data(ce, &byte, 8, uncertainty);
-	    nbits = 0;
-	    byte = 0;
-	    if (uncertainty)
-		uncertainty += 8;
+    for (i = 0; i < ce->num_states; i++) {
+	const uint32_t *c1 = currp + (i >> 1) * CONVCODE_BATCH_LANES;
+	const uint32_t *c2 = currp + ((i >> 1) | half) * CONVCODE_BATCH_LANES;
+	const uint32_t *b1 = bm + ce->prev_convert[0][i] * CONVCODE_BATCH_LANES;
+	const uint32_t *b2 = bm + ce->prev_convert[1][i] * CONVCODE_BATCH_LANES;
+	__m512i d1, d2;
+
+	d1 = _mm512_add_epi32(_mm512_loadu_si512(c1), _mm512_loadu_si512(b1));
+	d2 = _mm512_add_epi32(_mm512_loadu_si512(c2), _mm512_loadu_si512(b2));
+	_mm512_storeu_si512(nextp + i * CONVCODE_BATCH_LANES,
+			    _mm512_min_epu32(d1, d2));
+	decisions[i] = _mm512_cmplt_epu32_mask(d2, d1);
+    }
+}
+#endif /* CONVCODE_X86_SIMD */
+
+#ifdef CONVCODE_NEON_SIMD
+static void
+decode_batch_neon(struct convcode *ce, const uint32_t *bm,
+		  uint16_t *decisions)
+{
+    const uint32_t *currp = ce->batch_curr_path_values;
+    uint32_t *nextp = ce->batch_next_path_values;
+    unsigned int half = ce->num_states >> 1, i, j;
+    static const uint32_t lane_bits_init[4] = { 1, 2, 4, 8 };
+    uint32x4_t lane_bits = vld1q_u32(lane_bits_init);
+
+    for (i = 0; i < ce->num_states; i++) {
+	const uint32_t *c1 = currp + (i >> 1) * CONVCODE_BATCH_LANES;
+	const uint32_t *c2 = currp + ((i >> 1) | half) * CONVCODE_BATCH_LANES;
+	const uint32_t *b1 = bm + ce->prev_convert[0][i] * CONVCODE_BATCH_LANES;
+	const uint32_t *b2 = bm + ce->prev_convert[1][i] * CONVCODE_BATCH_LANES;
+	uint32_t *n = nextp + i * CONVCODE_BATCH_LANES;
+	unsigned int d = 0;
+
+	for (j = 0; j < CONVCODE_BATCH_LANES; j += 4) {
+	    uint32x4_t d1, d2;
+	    uint32x2_t t;
+
+	    d1 = vaddq_u32(vld1q_u32(c1 + j), vld1q_u32(b1 + j));
+	    d2 = vaddq_u32(vld1q_u32(c2 + j), vld1q_u32(b2 + j));
+	    vst1q_u32(n + j, vminq_u32(d1, d2));
+
+	    /* No movemask on NEON, add up a bit per lane instead. */
+	    d1 = vandq_u32(lane_bits, vcltq_u32(d2, d1));
+	    t = vpadd_u32(vget_low_u32(d1), vget_high_u32(d1));
+	    t = vpadd_u32(t, t);
+	    d |= vget_lane_u32(t, 0) << j;
 	}
+	decisions[i] = d;
     }
-    if (nbits > 0)
-	convdecode_data(ce, &byte, nbits, uncertainty);
-    convdecode_finish(ce, total_bits, num_errs);
 }
+#endif /* CONVCODE_NEON_SIMD */
 
-struct test_data {
-    char output[1024];
-    unsigned char enc_bytes[1024];
-    unsigned char dec_bytes[1024];
-    unsigned int uncertainties[1024];
-    unsigned int outpos;
+/*
+ * Is the given kernel's instruction set usable for batch decoding on
+ * this processor?  Fill in the function to call if it is.  Unlike
+ * decode_kernel_usable(), the number of states doesn't matter.
+ */
+static bool
+batch_kernel_usable(enum convcode_kernel kernel, convcode_batch_kernel *func)
+{
+    switch (kernel) {
+    case CONVCODE_KERNEL_SCALAR:
+	*func = decode_batch_scalar;
+	return true;
+
+#ifdef CONVCODE_X86_SIMD
+    case CONVCODE_KERNEL_SSE41:
+	__builtin_cpu_init();
+	*func = decode_batch_sse41;
+	return __builtin_cpu_supports("sse4.1");
+
+    case CONVCODE_KERNEL_AVX2:
+	__builtin_cpu_init();
+	*func = decode_batch_avx2;
+	return __builtin_cpu_supports("avx2");
+
+    case CONVCODE_KERNEL_AVX512:
+	__builtin_cpu_init();
+	*func = decode_batch_avx512;
+	return __builtin_cpu_supports("avx512f");
+#endif
+
+#ifdef CONVCODE_NEON_SIMD
+    case CONVCODE_KERNEL_NEON:
+	*func = decode_batch_neon;
+	return true;
+#endif
+
+    default:
+	return false;
+    }
+}
+
+/*
+ * Is the given kernel usable on this processor with this code?  Fill
+ * in the function to call if it is.
+ */
+static bool
+decode_kernel_usable(struct convcode *ce, enum convcode_kernel kernel,
+		     convcode_decode_kernel *func)
+{
+    /* The functions for 32, 16 and 8-bit path values. */
+    const convcode_decode_kernel *f32 = NULL, *f16 = NULL, *f8 = NULL;
+    /* The butterfly ones for 32-bit path values, if there are any. */
+    const convcode_decode_kernel *f32b = NULL;
+    const convcode_decode_kernel *f;
+    unsigned int lanes = 1; /* For 32-bit path values */
+
+    switch (kernel) {
+    case CONVCODE_KERNEL_SCALAR:
+	if (ce->metric_width == 32)
+	    f = ce->butterfly ? decode_bits_scalar_bfly_variants :
+		decode_bits_scalar_variants;
+	else
+	    f = ce->butterfly ? decode_bits_scalar_narrow_bfly_variants :
+		decode_bits_scalar_narrow_variants;
+	*func = f[decode_kernel_variant(ce)];
+	return true;
+
+#ifdef CONVCODE_X86_SIMD
+    case CONVCODE_KERNEL_SSE41:
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse4.1"))
+	    return false;
+	f32 = decode_bits_sse41_variants;
+	f32b = decode_bits_sse41_bfly_variants;
+	f16 = decode_bits_sse41_16_variants;
+	f8 = decode_bits_sse41_8_variants;
+	lanes = 4;
+	break;
+
+    case CONVCODE_KERNEL_AVX2:
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx2"))
+	    return false;
+	f32 = decode_bits_avx2_variants;
+	f32b = decode_bits_avx2_bfly_variants;
+	f16 = decode_bits_avx2_16_variants;
+	f8 = decode_bits_avx2_8_variants;
+	lanes = 8;
+	break;
+
+    case CONVCODE_KERNEL_AVX512:
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx512f"))
+	    return false;
+	f32 = decode_bits_avx512_variants;
+	f32b = decode_bits_avx512_bfly_variants;
+	if (__builtin_cpu_supports("avx512bw")) {
+	    f16 = decode_bits_avx512_16_variants;
+	    f8 = decode_bits_avx512_8_variants;
+	}
+	lanes = 16;
+	break;
+#endif
+
+#ifdef CONVCODE_NEON_SIMD
+    case CONVCODE_KERNEL_NEON:
+	f32 = decode_bits_neon_variants;
+	f16 = decode_bits_neon_16_variants;
+	lanes = 4;
+	break;
+#endif
+
+    default:
+	return false;
+    }
+
+    switch (ce->metric_width) {
+    case 8:
+	/* These look the branch metrics up in a 16 entry table. */
+	if (ce->num_polys > 4)
+	    return false;
+	f = f8;
+	lanes *= 4;
+	break;
+    case 16:
+	f = f16;
+	lanes *= 2;
+	break;
+    default:
+	f = f32;
+	/* A vector of butterflies covers twice as many states. */
+	if (ce->butterfly && f32b && ce->num_states >= 2 * lanes)
+	    f = f32b;
+	break;
+    }
+
+    /* The SIMD kernels need enough states for a vector. */
+    if (!f || ce->num_states < lanes)
+	return false;
+    *func = f[decode_kernel_variant(ce)];
+    return true;
+}
+
+/* Fastest first, usually. */
+static const enum convcode_kernel auto_order[] = {
+    CONVCODE_KERNEL_AVX512,
+    CONVCODE_KERNEL_AVX2,
+    CONVCODE_KERNEL_SSE41,
+    CONVCODE_KERNEL_NEON,
+    CONVCODE_KERNEL_SCALAR
 };
+#define NUM_AUTO_KERNELS (sizeof(auto_order) / sizeof(*auto_order))
+
+static const char *kernel_names[] = {
+    [CONVCODE_KERNEL_AUTO] = "auto",
+    [CONVCODE_KERNEL_SCALAR] = "scalar",
+    [CONVCODE_KERNEL_SSE41] = "sse41",
+    [CONVCODE_KERNEL_AVX2] = "avx2",
+    [CONVCODE_KERNEL_AVX512] = "avx512",
+    [CONVCODE_KERNEL_NEON] = "neon",
+    [CONVCODE_KERNEL_TUNE] = "tune",
+};
+#define NUM_KERNEL_NAMES (sizeof(kernel_names) / sizeof(*kernel_names))
 
-static int
-handle_test_output(struct convcode *ce, void *output_data, unsigned char byte,
-		   unsigned int nbits)
+const char *
+convcode_kernel_name(enum convcode_kernel kernel)
+{
+    if ((unsigned int) kernel >= NUM_KERNEL_NAMES)
+	return NULL;
+    return kernel_names[kernel];
+}
+
+int
+convcode_kernel_from_name(const char *name, enum convcode_kernel *kernel)
 {
-    struct test_data *t = output_data;
     unsigned int i;
 
-    for (i = 0; i < nbits; i++) {
-	assert(t->outpos < sizeof(t->output) - 1);
-	if (byte & 1)
-	    t->output[t->outpos++] = '1';
-	else
-	    t->output[t->outpos++] = '0';
-	byte >>= 1;
+    for (i = 0; i < NUM_KERNEL_NAMES; i++) {
+	if (strcmp(name, kernel_names[i]) == 0) {
+	    *kernel = i;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * The tuned kernels, by k, number of polynomials and path value
+ * width (8, 16 or 32 is 0, 1 or 2).  CONVCODE_KERNEL_AUTO means it
+ * hasn't been tuned.  These are shared by all the coders and may be
+ * set by several threads at once, so the entries are accessed
+ * atomically.  If two threads tune the same code at once they both
+ * do the work, which doesn't hurt anything.
+ */
+#define TUNING_WIDTHS 3
+static uint8_t kernel_tuning[CONVCODE_MAX_K][CONVCODE_MAX_POLYNOMIALS]
+			    [TUNING_WIDTHS];
+
+static uint8_t *
+kernel_tuning_entry(unsigned int k, unsigned int num_polys, unsigned int width)
+{
+    unsigned int w;
+
+    switch (width) {
+    case 8:
+	w = 0;
+	break;
+    case 16:
+	w = 1;
+	break;
+    case 32:
+	w = 2;
+	break;
+    default:
+	return NULL;
+    }
+    if (k < 1 || k > CONVCODE_MAX_K || num_polys < 1 ||
+		num_polys > CONVCODE_MAX_POLYNOMIALS)
+	return NULL;
+    return &kernel_tuning[k - 1][num_polys - 1][w];
+}
+
+/*
+ * Time each usable kernel on the coder's decoder memory and return
+ * the fastest.  This wipes out any decode in progress, but leaves the
+ * decoder reinitialized the way it was last.  Returns 1 if there's no
+ * way to time them.
+ */
+static int
+tune_decode_kernel(struct convcode *ce, enum convcode_kernel *kernel,
+		   convcode_decode_kernel *kfunc)
+{
+#ifdef CONVCODE_HAVE_CYCLES
+    /* Enough symbols for about 256K state updates, at least 64. */
+    unsigned int nsym = (1 << 18) / ce->num_states + 64;
+    unsigned int base[16], delta[16][CONVCODE_MAX_POLYNOMIALS];
+    unsigned int i, j, rep, bits, seed = 1;
+    unsigned int start_state = ce->dec_start_state;
+    unsigned int init_val = ce->dec_init_val;
+    uint64_t start, cycles, best = UINT64_MAX;
+    convcode_decode_kernel func;
+    void *tmp;
+
+    if (!ce->trellis_size || !ce->curr_path_values)
+	return 1;
+
+    /* Some random received symbols to decode. */
+    for (i = 0; i < 16; i++) {
+	seed = seed * 1103515245 + 12345;
+	bits = (seed >> 16) & ((1 << ce->num_polys) - 1);
+	base[i] = branch_costs(ce, bits, NULL, delta[i]);
+    }
+
+    for (i = 0; i < NUM_AUTO_KERNELS; i++) {
+	if (!decode_kernel_usable(ce, auto_order[i], &func))
+	    continue;
+	/* The first run warms up the caches, take the best of the rest. */
+	for (rep = 0; rep < 4; rep++) {
+	    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			      CONVCODE_DEFAULT_INIT_VAL);
+	    start = read_cycles();
+	    for (j = 0; j < nsym; j++) {
+		func(ce, base[j % 16], delta[j % 16]);
+		tmp = ce->curr_path_values;
+		ce->curr_path_values = ce->next_path_values;
+		ce->next_path_values = tmp;
+	    }
+	    cycles = read_cycles() - start;
+	    if (rep > 0 && cycles < best) {
+		best = cycles;
+		*kernel = auto_order[i];
+		*kfunc = func;
+	    }
+	}
     }
+    reinit_convdecode(ce, start_state, init_val);
     return 0;
+#else
+    return 1;
+#endif
 }
 
-static unsigned int
-run_test(unsigned int k, convcode_state *polys, unsigned int npolys,
-	 bool do_tail, const char *encoded, const char *decoded,
-	 unsigned int expected_errs, uint8_t *uncertainty,
-	 unsigned int *out_uncertainties)
+static void
+use_decode_kernel(struct convcode *ce, enum convcode_kernel kernel,
+		  convcode_decode_kernel func)
 {
-    struct test_data t;
-    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 128,
-					 do_tail, false,
-					 handle_test_output, &t,
-					 handle_test_output, &t);
+    ce->kernel = kernel;
+    ce->decode_kernel = func;
+}
+
+int
+set_decode_kernel(struct convcode *ce, enum convcode_kernel kernel)
+{
+    convcode_decode_kernel func;
+    enum convcode_kernel tuned;
+    const char *env;
+    uint8_t *entry;
+    unsigned int i;
+
+    if (kernel == CONVCODE_KERNEL_AUTO || kernel == CONVCODE_KERNEL_TUNE) {
+	/* The environment can override the automatic choice. */
+	env = getenv("CONVCODE_KERNEL");
+	if (env && !convcode_kernel_from_name(env, &tuned) &&
+		(tuned == CONVCODE_KERNEL_AUTO || tuned == CONVCODE_KERNEL_TUNE ||
+		 decode_kernel_usable(ce, tuned, &func)))
+	    kernel = tuned;
+    }
+
+    if (kernel != CONVCODE_KERNEL_AUTO && kernel != CONVCODE_KERNEL_TUNE) {
+	if (!decode_kernel_usable(ce, kernel, &func))
+	    return 1;
+	use_decode_kernel(ce, kernel, func);
+	ce->kernel_tune = false;
+	batch_kernel_usable(kernel, &ce->batch_kernel);
+	return 0;
+    }
+    ce->kernel_tune = kernel == CONVCODE_KERNEL_TUNE;
+
+    /* The batch kernel doesn't care about the states, pick separately. */
+    for (i = 0; !batch_kernel_usable(auto_order[i], &ce->batch_kernel); i++)
+	;
+
+    entry = kernel_tuning_entry(ce->k, ce->num_polys, ce->metric_width);
+    if (entry) {
+	tuned = __atomic_load_n(entry, __ATOMIC_RELAXED);
+	if (tuned != CONVCODE_KERNEL_AUTO &&
+		decode_kernel_usable(ce, tuned, &func)) {
+	    use_decode_kernel(ce, tuned, func);
+	    return 0;
+	}
+	if (ce->kernel_tune && !tune_decode_kernel(ce, &tuned, &func)) {
+	    __atomic_store_n(entry, tuned, __ATOMIC_RELAXED);
+	    use_decode_kernel(ce, tuned, func);
+	    return 0;
+	}
+    }
+
+    for (i = 0; ; i++) {
+	if (decode_kernel_usable(ce, auto_order[i], &func)) {
+	    use_decode_kernel(ce, auto_order[i], func);
+	    return 0;
+	}
+    }
+}
+
+/*
+ * Add str to buf at *len, as much of it as fits with room for a nul,
+ * and add its length to *len.
+ */
+static void
+tuning_add_str(char *buf, unsigned int size, unsigned int *len,
+	       const char *str)
+{
+    for (; *str; str++, (*len)++) {
+	if (*len + 1 < size)
+	    buf[*len] = *str;
+    }
+}
+
+/* Like tuning_add_str() for the decimal value of v. */
+static void
+tuning_add_num(char *buf, unsigned int size, unsigned int *len,
+	       unsigned int v)
+{
+    char num[12];
+    unsigned int i = sizeof(num) - 1;
+
+    num[i] = '\0';
+    do {
+	num[--i] = '0' + v % 10;
+	v /= 10;
+    } while (v);
+    tuning_add_str(buf, size, len, num + i);
+}
+
+unsigned int
+get_convcode_kernel_tuning(char *buf, unsigned int size)
+{
+    static const unsigned int widths[TUNING_WIDTHS] = { 8, 16, 32 };
+    unsigned int k, p, w, len = 0;
+    uint8_t kernel;
+
+    for (k = 1; k <= CONVCODE_MAX_K; k++) {
+	for (p = 1; p <= CONVCODE_MAX_POLYNOMIALS; p++) {
+	    for (w = 0; w < TUNING_WIDTHS; w++) {
+		kernel = __atomic_load_n(&kernel_tuning[k - 1][p - 1][w],
+					 __ATOMIC_RELAXED);
+		if (kernel == CONVCODE_KERNEL_AUTO)
+		    continue;
+		tuning_add_num(buf, size, &len, k);
+		tuning_add_str(buf, size, &len, " ");
+		tuning_add_num(buf, size, &len, p);
+		tuning_add_str(buf, size, &len, " ");
+		tuning_add_num(buf, size, &len, widths[w]);
+		tuning_add_str(buf, size, &len, " ");
+		tuning_add_str(buf, size, &len, kernel_names[kernel]);
+		tuning_add_str(buf, size, &len, "\n");
+	    }
+	}
+    }
+    if (size)
+	buf[len < size ? len : size - 1] = '\0';
+    return len;
+}
+
+int
+set_convcode_kernel_tuning(const char *str)
+{
+    uint8_t tuning[CONVCODE_MAX_K][CONVCODE_MAX_POLYNOMIALS][TUNING_WIDTHS];
+    unsigned int i, k, p, width;
+    enum convcode_kernel kernel;
+    char name[16], *end;
+    uint8_t *entry;
+
+    /* Check it all before changing anything. */
+    memset(tuning, 0, sizeof(tuning));
+    for (;;) {
+	while (*str == ' ' || *str == '\t' || *str == '\n')
+	    str++;
+	if (!*str)
+	    break;
+	k = strtoul(str, &end, 10);
+	p = strtoul(end, &end, 10);
+	width = strtoul(end, &end, 10);
+	while (*end == ' ' || *end == '\t')
+	    end++;
+	for (i = 0; i < sizeof(name) - 1 && end[i] && end[i] != ' ' &&
+		    end[i] != '\t' && end[i] != '\n'; i++)
+	    name[i] = end[i];
+	name[i] = '\0';
+	str = end + i;
+	if (convcode_kernel_from_name(name, &kernel) ||
+		kernel == CONVCODE_KERNEL_AUTO ||
+		kernel == CONVCODE_KERNEL_TUNE)
+	    return 1;
+	entry = kernel_tuning_entry(k, p, width);
+	if (!entry)
+	    return 1;
+	(&tuning[0][0][0])[entry - &kernel_tuning[0][0][0]] = kernel;
+    }
+
+    for (k = 0; k < CONVCODE_MAX_K; k++) {
+	for (p = 0; p < CONVCODE_MAX_POLYNOMIALS; p++) {
+	    for (i = 0; i < TUNING_WIDTHS; i++)
+		__atomic_store_n(&kernel_tuning[k][p][i], tuning[k][p][i],
+				 __ATOMIC_RELAXED);
+	}
+    }
+    return 0;
+}
+
+enum convcode_kernel
+get_decode_kernel(struct convcode *ce)
+{
+    return ce->kernel;
+}
+
+/*
+ * Find the state with the minimum path value.  If min_val is not
+ * NULL, the value (including what renormalization has subtracted) is
+ * returned there.
+ */
+static convcode_state
+find_min_state(struct convcode *ce, unsigned int *min_val)
+{
+    unsigned int i, v, val = get_path_value(ce, ce->curr_path_values, 0);
+    convcode_state cstate = 0;
+
+    for (i = 1; i < ce->num_states; i++) {
+	v = get_path_value(ce, ce->curr_path_values, i);
+	if (v < val) {
+	    cstate = i;
+	    val = v;
+	}
+    }
+    if (min_val)
+	*min_val = val + ce->metric_offset;
+    return cstate;
+}
+
+/*
+ * Go backwards through the trellis from cstate at the given column to
+ * find the path to it.  The bits for the first nstore columns are
+ * stored in position 0 of the column so we can play them back forward
+ * easily.
+ */
+static void
+trellis_traceback_from(struct convcode *ce, unsigned int column,
+		       convcode_state cstate, unsigned int nstore)
+{
+    unsigned int i;
+
+    STATS_ADD(ce, traceback_steps, column);
+    for (i = column; i > 0; ) {
+	convcode_state pstate; /* Previous state */
+
+	i--;
+	pstate = trellis_prev_state(ce, i, cstate);
+	if (i < nstore)
+	    trellis_set_bit(ce, i, get_prev_bit(ce, pstate, cstate));
+	cstate = pstate;
+    }
+}
+
+/* Trace back the full path from cstate at the end of the trellis. */
+static void
+trellis_traceback(struct convcode *ce, convcode_state cstate,
+		  unsigned int nstore)
+{
+    trellis_traceback_from(ce, ce->ctrellis, cstate, nstore);
+}
+
+/* Play the bits stored by trellis_traceback() forward to the output. */
+static int
+output_trellis_bits(struct convcode *ce, unsigned int nbits)
+{
+    unsigned int i, n = 0;
+    uint64_t bits = 0;
+    int rv;
+
+    /* Collect the bits a word at a time, it's a lot less overhead. */
+    for (i = 0; i < nbits; i++) {
+	bits |= (get_trellis_column(ce, i)[0] & 1) << n;
+	if (++n == 64) {
+	    rv = output_bits(ce, &ce->dec_out, bits, n);
+	    if (rv)
+		return rv;
+	    bits = 0;
+	    n = 0;
+	}
+    }
+    if (n)
+	return output_bits(ce, &ce->dec_out, bits, n);
+    return 0;
+}
+
+/*
+ * Output the first nout bits stored by a traceback and drop their
+ * columns from the front of the trellis ring.
+ */
+static int
+output_trellis_prefix(struct convcode *ce, unsigned int nout)
+{
+    int rv;
+
+    rv = output_trellis_bits(ce, nout);
+    if (rv)
+	return rv;
+
+    ce->trellis_start += nout;
+    if (ce->trellis_start >= ce->trellis_size)
+	ce->trellis_start -= ce->trellis_size;
+    ce->ctrellis -= nout;
+    return 0;
+}
+
+/*
+ * In streaming mode, this is called when the trellis is full.  Trace
+ * back from the current best state.  All the paths should have
+ * merged by the time we get traceback_depth columns back, so
+ * everything before that is final.  Output those bits and drop their
+ * columns from the front of the trellis ring.
+ */
+static int
+decode_window_flush(struct convcode *ce)
+{
+    unsigned int nout = ce->ctrellis - ce->traceback_depth;
+    uint64_t start = STATS_START(ce);
+    int rv;
+
+    trellis_traceback(ce, find_min_state(ce, NULL), nout);
+    rv = output_trellis_prefix(ce, nout);
+    STATS_END(ce, traceback_cycles, start);
+    return rv;
+}
+
+/*
+ * Follow the survivors of all the states back through the trellis at
+ * once, keeping the set of states they are in.  If the set gets down
+ * to one state, every path goes through it, so the path to it is
+ * final no matter which state wins in the end.  Output that and drop
+ * it from the trellis.  The set can only halve per column at best, so
+ * the last k - 1 columns (the tail, maybe) are never output here.
+ */
+static int
+decode_merge_check(struct convcode *ce)
+{
+    uint64_t *curr = ce->merge_states;
+    uint64_t *prev = curr + ce->trellis_col_words, *tmp, bits;
+    unsigned int i, w, nstates = ce->num_states;
+    convcode_state state = 0, pstate;
+    uint64_t start = STATS_START(ce);
+    int rv;
+
+    ce->merge_count = 0;
+    for (w = 0; w < ce->trellis_col_words; w++)
+	curr[w] = UINT64_MAX;
+    if (nstates < 64)
+	curr[0] = (1ULL << nstates) - 1;
+
+    for (i = ce->ctrellis; i > 0 && nstates > 1; ) {
+	i--;
+	memset(prev, 0, sizeof(*prev) * ce->trellis_col_words);
+	for (w = 0; w < ce->trellis_col_words; w++) {
+	    for (bits = curr[w]; bits; bits &= bits - 1) {
+		pstate = trellis_prev_state(ce, i,
+					    w * 64 + __builtin_ctzll(bits));
+		prev[pstate / 64] |= 1ULL << (pstate % 64);
+	    }
+	}
+	tmp = curr;
+	curr = prev;
+	prev = tmp;
+
+	nstates = 0;
+	for (w = 0; w < ce->trellis_col_words; w++) {
+	    if (curr[w]) {
+		nstates += __builtin_popcountll(curr[w]);
+		state = w * 64 + __builtin_ctzll(curr[w]);
+	    }
+	}
+    }
+    STATS_ADD(ce, traceback_steps, ce->ctrellis - i);
+
+    rv = 0;
+    if (nstates == 1 && i > 0) {
+	trellis_traceback_from(ce, i, state, i);
+	rv = output_trellis_prefix(ce, i);
+	STATS_ADD(ce, merged_bits, i);
+    }
+    STATS_END(ce, traceback_cycles, start);
+    return rv;
+}
+
+/*
+ * Subtract the minimum path value from all of them to keep them from
+ * overflowing, remembering it so the total errors still come out
+ * right.
+ */
+static void
+renormalize_path_values(struct convcode *ce, void *values)
+{
+    unsigned int i, v, min_val = get_path_value(ce, values, 0);
+
+    for (i = 1; i < ce->num_states; i++) {
+	v = get_path_value(ce, values, i);
+	if (v < min_val)
+	    min_val = v;
+    }
+    for (i = 0; i < ce->num_states; i++)
+	set_path_value(ce, values, i, get_path_value(ce, values, i) - min_val);
+    ce->metric_offset += min_val;
+    STATS_ADD(ce, renormalizations, 1);
+}
+
+int
+set_decode_metric_width(struct convcode *ce, unsigned int bits)
+{
+    if (set_metric_limits(ce, bits))
+	return 1;
+    set_decode_kernel(ce, ce->kernel_tune ? CONVCODE_KERNEL_TUNE :
+		      CONVCODE_KERNEL_AUTO);
+    return 0;
+}
+
+int
+set_decode_traceback_depth(struct convcode *ce, unsigned int depth)
+{
+    if (depth && (depth < ce->k || depth >= ce->trellis_size))
+	return 1;
+    ce->traceback_depth = depth;
+    return 0;
+}
+
+/*
+ * Allocate the chunk holding the given ring column if it isn't there
+ * yet.
+ */
+static int
+trellis_alloc_chunk(struct convcode *ce, unsigned int column)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int chunk = column >> ce->trellis_chunk_shift;
+
+    if (ce->trellis_chunks[chunk])
+	return 0;
+    ce->trellis_chunks[chunk] = o->zalloc(o, sizeof(uint64_t) *
+					  ce->trellis_col_words <<
+					  ce->trellis_chunk_shift);
+    if (!ce->trellis_chunks[chunk])
+	return 1;
+    return 0;
+}
+
+/*
+ * Make sure the column for the next symbol is there, for a growable
+ * trellis.
+ */
+static int
+trellis_reserve(struct convcode *ce)
+{
+    unsigned int column;
+
+    if (!ce->trellis_chunks)
+	return 0;
+    column = ce->ctrellis + ce->trellis_start;
+    if (column >= ce->trellis_size)
+	column -= ce->trellis_size;
+    return trellis_alloc_chunk(ce, column);
+}
+
+int
+set_decode_trellis_growth(struct convcode *ce, unsigned int chunk_symbols,
+			  unsigned int max_symbols)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int i, n, size, shift = 0;
+
+    if (!ce->trellis_size || !o)
+	return 1;
+    if (chunk_symbols) {
+	if (!max_symbols || max_symbols > UINT_MAX - ce->num_polys)
+	    return 1;
+	/* The same limit decode_symbol_start() has. */
+	size = max_symbols + ce->num_polys - 1;
+    } else {
+	/* Going back to the coder's own trellis. */
+	size = ce->trellis_chunks ? ce->fixed_trellis_size : ce->trellis_size;
+    }
+    if (ce->traceback_depth >= size)
+	return 1;
+
+    free_trellis_chunks(ce);
+    free_trellis_sized(ce);
+    if (!chunk_symbols)
+	return 0;
+
+    if (chunk_symbols > size)
+	chunk_symbols = size;
+    while ((1U << shift) < chunk_symbols)
+	shift++;
+    ce->fixed_trellis_size = ce->trellis_size;
+    ce->trellis_size = size;
+    ce->trellis_chunk_shift = shift;
+    ce->trellis_chunks = o->zalloc(o, sizeof(*ce->trellis_chunks) *
+				   trellis_num_chunks(ce));
+    if (!ce->trellis_chunks) {
+	ce->trellis_size = ce->fixed_trellis_size;
+	return 1;
+    }
+
+    /* Use the coder's own trellis for the chunks that fit in it. */
+    n = ce->fixed_trellis_size >> shift;
+    if (n > trellis_num_chunks(ce))
+	n = trellis_num_chunks(ce);
+    for (i = 0; i < n; i++)
+	ce->trellis_chunks[i] = (ce->trellis +
+				 ((unsigned long) i << shift) *
+				 ce->trellis_col_words);
+    ce->trellis_fixed_chunks = n;
+
+    /* Column 0 is always there, register exchange only uses it. */
+    if (trellis_alloc_chunk(ce, 0)) {
+	free_trellis_chunks(ce);
+	return 1;
+    }
+    return 0;
+}
+
+int
+set_decode_merge_interval(struct convcode *ce, unsigned int interval)
+{
+    if (interval && (!ce->trellis_size || !ce->merge_states))
+	return 1;
+    ce->merge_interval = interval;
+    ce->merge_count = 0;
+    return 0;
+}
+
+int
+set_decode_register_exchange(struct convcode *ce, unsigned int delay)
+{
+    convcode_os_funcs *o = ce->o;
+
+    if (delay) {
+	if (delay < ce->k || delay > 63 || !ce->trellis_size)
+	    return 1;
+	if (!ce->regex_hist) {
+	    if (!o)
+		return 1;
+	    ce->regex_hist = o->zalloc(o, sizeof(*ce->regex_hist) * 2 *
+				       ce->num_states);
+	    if (!ce->regex_hist)
+		return 1;
+	}
+    }
+    ce->regex_delay = delay;
+    ce->regex_symbols = 0;
+    ce->regex_curr = 0;
+    return 0;
+}
+
+/*
+ * In register exchange mode, build each state's history from its
+ * predecessor's using the decisions the kernel just put in the
+ * current trellis column.
+ */
+static void
+regex_update(struct convcode *ce)
+{
+    uint64_t *curr = ce->regex_hist + ce->regex_curr * ce->num_states;
+    uint64_t *next = ce->regex_hist + (ce->regex_curr ^ 1) * ce->num_states;
+    convcode_state i, pstate;
+
+    for (i = 0; i < ce->num_states; i++) {
+	pstate = trellis_prev_state(ce, ce->ctrellis, i);
+	next[i] = (curr[pstate] << 1) | get_prev_bit(ce, pstate, i);
+    }
+    ce->regex_curr ^= 1;
+    ce->regex_symbols++;
+}
+
+/*
+ * Output the bit regex_delay symbols back on the best path, once
+ * there is one.
+ */
+static int
+regex_output(struct convcode *ce)
+{
+    uint64_t *curr = ce->regex_hist + ce->regex_curr * ce->num_states;
+
+    if (ce->regex_symbols <= ce->regex_delay)
+	return 0;
+    return output_bits(ce, &ce->dec_out,
+		       (curr[find_min_state(ce, NULL)] >> ce->regex_delay) & 1,
+		       1);
+}
+
+/*
+ * Output the bits in the best state's history that regex_output()
+ * hasn't yet, except for the tail.
+ */
+static int
+regex_finish(struct convcode *ce, convcode_state cstate)
+{
+    uint64_t hist = ce->regex_hist[ce->regex_curr * ce->num_states + cstate];
+    unsigned int i, n = 0, left = ce->regex_symbols, extra_bits = 0;
+    uint64_t bits = 0;
+
+    if (left > ce->regex_delay)
+	left = ce->regex_delay;
+    if (ce->do_tail)
+	extra_bits = ce->k - 1;
+    for (i = left; i > extra_bits; i--)
+	bits |= ((hist >> (i - 1)) & 1) << n++;
+    if (!n)
+	return 0;
+    return output_bits(ce, &ce->dec_out, bits, n);
+}
+
+/*
+ * Make room in the trellis for the next symbol, returning 1 if there
+ * isn't any.
+ */
+static int
+decode_symbol_start(struct convcode *ce)
+{
+    int rv;
+
+    /* Only column 0 is used. */
+    if (ce->regex_delay)
+	return 0;
+    if (ce->merge_interval && ++ce->merge_count >= ce->merge_interval) {
+	rv = decode_merge_check(ce);
+	if (rv)
+	    return rv;
+    }
+    if (ce->traceback_depth) {
+	if (ce->ctrellis == ce->trellis_size)
+	    return decode_window_flush(ce);
+    } else if (ce->ctrellis + ce->num_polys > ce->trellis_size) {
+	/* Maybe the paths have merged enough to make room. */
+	if (ce->merge_interval && ce->merge_count) {
+	    rv = decode_merge_check(ce);
+	    if (rv)
+		return rv;
+	    if (ce->ctrellis + ce->num_polys <= ce->trellis_size)
+		return trellis_reserve(ce);
+	}
+	STATS_ADD(ce, trellis_overflows, 1);
+	return 1;
+    }
+    return trellis_reserve(ce);
+}
+
+/*
+ * Run a symbol with the given branch costs through the trellis.  This
+ * only fails if output fails in register exchange mode.
+ */
+static int
+decode_symbol(struct convcode *ce, unsigned int base, const unsigned int *delta)
+{
+    void *currp = ce->curr_path_values;
+    void *nextp = ce->next_path_values;
+#if CONVCODE_DEBUG_STATES
+    unsigned int i;
+#endif
+
+    ce->decode_kernel(ce, base, delta);
+
+    /*
+     * All the path values are close to each other, so checking one
+     * is enough to know when it's time to renormalize.
+     */
+    if (get_path_value(ce, nextp, 0) >= ce->metric_renorm)
+	renormalize_path_values(ce, nextp);
+    STATS_ADD(ce, symbols_decoded, 1);
+    STATS_ADD(ce, acs_butterflies, ce->num_states / 2);
+
+#if CONVCODE_DEBUG_STATES
+    for (i = 0; i < ce->num_states; i++) {
+	printf(" %4.4u", trellis_prev_state(ce, ce->ctrellis, i));
+    }
+    printf("\n");
+    for (i = 0; i < ce->num_states; i++) {
+	printf(" %4.4u", get_path_value(ce, nextp, i));
+    }
+    printf("\n");
+#endif
+    ce->next_path_values = currp;
+    ce->curr_path_values = nextp;
+    if (ce->regex_delay) {
+	regex_update(ce);
+	return regex_output(ce);
+    }
+    ce->ctrellis++;
+    return 0;
+}
+
+static int
+decode_bits(struct convcode *ce, unsigned int bits, const uint8_t *uncertainty)
+{
+    unsigned int base, delta[CONVCODE_MAX_POLYNOMIALS];
+    uint64_t start;
+    int rv;
+
+    rv = decode_symbol_start(ce);
+    if (rv)
+	return rv;
+
+    start = STATS_START(ce);
+    if (ce->puncture_period)
+	base = branch_costs_punctured(ce, bits, uncertainty, delta);
+    else
+	base = branch_costs(ce, bits, uncertainty, delta);
+#if CONVCODE_DEBUG_STATES
+    printf("T(%u) %x\n", ce->ctrellis, bits);
+#endif
+    rv = decode_symbol(ce, base, delta);
+    STATS_END(ce, decode_cycles, start);
+    return rv;
+}
+
+/*
+ * decode_bits() for a symbol of LLRs.
+ */
+static int
+decode_llrs(struct convcode *ce, const int8_t *llrs)
+{
+    unsigned int base, delta[CONVCODE_MAX_POLYNOMIALS];
+    uint64_t start;
+    int rv;
+
+    rv = decode_symbol_start(ce);
+    if (rv)
+	return rv;
+
+    start = STATS_START(ce);
+    base = llr_branch_costs(ce, llrs, delta);
+    rv = decode_symbol(ce, base, delta);
+    STATS_END(ce, decode_cycles, start);
+    return rv;
+}
+
+/*
+ * Extract nbits bits from bytes at offset curr.
+ */
+static unsigned int
+extract_bits(const unsigned char *bytes, unsigned int curr, unsigned int nbits)
+{
+    unsigned int pos = curr / 8;
+    unsigned int opos = 0;
+    unsigned int bit = curr % 8, bits_left = nbits;
+    unsigned int v = 0, byte_avail;
+
+    byte_avail = 8 - bit;
+    while (byte_avail <= bits_left) {
+	v |= ((unsigned int) (bytes[pos] >> bit)) << opos;
+	bits_left -= byte_avail;
+	opos += byte_avail;
+	bit = 0;
+	byte_avail = 8;
+	bytes++;
+    }
+    if (bits_left)
+	v |= ((unsigned int) (bytes[pos] >> bit)) << opos;
+    v &= (1 << nbits) - 1;
+    return v;
+}
+
+/*
+ * The number of bits received for the next symbol to decode.
+ */
+static unsigned int
+dec_symbol_size(struct convcode *ce)
+{
+    unsigned int pos = ce->dec_puncture_pos;
+
+    if (!ce->puncture_period)
+	return ce->num_polys;
+    return ce->puncture_offset[pos + 1] - ce->puncture_offset[pos];
+}
+
+/*
+ * Get sample i from a packed array of width-bit uncertainties, see
+ * convdecode_data_packed().  8 is just an array of bytes.
+ */
+static CONVCODE_ALWAYS_INLINE unsigned int
+get_uncertainty(const uint8_t *uncertainty, unsigned int i,
+		unsigned int width)
+{
+    unsigned int bit = i * width, v;
+
+    if (width == 8)
+	return uncertainty[i];
+    v = uncertainty[bit / 8] >> (bit % 8);
+    if (bit % 8 + width > 8)
+	v |= uncertainty[bit / 8 + 1] << (8 - bit % 8);
+    return v & ((1 << width) - 1);
+}
+
+/*
+ * decode_bits() for a symbol whose uncertainties start at sample pos
+ * of a packed array, unpacking them first.
+ */
+static CONVCODE_ALWAYS_INLINE int
+decode_bits_packed(struct convcode *ce, unsigned int bits,
+		   const uint8_t *uncertainty, unsigned int pos,
+		   unsigned int symsize, unsigned int width)
+{
+    uint8_t unc[CONVCODE_MAX_POLYNOMIALS];
+    unsigned int i;
+
+    if (width == 8)
+	return decode_bits(ce, bits, uncertainty + pos);
+    for (i = 0; i < symsize; i++)
+	unc[i] = get_uncertainty(uncertainty, pos + i, width);
+    return decode_bits(ce, bits, unc);
+}
+
+/*
+ * convdecode_data() with uncertainties packed width bits each.
+ * Leftover uncertainties are stored unpacked.
+ */
+static CONVCODE_ALWAYS_INLINE int
+decode_data(struct convcode *ce, const unsigned char *bytes,
+	    unsigned int nbits, const uint8_t *uncertainty,
+	    unsigned int width)
+{
+    unsigned int curr_bit = 0, i, symsize = dec_symbol_size(ce);
+    int rv;
+
+    if (ce->leftover_bits) {
+	unsigned int newbits, extract_size;
+
+	if (nbits + ce->leftover_bits < symsize) {
+	    /* Not enough bits for a full symbol, just store these. */
+	    ce->leftover_bits_data |= (extract_bits(bytes, 0, nbits)
+				       << ce->leftover_bits);
+	    if (uncertainty) {
+		for (i = 0; i < nbits; i++)
+		    ce->leftover_uncertainty[ce->leftover_bits++] =
+			get_uncertainty(uncertainty, i, width);
+	    } else {
+		ce->leftover_bits += nbits;
+	    }
+	    ce->leftover_bits_data &= (1 << ce->leftover_bits) - 1;
+	    return 0;
+	}
+	/* We got enough bits for a full symbol, process it. */
+	extract_size = symsize - ce->leftover_bits;
+	newbits = extract_bits(bytes, curr_bit, extract_size);
+	curr_bit += extract_size;
+	nbits -= extract_size;
+	ce->leftover_bits_data |= newbits << ce->leftover_bits;
+	if (uncertainty) {
+	    for (i = 0; i < extract_size; i++)
+		ce->leftover_uncertainty[ce->leftover_bits++] =
+		    get_uncertainty(uncertainty, i, width);
+	    rv = decode_bits(ce, ce->leftover_bits_data,
+			     ce->leftover_uncertainty);
+	} else {
+	    rv = decode_bits(ce, ce->leftover_bits_data, NULL);
+	}
+	ce->leftover_bits = 0;
+	if (rv)
+	    return rv;
+	symsize = dec_symbol_size(ce);
+    }
+
+    while (nbits >= symsize) {
+	unsigned int bits = extract_bits(bytes, curr_bit, symsize);
+
+	if (uncertainty)
+	    rv = decode_bits_packed(ce, bits, uncertainty, curr_bit, symsize,
+				    width);
+	else
+	    rv = decode_bits(ce, bits, NULL);
+	if (rv)
+	    return rv;
+	curr_bit += symsize;
+	nbits -= symsize;
+	symsize = dec_symbol_size(ce);
+    }
+    ce->leftover_bits = nbits;
+    if (nbits) {
+	ce->leftover_bits_data = extract_bits(bytes, curr_bit, nbits);
+	if (uncertainty) {
+	    for (i = 0; i < ce->leftover_bits; i++)
+		ce->leftover_uncertainty[i] =
+		    get_uncertainty(uncertainty, curr_bit++, width);
+	}
+    }
+    return 0;
+}
+
+int
+convdecode_data(struct convcode *ce,
+		const unsigned char *bytes, unsigned int nbits,
+		const uint8_t *uncertainty)
+{
+    return decode_data(ce, bytes, nbits, uncertainty, 8);
+}
+
+int
+convdecode_data_packed(struct convcode *ce,
+		       const unsigned char *bytes, unsigned int nbits,
+		       const uint8_t *uncertainty, unsigned int width)
+{
+    /* Let the compiler do the shifts and masks for the usual ones. */
+    switch (width) {
+    case 3:
+	return decode_data(ce, bytes, nbits, uncertainty, 3);
+    case 4:
+	return decode_data(ce, bytes, nbits, uncertainty, 4);
+    case 8:
+	return decode_data(ce, bytes, nbits, uncertainty, 8);
+    default:
+	if (width < 1 || width > 8)
+	    return 1;
+	return decode_data(ce, bytes, nbits, uncertainty, width);
+    }
+}
+
+int
+convdecode_data_llr(struct convcode *ce, const int8_t *llrs,
+		    unsigned int nbits)
+{
+    int8_t *leftover = (int8_t *) ce->leftover_uncertainty;
+    unsigned int i, n, symsize = dec_symbol_size(ce);
+    int rv;
+
+    /* A couple of bits at 254 each would saturate 8-bit path values. */
+    if (ce->metric_width == 8)
+	return 1;
+
+    if (ce->leftover_bits) {
+	n = symsize - ce->leftover_bits;
+	if (nbits < n)
+	    n = nbits;
+	for (i = 0; i < n; i++)
+	    leftover[ce->leftover_bits++] = llrs[i];
+	if (ce->leftover_bits < symsize)
+	    return 0;
+	llrs += n;
+	nbits -= n;
+	ce->leftover_bits = 0;
+	rv = decode_llrs(ce, leftover);
+	if (rv)
+	    return rv;
+	symsize = dec_symbol_size(ce);
+    }
+
+    while (nbits >= symsize) {
+	rv = decode_llrs(ce, llrs);
+	if (rv)
+	    return rv;
+	llrs += symsize;
+	nbits -= symsize;
+	symsize = dec_symbol_size(ce);
+    }
+    for (i = 0; i < nbits; i++)
+	leftover[i] = llrs[i];
+    ce->leftover_bits = nbits;
+    return 0;
+}
+
+int
+convdecode_finish(struct convcode *ce, unsigned int *total_out_bits,
+		  unsigned int *num_errs)
+{
+    unsigned int extra_bits = 0, min_val;
+    uint64_t start = STATS_START(ce);
+    convcode_state cstate = find_min_state(ce, &min_val);
+    int rv;
+
+    if (ce->regex_delay) {
+	rv = regex_finish(ce, cstate);
+    } else {
+	/* Trace back from the minimum value in the final path. */
+	trellis_traceback(ce, cstate, ce->ctrellis);
+
+	/*
+	 * We've stored the values in index 0 of each column, play it
+	 * forward.  If we didn't even get the tail, there's nothing.
+	 */
+	if (ce->do_tail)
+	    extra_bits = ce->k - 1;
+	if (ce->ctrellis > extra_bits)
+	    rv = output_trellis_bits(ce, ce->ctrellis - extra_bits);
+	else
+	    rv = 0;
+    }
+    STATS_END(ce, traceback_cycles, start);
+    if (rv)
+	return rv;
+    rv = output_flush(ce, &ce->dec_out);
+    if (rv)
+	return rv;
+    if (num_errs)
+	*num_errs = min_val;
+    if (total_out_bits)
+	*total_out_bits = ce->dec_out.total_out_bits;
+    return 0;
+}
+
+/*
+ * Like trellis_prev_state(), but for the given lane of batch_trellis.
+ */
+static convcode_state
+batch_prev_state(struct convcode *ce, unsigned int lane, unsigned int column,
+		 convcode_state state)
+{
+    convcode_state pstate = state >> 1;
+
+    if ((ce->batch_trellis[column * ce->num_states + state] >> lane) & 1)
+	pstate |= ce->num_states >> 1;
+    return pstate;
+}
+
+/*
+ * Get the branch costs (see branch_costs()) of symbol number symbol
+ * in a block of received data, finding where it is if the data is
+ * punctured.
+ */
+static unsigned int
+block_symbol_costs(struct convcode *ce, const unsigned char *bytes,
+		   const uint8_t *uncertainty, const int8_t *llrs,
+		   unsigned int symbol, unsigned int *delta)
+{
+    unsigned int inpos, size, pos;
+    const uint8_t *u = NULL;
+
+    if (!ce->puncture_period) {
+	inpos = symbol * ce->num_polys;
+	if (llrs)
+	    return llr_branch_costs_n(llrs + inpos, delta, ce->num_polys, ~0U);
+	if (uncertainty)
+	    u = uncertainty + inpos;
+	return branch_costs(ce, extract_bits(bytes, inpos, ce->num_polys),
+			    u, delta);
+    }
+
+    pos = symbol % ce->puncture_period;
+    inpos = (symbol / ce->puncture_period *
+	     ce->puncture_offset[ce->puncture_period] +
+	     ce->puncture_offset[pos]);
+    size = ce->puncture_offset[pos + 1] - ce->puncture_offset[pos];
+    if (llrs)
+	return llr_branch_costs_n(llrs + inpos, delta, ce->num_polys,
+				  ce->puncture[pos]);
+    if (uncertainty)
+	u = uncertainty + inpos;
+    return branch_costs_n(ce, extract_bits(bytes, inpos, size), u, delta,
+			  ce->num_polys, ce->puncture[pos]);
+}
+
+/*
+ * The number of whole symbols in nbits of received data.
+ */
+static unsigned int
+block_symbols(struct convcode *ce, unsigned int nbits)
+{
+    unsigned int period_bits, nsym, pos;
+
+    if (!ce->puncture_period)
+	return nbits / ce->num_polys;
+
+    period_bits = ce->puncture_offset[ce->puncture_period];
+    nsym = nbits / period_bits * ce->puncture_period;
+    nbits %= period_bits;
+    for (pos = 0; ce->puncture_offset[pos + 1] <= nbits; pos++)
+	nsym++;
+    return nsym;
+}
+
+/*
+ * Go backwards through the trellis from cstate at column ncols to
+ * find the full path for a block decode, storing the bits and the
+ * output uncertainties.  For a batch decode lane is the frame's lane
+ * in batch_trellis, otherwise it is -1.  The input is in llrs if it
+ * is not NULL, otherwise in bytes and uncertainty.
+ */
+static void
+block_traceback(struct convcode *ce, int lane, unsigned int ncols,
+		convcode_state cstate, unsigned int min_val,
+		const unsigned char *bytes, const uint8_t *uncertainty,
+		const int8_t *llrs,
+		unsigned char *outbytes, unsigned int *output_uncertainty)
+{
+    unsigned int i, extra_bits = 0, cuncertainty;
+    uint64_t start = STATS_START(ce);
+
+    STATS_ADD(ce, traceback_steps, ncols);
+    if (ce->do_tail)
+	extra_bits = ce->k - 1;
+    cuncertainty = min_val;
+    for (i = ncols; i > 0; ) {
+	convcode_state pstate; /* Previous state */
+	unsigned int bit, base, delta[CONVCODE_MAX_POLYNOMIALS];
+
+	i--;
+	if (lane < 0)
+	    pstate = trellis_prev_state(ce, i, cstate);
+	else
+	    pstate = batch_prev_state(ce, lane, i, cstate);
+	bit = get_prev_bit(ce, pstate, cstate);
+
+	/*
+	 * Store the bit values in the user-supplied data.
+	 */
+	if (extra_bits == 0)
+	    outbytes[i / 8] |= bit << (i % 8);
+
+	if (output_uncertainty) {
+	    if (extra_bits == 0)
+		output_uncertainty[i] = cuncertainty;
+
+	    /*
+	     * Subtract off the distance we had computed to here to get the
+	     * previous uncertainty value.
+	     */
+	    base = block_symbol_costs(ce, bytes, uncertainty, llrs, i, delta);
+	    cuncertainty -= branch_metric(base, delta,
+					  ce->convert[bit][pstate]);
+	}
+	if (extra_bits > 0)
+	    extra_bits--;
+
+	cstate = pstate;
+    }
+    STATS_END(ce, traceback_cycles, start);
+}
+
+int
+convdecode_block(struct convcode *ce, const unsigned char *bytes,
+		 unsigned int nbits, const uint8_t *uncertainty,
+		 unsigned char *outbytes, unsigned int *output_uncertainty,
+		 unsigned int *num_errs)
+{
+    unsigned int min_val, cstate;
+
+    if (ce->traceback_depth || ce->merge_interval || ce->regex_delay)
+	return 1;
+
+    if (convdecode_data(ce, bytes, nbits, uncertainty))
+	return 1;
+
+    /* Find the minimum value in the final path. */
+    cstate = find_min_state(ce, &min_val);
+    block_traceback(ce, -1, ce->ctrellis, cstate, min_val, bytes, uncertainty,
+		    NULL, outbytes, output_uncertainty);
+
+    if (num_errs)
+	*num_errs = min_val;
+
+    return 0;
+}
+
+int
+convdecode_block_llr(struct convcode *ce, const int8_t *llrs,
+		     unsigned int nbits, unsigned char *outbytes,
+		     unsigned int *output_uncertainty, unsigned int *num_errs)
+{
+    unsigned int min_val, cstate;
+
+    if (ce->traceback_depth || ce->merge_interval || ce->regex_delay)
+	return 1;
+
+    if (convdecode_data_llr(ce, llrs, nbits))
+	return 1;
+
+    cstate = find_min_state(ce, &min_val);
+    block_traceback(ce, -1, ce->ctrellis, cstate, min_val, NULL, NULL,
+		    llrs, outbytes, output_uncertainty);
+
+    if (num_errs)
+	*num_errs = min_val;
+
+    return 0;
+}
+
+/*
+ * Follow the path ending in cstate at the end of the trellis back to
+ * its start, returning the state it starts in.  If cost is not NULL,
+ * it gets the distance between the path and the received data.
+ */
+static convcode_state
+block_path_start(struct convcode *ce, convcode_state cstate,
+		 const unsigned char *bytes, const uint8_t *uncertainty,
+		 unsigned int *cost)
+{
+    unsigned int i, bit, base, delta[CONVCODE_MAX_POLYNOMIALS];
+    uint64_t start = STATS_START(ce);
+    convcode_state pstate;
+
+    STATS_ADD(ce, traceback_steps, ce->ctrellis);
+    if (cost)
+	*cost = 0;
+    for (i = ce->ctrellis; i > 0; ) {
+	i--;
+	pstate = trellis_prev_state(ce, i, cstate);
+	if (cost) {
+	    bit = get_prev_bit(ce, pstate, cstate);
+	    base = block_symbol_costs(ce, bytes, uncertainty, NULL, i, delta);
+	    *cost += branch_metric(base, delta, ce->convert[bit][pstate]);
+	}
+	cstate = pstate;
+    }
+    STATS_END(ce, traceback_cycles, start);
+    return cstate;
+}
+
+/*
+ * Look for a path that ends in the state it started in among the
+ * best paths at the end of the trellis.  There are often several
+ * with the same value, especially with hard decoding, and any of them
+ * will do.  If one is found, it is returned in cstate.
+ */
+static bool
+tailbiting_best_state(struct convcode *ce, unsigned int min_val,
+		      convcode_state *cstate)
+{
+    unsigned int i;
+
+    min_val -= ce->metric_offset;
+    for (i = 0; i < ce->num_states; i++) {
+	if (get_path_value(ce, ce->curr_path_values, i) != min_val)
+	    continue;
+	if (block_path_start(ce, i, NULL, NULL, NULL) == i) {
+	    *cstate = i;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * Set up for another pass of a tail-biting decode, starting from the
+ * path values at the end of the last one.
+ */
+static void
+tailbiting_wrap(struct convcode *ce)
+{
+    void *values = ce->curr_path_values;
+    unsigned int i;
+
+    renormalize_path_values(ce, values);
+    if (ce->metric_width < 32) {
+	/* Leave room for the paths to grow, like reinit_convdecode(). */
+	for (i = 0; i < ce->num_states; i++) {
+	    if (get_path_value(ce, values, i) > ce->metric_max / 4)
+		set_path_value(ce, values, i, ce->metric_max / 4);
+	}
+    }
+    ce->metric_offset = 0;
+    ce->ctrellis = 0;
+    ce->leftover_bits = 0;
+    ce->dec_puncture_pos = 0;
+}
+
+int
+convdecode_tailbiting(struct convcode *ce, const unsigned char *bytes,
+		      unsigned int nbits, const uint8_t *uncertainty,
+		      unsigned char *outbytes, unsigned int *output_uncertainty,
+		      unsigned int *num_errs, unsigned int max_passes,
+		      unsigned int *passes)
+{
+    unsigned int pass, cost, min_val;
+    convcode_state cstate;
+    bool found = false;
+
+    if (ce->traceback_depth || ce->merge_interval || ce->regex_delay ||
+	ce->do_tail)
+	return 1;
+    if (max_passes == 0)
+	max_passes = CONVCODE_DEFAULT_TAILBITING_PASSES;
+
+    /* Any start state is as good as any other to begin with. */
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE, 0);
+    for (pass = 1; ; pass++) {
+	if (convdecode_data(ce, bytes, nbits, uncertainty))
+	    return 1;
+	cstate = find_min_state(ce, &min_val);
+	if (tailbiting_best_state(ce, min_val, &cstate)) {
+	    found = true;
+	    break;
+	}
+	if (pass == max_passes)
+	    break;
+	tailbiting_wrap(ce);
+    }
+
+    block_path_start(ce, cstate, bytes, uncertainty, &cost);
+    block_traceback(ce, -1, ce->ctrellis, cstate, cost, bytes, uncertainty,
+		    NULL, outbytes, output_uncertainty);
+    if (num_errs)
+	*num_errs = cost;
+    if (passes)
+	*passes = found ? pass : 0;
+    return 0;
+}
+
+/*
+ * Allocate whatever batch decoding memory hasn't been allocated yet.
+ */
+static int
+alloc_batch(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int lane_bytes = sizeof(uint32_t) * CONVCODE_BATCH_LANES;
+
+    if (ce->batch_trellis && ce->batch_curr_path_values &&
+		ce->batch_next_path_values && ce->batch_branch_metrics)
+	return 0;
+    if (!o)
+	return 1;
+
+    if (!ce->batch_trellis) {
+	ce->batch_trellis = o->zalloc(o, sizeof(*ce->batch_trellis) *
+				      ce->trellis_size * ce->num_states);
+	if (!ce->batch_trellis)
+	    return 1;
+    }
+    if (!ce->batch_curr_path_values) {
+	ce->batch_curr_path_values = o->zalloc(o, lane_bytes * ce->num_states);
+	if (!ce->batch_curr_path_values)
+	    return 1;
+    }
+    if (!ce->batch_next_path_values) {
+	ce->batch_next_path_values = o->zalloc(o, lane_bytes * ce->num_states);
+	if (!ce->batch_next_path_values)
+	    return 1;
+    }
+    if (!ce->batch_branch_metrics) {
+	ce->batch_branch_metrics = o->zalloc(o, lane_bytes
+					     << ce->num_polys);
+	if (!ce->batch_branch_metrics)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Fill in batch_branch_metrics for the given symbol of each frame,
+ * like fill_branch_metrics() does for each lane.  Lanes without a
+ * frame or past the end of their frame get anything, they aren't
+ * used.
+ */
+static void
+batch_branch_metrics(struct convcode *ce, struct convdecode_frame *frames,
+		     unsigned int nframes, unsigned int column)
+{
+    uint32_t *bm = ce->batch_branch_metrics;
+    unsigned int delta[CONVCODE_MAX_POLYNOMIALS][CONVCODE_BATCH_LANES];
+    unsigned int d[CONVCODE_MAX_POLYNOMIALS];
+    unsigned int inpos = column * ce->num_polys;
+    unsigned int i, j, n, lane;
+
+    for (lane = 0; lane < CONVCODE_BATCH_LANES; lane++) {
+	unsigned int bits = 0;
+	const uint8_t *u = NULL;
+
+	if (lane < nframes && inpos + ce->num_polys <= frames[lane].nbits) {
+	    bits = extract_bits(frames[lane].bytes, inpos, ce->num_polys);
+	    if (frames[lane].uncertainty)
+		u = frames[lane].uncertainty + inpos;
+	}
+	bm[lane] = branch_costs(ce, bits, u, d);
+	for (j = 0; j < ce->num_polys; j++)
+	    delta[j][lane] = d[j];
+    }
+
+    for (j = 0, n = 1; j < ce->num_polys; j++, n <<= 1) {
+	for (i = 0; i < n; i++) {
+	    uint32_t *from = bm + i * CONVCODE_BATCH_LANES;
+	    uint32_t *to = bm + (n + i) * CONVCODE_BATCH_LANES;
+
+	    for (lane = 0; lane < CONVCODE_BATCH_LANES; lane++)
+		to[lane] = from[lane] + delta[j][lane];
+	}
+    }
+}
+
+/* Like find_min_state() for the given lane of the batch path values. */
+static convcode_state
+batch_min_state(struct convcode *ce, unsigned int lane, unsigned int *min_val)
+{
+    const uint32_t *values = ce->batch_curr_path_values + lane;
+    unsigned int i, val = values[0];
+    convcode_state cstate = 0;
+
+    for (i = 1; i < ce->num_states; i++) {
+	if (values[i * CONVCODE_BATCH_LANES] < val) {
+	    cstate = i;
+	    val = values[i * CONVCODE_BATCH_LANES];
+	}
+    }
+    *min_val = val;
+    return cstate;
+}
+
+/*
+ * Decode up to CONVCODE_BATCH_LANES frames together.  When a frame
+ * runs out of symbols its best state is saved, the lane keeps going
+ * with junk until the longest frame is done.
+ */
+static void
+batch_decode_group(struct convcode *ce, struct convdecode_frame *frames,
+		   unsigned int nframes)
+{
+    unsigned int nsym[CONVCODE_BATCH_LANES], min_val[CONVCODE_BATCH_LANES];
+    convcode_state cstate[CONVCODE_BATCH_LANES];
+    unsigned int i, lane, column, maxsym = 0;
+    uint64_t start;
+    uint32_t *tmp;
+
+    for (lane = 0; lane < nframes; lane++) {
+	nsym[lane] = frames[lane].nbits / ce->num_polys;
+	if (nsym[lane] > maxsym)
+	    maxsym = nsym[lane];
+	STATS_ADD(ce, symbols_decoded, nsym[lane]);
+    }
+    STATS_ADD(ce, acs_butterflies,
+	      (uint64_t) maxsym * ce->num_states / 2 * CONVCODE_BATCH_LANES);
+
+    for (i = 0; i < ce->num_states; i++) {
+	unsigned int v = CONVCODE_DEFAULT_INIT_VAL;
+
+	if (i == CONVCODE_DEFAULT_START_STATE)
+	    v = 0;
+	for (lane = 0; lane < CONVCODE_BATCH_LANES; lane++)
+	    ce->batch_curr_path_values[i * CONVCODE_BATCH_LANES + lane] = v;
+    }
+
+    for (column = 0; ; column++) {
+	for (lane = 0; lane < nframes; lane++) {
+	    if (nsym[lane] == column)
+		cstate[lane] = batch_min_state(ce, lane, &min_val[lane]);
+	}
+	if (column == maxsym)
+	    break;
+
+	start = STATS_START(ce);
+	batch_branch_metrics(ce, frames, nframes, column);
+	ce->batch_kernel(ce, ce->batch_branch_metrics,
+			 ce->batch_trellis + column * ce->num_states);
+	STATS_END(ce, decode_cycles, start);
+	tmp = ce->batch_curr_path_values;
+	ce->batch_curr_path_values = ce->batch_next_path_values;
+	ce->batch_next_path_values = tmp;
+    }
+
+    for (lane = 0; lane < nframes; lane++) {
+	block_traceback(ce, lane, nsym[lane], cstate[lane], min_val[lane],
+			frames[lane].bytes, frames[lane].uncertainty, NULL,
+			frames[lane].outbytes,
+			frames[lane].output_uncertainty);
+	frames[lane].num_errs = min_val[lane];
+    }
+}
+
+/*
+ * Can the frames be batch decoded on this coder?
+ */
+static int
+batch_check(struct convcode *ce, struct convdecode_frame *frames,
+	    unsigned int nframes)
+{
+    unsigned int i, nsym;
+
+    if (ce->traceback_depth || !ce->trellis_size || ce->num_polys > 8 ||
+	ce->puncture_period)
+	return 1;
+
+    /* The same limit decode_bits() has. */
+    for (i = 0; i < nframes; i++) {
+	nsym = frames[i].nbits / ce->num_polys;
+	if (nsym && nsym - 1 + ce->num_polys > ce->trellis_size) {
+	    STATS_ADD(ce, trellis_overflows, 1);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static void
+batch_decode_frames(struct convcode *ce, struct convdecode_frame *frames,
+		    unsigned int nframes)
+{
+    unsigned int i;
+
+    for (i = 0; i < nframes; i += CONVCODE_BATCH_LANES) {
+	unsigned int n = nframes - i;
+
+	if (n > CONVCODE_BATCH_LANES)
+	    n = CONVCODE_BATCH_LANES;
+	batch_decode_group(ce, frames + i, n);
+    }
+}
+
+int
+convdecode_batch(struct convcode *ce, struct convdecode_frame *frames,
+		 unsigned int nframes)
+{
+    if (batch_check(ce, frames, nframes) || alloc_batch(ce))
+	return 1;
+    batch_decode_frames(ce, frames, nframes);
+    return 0;
+}
+
+/*
+ * Make sure *mem is at least size bytes.  What was in it is lost.
+ */
+static int
+batch_mem_grow(convcode_os_funcs *o, void **mem, unsigned long *mem_size,
+	       unsigned long size)
+{
+    if (*mem_size >= size)
+	return 0;
+    if (*mem)
+	o->free(o, *mem);
+    *mem_size = 0;
+    *mem = o->zalloc(o, size);
+    if (!*mem)
+	return 1;
+    *mem_size = size;
+    return 0;
+}
+
+int
+convdecode_batch_with_mem(struct convcode *ce,
+			  struct convdecode_batch_mem *mem,
+			  struct convdecode_frame *frames,
+			  unsigned int nframes)
+{
+    convcode_os_funcs *o = mem->o;
+    unsigned long values_size = (sizeof(uint32_t) * CONVCODE_BATCH_LANES *
+				 ce->num_states);
+    uint16_t *trellis;
+    uint32_t *currp, *nextp, *bm;
+
+    if (batch_check(ce, frames, nframes) || !o)
+	return 1;
+    if (batch_mem_grow(o, (void **) &mem->trellis, &mem->trellis_size,
+		       (sizeof(*mem->trellis) * ce->trellis_size *
+			ce->num_states)) ||
+	batch_mem_grow(o, (void **) &mem->branch_metrics,
+		       &mem->branch_metrics_size,
+		       (sizeof(uint32_t) * CONVCODE_BATCH_LANES
+			<< ce->num_polys)))
+	return 1;
+    if (mem->values_size < values_size) {
+	/* These are swapped while decoding, so they are the same size. */
+	if (mem->curr_path_values)
+	    o->free(o, mem->curr_path_values);
+	if (mem->next_path_values)
+	    o->free(o, mem->next_path_values);
+	mem->values_size = 0;
+	mem->curr_path_values = o->zalloc(o, values_size);
+	mem->next_path_values = o->zalloc(o, values_size);
+	if (!mem->curr_path_values || !mem->next_path_values)
+	    return 1;
+	mem->values_size = values_size;
+    }
+
+    /*
+     * Decode with mem in place of the coder's own batch memory.  The
+     * path value pointers get swapped around while decoding, so take
+     * them back from the coder afterwards.
+     */
+    trellis = ce->batch_trellis;
+    currp = ce->batch_curr_path_values;
+    nextp = ce->batch_next_path_values;
+    bm = ce->batch_branch_metrics;
+    ce->batch_trellis = mem->trellis;
+    ce->batch_curr_path_values = mem->curr_path_values;
+    ce->batch_next_path_values = mem->next_path_values;
+    ce->batch_branch_metrics = mem->branch_metrics;
+    batch_decode_frames(ce, frames, nframes);
+    mem->curr_path_values = ce->batch_curr_path_values;
+    mem->next_path_values = ce->batch_next_path_values;
+    ce->batch_trellis = trellis;
+    ce->batch_curr_path_values = currp;
+    ce->batch_next_path_values = nextp;
+    ce->batch_branch_metrics = bm;
+    return 0;
+}
+
+void
+free_convdecode_batch_mem(struct convdecode_batch_mem *mem)
+{
+    convcode_os_funcs *o = mem->o;
+
+    if (mem->trellis)
+	o->free(o, mem->trellis);
+    if (mem->curr_path_values)
+	o->free(o, mem->curr_path_values);
+    if (mem->next_path_values)
+	o->free(o, mem->next_path_values);
+    if (mem->branch_metrics)
+	o->free(o, mem->branch_metrics);
+    mem->trellis = NULL;
+    mem->curr_path_values = NULL;
+    mem->next_path_values = NULL;
+    mem->branch_metrics = NULL;
+    mem->trellis_size = 0;
+    mem->values_size = 0;
+    mem->branch_metrics_size = 0;
+}
+
+static int
+alloc_bitslice(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int values_size = (sizeof(uint64_t) * ce->num_states *
+				CONVCODE_BITSLICE_MAX_PLANES);
+
+    if (ce->bitslice_trellis && ce->bitslice_curr_path_values &&
+		ce->bitslice_next_path_values)
+	return 0;
+    if (!o)
+	return 1;
+
+    if (!ce->bitslice_trellis) {
+	ce->bitslice_trellis = o->zalloc(o, sizeof(*ce->bitslice_trellis) *
+					 ce->trellis_size * ce->num_states);
+	if (!ce->bitslice_trellis)
+	    return 1;
+    }
+    if (!ce->bitslice_curr_path_values) {
+	ce->bitslice_curr_path_values = o->zalloc(o, values_size);
+	if (!ce->bitslice_curr_path_values)
+	    return 1;
+    }
+    if (!ce->bitslice_next_path_values) {
+	ce->bitslice_next_path_values = o->zalloc(o, values_size);
+	if (!ce->bitslice_next_path_values)
+	    return 1;
+    }
+    return 0;
+}
+
+/* Enough bit planes to count up to 8 mismatched bits. */
+#define BITSLICE_BM_PLANES 4
+
+/*
+ * The value the states other than the start state start at.  Once
+ * every state can be reached from the start state (k - 1 symbols in)
+ * a path from the start state costs at most (k - 1) * num_polys, so
+ * with this they can never win against one.
+ */
+static unsigned int
+bitslice_init_val(struct convcode *ce)
+{
+    return ce->k * ce->num_polys + 1;
+}
+
+/*
+ * The number of bit planes the path values need.  Every state can be
+ * reached from the best one in k - 1 symbols, so once the other
+ * states' start values are gone no path value is more than
+ * (k - 1) * num_polys above the best one, and the branches add up to
+ * num_polys more.  Before that, the start values are up to
+ * bitslice_init_val() more.  The values are allowed to wrap, if the
+ * planes can hold more than twice the spread the sign of the
+ * difference between two values still says which is smaller.
+ */
+static unsigned int
+bitslice_planes(struct convcode *ce)
+{
+    unsigned int spread = bitslice_init_val(ce) + ce->k * ce->num_polys;
+    unsigned int planes = 1;
+
+    while ((1U << (planes - 1)) <= spread)
+	planes++;
+    return planes;
+}
+
+/*
+ * Count the mismatched bits between the received symbol of each frame
+ * and every possible output value.  bm[v] is the count for output
+ * value v in BITSLICE_BM_PLANES bit planes.  Lanes without a frame or
+ * past the end of their frame get anything, they aren't used.
+ */
+static void
+bitslice_branch_metrics(struct convcode *ce, struct convdecode_frame *frames,
+			unsigned int nframes, unsigned int column,
+			uint64_t (*bm)[BITSLICE_BM_PLANES])
+{
+    uint64_t received[8] = { 0 };
+    unsigned int inpos = column * ce->num_polys;
+    unsigned int i, j, v, lane;
+
+    for (lane = 0; lane < nframes; lane++) {
+	unsigned int bits;
+
+	if (inpos + ce->num_polys > frames[lane].nbits)
+	    continue;
+	bits = extract_bits(frames[lane].bytes, inpos, ce->num_polys);
+	for (j = 0; j < ce->num_polys; j++)
+	    received[j] |= (uint64_t) ((bits >> j) & 1) << lane;
+    }
+
+    for (v = 0; v < (1U << ce->num_polys); v++) {
+	for (i = 0; i < BITSLICE_BM_PLANES; i++)
+	    bm[v][i] = 0;
+	for (j = 0; j < ce->num_polys; j++) {
+	    /* Add the mismatches for this bit to the count. */
+	    uint64_t carry = received[j] ^ -(uint64_t) ((v >> j) & 1), t;
+
+	    for (i = 0; carry && i < BITSLICE_BM_PLANES; i++) {
+		t = bm[v][i] & carry;
+		bm[v][i] ^= carry;
+		carry = t;
+	    }
+	}
+    }
+}
+
+/*
+ * Run one symbol through the trellis for every state like
+ * decode_bits_scalar_n(), but 64 frames at a time on bit planes.
+ */
+static CONVCODE_ALWAYS_INLINE void
+bitslice_acs_n(struct convcode *ce, const uint64_t (*bm)[BITSLICE_BM_PLANES],
+	       uint64_t *column, unsigned int planes, unsigned int bm_planes)
+{
+    const uint64_t *currp = ce->bitslice_curr_path_values;
+    uint64_t *nextp = ce->bitslice_next_path_values;
+    const uint16_t *out1 = ce->prev_convert[0];
+    const uint16_t *out2 = ce->prev_convert[1];
+    unsigned int half = ce->num_states >> 1, i, j;
+
+    for (i = 0; i < ce->num_states; i++) {
+	const uint64_t *v1 = currp + (i >> 1) * planes;
+	const uint64_t *v2 = currp + ((i >> 1) | half) * planes;
+	const uint64_t *b1 = bm[out1[i]], *b2 = bm[out2[i]];
+	uint64_t dist1[CONVCODE_BITSLICE_MAX_PLANES];
+	uint64_t dist2[CONVCODE_BITSLICE_MAX_PLANES];
+	uint64_t c1 = 0, c2 = 0, c3 = ~(uint64_t) 0, x, y, sign = 0;
+
+	for (j = 0; j < planes; j++) {
+	    x = j < bm_planes ? b1[j] : 0;
+	    dist1[j] = v1[j] ^ x ^ c1;
+	    c1 = (v1[j] & x) | (c1 & (v1[j] ^ x));
+
+	    x = j < bm_planes ? b2[j] : 0;
+	    dist2[j] = v2[j] ^ x ^ c2;
+	    c2 = (v2[j] & x) | (c2 & (v2[j] ^ x));
+
+	    /* dist2 - dist1, only the sign is needed. */
+	    y = ~dist1[j];
+	    sign = dist2[j] ^ y ^ c3;
+	    c3 = (dist2[j] & y) | (c3 & (dist2[j] ^ y));
+	}
+
+	/* The sign is set where dist2 < dist1. */
+	column[i] = sign;
+	for (j = 0; j < planes; j++)
+	    nextp[i * planes + j] = dist1[j] ^ ((dist1[j] ^ dist2[j]) & sign);
+    }
+}
+
+static void
+bitslice_acs(struct convcode *ce, const uint64_t (*bm)[BITSLICE_BM_PLANES],
+	     uint64_t *column, unsigned int planes)
+{
+    /*
+     * Let the compiler unroll the loops for the common codes, rate 1/2
+     * and 1/3 need two planes for the branch metrics.
+     */
+    if (ce->num_polys <= 3) {
+	switch (planes) {
+	case 5:
+	    bitslice_acs_n(ce, bm, column, 5, 2);
+	    return;
+	case 6:
+	    bitslice_acs_n(ce, bm, column, 6, 2);
+	    return;
+	case 7:
+	    bitslice_acs_n(ce, bm, column, 7, 2);
+	    return;
+	}
+    }
+    bitslice_acs_n(ce, bm, column, planes, BITSLICE_BM_PLANES);
+}
+
+/*
+ * Like find_min_state() for the given lane of the bit-sliced path
+ * values.  The values wrap, so compare them by the sign of the
+ * difference.
+ */
+static convcode_state
+bitslice_min_state(struct convcode *ce, unsigned int lane, unsigned int planes)
+{
+    const uint64_t *values = ce->bitslice_curr_path_values;
+    unsigned int mask = (1U << planes) - 1, sign = 1U << (planes - 1);
+    unsigned int i, j, v, val = 0;
+    convcode_state cstate = 0;
+
+    for (i = 0; i < ce->num_states; i++) {
+	v = 0;
+	for (j = 0; j < planes; j++)
+	    v |= ((values[i * planes + j] >> lane) & 1) << j;
+	if (i == 0 || ((v - val) & mask & sign)) {
+	    cstate = i;
+	    val = v;
+	}
+    }
+    return cstate;
+}
+
+/*
+ * Like block_traceback() for a lane of bitslice_trellis.  The path
+ * values don't have the total, so the distance is counted from the
+ * received data, and returned.
+ */
+static unsigned int
+bitslice_traceback(struct convcode *ce, unsigned int lane, unsigned int ncols,
+		   convcode_state cstate, struct convdecode_frame *frame)
+{
+    unsigned int *output_uncertainty = frame->output_uncertainty;
+    unsigned int i, bit, cost, nout = 0, num_errs = 0;
+    convcode_state pstate;
+    uint64_t start = STATS_START(ce);
+
+    STATS_ADD(ce, traceback_steps, ncols);
+    if (!ce->do_tail)
+	nout = ncols;
+    else if (ncols > ce->k - 1)
+	nout = ncols - (ce->k - 1);
+    for (i = ncols; i > 0; ) {
+	i--;
+	pstate = cstate >> 1;
+	if ((ce->bitslice_trellis[i * ce->num_states + cstate] >> lane) & 1)
+	    pstate |= ce->num_states >> 1;
+	bit = get_prev_bit(ce, pstate, cstate);
+	cost = __builtin_popcountll(extract_bits(frame->bytes,
+						 i * ce->num_polys,
+						 ce->num_polys) ^
+				    ce->convert[bit][pstate]);
+	num_errs += cost;
+	if (i < nout) {
+	    frame->outbytes[i / 8] |= bit << (i % 8);
+	    if (output_uncertainty)
+		output_uncertainty[i] = cost;
+	}
+	cstate = pstate;
+    }
+
+    /* The uncertainty is the distance up to and including the bit. */
+    if (output_uncertainty) {
+	for (i = 1; i < nout; i++)
+	    output_uncertainty[i] += output_uncertainty[i - 1];
+    }
+    STATS_END(ce, traceback_cycles, start);
+    return num_errs;
+}
+
+/*
+ * Decode up to CONVCODE_BITSLICE_LANES frames together, like
+ * batch_decode_group().
+ */
+static void
+bitslice_decode_group(struct convcode *ce, struct convdecode_frame *frames,
+		      unsigned int nframes)
+{
+    unsigned int nsym[CONVCODE_BITSLICE_LANES];
+    convcode_state cstate[CONVCODE_BITSLICE_LANES];
+    uint64_t bm[1 << 8][BITSLICE_BM_PLANES];
+    unsigned int planes = bitslice_planes(ce), init = bitslice_init_val(ce);
+    unsigned int i, j, lane, column, maxsym = 0;
+    uint64_t start, *tmp;
+
+    for (lane = 0; lane < nframes; lane++) {
+	nsym[lane] = frames[lane].nbits / ce->num_polys;
+	if (nsym[lane] > maxsym)
+	    maxsym = nsym[lane];
+	STATS_ADD(ce, symbols_decoded, nsym[lane]);
+    }
+    STATS_ADD(ce, acs_butterflies,
+	      (uint64_t) maxsym * ce->num_states / 2 * CONVCODE_BITSLICE_LANES);
+
+    for (i = 0; i < ce->num_states; i++) {
+	for (j = 0; j < planes; j++) {
+	    uint64_t v = 0;
+
+	    if (i != CONVCODE_DEFAULT_START_STATE && ((init >> j) & 1))
+		v = ~(uint64_t) 0;
+	    ce->bitslice_curr_path_values[i * planes + j] = v;
+	}
+    }
+
+    for (column = 0; ; column++) {
+	for (lane = 0; lane < nframes; lane++) {
+	    if (nsym[lane] == column)
+		cstate[lane] = bitslice_min_state(ce, lane, planes);
+	}
+	if (column == maxsym)
+	    break;
+
+	start = STATS_START(ce);
+	bitslice_branch_metrics(ce, frames, nframes, column, bm);
+	bitslice_acs(ce, (const uint64_t (*)[BITSLICE_BM_PLANES]) bm,
+		     ce->bitslice_trellis + column * ce->num_states, planes);
+	STATS_END(ce, decode_cycles, start);
+	tmp = ce->bitslice_curr_path_values;
+	ce->bitslice_curr_path_values = ce->bitslice_next_path_values;
+	ce->bitslice_next_path_values = tmp;
+    }
+
+    for (lane = 0; lane < nframes; lane++)
+	frames[lane].num_errs = bitslice_traceback(ce, lane, nsym[lane],
+						   cstate[lane],
+						   &frames[lane]);
+}
+
+int
+convdecode_bitsliced(struct convcode *ce, struct convdecode_frame *frames,
+		     unsigned int nframes)
+{
+    unsigned int i, nsym;
+
+    if (ce->traceback_depth || !ce->trellis_size || ce->num_polys > 8 ||
+	ce->puncture_period)
+	return 1;
+
+    for (i = 0; i < nframes; i++) {
+	if (frames[i].uncertainty)
+	    return 1;
+	/* The same limit decode_bits() has. */
+	nsym = frames[i].nbits / ce->num_polys;
+	if (nsym && nsym - 1 + ce->num_polys > ce->trellis_size) {
+	    STATS_ADD(ce, trellis_overflows, 1);
+	    return 1;
+	}
+    }
+
+    if (alloc_bitslice(ce))
+	return 1;
+
+    for (i = 0; i < nframes; i += CONVCODE_BITSLICE_LANES) {
+	unsigned int n = nframes - i;
+
+	if (n > CONVCODE_BITSLICE_LANES)
+	    n = CONVCODE_BITSLICE_LANES;
+	bitslice_decode_group(ce, frames + i, n);
+    }
+    return 0;
+}
+
+/*
+ * A piece of a parallel block decode, and the info about the whole
+ * decode for all the pieces.  See convdecode_block_parallel().
+ */
+struct convdecode_segment {
+    struct convcode *ce;
+    unsigned int start; /* First symbol to output */
+    unsigned int end; /* One after the last symbol to output */
+    unsigned int num_errs;
+    int rv;
+};
+
+struct convdecode_parallel {
+    const unsigned char *bytes;
+    const uint8_t *uncertainty;
+    unsigned char *outbytes;
+    unsigned int nsym; /* Total symbols */
+    unsigned int nout; /* Total output bits, nsym without the tail */
+    unsigned int overlap;
+    struct convdecode_segment *segs;
+};
+
+static void
+decode_segment(void *data, unsigned int n)
+{
+    struct convdecode_parallel *p = data;
+    struct convdecode_segment *seg = &p->segs[n];
+    struct convcode *ce = seg->ce;
+    unsigned int wstart = 0, wend, i, bit, bits, inpos;
+    uint64_t start;
+    const uint8_t *u = NULL;
+    convcode_state cstate, pstate;
+
+    if (seg->start > p->overlap)
+	wstart = seg->start - p->overlap;
+    wend = seg->end + p->overlap;
+    if (wend > p->nsym)
+	wend = p->nsym;
+
+    /* Only the first segment knows where it starts. */
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      wstart ? 0 : CONVCODE_DEFAULT_INIT_VAL);
+    for (i = wstart; i < wend; i++) {
+	inpos = i * ce->num_polys;
+	bits = extract_bits(p->bytes, inpos, ce->num_polys);
+	if (p->uncertainty)
+	    u = p->uncertainty + inpos;
+	if (decode_bits(ce, bits, u)) {
+	    seg->rv = 1;
+	    return;
+	}
+    }
+
+    cstate = find_min_state(ce, NULL);
+    STATS_ADD(ce, traceback_steps, wend - wstart);
+    start = STATS_START(ce);
+    for (i = wend; i > wstart; ) {
+	i--;
+	pstate = trellis_prev_state(ce, i - wstart, cstate);
+	if (i >= seg->start && i < seg->end) {
+	    bit = get_prev_bit(ce, pstate, cstate);
+	    if (i < p->nout)
+		p->outbytes[i / 8] |= bit << (i % 8);
+	    inpos = i * ce->num_polys;
+	    bits = extract_bits(p->bytes, inpos, ce->num_polys);
+	    if (p->uncertainty)
+		u = p->uncertainty + inpos;
+	    seg->num_errs += hamming_distance(ce, ce->convert[bit][pstate],
+					      bits, u);
+	}
+	cstate = pstate;
+    }
+    STATS_END(ce, traceback_cycles, start);
+}
+
+/*
+ * Make sure there are at least n segment coders with room for bits,
+ * reusing the ones from the last call that are big enough.
+ */
+static int
+alloc_par_coders(struct convcode *ce, unsigned int n, unsigned int bits)
+{
+    convcode_os_funcs *o = ce->o;
+    convcode_state polys[CONVCODE_MAX_POLYNOMIALS];
+    struct convcode **coders;
+    unsigned int i;
+
+    if (n > ce->num_par_coders) {
+	coders = o->zalloc(o, sizeof(*coders) * n);
+	if (!coders)
+	    return 1;
+	for (i = 0; i < ce->num_par_coders; i++)
+	    coders[i] = ce->par_coders[i];
+	if (ce->par_coders)
+	    o->free(o, ce->par_coders);
+	ce->par_coders = coders;
+	ce->num_par_coders = n;
+    }
+
+    for (i = 0; i < ce->num_polys; i++)
+	polys[i] = reverse_bits(ce->k, ce->polys[i]);
+    for (i = 0; i < n; i++) {
+	/* The same size setup_convcode1() gives it. */
+	if (ce->par_coders[i]) {
+	    if (ce->par_coders[i]->trellis_size >=
+			bits + ce->k * ce->num_polys)
+		continue;
+	    free_convcode(ce->par_coders[i]);
+	}
+	if (ce->code)
+	    ce->par_coders[i] = alloc_convcode_from_code(o, ce->code, bits,
+							 ce->do_tail,
+							 NULL, NULL,
+							 NULL, NULL);
+	else
+	    ce->par_coders[i] = alloc_convcode(o, ce->k, polys,
+					       ce->num_polys, bits,
+					       ce->do_tail, ce->recursive,
+					       NULL, NULL, NULL, NULL);
+	if (!ce->par_coders[i])
+	    return 1;
+    }
+    return 0;
+}
+
+int
+convdecode_block_parallel(struct convcode *ce, const unsigned char *bytes,
+			  unsigned int nbits, const uint8_t *uncertainty,
+			  unsigned char *outbytes, unsigned int *num_errs,
+			  unsigned int nsegments, unsigned int overlap)
+{
+    convcode_os_funcs *o = ce->o;
+    struct convdecode_parallel p;
+    unsigned int i, seglen, total_errs = 0;
+    int rv = 0;
+
+    if (!o || nsegments == 0 || ce->puncture_period)
+	return 1;
+    if (overlap == 0)
+	overlap = 10 * ce->k;
+
+    p.bytes = bytes;
+    p.uncertainty = uncertainty;
+    p.outbytes = outbytes;
+    p.overlap = overlap;
+    p.nsym = nbits / ce->num_polys;
+    p.nout = 0;
+    if (!ce->do_tail)
+	p.nout = p.nsym;
+    else if (p.nsym > ce->k - 1)
+	p.nout = p.nsym - (ce->k - 1);
+    if (num_errs)
+	*num_errs = 0;
+    if (p.nsym == 0)
+	return 0;
+
+    /* Segments own whole output bytes, so they don't share any. */
+    seglen = (p.nsym + nsegments - 1) / nsegments;
+    if (seglen < overlap)
+	seglen = overlap;
+    seglen = (seglen + 7) / 8 * 8;
+    nsegments = (p.nsym + seglen - 1) / seglen;
+
+    if (alloc_par_coders(ce, nsegments, seglen + 2 * overlap))
+	return 1;
+    p.segs = o->zalloc(o, sizeof(*p.segs) * nsegments);
+    if (!p.segs)
+	return 1;
+
+    for (i = 0; i < nsegments; i++) {
+	struct convdecode_segment *seg = &p.segs[i];
+
+	seg->start = i * seglen;
+	seg->end = seg->start + seglen;
+	if (seg->end > p.nsym)
+	    seg->end = p.nsym;
+	seg->ce = ce->par_coders[i];
+	seg->ce->uncertainty_100 = ce->uncertainty_100;
+	if (seg->ce->metric_width != ce->metric_width)
+	    set_decode_metric_width(seg->ce, ce->metric_width);
+	if (seg->ce->kernel != ce->kernel)
+	    set_decode_kernel(seg->ce, ce->kernel);
+	seg->ce->stats_timing = ce->stats_timing;
+    }
+
+    if (o->run_parallel) {
+	o->run_parallel(o, decode_segment, &p, nsegments);
+    } else {
+	for (i = 0; i < nsegments; i++)
+	    decode_segment(&p, i);
+    }
+
+    for (i = 0; i < nsegments; i++) {
+	if (p.segs[i].rv)
+	    rv = 1;
+	total_errs += p.segs[i].num_errs;
+#ifdef CONVCODE_STATS
+	add_stats(&ce->stats, &p.segs[i].ce->stats);
+	reset_convcode_stats(p.segs[i].ce);
+#endif
+    }
+    if (!rv && num_errs)
+	*num_errs = total_errs;
+
+    o->free(o, p.segs);
+    return rv;
+}
+
+/*
+ * The path values for states that can't be reached in
+ * convdecode_llr(), and when to renormalize.  These leave room to
+ * add an alpha and a beta together without overflowing.
+ */
+#define LLR_UNREACHABLE (UINT32_MAX / 8)
+#define LLR_RENORM (UINT32_MAX / 8)
+
+static int
+alloc_llr(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int i;
+
+    if (ce->llr_alpha && ce->llr_beta[0] && ce->llr_beta[1])
+	return 0;
+    if (!o)
+	return 1;
+
+    if (!ce->llr_alpha) {
+	ce->llr_alpha = o->zalloc(o, sizeof(*ce->llr_alpha) *
+				  (ce->trellis_size + 1) * ce->num_states);
+	if (!ce->llr_alpha)
+	    return 1;
+    }
+    for (i = 0; i < 2; i++) {
+	if (!ce->llr_beta[i]) {
+	    ce->llr_beta[i] = o->zalloc(o, sizeof(*ce->llr_beta[i]) *
+					ce->num_states);
+	    if (!ce->llr_beta[i])
+		return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Set up the branch metrics for the given symbol, returning the base
+ * for llr_metric().  convdecode_reduced() uses these, too.
+ */
+static unsigned int
+llr_symbol_costs(struct convcode *ce, const unsigned char *bytes,
+		 const uint8_t *uncertainty, unsigned int symbol,
+		 unsigned int *delta)
+{
+    unsigned int base;
+
+    base = block_symbol_costs(ce, bytes, uncertainty, NULL, symbol, delta);
+    if (ce->branch_metrics)
+	fill_branch_metrics(ce, base, delta, ce->num_polys);
+    return base;
+}
+
+static unsigned int
+llr_metric(struct convcode *ce, unsigned int base, const unsigned int *delta,
+	   unsigned int v)
+{
+    if (ce->branch_metrics)
+	return ce->branch_metrics[v];
+    return branch_metric(base, delta, v);
+}
+
+/*
+ * Subtract the smallest value from a column of path values if they
+ * are getting big, returning how much was subtracted.
+ */
+static unsigned int
+llr_renormalize(struct convcode *ce, uint32_t *values)
+{
+    unsigned int i, min = values[0];
+
+    if (min < LLR_RENORM)
+	return 0;
+    for (i = 1; i < ce->num_states; i++) {
+	if (values[i] < min)
+	    min = values[i];
+    }
+    for (i = 0; i < ce->num_states; i++)
+	values[i] -= min;
+    return min;
+}
+
+int
+convdecode_llr(struct convcode *ce, const unsigned char *bytes,
+	       unsigned int nbits, const uint8_t *uncertainty,
+	       int32_t *llrs, unsigned char *outbytes,
+	       unsigned int *num_errs)
+{
+    unsigned int nsym = block_symbols(ce, nbits), nout = nsym;
+    unsigned int half = ce->num_states >> 1, i, t;
+    unsigned int base, delta[CONVCODE_MAX_POLYNOMIALS];
+    unsigned int offset = 0, min_val;
+    uint32_t *alpha, *beta, *nbeta, *tmp;
+
+    if (!ce->trellis_size)
+	return 1;
+    /* The same limit decode_bits() has. */
+    if (nsym && nsym - 1 + ce->num_polys > ce->trellis_size)
+	return 1;
+    if (alloc_llr(ce))
+	return 1;
+    if (ce->do_tail)
+	nout = nsym > ce->k - 1 ? nsym - (ce->k - 1) : 0;
+
+    /* Forward pass, this is just Viterbi without the decisions. */
+    alpha = ce->llr_alpha;
+    for (i = 0; i < ce->num_states; i++)
+	alpha[i] = LLR_UNREACHABLE;
+    alpha[CONVCODE_DEFAULT_START_STATE] = 0;
+    for (t = 0; t < nsym; t++) {
+	const uint32_t *calpha = alpha + t * ce->num_states;
+	uint32_t *nalpha = alpha + (t + 1) * ce->num_states;
+
+	base = llr_symbol_costs(ce, bytes, uncertainty, t, delta);
+	if (t >= nout) {
+	    /* In the tail, only an input of 0 is possible. */
+	    for (i = 0; i < ce->num_states; i++)
+		nalpha[i] = LLR_UNREACHABLE;
+	    for (i = 0; i < ce->num_states; i++) {
+		unsigned int dist = calpha[i] + llr_metric(ce, base, delta,
+							   ce->convert[0][i]);
+
+		if (dist < nalpha[ce->next_state[0][i]])
+		    nalpha[ce->next_state[0][i]] = dist;
+	    }
+	    offset += llr_renormalize(ce, nalpha);
+	    continue;
+	}
+	for (i = 0; i < ce->num_states; i++) {
+	    unsigned int dist1, dist2;
+
+	    dist1 = calpha[i >> 1] + llr_metric(ce, base, delta,
+						ce->prev_convert[0][i]);
+	    dist2 = calpha[(i >> 1) | half] + llr_metric(ce, base, delta,
+						     ce->prev_convert[1][i]);
+	    nalpha[i] = dist2 < dist1 ? dist2 : dist1;
+	}
+	offset += llr_renormalize(ce, nalpha);
+    }
+
+    /* Any end state, with a tail the tail inputs take care of it. */
+    nbeta = ce->llr_beta[1];
+    for (i = 0; i < ce->num_states; i++)
+	nbeta[i] = 0;
+
+    alpha += nsym * ce->num_states;
+    min_val = alpha[0] + nbeta[0];
+    for (i = 1; i < ce->num_states; i++) {
+	if (alpha[i] + nbeta[i] < min_val)
+	    min_val = alpha[i] + nbeta[i];
+    }
+    if (num_errs)
+	*num_errs = min_val + offset;
+
+    /*
+     * Backward pass.  For each state at time t, beta is the best cost
+     * from there to the end, and alpha + the branch + the next beta
+     * is the best full path through each of its branches.
+     */
+    beta = ce->llr_beta[0];
+    for (t = nsym; t > 0; ) {
+	unsigned int min0 = UINT32_MAX, min1 = UINT32_MAX;
+
+	t--;
+	alpha = ce->llr_alpha + t * ce->num_states;
+	base = llr_symbol_costs(ce, bytes, uncertainty, t, delta);
+	for (i = 0; i < ce->num_states; i++) {
+	    unsigned int c0, c1;
+
+	    c0 = llr_metric(ce, base, delta, ce->convert[0][i]) +
+		nbeta[ce->next_state[0][i]];
+	    c1 = llr_metric(ce, base, delta, ce->convert[1][i]) +
+		nbeta[ce->next_state[1][i]];
+	    if (t >= nout)
+		c1 = LLR_UNREACHABLE; /* Tail inputs are always 0. */
+	    beta[i] = c1 < c0 ? c1 : c0;
+	    if (alpha[i] + c0 < min0)
+		min0 = alpha[i] + c0;
+	    if (alpha[i] + c1 < min1)
+		min1 = alpha[i] + c1;
+	}
+	if (t < nout) {
+	    int32_t llr = (int32_t) (min1 - min0);
+
+	    llrs[t] = llr;
+	    if (outbytes && llr < 0)
+		outbytes[t / 8] |= 1 << (t % 8);
+	}
+	llr_renormalize(ce, beta);
+	tmp = beta;
+	beta = nbeta;
+	nbeta = tmp;
+    }
+
+    return 0;
+}
+
+/*
+ * The number of symbols reduced_paths has room for, its own size if
+ * set_decode_reduced_states() was given one, otherwise the trellis
+ * size.
+ */
+static unsigned int
+reduced_symbols(struct convcode *ce)
+{
+    return ce->reduced_size ? ce->reduced_size : ce->trellis_size;
+}
+
+int
+set_decode_reduced_states(struct convcode *ce, unsigned int max_states,
+			  unsigned int threshold,
+			  unsigned int max_decode_len_bits)
+{
+    convcode_os_funcs *o = ce->o;
+    unsigned int size = 0;
+
+    /* The same size alloc_convcode() gives the trellis. */
+    if (max_decode_len_bits)
+	size = max_decode_len_bits + ce->k * ce->num_polys;
+    else if (!ce->trellis_size)
+	return 1;
+    if (max_states == 0 || max_states > ce->num_states)
+	max_states = ce->num_states;
+
+    /* The memory depends on the sizes, so get it again if they change. */
+    if (o && (max_states != ce->reduced_max_states ||
+	      size != ce->reduced_size)) {
+	if (ce->reduced_paths)
+	    o->free(o, ce->reduced_paths);
+	if (ce->reduced_work)
+	    o->free(o, ce->reduced_work);
+	ce->reduced_paths = NULL;
+	ce->reduced_work = NULL;
+    }
+    ce->reduced_max_states = max_states;
+    ce->reduced_threshold = threshold;
+    ce->reduced_size = size;
+    return 0;
+}
+
+static int
+alloc_reduced(struct convcode *ce)
+{
+    convcode_os_funcs *o = ce->o;
+
+    if (ce->reduced_paths && ce->reduced_work)
+	return 0;
+    if (!o)
+	return 1;
+
+    if (!ce->reduced_paths) {
+	ce->reduced_paths = o->zalloc(o, sizeof(*ce->reduced_paths) *
+				      reduced_symbols(ce) *
+				      ce->reduced_max_states);
+	if (!ce->reduced_paths)
+	    return 1;
+    }
+    if (!ce->reduced_work) {
+	ce->reduced_work = o->zalloc(o, sizeof(*ce->reduced_work) *
+				     (ce->num_states +
+				      10 * ce->reduced_max_states));
+	if (!ce->reduced_work)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return the kth smallest (starting at 0) of the n values, which are
+ * rearranged.  This is the usual quickselect.
+ */
+static uint32_t
+select_kth(uint32_t *v, unsigned int n, unsigned int kth)
+{
+    int lo = 0, hi = n - 1, i, j;
+    uint32_t pivot, tmp;
+
+    while (lo < hi) {
+	pivot = v[lo + (hi - lo) / 2];
+	for (i = lo, j = hi; i <= j; i++, j--) {
+	    while (v[i] < pivot)
+		i++;
+	    while (v[j] > pivot)
+		j--;
+	    if (i > j)
+		break;
+	    tmp = v[i];
+	    v[i] = v[j];
+	    v[j] = tmp;
+	}
+	if ((int) kth <= j)
+	    hi = j;
+	else if ((int) kth >= i)
+	    lo = i;
+	else
+	    break;
+    }
+    return v[kth];
+}
+
+int
+convdecode_reduced(struct convcode *ce, const unsigned char *bytes,
+		   unsigned int nbits, const uint8_t *uncertainty,
+		   unsigned char *outbytes, unsigned int *num_errs)
+{
+    unsigned int nsym = block_symbols(ce, nbits), nout = nsym;
+    unsigned int m = ce->reduced_max_states, nsurv, ncand, nkeep, nties;
+    unsigned int base, delta[CONVCODE_MAX_POLYNOMIALS];
+    unsigned int i, j, t, bit, ninputs, offset = 0;
+    uint32_t *slot, *surv_state, *surv_metric;
+    uint32_t *cand_state, *cand_metric, *cand_from, *scratch;
+    uint32_t best, limit, dist;
+    convcode_state state, nstate;
+    uint16_t *paths;
+
+    if (!reduced_symbols(ce) || !m)
+	return 1;
+    /* The same limit decode_bits() has. */
+    if (nsym && nsym - 1 + ce->num_polys > reduced_symbols(ce))
+	return 1;
+    if (alloc_reduced(ce))
+	return 1;
+    if (ce->do_tail)
+	nout = nsym > ce->k - 1 ? nsym - (ce->k - 1) : 0;
+
+    paths = ce->reduced_paths;
+
+    /*
+     * slot is the candidate for each state in the next symbol, so two
+     * paths going to the same state can be merged like Viterbi does.
+     * It's UINT32_MAX for states that have no candidate.
+     */
+    slot = ce->reduced_work;
+    surv_state = slot + ce->num_states;
+    surv_metric = surv_state + m;
+    cand_state = surv_metric + m;
+    cand_metric = cand_state + 2 * m;
+    cand_from = cand_metric + 2 * m;
+    scratch = cand_from + 2 * m;
+    for (i = 0; i < ce->num_states; i++)
+	slot[i] = UINT32_MAX;
+
+    surv_state[0] = CONVCODE_DEFAULT_START_STATE;
+    surv_metric[0] = 0;
+    nsurv = 1;
+    for (t = 0; t < nsym; t++) {
+	base = llr_symbol_costs(ce, bytes, uncertainty, t, delta);
+
+	/* Extend all the survivors, in the tail only an input of 0. */
+	ninputs = t < nout ? 2 : 1;
+	ncand = 0;
+	for (i = 0; i < nsurv; i++) {
+	    state = surv_state[i];
+	    for (bit = 0; bit < ninputs; bit++) {
+		nstate = ce->next_state[bit][state];
+		dist = surv_metric[i] + llr_metric(ce, base, delta,
+						   ce->convert[bit][state]);
+		j = slot[nstate];
+		if (j == UINT32_MAX) {
+		    j = ncand++;
+		    slot[nstate] = j;
+		    cand_state[j] = nstate;
+		} else if (dist >= cand_metric[j]) {
+		    continue;
+		}
+		cand_metric[j] = dist;
+		cand_from[j] = (i << 1) | bit;
+	    }
+	}
+
+	best = UINT32_MAX;
+	for (j = 0; j < ncand; j++) {
+	    slot[cand_state[j]] = UINT32_MAX;
+	    if (cand_metric[j] < best)
+		best = cand_metric[j];
+	}
+
+	/*
+	 * Only keep the ones within the threshold of the best, and if
+	 * there are more than m of those, the best m.  That is the ones
+	 * less than the mth best value and enough of the ones equal to
+	 * it to make m.
+	 */
+	limit = UINT32_MAX;
+	if (ce->reduced_threshold)
+	    limit = best + ce->reduced_threshold;
+	nkeep = 0;
+	for (j = 0; j < ncand; j++) {
+	    if (cand_metric[j] <= limit)
+		scratch[nkeep++] = cand_metric[j];
+	}
+	nties = nkeep;
+	if (nkeep > m) {
+	    limit = select_kth(scratch, nkeep, m - 1);
+	    nties = m;
+	    for (j = 0; j < ncand; j++) {
+		if (cand_metric[j] < limit)
+		    nties--;
+	    }
+	}
+
+	nsurv = 0;
+	for (j = 0; j < ncand; j++) {
+	    if (cand_metric[j] > limit)
+		continue;
+	    if (cand_metric[j] == limit) {
+		if (!nties)
+		    continue;
+		nties--;
+	    }
+	    surv_state[nsurv] = cand_state[j];
+	    surv_metric[nsurv] = cand_metric[j] - best;
+	    paths[t * m + nsurv] = cand_from[j];
+	    nsurv++;
+	}
+	offset += best;
+    }
+
+    /* The survivors are relative to the best one, find it. */
+    for (i = 0; nsym && surv_metric[i] != 0; i++)
+	;
+    if (num_errs)
+	*num_errs = offset;
+
+    for (t = nsym; t > 0; ) {
+	t--;
+	bit = paths[t * m + i];
+	if (t < nout) {
+	    if (bit & 1)
+		outbytes[t / 8] |= 1 << (t % 8);
+	    else
+		outbytes[t / 8] &= ~(1 << (t % 8));
+	}
+	i = bit >> 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Lay out the arrays of a turbo coder after it in mem, see
+ * layout_array().  Returns the total size.
+ */
+static unsigned long
+layout_turbo(struct convcode_turbo *t, unsigned char *mem, unsigned int n,
+	     unsigned int num_polys, unsigned int num_states)
+{
+    unsigned long pos = align_size(sizeof(*t));
+    unsigned int i, nbytes = n / 8 + 1;
+
+    t->interleaver = layout_array(mem, &pos, sizeof(*t->interleaver) * n);
+    t->interleaved = layout_array(mem, &pos, nbytes);
+    for (i = 0; i < 2; i++) {
+	t->enc[i] = layout_array(mem, &pos, (n * num_polys) / 8 + 1);
+	t->sys[i] = layout_array(mem, &pos, sizeof(int32_t) * n);
+	t->parity[i] = layout_array(mem, &pos, sizeof(int32_t) * n *
+				    (num_polys - 1));
+	t->apriori[i] = layout_array(mem, &pos, sizeof(int32_t) * n);
+	t->extrinsic[i] = layout_array(mem, &pos, sizeof(int32_t) * n);
+	t->beta[i] = layout_array(mem, &pos, sizeof(int32_t) * num_states);
+	t->hard[i] = layout_array(mem, &pos, nbytes);
+    }
+    t->llrs = layout_array(mem, &pos, sizeof(int32_t) * n);
+    t->alpha = layout_array(mem, &pos, sizeof(int32_t) * (n + 1) * num_states);
+    return pos;
+}
+
+struct convcode_turbo *
+alloc_convcode_turbo(convcode_os_funcs *o, unsigned int k,
+		     convcode_state *polynomials, unsigned int num_polynomials,
+		     unsigned int block_bits, const unsigned int *interleaver)
+{
+    struct convcode_turbo scratch, *t;
+    struct convcode_code *code;
+    unsigned int i, j, n = block_bits, num_states;
+    void *alloc_mem;
+
+    if (num_polynomials < 2 ||
+	num_polynomials > CONVCODE_TURBO_MAX_POLYNOMIALS ||
+	k < 2 || k > CONVCODE_MAX_K || n == 0)
+	return NULL;
+    num_states = 1 << (k - 1);
+
+    t = alloc_aligned(o, layout_turbo(&scratch, NULL, n, num_polynomials,
+				      num_states), &alloc_mem);
+    if (!t)
+	return NULL;
+    layout_turbo(t, (unsigned char *) t, n, num_polynomials, num_states);
+    t->o = o;
+    t->alloc_mem = alloc_mem;
+    t->block_bits = n;
+    t->num_polys = num_polynomials;
+
+    /* Make sure it's a permutation, using hard[0] as scratch. */
+    memset(t->hard[0], 0, n / 8 + 1);
+    for (i = 0; i < n; i++) {
+	j = interleaver[i];
+	if (j >= n || (t->hard[0][j / 8] >> (j % 8)) & 1)
+	    goto out_err;
+	t->hard[0][j / 8] |= 1 << (j % 8);
+	t->interleaver[i] = j;
+    }
+
+    code = alloc_convcode_code(o, k, polynomials, num_polynomials, true);
+    if (!code)
+	goto out_err;
+    for (i = 0; i < 2; i++) {
+	t->coder[i] = alloc_convcode_from_code(o, code, 0, false,
+					       NULL, NULL, NULL, NULL);
+	if (!t->coder[i])
+	    break;
+    }
+    /* The coders have their own references. */
+    free_convcode_code(code);
+    if (i < 2)
+	goto out_err;
+    return t;
+
+ out_err:
+    free_convcode_turbo(t);
+    return NULL;
+}
+
+void
+free_convcode_turbo(struct convcode_turbo *t)
+{
+    convcode_os_funcs *o = t->o;
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+	if (t->coder[i])
+	    free_convcode(t->coder[i]);
+    }
+    o->free(o, t->alloc_mem);
+}
+
+void
+set_turbo_check(struct convcode_turbo *t, convcode_turbo_check check,
+		void *check_data)
+{
+    t->check = check;
+    t->check_data = check_data;
+}
+
+void
+convencode_turbo(struct convcode_turbo *t, const unsigned char *bytes,
+		 unsigned char *outbytes)
+{
+    unsigned int n = t->block_bits, np = t->num_polys, nout = 2 * np - 1;
+    unsigned int i, j, v;
+
+    memset(t->interleaved, 0, n / 8 + 1);
+    for (i = 0; i < n; i++) {
+	j = t->interleaver[i];
+	t->interleaved[i / 8] |= ((bytes[j / 8] >> (j % 8)) & 1) << (i % 8);
+    }
+    for (i = 0; i < 2; i++) {
+	memset(t->enc[i], 0, (n * np) / 8 + 1);
+	reinit_convencode(t->coder[i], CONVCODE_DEFAULT_START_STATE);
+	convencode_block(t->coder[i], i ? t->interleaved : bytes, n,
+			 t->enc[i]);
+    }
+
+    /* The second coder's first output is the interleaved data, skip it. */
+    memset(outbytes, 0, (n * nout + 7) / 8);
+    for (i = 0; i < n; i++) {
+	v = extract_bits(t->enc[0], i * np, np);
+	v |= (extract_bits(t->enc[1], i * np, np) >> 1) << np;
+	for (j = 0; j < nout; j++) {
+	    if ((v >> j) & 1)
+		outbytes[(i * nout + j) / 8] |= 1 << ((i * nout + j) % 8);
+	}
+    }
+}
+
+/*
+ * An impossible path value, and how big the extrinsic information is
+ * allowed to get, small enough that adding them all up can't
+ * overflow.
+ */
+#define TURBO_UNREACHABLE (INT32_MAX / 4)
+#define TURBO_MAX_EXTRINSIC (1 << 20)
+
+static void
+turbo_renormalize(int32_t *values, unsigned int num_states)
+{
+    unsigned int i;
+    int32_t min = values[0];
+
+    for (i = 1; i < num_states; i++) {
+	if (values[i] < min)
+	    min = values[i];
+    }
+    for (i = 0; i < num_states; i++)
+	values[i] -= min;
+}
+
+/*
+ * Set up the cost of each encoded output value for bit n of the given
+ * coder.  The first output bit is the data bit, the information about
+ * it is the received value plus the a-priori information.
+ */
+static void
+turbo_branch_costs(struct convcode_turbo *t, unsigned int c, unsigned int n,
+		   int32_t *costs)
+{
+    unsigned int i, j, np = t->num_polys;
+    const int32_t *parity = t->parity[c] + n * (np - 1);
+
+    costs[0] = 0;
+    costs[1] = t->sys[c][n] + t->apriori[c][n];
+    for (j = 1; j < np; j++) {
+	for (i = 0; i < 1U << j; i++)
+	    costs[(1 << j) + i] = costs[i] + parity[j - 1];
+    }
+}
+
+/*
+ * Max-Log-MAP over one of the coders, like convdecode_llr(), but with
+ * a-priori information for each bit and saving the extrinsic
+ * information, what this coder found beyond what it was given.  The
+ * end state is unknown.
+ */
+static void
+turbo_siso(struct convcode_turbo *t, unsigned int c)
+{
+    struct convcode *ce = t->coder[c];
+    unsigned int n = t->block_bits, num_states = ce->num_states;
+    unsigned int i, j, bit;
+    int32_t costs[1 << CONVCODE_TURBO_MAX_POLYNOMIALS];
+    int32_t *alpha = t->alpha, *beta = t->beta[0], *nbeta = t->beta[1];
+    int32_t *tmp, dist, min[2], ext;
+
+    for (i = 0; i < num_states; i++)
+	alpha[i] = TURBO_UNREACHABLE;
+    alpha[CONVCODE_DEFAULT_START_STATE] = 0;
+    for (j = 0; j < n; j++) {
+	const int32_t *calpha = t->alpha + j * num_states;
+	int32_t *nalpha = t->alpha + (j + 1) * num_states;
+
+	turbo_branch_costs(t, c, j, costs);
+	for (i = 0; i < num_states; i++)
+	    nalpha[i] = TURBO_UNREACHABLE;
+	for (i = 0; i < num_states; i++) {
+	    for (bit = 0; bit < 2; bit++) {
+		convcode_state nstate = ce->next_state[bit][i];
+
+		dist = calpha[i] + costs[ce->convert[bit][i]];
+		if (dist < nalpha[nstate])
+		    nalpha[nstate] = dist;
+	    }
+	}
+	turbo_renormalize(nalpha, num_states);
+    }
+
+    for (i = 0; i < num_states; i++)
+	nbeta[i] = 0;
+    for (j = n; j > 0; ) {
+	j--;
+	alpha = t->alpha + j * num_states;
+	turbo_branch_costs(t, c, j, costs);
+	min[0] = min[1] = INT32_MAX;
+	for (i = 0; i < num_states; i++) {
+	    beta[i] = TURBO_UNREACHABLE;
+	    for (bit = 0; bit < 2; bit++) {
+		dist = costs[ce->convert[bit][i]] +
+		    nbeta[ce->next_state[bit][i]];
+		if (dist < beta[i])
+		    beta[i] = dist;
+		if (alpha[i] + dist < min[bit])
+		    min[bit] = alpha[i] + dist;
+	    }
+	}
+	t->llrs[j] = min[1] - min[0];
+
+	/*
+	 * Max-Log-MAP is overconfident, the usual fix is to scale the
+	 * extrinsic information down by 3/4.
+	 */
+	ext = t->llrs[j] - t->sys[c][j] - t->apriori[c][j];
+	ext = ext * 3 / 4;
+	if (ext > TURBO_MAX_EXTRINSIC)
+	    ext = TURBO_MAX_EXTRINSIC;
+	else if (ext < -TURBO_MAX_EXTRINSIC)
+	    ext = -TURBO_MAX_EXTRINSIC;
+	t->extrinsic[c][j] = ext;
+
+	turbo_renormalize(beta, num_states);
+	tmp = beta;
+	beta = nbeta;
+	nbeta = tmp;
+    }
+}
+
+int
+convdecode_turbo(struct convcode_turbo *t, const int8_t *llrs,
+		 unsigned char *outbytes, int32_t *out_llrs,
+		 unsigned int max_iterations, unsigned int *iterations)
+{
+    unsigned int n = t->block_bits, np = t->num_polys, nout = 2 * np - 1;
+    unsigned int nbytes = n / 8 + 1, i, j, iter;
+    unsigned char *hard = t->hard[0], *prev = t->hard[1], *tmp;
+    const int8_t *l;
+    int rv = t->check ? 1 : 0;
+
+    if (max_iterations == 0)
+	max_iterations = CONVCODE_DEFAULT_TURBO_ITERATIONS;
+
+    /*
+     * Convert the LLRs to costs the way convdecode_data_llr() does,
+     * the difference between expecting a 1 and a 0 is twice the LLR.
+     */
+    for (i = 0; i < n; i++) {
+	l = llrs + i * nout;
+	t->sys[0][i] = 2 * (l[0] == -128 ? -127 : l[0]);
+	for (j = 1; j < np; j++) {
+	    t->parity[0][i * (np - 1) + j - 1] =
+		2 * (l[j] == -128 ? -127 : l[j]);
+	    t->parity[1][i * (np - 1) + j - 1] =
+		2 * (l[np + j - 1] == -128 ? -127 : l[np + j - 1]);
+	}
+	t->apriori[0][i] = 0;
+    }
+    for (i = 0; i < n; i++)
+	t->sys[1][i] = t->sys[0][t->interleaver[i]];
+
+    for (iter = 1; ; iter++) {
+	turbo_siso(t, 0);
+	for (i = 0; i < n; i++)
+	    t->apriori[1][i] = t->extrinsic[0][t->interleaver[i]];
+	turbo_siso(t, 1);
+
+	memset(hard, 0, nbytes);
+	for (i = 0; i < n; i++) {
+	    j = t->interleaver[i];
+	    t->apriori[0][j] = t->extrinsic[1][i];
+	    if (t->llrs[i] < 0)
+		hard[j / 8] |= 1 << (j % 8);
+	    if (out_llrs)
+		out_llrs[j] = t->llrs[i];
+	}
+
+	if (t->check && t->check(t->check_data, hard, n)) {
+	    rv = 0;
+	    break;
+	}
+	if (iter == max_iterations)
+	    break;
+	if (iter > 1 && memcmp(hard, prev, nbytes) == 0)
+	    break;
+	tmp = hard;
+	hard = prev;
+	prev = tmp;
+    }
+
+    memcpy(outbytes, hard, (n + 7) / 8);
+    if (iterations)
+	*iterations = iter;
+    return rv;
+}
+
+#ifdef CONVCODE_TESTS
+
+/*
+ * Test code.
+ *
+ * Compile and run with -t to run tests.
+ *
+ * To supply your own input and output, run as:
+ *
+ * ./convcode [-t] [-x] [-s start state] [-i init_val]
+ *        -p <poly1> [ -p <poly2> ... ] k <bits>
+ *
+ * where bits is a sequence of 0 or 1.  The -x option disables the
+ * "tail" of the encoder and expectation of the tail in the decoder.
+ * (see the convcode.h file about do_tail).  -x works with -t to run
+ * the tests that way.  Otherwise, no other options have an effect
+ * with -t.
+ *
+ * The -s and -i options set the start state of the encoder/decoder,
+ * and for decoding the init value for the probability matrix for
+ * values besides the start state.  See the discussion on tails in
+ * convcode.h for detail.
+ *
+ * To process files instead, run as:
+ *
+ * ./convcode [-d] [-x] [-s start state] [-i init_val] [-n nbits]
+ *        [-D depth] [-w window] -f <infile> | -l <llrfile>
+ *        [-o <outfile>] -p <poly1> [ -p <poly2> ... ] k
+ *
+ * The input file is packed bits, low bit first, the same format the
+ * library uses, and the output is written to outfile (or stdout) the
+ * same way.  -n limits the input to nbits, for data that doesn't end
+ * on a byte boundary.  For decoding, -l gives a file of signed 8-bit
+ * LLRs, one per received bit (see convdecode_data_llr()), instead.
+ * The files are mapped and fed to the library in big chunks, and
+ * decoding is done in streaming mode with a traceback depth of depth
+ * (default 5 * k) and a window of window (default 8 * depth)
+ * symbols, so files of any size can be handled.  The bit counts,
+ * time and throughput are printed to stderr at the end.
+ *
+ * For instance, to decode some data with the Voyager coder, do:
+ *
+ * $ ./convcode -p 0171 -p 0133 7 00110011
+ *   0000111010000000111111100111
+ *   bits = 28
+ *
+ * To then decode that data, do:
+ *
+ * $ ./convcode -p 0171 -p 0133 -d 7 0000111010000000111111100111
+ *   00110011
+ *   errors = 0
+ *   bits = 8
+ *
+ * The tests themselves are stolen from
+ * https://github.com/xukmin/viterbi.git
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "convcode_sched.h"
+
+static int
+handle_output(struct convcode *ce, void *output_data, unsigned char byte,
+	      unsigned int nbits)
+{
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++) {
+	if (byte & 1)
+	    printf("1");
+	else
+	    printf("0");
+	byte >>= 1;
+    }
+    return 0;
+}
+
+static void
+do_encode_data(struct convcode *ce, const char *input, unsigned int *total_bits)
+{
+    unsigned int i, nbits;
+    unsigned char byte = 0;
+
+    for (i = 0, nbits = 0; input[i]; i++) {
+	if (input[i] == '1')
+	    byte |= 1 << nbits;
+	nbits++;
+	if (nbits == 8) {
+	    convencode_data(ce, &byte, 8);
+	    nbits = 0;
+	    byte = 0;
+	}
+    }
+    if (nbits > 0)
+	convencode_data(ce, &byte, nbits);
+    convencode_finish(ce, total_bits);
+}
+
+static void
+do_decode_data(struct convcode *ce, const char *input, unsigned int *total_bits,
+	       unsigned int *num_errs, uint8_t *uncertainty)
+{
+    unsigned int i, nbits;
+    unsigned char byte = 0;
+
+    for (i = 0, nbits = 0; input[i]; i++) {
+	if (input[i] == '1')
+	    byte |= 1 << nbits;
+	nbits++;
+	if (nbits == 8) {
+	    convdecode_data(ce, &byte, 8, uncertainty);
+	    nbits = 0;
+	    byte = 0;
+	    if (uncertainty)
+		uncertainty += 8;
+	}
+    }
+    if (nbits > 0)
+	convdecode_data(ce, &byte, nbits, uncertainty);
+    convdecode_finish(ce, total_bits, num_errs);
+}
+
+/*
+ * File mode: the input comes from a file, packed bits low bit first
+ * like the library uses, or int8 LLRs for decoding, and the output
+ * goes to a file, packed the same way.  The input is mapped, not
+ * read, and handed to the library in big chunks straight from the
+ * mapping, and the output is written straight from the library's
+ * output buffer.  Decoding is done in streaming mode, so the files
+ * can be of any size.
+ */
+#define FILE_CHUNK_BYTES (1 << 20)
+#define FILE_OUTBUF_SIZE (1 << 20)
+
+struct file_output {
+    int fd;
+    uint64_t nbits;
+};
+
+static int
+handle_file_output(struct convcode *ce, void *user_data,
+		   unsigned char *buf, unsigned int nbits)
+{
+    struct file_output *f = user_data;
+    size_t left = (nbits + 7) / 8;
+    ssize_t rv;
+
+    while (left > 0) {
+	rv = write(f->fd, buf, left);
+	if (rv < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("write");
+	    return 1;
+	}
+	buf += rv;
+	left -= rv;
+    }
+    f->nbits += nbits;
+    return 0;
+}
+
+static const unsigned char *
+map_file(const char *name, size_t *size)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1) {
+	fprintf(stderr, "Unable to open %s: %s\n", name, strerror(errno));
+	return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+	fprintf(stderr, "Unable to stat %s: %s\n", name, strerror(errno));
+	close(fd);
+	return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+	/* Can't map nothing, but there's nothing to read, either. */
+	close(fd);
+	return (const unsigned char *) "";
+    }
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+	fprintf(stderr, "Unable to map %s: %s\n", name, strerror(errno));
+	return NULL;
+    }
+    madvise(p, *size, MADV_SEQUENTIAL);
+    return p;
+}
+
+static double
+file_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Encode or decode infile (or the LLRs in llrfile) into outfile, or
+ * stdout if outfile is NULL.  nbits limits the number of input bits if
+ * it is not 0, for packed input that doesn't end on a byte.  The
+ * coder must have been allocated with an output buffer and, for
+ * decoding, a traceback depth.
+ */
+static int
+process_file(struct convcode *ce, bool decode, const char *infile,
+	     const char *llrfile, const char *outfile, uint64_t nbits)
+{
+    const unsigned char *in;
+    size_t size, pos, chunk;
+    uint64_t in_bits;
+    unsigned int total_bits, num_errs = 0;
+    struct file_output f = { .fd = 1 };
+    unsigned char *outbuf = NULL;
+    double start, secs;
+    int rv = 1;
+
+    in = map_file(llrfile ? llrfile : infile, &size);
+    if (!in)
+	return 1;
+    in_bits = llrfile ? size : (uint64_t) size * 8;
+    if (nbits && nbits < in_bits)
+	in_bits = nbits;
+
+    if (outfile) {
+	f.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (f.fd == -1) {
+	    fprintf(stderr, "Unable to open %s: %s\n", outfile,
+		    strerror(errno));
+	    goto out;
+	}
+    }
+
+    outbuf = malloc(FILE_OUTBUF_SIZE);
+    if (!outbuf) {
+	fprintf(stderr, "Out of memory\n");
+	goto out;
+    }
+    if (decode)
+	set_decode_output_buffer(ce, outbuf, FILE_OUTBUF_SIZE,
+				 handle_file_output, &f);
+    else
+	set_encode_output_buffer(ce, outbuf, FILE_OUTBUF_SIZE,
+				 handle_file_output, &f);
+
+    start = file_now();
+    for (pos = 0; pos < in_bits; pos += chunk) {
+	chunk = in_bits - pos;
+	if (llrfile) {
+	    if (chunk > FILE_CHUNK_BYTES)
+		chunk = FILE_CHUNK_BYTES;
+	    if (convdecode_data_llr(ce, (const int8_t *) in + pos, chunk))
+		goto out;
+	} else {
+	    if (chunk > FILE_CHUNK_BYTES * 8)
+		chunk = FILE_CHUNK_BYTES * 8;
+	    if (decode) {
+		if (convdecode_data(ce, in + pos / 8, chunk, NULL))
+		    goto out;
+	    } else {
+		if (convencode_data(ce, in + pos / 8, chunk))
+		    goto out;
+	    }
+	}
+    }
+    if (decode) {
+	if (convdecode_finish(ce, &total_bits, &num_errs))
+	    goto out;
+    } else {
+	if (convencode_finish(ce, &total_bits))
+	    goto out;
+    }
+    secs = file_now() - start;
+
+    if (decode)
+	fprintf(stderr, "  errors = %u\n", num_errs);
+    fprintf(stderr, "  in bits = %llu\n  out bits = %llu\n",
+	    (unsigned long long) in_bits, (unsigned long long) f.nbits);
+    fprintf(stderr, "  %.3f seconds, %.2f Mbit/s in, %.2f Mbit/s out\n",
+	    secs, secs > 0 ? in_bits / secs / 1e6 : 0.0,
+	    secs > 0 ? f.nbits / secs / 1e6 : 0.0);
+    rv = 0;
+
+ out:
+    if (rv)
+	fprintf(stderr, "Error processing the data\n");
+    free(outbuf);
+    if (outfile && f.fd != -1)
+	close(f.fd);
+    if (size)
+	munmap((void *) in, size);
+    return rv;
+}
+
+struct test_data {
+    char output[1024];
+    unsigned char enc_bytes[1024];
+    unsigned char dec_bytes[1024];
+    unsigned int uncertainties[1024];
+    unsigned int outpos;
+};
+
+static int
+handle_test_output(struct convcode *ce, void *output_data, unsigned char byte,
+		   unsigned int nbits)
+{
+    struct test_data *t = output_data;
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++) {
+	assert(t->outpos < sizeof(t->output) - 1);
+	if (byte & 1)
+	    t->output[t->outpos++] = '1';
+	else
+	    t->output[t->outpos++] = '0';
+	byte >>= 1;
+    }
+    return 0;
+}
+
+static unsigned int
+run_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	 bool do_tail, const char *encoded, const char *decoded,
+	 unsigned int expected_errs, uint8_t *uncertainty,
+	 unsigned int *out_uncertainties)
+{
+    struct test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 128,
+					 do_tail, false,
+					 handle_test_output, &t,
+					 handle_test_output, &t);
     unsigned int i, enc_nbits, dec_nbits, num_errs, rv = 0;
 
-    printf("Test k=%u err=%u polys={ 0%o", k, expected_errs, polys[0]);
+    printf("Test k=%u err=%u polys={ 0%o", k, expected_errs, polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+    t.outpos = 0;
+    if (expected_errs == 0) {
+	do_encode_data(ce, decoded, &enc_nbits);
+	t.output[t.outpos] = '\0';
+	if (strcmp(encoded, t.output) != 0) {
+	    printf("  encode failure, expected\n    %s\n  got\n    %s\n",
+		   encoded, t.output);
+	    rv = 1;
+	    goto out;
+	}
+	if (enc_nbits != strlen(encoded)) {
+	    printf("  encode failure, got %u output bits, expected %u\n",
+		   enc_nbits, (unsigned int) strlen(encoded));
+	    rv++;
+	}
+	t.outpos = 0;
+    }
+    do_decode_data(ce, encoded, &dec_nbits, &num_errs, uncertainty);
+    t.output[t.outpos] = '\0';
+    if (strcmp(decoded, t.output) != 0) {
+	printf("  decode failure, expected\n    %s\n  got\n    %s\n",
+	       decoded, t.output);
+	rv++;
+    }
+    if (num_errs != expected_errs) {
+	printf("  decode failure, got %u errors, expected %u\n",
+	       num_errs, expected_errs);
+	rv++;
+    }
+    if (dec_nbits != strlen(decoded)) {
+	printf("  decode failure, got %u output bits, expected %u\n",
+	       dec_nbits, (unsigned int) strlen(decoded));
+	rv++;
+    }
+    if (rv)
+	goto out;
+
+    reinit_convcode(ce);
+    memset(t.enc_bytes, 0, sizeof(t.enc_bytes));
+    if (expected_errs == 0) {
+	memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
+	for (i = 0, dec_nbits = 0; decoded[i]; i++, dec_nbits++) {
+	    unsigned int bit = decoded[i] == '0' ? 0 : 1;
+	    t.dec_bytes[i / 8] |= bit << (i % 8);
+	}
+	enc_nbits = dec_nbits;
+	if (do_tail)
+	    enc_nbits += k - 1;
+	enc_nbits *= npolys;
+
+	convencode_block(ce, t.dec_bytes, dec_nbits, t.enc_bytes);
+	for (i = 0; i < enc_nbits; i++) {
+	    unsigned int bit = encoded[i] == '0' ? 0 : 1;
+
+	    if (((t.enc_bytes[i / 8] >> (i % 8)) & 1) != bit) {
+		printf("  block encode failure at bit %u\n", i);
+		rv++;
+		goto out;
+	    }
+	}
+    } else {
+	for (i = 0, enc_nbits = 0; encoded[i]; i++, enc_nbits++) {
+	    unsigned int bit = encoded[i] == '0' ? 0 : 1;
+	    t.enc_bytes[i / 8] |= bit << (i % 8);
+	}
+    }
+
+    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
+    if (convdecode_block(ce, t.enc_bytes, enc_nbits, uncertainty,
+			 t.dec_bytes, t.uncertainties, &num_errs)) {
+	printf("  block decode error return\n");
+	rv++;
+	goto out;
+    }
+    if (num_errs != expected_errs) {
+	printf("  decode failure, got %u errors, expected %u\n",
+	       num_errs, expected_errs);
+	rv++;
+    }
+    for (i = 0; i < dec_nbits; i++) {
+	unsigned int bit = decoded[i] == '0' ? 0 : 1;
+
+	if (((t.dec_bytes[i / 8] >> (i % 8)) & 1) != bit) {
+	    printf("  block decode failure at bit %u\n", i);
+	    rv++;
+	    goto out;
+	}
+	if (out_uncertainties && (t.uncertainties[i] != out_uncertainties[i])) {
+	    printf("  block decode invalid uncertainty at bit %u\n", i);
+	    rv++;
+	    goto out;
+	}
+    }
+
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+static unsigned int
+rand_block_test(struct convcode *ce,
+		const char *encoded, const char *decoded)
+{
+    struct test_data t;
+    unsigned int i, dec_nbits, enc_nbits;
+    unsigned int rv;
+
+    reinit_convcode(ce);
+    memset(t.enc_bytes, 0, sizeof(t.enc_bytes));
+    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
+    for (i = 0, dec_nbits = 0; decoded[i]; i++, dec_nbits++) {
+	unsigned int bit = decoded[i] == '0' ? 0 : 1;
+	t.dec_bytes[i / 8] |= bit << (i % 8);
+    }
+    enc_nbits = dec_nbits;
+    if (ce->do_tail)
+	enc_nbits += ce->k - 1;
+    enc_nbits *= ce->num_polys;
+
+    convencode_block(ce, t.dec_bytes, dec_nbits, t.enc_bytes);
+    for (i = 0; i < enc_nbits; i++) {
+	unsigned int bit = encoded[i] == '0' ? 0 : 1;
+
+	if (((t.enc_bytes[i / 8] >> (i % 8)) & 1) != bit) {
+	    printf("  block encode failure at bit %u\n", i);
+	    rv++;
+	    goto out;
+	}
+    }
+
+    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
+    if (convdecode_block(ce, t.enc_bytes, enc_nbits, NULL,
+			 t.dec_bytes, NULL, NULL)) {
+	printf("  block decode error return\n");
+	rv++;
+	goto out;
+    }
+    for (i = 0; i < dec_nbits; i++) {
+	unsigned int bit = decoded[i] == '0' ? 0 : 1;
+
+	if (((t.dec_bytes[i / 8] >> (i % 8)) & 1) != bit) {
+	    printf("  block decode failure at bit %u\n", i);
+	    rv++;
+	    goto out;
+	}
+    }
+ out:
+    return rv;
+}
+
+static unsigned int
+rand_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	  bool do_tail, bool recursive)
+{
+    struct test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 128,
+					 do_tail, recursive,
+					 handle_test_output, &t,
+					 handle_test_output, &t);
+    unsigned int i, j, bit, total_bits, num_errs, rv = 0;
+    char decoded[33];
+    char encoded[1024];
+
+    if (recursive)
+	set_encode_output_per_symbol(ce, true);
+
+    printf("Random test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    for (i = 8; i < 32; i++) {
+	for (j = 0; j < 10; j++) {
+	    for (bit = 0; bit < i; bit++)
+		decoded[bit] = rand() & 1 ? '1' : '0';
+	    decoded[bit] = 0;
+	    t.outpos = 0;
+	    reinit_convcode(ce);
+	    do_encode_data(ce, decoded, &total_bits);
+	    memcpy(encoded, t.output, t.outpos);
+	    encoded[t.outpos] = '\0';
+	    t.outpos = 0;
+	    do_decode_data(ce, encoded, &total_bits, &num_errs, NULL);
+	    t.output[t.outpos] = '\0';
+	    if (strcmp(t.output, decoded) != 0) {
+		printf("  decode failure, expected\n    %s\n  got\n    %s\n",
+		       decoded, t.output);
+		rv++;
+	    }
+	    rv += rand_block_test(ce, encoded, decoded);
+	}
+    }
+    free_convcode(ce);
+    return rv;
+}
+
+/*
+ * Decode random data with random errors and uncertainties with every
+ * available decode kernel and path value width and make sure they
+ * all match the scalar one.  The narrow widths should match 32 bits
+ * exactly unless the path values can saturate, which can happen with
+ * 8 bits; then compare with the scalar kernel at that width.
+ */
+static unsigned int
+kernel_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail, bool recursive)
+{
+    static const enum convcode_kernel kernels[] = {
+	CONVCODE_KERNEL_SCALAR, CONVCODE_KERNEL_SSE41, CONVCODE_KERNEL_AVX2,
+	CONVCODE_KERNEL_AVX512, CONVCODE_KERNEL_NEON
+    };
+    static const char *kernel_names[] = {
+	"scalar", "sse4.1", "avx2", "avx512", "neon"
+    };
+    static const unsigned int widths[] = { 32, 16, 8 };
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 2048,
+					 do_tail, recursive,
+					 NULL, NULL, NULL, NULL);
+    unsigned char dec_bytes[32], enc_bytes[256];
+    unsigned char exp_bytes[32], out_bytes[32];
+    unsigned int exp_uncertainties[256], out_uncertainties[256];
+    uint8_t uncertainties[2048];
+    unsigned int i, j, w, pass, nbits, enc_nbits, rv = 0;
+    unsigned int exp_errs, num_errs;
+    bool exact;
+
+    printf("Kernel test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }:");
+
+    for (w = 0; w < sizeof(widths) / sizeof(*widths); w++) {
+	printf(" %u:", widths[w]);
+	for (i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+	    set_decode_metric_width(ce, widths[w]);
+	    if (set_decode_kernel(ce, kernels[i]))
+		continue;
+	    printf(" %s", kernel_names[i]);
+	    for (pass = 0; pass < 20; pass++) {
+		const uint8_t *u = (pass & 1) ? uncertainties : NULL;
+
+		exact = widths[w] != 8 || (!u && (k - 1) * npolys < 64);
+
+		nbits = 8 + rand() % 150;
+		memset(dec_bytes, 0, sizeof(dec_bytes));
+		for (j = 0; j < nbits; j++)
+		    dec_bytes[j / 8] |= (rand() & 1) << (j % 8);
+		enc_nbits = nbits;
+		if (do_tail)
+		    enc_nbits += k - 1;
+		enc_nbits *= npolys;
+
+		memset(enc_bytes, 0, sizeof(enc_bytes));
+		reinit_convcode(ce);
+		convencode_block(ce, dec_bytes, nbits, enc_bytes);
+		for (j = 0; j < enc_nbits; j++) {
+		    uncertainties[j] = rand() % 51;
+		    if (rand() % 10 == 0)
+			enc_bytes[j / 8] ^= 1 << (j % 8);
+		}
+
+		set_decode_metric_width(ce, exact ? 32 : widths[w]);
+		set_decode_kernel(ce, CONVCODE_KERNEL_SCALAR);
+		/* Compare against the generic, not a specialized, kernel. */
+		if (ce->metric_width == 32)
+		    ce->decode_kernel = decode_bits_scalar;
+		else
+		    ce->decode_kernel = decode_bits_scalar_narrow;
+		memset(exp_bytes, 0, sizeof(exp_bytes));
+		reinit_convcode(ce);
+		convdecode_block(ce, enc_bytes, enc_nbits, u,
+				 exp_bytes, exp_uncertainties, &exp_errs);
+
+		set_decode_metric_width(ce, widths[w]);
+		set_decode_kernel(ce, kernels[i]);
+		memset(out_bytes, 0, sizeof(out_bytes));
+		reinit_convcode(ce);
+		convdecode_block(ce, enc_bytes, enc_nbits, u,
+				 out_bytes, out_uncertainties, &num_errs);
+
+		if (num_errs != exp_errs) {
+		    printf("\n  %s kernel %u bits got %u errors, expected %u\n",
+			   kernel_names[i], widths[w], num_errs, exp_errs);
+		    rv++;
+		    goto out;
+		}
+		if (memcmp(exp_bytes, out_bytes, sizeof(out_bytes)) != 0) {
+		    printf("\n  %s kernel %u bits decode mismatch\n",
+			   kernel_names[i], widths[w]);
+		    rv++;
+		    goto out;
+		}
+		for (j = 0; j < nbits; j++) {
+		    if (exp_uncertainties[j] != out_uncertainties[j]) {
+			printf("\n  %s kernel %u bits uncertainty mismatch"
+			       " at bit %u\n",
+			       kernel_names[i], widths[w], j);
+			rv++;
+			goto out;
+		    }
+		}
+	    }
+	}
+    }
+ out:
+    printf("\n");
+    free_convcode(ce);
+    return rv;
+}
+
+struct stream_test_data {
+    unsigned char *bytes;
+    unsigned int nbits;
+    unsigned int max_bits;
+};
+
+static int
+handle_stream_test_output(struct convcode *ce, void *output_data,
+			  unsigned char byte, unsigned int nbits)
+{
+    struct stream_test_data *t = output_data;
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++) {
+	assert(t->nbits < t->max_bits);
+	t->bytes[t->nbits / 8] |= (byte & 1) << (t->nbits % 8);
+	t->nbits++;
+	byte >>= 1;
+    }
+    return 0;
+}
+
+/*
+ * Run a stream much longer than the trellis through the decoder in
+ * streaming mode, fed in odd-sized pieces, with some errors spread
+ * out enough that they will all be corrected.
+ */
+static unsigned int
+stream_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail, unsigned int metric_width, bool regex)
+{
+    struct stream_test_data t;
+    const unsigned int nbits = 20000;
+    unsigned int enc_nbits = (nbits + k - 1) * npolys;
+    unsigned char *in = calloc(1, nbits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_nbits / 8 + 1);
+    unsigned char *out = calloc(1, nbits / 8 + 1);
+    /* Register exchange only needs one trellis column. */
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys,
+					 regex ? 1 : 20 * k,
+					 do_tail, false, NULL, NULL,
+					 handle_stream_test_output, &t);
+    unsigned int i, pos, len, total_bits, num_errs, nerrs = 0, rv = 0;
+
+    printf("Stream test k=%u %s %u-bit%s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", metric_width,
+	   regex ? " regex" : "", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && out && ce);
+    set_decode_metric_width(ce, metric_width);
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (regex) {
+	if (set_decode_register_exchange(ce, 5 * k)) {
+	    printf("  Unable to set register exchange\n");
+	    rv++;
+	    goto out;
+	}
+    } else if (set_decode_traceback_depth(ce, 5 * k)) {
+	printf("  Unable to set traceback depth\n");
+	rv++;
+	goto out;
+    }
+
+    for (i = 0; i < nbits; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    convencode_block(ce, in, nbits, enc);
+    if (!do_tail)
+	enc_nbits = nbits * npolys;
+    for (i = 0; i < enc_nbits - 20 * npolys; i += 61) {
+	enc[i / 8] ^= 1 << (i % 8);
+	nerrs++;
+    }
+
+    t.bytes = out;
+    t.nbits = 0;
+    t.max_bits = nbits;
+    /* Chop it into pieces that don't line up on symbols. */
+    for (pos = 0; pos < enc_nbits; pos += len) {
+	len = 8 * (1 + rand() % 20);
+	if (len > enc_nbits - pos)
+	    len = enc_nbits - pos;
+	if (convdecode_data(ce, enc + pos / 8, len, NULL)) {
+	    printf("  stream decode error return\n");
+	    rv++;
+	    goto out;
+	}
+	if (pos > 1000 && t.nbits == 0) {
+	    printf("  no output from streaming decode\n");
+	    rv++;
+	    goto out;
+	}
+    }
+    convdecode_finish(ce, &total_bits, &num_errs);
+    if (total_bits != nbits) {
+	printf("  decode failure, got %u output bits, expected %u\n",
+	       total_bits, nbits);
+	rv++;
+    }
+    if (num_errs != nerrs) {
+	printf("  decode failure, got %u errors, expected %u\n",
+	       num_errs, nerrs);
+	rv++;
+    }
+    for (i = 0; i < nbits; i++) {
+	if (((in[i / 8] ^ out[i / 8]) >> (i % 8)) & 1) {
+	    printf("  stream decode failure at bit %u\n", i);
+	    rv++;
+	    break;
+	}
+    }
+
+ out:
+    free_convcode(ce);
+    free(in);
+    free(enc);
+    free(out);
+    return rv;
+}
+
+static unsigned int
+count_trellis_chunks(struct convcode *ce)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < trellis_num_chunks(ce); i++)
+	n += !!ce->trellis_chunks[i];
+    return n;
+}
+
+/*
+ * Decode messages of increasing size with a growable trellis and make
+ * sure they come out the same as with a full-size one, that only the
+ * chunks that were needed got allocated, and that max_symbols is
+ * enforced.  Then stream through a small growable window.
+ */
+static unsigned int
+growth_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail)
+{
+    static const unsigned int lens[] = { 10, 200, 300, 2000, 5000 };
+    const unsigned int max_bits = 5000, chunk = 256;
+    unsigned int max_symbols = max_bits + (do_tail ? k - 1 : 0);
+    unsigned int enc_bytes = (max_symbols + 1) * npolys / 8 + 1;
+    unsigned char *in = calloc(1, max_bits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_bytes);
+    unsigned char *exp = calloc(1, max_bits / 8 + 1);
+    unsigned char *out = calloc(1, max_bits / 8 + 1);
+    struct convcode *fce = alloc_convcode(o, k, polys, npolys, max_bits,
+					  do_tail, false,
+					  NULL, NULL, NULL, NULL);
+    struct stream_test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 1,
+					 do_tail, false, NULL, NULL,
+					 handle_stream_test_output, &t);
+    unsigned int i, j, nbits, nsym, exp_errs, num_errs, total_bits, rv = 0;
+
+    printf("Growth test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && exp && out && fce && ce);
+    if (set_decode_trellis_growth(ce, chunk, max_symbols)) {
+	printf("  Unable to set trellis growth\n");
+	rv++;
+	goto out;
+    }
+    if (count_trellis_chunks(ce) != 1) {
+	printf("  %u chunks allocated at start\n", count_trellis_chunks(ce));
+	rv++;
+	goto out;
+    }
+
+    for (i = 0; i < sizeof(lens) / sizeof(*lens); i++) {
+	nbits = lens[i];
+	nsym = nbits + (do_tail ? k - 1 : 0);
+	memset(in, 0, max_bits / 8 + 1);
+	for (j = 0; j < nbits; j++)
+	    in[j / 8] |= (rand() & 1) << (j % 8);
+	memset(enc, 0, enc_bytes);
+	reinit_convencode(fce, 0);
+	convencode_block(fce, in, nbits, enc);
+	for (j = 0; j < nsym * npolys; j += 53)
+	    enc[j / 8] ^= 1 << (j % 8);
+
+	memset(exp, 0, max_bits / 8 + 1);
+	reinit_convdecode(fce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	assert(!convdecode_block(fce, enc, nsym * npolys, NULL, exp, NULL,
+				 &exp_errs));
+
+	memset(out, 0, max_bits / 8 + 1);
+	reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	if (convdecode_block(ce, enc, nsym * npolys, NULL, out, NULL,
+			     &num_errs)) {
+	    printf("  %u bits error return\n", nbits);
+	    rv++;
+	    goto out;
+	}
+	if (num_errs != exp_errs || memcmp(exp, out, max_bits / 8 + 1) != 0) {
+	    printf("  %u bits decode mismatch\n", nbits);
+	    rv++;
+	    goto out;
+	}
+	if (count_trellis_chunks(ce) != (nsym + chunk - 1) / chunk) {
+	    printf("  %u bits used %u chunks, expected %u\n", nbits,
+		   count_trellis_chunks(ce), (nsym + chunk - 1) / chunk);
+	    rv++;
+	    goto out;
+	}
+    }
+
+    /* One more symbol is too many. */
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (!convdecode_block(ce, enc, (max_symbols + 1) * npolys, NULL, out,
+			  NULL, NULL)) {
+	printf("  no error on overflow\n");
+	rv++;
+	goto out;
+    }
+
+    /* Setting it again starts over. */
+    if (set_decode_trellis_growth(ce, 64, 20 * k) ||
+	count_trellis_chunks(ce) != 1) {
+	printf("  Unable to reset trellis growth\n");
+	rv++;
+	goto out;
+    }
+    if (set_decode_traceback_depth(ce, 5 * k)) {
+	printf("  Unable to set traceback depth\n");
+	rv++;
+	goto out;
+    }
+    memset(enc, 0, enc_bytes);
+    reinit_convencode(fce, 0);
+    convencode_block(fce, in, max_bits, enc);
+    memset(out, 0, max_bits / 8 + 1);
+    t.bytes = out;
+    t.nbits = 0;
+    t.max_bits = max_bits;
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (convdecode_data(ce, enc, max_symbols * npolys, NULL) ||
+	convdecode_finish(ce, &total_bits, &num_errs)) {
+	printf("  stream decode error return\n");
+	rv++;
+	goto out;
+    }
+    if (total_bits != max_bits || num_errs != 0 ||
+	memcmp(in, out, max_bits / 8 + 1) != 0) {
+	printf("  stream decode failure\n");
+	rv++;
+    }
+
+    /*
+     * A coder with a full-size trellis uses it for the first chunks,
+     * and only allocates the ones past it.
+     */
+    if (set_decode_trellis_growth(fce, chunk, 2 * max_symbols) ||
+	fce->trellis_chunks[0] != fce->trellis ||
+	fce->trellis_fixed_chunks != fce->fixed_trellis_size / chunk) {
+	printf("  full-size trellis not used for growth\n");
+	rv++;
+	goto out;
+    }
+    memset(out, 0, max_bits / 8 + 1);
+    reinit_convdecode(fce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (convdecode_block(fce, enc, max_symbols * npolys, NULL, out, NULL,
+			 &num_errs) || num_errs != 0 ||
+	memcmp(in, out, max_bits / 8 + 1) != 0) {
+	printf("  full-size trellis growth decode failure\n");
+	rv++;
+    }
+    if (count_trellis_chunks(fce) != (max_symbols + chunk - 1) / chunk) {
+	printf("  full-size trellis growth used %u chunks\n",
+	       count_trellis_chunks(fce));
+	rv++;
+    }
+
+    /*
+     * The coder's own trellis is too small for that traceback depth,
+     * so it can't go back to it until streaming is turned off.
+     */
+    if (!set_decode_trellis_growth(ce, 0, 0) || !ce->trellis_chunks) {
+	printf("  growth turned off under the traceback depth\n");
+	rv++;
+    }
+    if (set_decode_traceback_depth(ce, 0) ||
+	set_decode_trellis_growth(ce, 0, 0) || ce->trellis_chunks) {
+	printf("  Unable to turn off trellis growth\n");
+	rv++;
+    }
+
+ out:
+    free_convcode(fce);
+    free_convcode(ce);
+    free(in);
+    free(enc);
+    free(exp);
+    free(out);
+    return rv;
+}
+
+/*
+ * Decode a noisy soft message fed in odd-sized pieces with
+ * convdecode_data_packed() and make sure it comes out the same as
+ * convdecode_data() with the uncertainties unpacked, in one piece.
+ */
+static unsigned int
+packed_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail, unsigned int width, const uint16_t *pattern,
+	    unsigned int period)
+{
+    struct stream_test_data t;
+    const unsigned int nbits = 3000;
+    unsigned int enc_nbits = (nbits + k - 1) * npolys;
+    unsigned char *in = calloc(1, nbits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_nbits / 8 + 1);
+    unsigned char *exp = calloc(1, nbits / 8 + 1);
+    unsigned char *out = calloc(1, nbits / 8 + 1);
+    uint8_t *unc = calloc(1, enc_nbits);
+    uint8_t *packed = calloc(1, enc_nbits * width / 8 + 1);
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, nbits,
+					 do_tail, false, NULL, NULL,
+					 handle_stream_test_output, &t);
+    unsigned int i, bit, pos, len, nsym, max = (1 << width) - 1;
+    unsigned int exp_bits, exp_errs, total_bits, num_errs, rv = 0;
+
+    printf("Packed test k=%u %s %u-bit%s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", width, pattern ? " punctured" : "",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && exp && out && unc && packed && ce);
+    if (pattern)
+	assert(!set_puncture_pattern(ce, pattern, period));
+    set_decode_max_uncertainty(ce, 2 * max);
+
+    for (i = 0; i < nbits; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    convencode_block(ce, in, nbits, enc);
+    nsym = nbits + (do_tail ? k - 1 : 0);
+    enc_nbits = 0;
+    for (i = 0; i < nsym; i++)
+	enc_nbits += pattern ? __builtin_popcount(pattern[i % period]) : npolys;
+
+    /* Some noise, and now and then a bit that's wrong but uncertain. */
+    for (i = 0; i < enc_nbits; i++) {
+	unc[i] = rand() % (max / 2 + 1);
+	if (rand() % 40 == 0) {
+	    enc[i / 8] ^= 1 << (i % 8);
+	    unc[i] = max - rand() % 2;
+	}
+	bit = i * width;
+	packed[bit / 8] |= unc[i] << (bit % 8);
+	if (bit % 8 + width > 8)
+	    packed[bit / 8 + 1] |= unc[i] >> (8 - bit % 8);
+    }
+
+    t.bytes = exp;
+    t.nbits = 0;
+    t.max_bits = nbits;
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    assert(!convdecode_data(ce, enc, enc_nbits, unc));
+    assert(!convdecode_finish(ce, &exp_bits, &exp_errs));
+
+    t.bytes = out;
+    t.nbits = 0;
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    /*
+     * Chop it into pieces that don't line up on symbols, but do on
+     * bytes of the packed uncertainties.
+     */
+    for (pos = 0; pos < enc_nbits; pos += len) {
+	len = 8 * (1 + rand() % 20);
+	if (len > enc_nbits - pos)
+	    len = enc_nbits - pos;
+	if (convdecode_data_packed(ce, enc + pos / 8, len,
+				   packed + pos * width / 8, width)) {
+	    printf("  packed decode error return\n");
+	    rv++;
+	    goto out;
+	}
+    }
+    if (convdecode_finish(ce, &total_bits, &num_errs)) {
+	printf("  packed decode finish error return\n");
+	rv++;
+	goto out;
+    }
+    if (total_bits != exp_bits || num_errs != exp_errs ||
+	memcmp(exp, out, nbits / 8 + 1) != 0) {
+	printf("  packed decode mismatch, %u bits %u errs, expected"
+	       " %u bits %u errs\n", total_bits, num_errs, exp_bits,
+	       exp_errs);
+	rv++;
+    }
+
+ out:
+    free_convcode(ce);
+    free(in);
+    free(enc);
+    free(exp);
+    free(out);
+    free(unc);
+    free(packed);
+    return rv;
+}
+
+/*
+ * Decode a noisy message with survivor merge detection in a trellis
+ * much smaller than the message and make sure the output is exactly
+ * what a full-length decode gives.
+ */
+static unsigned int
+merge_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	   bool do_tail, unsigned int interval)
+{
+    struct stream_test_data t, rt;
+    const unsigned int nbits = 4000;
+    unsigned int enc_nbits = (nbits + k - 1) * npolys;
+    unsigned char *in = calloc(1, nbits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_nbits / 8 + 1);
+    unsigned char *out = calloc(1, nbits / 8 + 1);
+    unsigned char *ref = calloc(1, nbits / 8 + 1);
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 64 * k,
+					 do_tail, false, NULL, NULL,
+					 handle_stream_test_output, &t);
+    struct convcode *rce = alloc_convcode(o, k, polys, npolys, nbits + k,
+					  do_tail, false, NULL, NULL,
+					  handle_stream_test_output, &rt);
+    unsigned int i, pos, len, total_bits, ref_bits;
+    unsigned int num_errs, ref_errs, rv = 0;
+
+    printf("Merge test k=%u %s interval %u polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", interval, polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && out && ref && ce && rce);
+    if (set_decode_merge_interval(ce, interval)) {
+	printf("  Unable to set merge interval\n");
+	rv++;
+	goto out;
+    }
+
+    for (i = 0; i < nbits; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    convencode_block(ce, in, nbits, enc);
+    if (!do_tail)
+	enc_nbits = nbits * npolys;
+    for (i = 0; i < enc_nbits; i++) {
+	if (rand() % 40 == 0)
+	    enc[i / 8] ^= 1 << (i % 8);
+    }
+
+    rt.bytes = ref;
+    rt.nbits = 0;
+    rt.max_bits = nbits;
+    reinit_convdecode(rce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (convdecode_data(rce, enc, enc_nbits, NULL)) {
+	printf("  reference decode error return\n");
+	rv++;
+	goto out;
+    }
+    convdecode_finish(rce, &ref_bits, &ref_errs);
+
+    t.bytes = out;
+    t.nbits = 0;
+    t.max_bits = nbits;
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    for (pos = 0; pos < enc_nbits; pos += len) {
+	len = 8 * (1 + rand() % 20);
+	if (len > enc_nbits - pos)
+	    len = enc_nbits - pos;
+	if (convdecode_data(ce, enc + pos / 8, len, NULL)) {
+	    printf("  merge decode error return\n");
+	    rv++;
+	    goto out;
+	}
+    }
+    if (t.nbits == 0) {
+	printf("  no output before the end of the message\n");
+	rv++;
+    }
+    convdecode_finish(ce, &total_bits, &num_errs);
+    if (total_bits != ref_bits || num_errs != ref_errs) {
+	printf("  got %u bits and %u errors, expected %u and %u\n",
+	       total_bits, num_errs, ref_bits, ref_errs);
+	rv++;
+    }
+    if (memcmp(out, ref, nbits / 8 + 1) != 0) {
+	printf("  output doesn't match the full decode\n");
+	rv++;
+    }
+
+ out:
+    free_convcode(ce);
+    free_convcode(rce);
+    free(in);
+    free(enc);
+    free(out);
+    free(ref);
+    return rv;
+}
+
+/*
+ * Encode a block a bit at a time, for comparing with the byte at a
+ * time encoders.
+ */
+static void
+encode_test_ref(struct convcode *ce, const unsigned char *bytes,
+		unsigned int nbits, unsigned char *outbytes,
+		unsigned int outbitpos)
+{
+    unsigned int i;
+
+    reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+    for (i = 0; i < nbits; i++)
+	convencode_block_bit(ce, (bytes[i / 8] >> (i % 8)) & 1,
+			     &outbytes, &outbitpos);
+    if (ce->do_tail) {
+	for (i = 0; i < ce->k - 1; i++)
+	    convencode_block_bit(ce, 0, &outbytes, &outbitpos);
+    }
+}
+
+/*
+ * Encode random data with convencode_block_final() at random output
+ * bit positions and with convencode_data() in two random pieces and
+ * make sure they match encoding a bit at a time.
+ */
+static unsigned int
+encode_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail, bool recursive)
+{
+    struct stream_test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 0,
+					 do_tail, recursive,
+					 handle_stream_test_output, &t,
+					 NULL, NULL);
+    unsigned char dec_bytes[64], exp_bytes[600], out_bytes[600];
+    unsigned int i, pass, nbits, enc_nbits, outbitpos, split, total_bits;
+    unsigned int rv = 0;
+
+    printf("Encode test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(ce);
+    for (pass = 0; pass < 50; pass++) {
+	nbits = rand() % 400;
+	for (i = 0; i < sizeof(dec_bytes); i++)
+	    dec_bytes[i] = rand();
+	enc_nbits = nbits;
+	if (do_tail)
+	    enc_nbits += k - 1;
+	enc_nbits *= npolys;
+
+	outbitpos = rand() % 8;
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	encode_test_ref(ce, dec_bytes, nbits, exp_bytes, outbitpos);
+	memset(out_bytes, 0, sizeof(out_bytes));
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_block_final(ce, dec_bytes, nbits, out_bytes, outbitpos);
+	if (memcmp(exp_bytes, out_bytes, sizeof(out_bytes)) != 0) {
+	    printf("  block encode mismatch, %u bits at bit %u\n",
+		   nbits, outbitpos);
+	    rv++;
+	    break;
+	}
+
+	/* convencode_data() output always starts at bit 0. */
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	encode_test_ref(ce, dec_bytes, nbits, exp_bytes, 0);
+	memset(out_bytes, 0, sizeof(out_bytes));
+	t.bytes = out_bytes;
+	t.nbits = 0;
+	t.max_bits = sizeof(out_bytes) * 8;
+	split = nbits ? (rand() % nbits) / 8 * 8 : 0;
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_data(ce, dec_bytes, split);
+	convencode_data(ce, dec_bytes + split / 8, nbits - split);
+	convencode_finish(ce, &total_bits);
+	if (total_bits != enc_nbits || t.nbits != enc_nbits) {
+	    printf("  data encode got %u bits, expected %u\n",
+		   total_bits, enc_nbits);
+	    rv++;
+	    break;
+	}
+	if (memcmp(exp_bytes, out_bytes, sizeof(out_bytes)) != 0) {
+	    printf("  data encode mismatch, %u bits split at %u\n",
+		   nbits, split);
+	    rv++;
+	    break;
+	}
+    }
+    free_convcode(ce);
+    return rv;
+}
+
+/*
+ * Tune the kernel for a code, make sure the result is remembered and
+ * decodes right, and try saving and restoring the tuning and
+ * overriding it from the environment.
+ */
+static unsigned int
+kernel_tune_test(void)
+{
+    static const char *bad[] = {
+	"7 2 33 scalar", "7 2 32 bogus", "17 2 32 scalar", "7 0 32 scalar",
+	"7 2 32 auto", "7 2 32 tune", "7 2"
+    };
+    convcode_state polys[2] = { 0171, 0133 };
+    struct convcode *ce, *ref;
+    enum convcode_kernel kernel, k2;
+    unsigned char in[32], enc[64], out[32], exp[32];
+    unsigned int i, bits, errs, exp_errs, rv = 0;
+    char buf[64], buf2[64];
+
+    printf("Kernel tuning test\n");
+    for (kernel = CONVCODE_KERNEL_AUTO; kernel <= CONVCODE_KERNEL_TUNE;
+	 kernel++) {
+	if (convcode_kernel_from_name(convcode_kernel_name(kernel), &k2) ||
+		k2 != kernel) {
+	    printf("  kernel %u name mismatch\n", kernel);
+	    rv++;
+	}
+    }
+    if (convcode_kernel_name(CONVCODE_KERNEL_TUNE + 1) ||
+		!convcode_kernel_from_name("sse4", &k2)) {
+	printf("  invalid kernel name accepted\n");
+	rv++;
+    }
+
+    assert(!set_convcode_kernel_tuning(""));
+    ce = alloc_convcode(o, 7, polys, 2, 256, true, false,
+			NULL, NULL, NULL, NULL);
+    ref = alloc_convcode(o, 7, polys, 2, 256, true, false,
+			 NULL, NULL, NULL, NULL);
+    assert(ce && ref);
+    if (set_decode_kernel(ce, CONVCODE_KERNEL_TUNE)) {
+	printf("  tune failed\n");
+	rv++;
+	goto out;
+    }
+    kernel = get_decode_kernel(ce);
+    if (kernel == CONVCODE_KERNEL_AUTO || kernel == CONVCODE_KERNEL_TUNE) {
+	printf("  tuned to kernel %u\n", kernel);
+	rv++;
+	goto out;
+    }
+
+    /* The tuned kernel has to give the same results as the others. */
+    for (i = 0; i < sizeof(in); i++)
+	in[i] = rand();
+    memset(enc, 0, sizeof(enc));
+    convencode_block(ce, in, 200, enc);
+    for (i = 0; i < 412; i += 37)
+	enc[i / 8] ^= 1 << (i % 8);
+    memset(out, 0, sizeof(out));
+    memset(exp, 0, sizeof(exp));
+    assert(!set_decode_kernel(ref, CONVCODE_KERNEL_SCALAR));
+    if (convdecode_block(ce, enc, 412, NULL, out, NULL, &errs) ||
+		convdecode_block(ref, enc, 412, NULL, exp, NULL, &exp_errs) ||
+		errs != exp_errs || memcmp(out, exp, sizeof(out)) != 0) {
+	printf("  tuned decode mismatch\n");
+	rv++;
+    }
+
+#ifdef CONVCODE_HAVE_CYCLES
+    snprintf(buf2, sizeof(buf2), "7 2 32 %s\n", convcode_kernel_name(kernel));
+    if (get_convcode_kernel_tuning(buf, sizeof(buf)) != strlen(buf2) ||
+		strcmp(buf, buf2) != 0) {
+	printf("  tuning was %s, expected %s", buf, buf2);
+	rv++;
+    }
+    if (get_convcode_kernel_tuning(buf, 4) != strlen(buf2) ||
+		strcmp(buf, "7 2") != 0) {
+	printf("  short tuning buffer got %s\n", buf);
+	rv++;
+    }
+#endif
+
+    /* Restore some tuning and allocate with it. */
+    if (set_convcode_kernel_tuning("7 2 32 scalar\n  3 2 16 avx2\n")) {
+	printf("  restoring tuning failed\n");
+	rv++;
+    }
+    get_convcode_kernel_tuning(buf, sizeof(buf));
+    free_convcode(ref);
+    ref = alloc_convcode(o, 7, polys, 2, 256, true, false,
+			 NULL, NULL, NULL, NULL);
+    assert(ref);
+    if (get_decode_kernel(ref) != CONVCODE_KERNEL_SCALAR) {
+	printf("  restored tuning not used\n");
+	rv++;
+    }
+    for (i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+	if (!set_convcode_kernel_tuning(bad[i])) {
+	    printf("  bad tuning \"%s\" accepted\n", bad[i]);
+	    rv++;
+	}
+    }
+    get_convcode_kernel_tuning(buf2, sizeof(buf2));
+    if (strcmp(buf, buf2) != 0) {
+	printf("  bad tuning changed the tuning\n");
+	rv++;
+    }
+    assert(!set_convcode_kernel_tuning(""));
+    if (get_convcode_kernel_tuning(buf, sizeof(buf)) != 0) {
+	printf("  tuning not cleared\n");
+	rv++;
+    }
+
+    /*
+     * Tuning runs the decoder, it has to put back the start state and
+     * init value it was given, including when changing the width.
+     */
+#ifdef CONVCODE_HAVE_CYCLES
+    for (bits = 32; bits >= 16; bits -= 16) {
+	if (reinit_convdecode(ce, 5, 1000) ||
+		(bits == 32 ? set_decode_kernel(ce, CONVCODE_KERNEL_TUNE) :
+		 set_decode_metric_width(ce, bits))) {
+	    printf("  width %u tune failed\n", bits);
+	    rv++;
+	    continue;
+	}
+	assert(!set_convcode_kernel_tuning(""));
+	for (i = 0; i < ce->num_states; i++) {
+	    if (get_path_value(ce, ce->curr_path_values, i) !=
+			(i == 5 ? 0 : 1000)) {
+		printf("  width %u tuning lost the start state\n", bits);
+		rv++;
+		break;
+	    }
+	}
+    }
+#endif
+    assert(!set_decode_metric_width(ce, 32));
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+
+    /* The environment overrides the automatic choice. */
+    setenv("CONVCODE_KERNEL", "scalar", 1);
+    set_decode_kernel(ce, CONVCODE_KERNEL_AUTO);
+    unsetenv("CONVCODE_KERNEL");
+    if (get_decode_kernel(ce) != CONVCODE_KERNEL_SCALAR) {
+	printf("  environment kernel not used\n");
+	rv++;
+    }
+    set_decode_kernel(ce, CONVCODE_KERNEL_AUTO);
+
+ out:
+    free_convcode(ce);
+    free_convcode(ref);
+    return rv;
+}
+
+/*
+ * Decode a bunch of random frames of different lengths, some soft and
+ * some hard, with convdecode_batch() with every kernel and make sure
+ * each frame matches decoding it by itself with convdecode_block().
+ */
+static unsigned int
+batch_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	   bool do_tail, bool recursive)
+{
+    static const enum convcode_kernel kernels[] = {
+	CONVCODE_KERNEL_AUTO, CONVCODE_KERNEL_SCALAR, CONVCODE_KERNEL_SSE41,
+	CONVCODE_KERNEL_AVX2, CONVCODE_KERNEL_AVX512, CONVCODE_KERNEL_NEON
+    };
+    static const char *kernel_names[] = {
+	"auto", "scalar", "sse4.1", "avx2", "avx512", "neon"
+    };
+    enum { nframes = 37 };
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 512,
+					 do_tail, recursive,
+					 NULL, NULL, NULL, NULL);
+    struct convdecode_frame frames[nframes];
+    static unsigned char enc_bytes[nframes][128];
+    static uint8_t uncertainties[nframes][1024];
+    static unsigned char exp_bytes[32], out_bytes[nframes][32];
+    static unsigned int exp_uncertainties[256];
+    static unsigned int out_uncertainties[nframes][256];
+    struct convdecode_batch_mem mem = { .o = o };
+    unsigned char dec_bytes[32];
+    unsigned int i, j, f, m, nbits, exp_errs, rv = 0;
+
+    printf("Batch test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }:");
+
+    assert(ce);
+    for (f = 0; f < nframes; f++) {
+	nbits = rand() % 200;
+	memset(dec_bytes, 0, sizeof(dec_bytes));
+	for (j = 0; j < nbits; j++)
+	    dec_bytes[j / 8] |= (rand() & 1) << (j % 8);
+	memset(enc_bytes[f], 0, sizeof(enc_bytes[f]));
+	reinit_convcode(ce);
+	convencode_block(ce, dec_bytes, nbits, enc_bytes[f]);
+	if (do_tail)
+	    nbits += k - 1;
+	nbits *= npolys;
+	for (j = 0; j < nbits; j++) {
+	    uncertainties[f][j] = rand() % 51;
+	    if (rand() % 10 == 0)
+		enc_bytes[f][j / 8] ^= 1 << (j % 8);
+	}
+	frames[f].bytes = enc_bytes[f];
+	frames[f].nbits = nbits;
+	frames[f].uncertainty = (f % 3 == 0) ? uncertainties[f] : NULL;
+	frames[f].outbytes = out_bytes[f];
+	frames[f].output_uncertainty = out_uncertainties[f];
+    }
+
+    for (i = 0; i < sizeof(kernels) / sizeof(*kernels); i++) {
+	if (set_decode_kernel(ce, kernels[i]))
+	    continue;
+	printf(" %s", kernel_names[i]);
+
+	/* With memory from outside the coder, then the coder's own. */
+	for (m = 0; m < 2; m++) {
+	    memset(out_bytes, 0, sizeof(out_bytes));
+	    if (m ? convdecode_batch(ce, frames, nframes) :
+		    convdecode_batch_with_mem(ce, &mem, frames, nframes)) {
+		printf("\n  %s batch decode failed\n", kernel_names[i]);
+		rv++;
+		goto out;
+	    }
+	    if (!m && ce->batch_trellis && i == 0) {
+		printf("\n  batch memory allocated in the coder\n");
+		rv++;
+	    }
+
+	    for (f = 0; f < nframes; f++) {
+		memset(exp_bytes, 0, sizeof(exp_bytes));
+		reinit_convcode(ce);
+		convdecode_block(ce, frames[f].bytes, frames[f].nbits,
+				 frames[f].uncertainty,
+				 exp_bytes, exp_uncertainties, &exp_errs);
+		nbits = frames[f].nbits / npolys;
+		if (do_tail)
+		    nbits -= k - 1;
+		if (frames[f].num_errs != exp_errs) {
+		    printf("\n  %s frame %u got %u errors, expected %u\n",
+			   kernel_names[i], f, frames[f].num_errs, exp_errs);
+		    rv++;
+		    goto out;
+		}
+		if (memcmp(exp_bytes, out_bytes[f], sizeof(exp_bytes)) != 0) {
+		    printf("\n  %s frame %u decode mismatch\n",
+			   kernel_names[i], f);
+		    rv++;
+		    goto out;
+		}
+		for (j = 0; j < nbits; j++) {
+		    if (exp_uncertainties[j] != out_uncertainties[f][j]) {
+			printf("\n  %s frame %u uncertainty mismatch at bit %u\n",
+			       kernel_names[i], f, j);
+			rv++;
+			goto out;
+		    }
+		}
+	    }
+	}
+    }
+ out:
+    printf("\n");
+    free_convdecode_batch_mem(&mem);
+    free_convcode(ce);
+    return rv;
+}
+
+/*
+ * Decode a bunch of random hard decision frames of different lengths
+ * with convdecode_bitsliced(), more than fit in one group, and make
+ * sure each frame matches decoding it by itself with
+ * convdecode_block().  Some frames are pure noise to push the path
+ * values around.
+ */
+static unsigned int
+bitslice_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	      bool do_tail, bool recursive)
+{
+    enum { nframes = 150 };
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 512,
+					 do_tail, recursive,
+					 NULL, NULL, NULL, NULL);
+    struct convdecode_frame frames[nframes];
+    static unsigned char enc_bytes[nframes][320];
+    static unsigned char exp_bytes[32], out_bytes[nframes][32];
+    static unsigned int exp_uncertainties[256];
+    static unsigned int out_uncertainties[nframes][256];
+    unsigned char dec_bytes[32];
+    unsigned int i, j, f, nbits, exp_errs, rv = 0;
+
+    printf("Bit-sliced test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(ce);
+    for (f = 0; f < nframes; f++) {
+	nbits = rand() % 250;
+	memset(dec_bytes, 0, sizeof(dec_bytes));
+	for (j = 0; j < nbits; j++)
+	    dec_bytes[j / 8] |= (rand() & 1) << (j % 8);
+	memset(enc_bytes[f], 0, sizeof(enc_bytes[f]));
+	reinit_convcode(ce);
+	convencode_block(ce, dec_bytes, nbits, enc_bytes[f]);
+	if (do_tail)
+	    nbits += k - 1;
+	nbits *= npolys;
+	for (j = 0; j < nbits; j++) {
+	    if (f % 10 == 0 || rand() % 10 == 0)
+		enc_bytes[f][j / 8] ^= (rand() & 1) << (j % 8);
+	}
+	frames[f].bytes = enc_bytes[f];
+	frames[f].nbits = nbits;
+	frames[f].uncertainty = NULL;
+	frames[f].outbytes = out_bytes[f];
+	frames[f].output_uncertainty = (f % 2) ? out_uncertainties[f] : NULL;
+    }
+
+    memset(out_bytes, 0, sizeof(out_bytes));
+    if (convdecode_bitsliced(ce, frames, nframes)) {
+	printf("  bit-sliced decode failed\n");
+	rv++;
+	goto out;
+    }
+
+    for (f = 0; f < nframes; f++) {
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	reinit_convcode(ce);
+	convdecode_block(ce, frames[f].bytes, frames[f].nbits, NULL,
+			 exp_bytes, exp_uncertainties, &exp_errs);
+	nbits = frames[f].nbits / npolys;
+	if (do_tail)
+	    nbits -= k - 1;
+	if (frames[f].num_errs != exp_errs) {
+	    printf("  frame %u got %u errors, expected %u\n",
+		   f, frames[f].num_errs, exp_errs);
+	    rv++;
+	    goto out;
+	}
+	if (memcmp(exp_bytes, out_bytes[f], sizeof(exp_bytes)) != 0) {
+	    printf("  frame %u decode mismatch\n", f);
+	    rv++;
+	    goto out;
+	}
+	if (!frames[f].output_uncertainty)
+	    continue;
+	for (j = 0; j < nbits; j++) {
+	    if (exp_uncertainties[j] != out_uncertainties[f][j]) {
+		printf("  frame %u uncertainty mismatch at bit %u\n", f, j);
+		rv++;
+		goto out;
+	    }
+	}
+    }
+
+    /* Soft decisions aren't allowed. */
+    frames[0].uncertainty = (const uint8_t *) enc_bytes[0];
+    if (!convdecode_bitsliced(ce, frames, nframes)) {
+	printf("  bit-sliced decode took uncertainties\n");
+	rv++;
+    }
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+struct sched_test_data {
+    unsigned int ndone;
+    struct convcode_sched_job *hold;
+    bool release;
+};
+
+static void
+sched_test_done(struct convcode_sched_job *job)
+{
+    struct sched_test_data *d = job->user_data;
+
+    /* Hold the worker up until the rest of the jobs are queued. */
+    if (job == d->hold) {
+	while (!__atomic_load_n(&d->release, __ATOMIC_ACQUIRE))
+	    usleep(100);
+    }
+    __atomic_add_fetch(&d->ndone, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Decode soft frames from a bunch of channels with the scheduler,
+ * some that can be batched together (the ones sharing a code with the
+ * same settings) and some that can't, and make sure each one comes out
+ * the same as decoding it directly.  The first job holds its worker
+ * up until the round is queued, so with one worker the shared code
+ * jobs behind it have to have been batched.
+ */
+static unsigned int
+sched_test(unsigned int nworkers)
+{
+    enum { nshared = 24, nchans = 32, nrounds = 4 };
+    convcode_state voyager[2] = { 0171, 0133 };
+    convcode_state lte[3] = { 0117, 0127, 0155 };
+    struct convcode_code *code = alloc_convcode_code(o, 7, voyager, 2,
+						     false);
+    struct convcode *chans[nchans];
+    struct convcode_sched *s = alloc_convcode_sched(o, nworkers);
+    static struct convcode_sched_job jobs[nchans];
+    static unsigned char enc_bytes[nchans][256], out_bytes[nchans][64];
+    static uint8_t uncertainty[nchans][2048];
+    unsigned char dec_bytes[64], exp_bytes[64];
+    struct sched_test_data d;
+    unsigned int i, j, c, r, nbits, np, exp_errs, rv = 0;
+    unsigned long batched;
+
+    printf("Scheduler test %u workers\n", nworkers);
+    assert(code && s);
+    memset(&d, 0, sizeof(d));
+    for (c = 0; c < nchans; c++) {
+	if (c < nshared)
+	    chans[c] = alloc_convcode_from_code(o, code, 512, true,
+						NULL, NULL, NULL, NULL);
+	else
+	    chans[c] = alloc_convcode(o, 7, lte, 3, 512, true, false,
+				      NULL, NULL, NULL, NULL);
+	assert(chans[c]);
+	/* These can't be batched with the others. */
+	if (c < nshared && c % 4 == 1)
+	    set_decode_max_uncertainty(chans[c], 50);
+	if (c < nshared && c % 4 == 2)
+	    set_decode_metric_width(chans[c], 16);
+    }
+
+    for (r = 0; r < nrounds; r++) {
+	memset(out_bytes, 0, sizeof(out_bytes));
+	memset(enc_bytes, 0, sizeof(enc_bytes));
+	d.hold = &jobs[0];
+	d.release = false;
+	for (c = 0; c < nchans; c++) {
+	    np = chans[c]->num_polys;
+	    nbits = 100 + rand() % 400;
+	    memset(dec_bytes, 0, sizeof(dec_bytes));
+	    for (j = 0; j < nbits; j++)
+		dec_bytes[j / 8] |= (rand() & 1) << (j % 8);
+	    reinit_convencode(chans[c], CONVCODE_DEFAULT_START_STATE);
+	    convencode_block(chans[c], dec_bytes, nbits, enc_bytes[c]);
+	    nbits = (nbits + chans[c]->k - 1) * np;
+	    for (j = 0; j < nbits; j++) {
+		uncertainty[c][j] = rand() % 51;
+		if (rand() % 10 == 0)
+		    enc_bytes[c][j / 8] ^= 1 << (j % 8);
+	    }
+	    memset(&jobs[c], 0, sizeof(jobs[c]));
+	    jobs[c].ce = chans[c];
+	    jobs[c].frame.bytes = enc_bytes[c];
+	    jobs[c].frame.nbits = nbits;
+	    jobs[c].frame.uncertainty = uncertainty[c];
+	    jobs[c].frame.outbytes = out_bytes[c];
+	    jobs[c].done = sched_test_done;
+	    jobs[c].user_data = &d;
+	    jobs[c].rv = -1;
+	    convcode_sched_submit(s, &jobs[c], c);
+	}
+	__atomic_store_n(&d.release, true, __ATOMIC_RELEASE);
+	convcode_sched_wait(s);
+
+	for (c = 0; c < nchans; c++) {
+	    memset(exp_bytes, 0, sizeof(exp_bytes));
+	    reinit_convdecode(chans[c], CONVCODE_DEFAULT_START_STATE,
+			      CONVCODE_DEFAULT_INIT_VAL);
+	    convdecode_block(chans[c], enc_bytes[c], jobs[c].frame.nbits,
+			     uncertainty[c], exp_bytes, NULL, &exp_errs);
+	    if (jobs[c].rv != 0 || jobs[c].frame.num_errs != exp_errs ||
+		memcmp(exp_bytes, out_bytes[c], sizeof(exp_bytes)) != 0) {
+		printf("  round %u channel %u decode mismatch\n", r, c);
+		rv++;
+		goto out;
+	    }
+	}
+    }
+    if (d.ndone != nchans * nrounds) {
+	printf("  %u jobs done, expected %u\n", d.ndone, nchans * nrounds);
+	rv++;
+    }
+    batched = convcode_sched_num_batched(s);
+    if (batched > nshared * nrounds || (nworkers == 1 && batched == 0)) {
+	printf("  %lu jobs batched\n", batched);
+	rv++;
+    }
+    for (c = 0; c < nchans; c++) {
+	if (chans[c]->batch_trellis) {
+	    printf("  channel %u allocated batch memory\n", c);
+	    rv++;
+	    break;
+	}
+    }
+
+ out:
+    free_convcode_sched(s);
+    for (i = 0; i < nchans; i++)
+	free_convcode(chans[i]);
+    free_convcode_code(code);
+    return rv;
+}
+
+/*
+ * Encode a block with odd sizes in pieces with
+ * convencode_block_parallel() and make sure it matches
+ * convencode_block(), from a non-default start state and with a
+ * puncture pattern if one is given.
+ */
+static unsigned int
+parallel_encode_test(unsigned int k, convcode_state *polys,
+		     unsigned int npolys, bool do_tail,
+		     const uint16_t *pattern, unsigned int period)
+{
+    static const unsigned int nsegments[] = { 1, 2, 3, 7, 64, 5000 };
+    const unsigned int max_bits = 20000;
+    unsigned int enc_bytes = (max_bits + k - 1) * npolys / 8 + 1;
+    unsigned char *in = calloc(1, max_bits / 8 + 1);
+    unsigned char *exp = calloc(1, enc_bytes);
+    unsigned char *out = calloc(1, enc_bytes);
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 0,
+					 do_tail, false,
+					 NULL, NULL, NULL, NULL);
+    unsigned int i, j, nbits, start_state, rv = 0;
+    convcode_state exp_state;
+
+    printf("Parallel encode test k=%u %s%s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", pattern ? " punctured" : "",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && exp && out && ce);
+    if (pattern)
+	assert(!set_puncture_pattern(ce, pattern, period));
+    for (i = 0; i < sizeof(nsegments) / sizeof(*nsegments); i++) {
+	nbits = max_bits - rand() % 1000;
+	memset(in, 0, max_bits / 8 + 1);
+	for (j = 0; j < nbits; j++)
+	    in[j / 8] |= (rand() & 1) << (j % 8);
+	start_state = rand() % (1 << (k - 1));
+
+	memset(exp, 0, enc_bytes);
+	reinit_convencode(ce, start_state);
+	convencode_block(ce, in, nbits, exp);
+	exp_state = ce->enc_state;
+
+	memset(out, 0, enc_bytes);
+	reinit_convencode(ce, start_state);
+	if (convencode_block_parallel(ce, in, nbits, out, nsegments[i])) {
+	    printf("  %u segments error return\n", nsegments[i]);
+	    rv++;
+	    goto out;
+	}
+	if (memcmp(exp, out, enc_bytes) != 0) {
+	    printf("  %u segments encode mismatch, %u bits\n",
+		   nsegments[i], nbits);
+	    rv++;
+	    goto out;
+	}
+	if (ce->enc_state != exp_state) {
+	    printf("  %u segments ended in state %u, expected %u\n",
+		   nsegments[i], ce->enc_state, exp_state);
+	    rv++;
+	    goto out;
+	}
+    }
+ out:
+    free_convcode(ce);
+    free(in);
+    free(exp);
+    free(out);
+    return rv;
+}
+
+/*
+ * Decode a long block in a bunch of different numbers of segments
+ * with convdecode_block_parallel() and compare with convdecode_block().
+ * Without errors, the output must be exactly the same with the
+ * minimum overlap of 2 * k.  With errors and the default overlap, the
+ * segments can pick a different path near their edges now and then,
+ * so only allow a few bits and a little distance to be different.
+ */
+static unsigned int
+parallel_check(struct convcode *ce, const unsigned char *enc,
+	       unsigned int enc_nbits, const uint8_t *u, unsigned int nbits,
+	       unsigned char *exp, unsigned char *out, unsigned int overlap,
+	       bool exact)
+{
+    static const unsigned int nsegments[] = { 1, 2, 5, 16 };
+    unsigned int i, j, ndiff, exp_errs, num_errs, maxdiff = 0, maxerrs = 0;
+
+    memset(exp, 0, nbits / 8 + 1);
+    reinit_convcode(ce);
+    if (convdecode_block(ce, enc, enc_nbits, u, exp, NULL, &exp_errs)) {
+	printf("  block decode error return\n");
+	return 1;
+    }
+    if (!exact) {
+	maxdiff = nbits / 100;
+	maxerrs = exp_errs / 100;
+    }
+    for (i = 0; i < sizeof(nsegments) / sizeof(*nsegments); i++) {
+	memset(out, 0, nbits / 8 + 1);
+	if (convdecode_block_parallel(ce, enc, enc_nbits, u, out,
+				      &num_errs, nsegments[i], overlap)) {
+	    printf("  parallel decode error return\n");
+	    return 1;
+	}
+	if (num_errs > exp_errs + maxerrs || num_errs + maxerrs < exp_errs) {
+	    printf("  %u segments got %u errors, expected %u\n",
+		   nsegments[i], num_errs, exp_errs);
+	    return 1;
+	}
+	for (j = 0, ndiff = 0; j < nbits / 8 + 1; j++)
+	    ndiff += __builtin_popcount(exp[j] ^ out[j]);
+	if (ndiff > maxdiff) {
+	    printf("  %u segments got %u different bits\n",
+		   nsegments[i], ndiff);
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static unsigned int
+parallel_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	      bool do_tail)
+{
+    const unsigned int nbits = 30000;
+    unsigned int enc_nbits = (nbits + k - 1) * npolys;
+    unsigned char *in = calloc(1, nbits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_nbits / 8 + 1);
+    unsigned char *exp = calloc(1, nbits / 8 + 1);
+    unsigned char *out = calloc(1, nbits / 8 + 1);
+    uint8_t *uncertainties = calloc(1, enc_nbits);
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, enc_nbits,
+					 do_tail, false,
+					 NULL, NULL, NULL, NULL);
+    struct convcode *cce, *seg;
+    struct convcode_code *code;
+    unsigned int i, pass, rv = 0;
+
+    printf("Parallel test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && exp && out && uncertainties && ce);
+    for (i = 0; i < nbits; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    convencode_block(ce, in, nbits, enc);
+    if (!do_tail)
+	enc_nbits = nbits * npolys;
+    for (i = 0; i < enc_nbits; i++)
+	uncertainties[i] = rand() % 51;
+
+    for (pass = 0; pass < 2; pass++) {
+	const uint8_t *u = pass ? uncertainties : NULL;
+
+	rv = parallel_check(ce, enc, enc_nbits, u, nbits, exp, out, 2 * k,
+			    true);
+	if (rv)
+	    goto out;
+    }
+
+    for (i = 0; i < enc_nbits; i++) {
+	if (rand() % 30 == 0)
+	    enc[i / 8] ^= 1 << (i % 8);
+    }
+    for (pass = 0; pass < 2; pass++) {
+	const uint8_t *u = pass ? uncertainties : NULL;
+
+	rv = parallel_check(ce, enc, enc_nbits, u, nbits, exp, out, 0, false);
+	if (rv)
+	    goto out;
+    }
+
+    /*
+     * The segment coders are kept for the next call, and share the
+     * code tables if the coder has them.
+     */
+    seg = ce->par_coders[15];
+    if (convdecode_block_parallel(ce, enc, enc_nbits, NULL, out, NULL,
+				  16, 0) || ce->par_coders[15] != seg) {
+	printf("  segment coders not reused\n");
+	rv++;
+	goto out;
+    }
+    code = alloc_convcode_code(o, k, polys, npolys, false);
+    assert(code);
+    cce = alloc_convcode_from_code(o, code, enc_nbits, do_tail,
+				   NULL, NULL, NULL, NULL);
+    assert(cce);
+    rv = parallel_check(cce, enc, enc_nbits, uncertainties, nbits, exp, out,
+			0, false);
+    if (!rv && cce->par_coders[0]->code != code) {
+	printf("  segment coders don't share the code\n");
+	rv++;
+    }
+    free_convcode(cce);
+    free_convcode_code(code);
+ out:
+    free_convcode(ce);
+    free(in);
+    free(enc);
+    free(exp);
+    free(out);
+    free(uncertainties);
+    return rv;
+}
+
+/*
+ * Check convdecode_llr() on short random frames against a brute force
+ * Max-Log-MAP that tries every possible input.  Without a tail (with
+ * one, convdecode_block() doesn't know the end state) also check the
+ * hard decisions and num_errs against convdecode_block().
+ */
+static unsigned int
+llr_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	 bool do_tail, bool recursive)
+{
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 1024,
+					 do_tail, recursive,
+					 NULL, NULL, NULL, NULL);
+    unsigned char dec_bytes[32], enc_bytes[256], try_bytes[256];
+    unsigned char exp_bytes[32], out_bytes[32];
+    uint8_t uncertainties[2048];
+    int32_t llrs[256];
+    unsigned int min0[10], min1[10];
+    unsigned int i, j, pass, nbits, enc_nbits, in, cost, num_errs, exp_errs;
+    unsigned int rv = 0;
+
+    printf("LLR test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive",
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(ce);
+    for (pass = 0; pass < 40; pass++) {
+	const uint8_t *u = (pass & 1) ? uncertainties : NULL;
+	bool brute = pass < 20;
+
+	if (brute)
+	    nbits = 1 + rand() % 10;
+	else
+	    nbits = 8 + rand() % 240;
+	memset(dec_bytes, 0, sizeof(dec_bytes));
+	for (j = 0; j < nbits; j++)
+	    dec_bytes[j / 8] |= (rand() & 1) << (j % 8);
+	enc_nbits = nbits;
+	if (do_tail)
+	    enc_nbits += k - 1;
+	enc_nbits *= npolys;
+	memset(enc_bytes, 0, sizeof(enc_bytes));
+	reinit_convcode(ce);
+	convencode_block(ce, dec_bytes, nbits, enc_bytes);
+	for (j = 0; j < enc_nbits; j++) {
+	    uncertainties[j] = rand() % 51;
+	    if (rand() % 8 == 0)
+		enc_bytes[j / 8] ^= 1 << (j % 8);
+	}
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	if (convdecode_llr(ce, enc_bytes, enc_nbits, u, llrs, out_bytes,
+			   &num_errs)) {
+	    printf("  llr decode error return\n");
+	    rv++;
+	    break;
+	}
+
+	if (brute) {
+	    for (j = 0; j < nbits; j++)
+		min0[j] = min1[j] = UINT_MAX;
+	    for (in = 0; in < 1U << nbits; in++) {
+		dec_bytes[0] = in;
+		dec_bytes[1] = in >> 8;
+		memset(try_bytes, 0, sizeof(try_bytes));
+		reinit_convcode(ce);
+		convencode_block(ce, dec_bytes, nbits, try_bytes);
+		for (cost = 0, j = 0; j < enc_nbits; j += npolys)
+		    cost += hamming_distance(ce,
+				extract_bits(try_bytes, j, npolys),
+				extract_bits(enc_bytes, j, npolys),
+				u ? u + j : NULL);
+		for (j = 0; j < nbits; j++) {
+		    unsigned int *min = ((in >> j) & 1) ? min1 : min0;
+
+		    if (cost < min[j])
+			min[j] = cost;
+		}
+	    }
+	    for (j = 0; j < nbits; j++) {
+		if (llrs[j] != (int32_t) (min1[j] - min0[j])) {
+		    printf("  llr mismatch at bit %u of %u, got %d,"
+			   " expected %d\n", j, nbits, llrs[j],
+			   (int32_t) (min1[j] - min0[j]));
+		    rv++;
+		    goto out;
+		}
+	    }
+	}
+
+	if (do_tail)
+	    continue;
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	reinit_convcode(ce);
+	convdecode_block(ce, enc_bytes, enc_nbits, u, exp_bytes, NULL,
+			 &exp_errs);
+	if (num_errs != exp_errs) {
+	    printf("  llr decode got %u errors, expected %u\n",
+		   num_errs, exp_errs);
+	    rv++;
+	    break;
+	}
+	for (j = 0; j < nbits; j++) {
+	    if (llrs[j] != 0 && (((out_bytes[j / 8] ^ exp_bytes[j / 8])
+				  >> (j % 8)) & 1)) {
+		printf("  llr decode bit %u differs from viterbi\n", j);
+		rv++;
+		goto out;
+	    }
+	}
+    }
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+/*
+ * Run convdecode_reduced() on data with errors spread out enough that
+ * it should correct all of them.  Then, for small codes, with lots of
+ * errors, hard and soft, check the cost of what it finds against the
+ * best path from convdecode_llr(); it can't do better, and keeping
+ * all the states it must find the same cost.  Big codes get a coder
+ * with no trellis, only the reduced-state paths.
+ */
+static unsigned int
+reduced_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	     bool do_tail, bool recursive, unsigned int max_states,
+	     unsigned int threshold)
+{
+    const unsigned int nbits = 2000;
+    unsigned int enc_nbits = (nbits + k - 1) * npolys;
+    unsigned char *in = calloc(1, nbits / 8 + 1);
+    unsigned char *enc = calloc(1, enc_nbits / 8 + 1);
+    unsigned char *out = calloc(1, nbits / 8 + 1);
+    uint8_t *uncertainties = calloc(1, enc_nbits);
+    int32_t *llrs = calloc(nbits, sizeof(*llrs));
+    bool full = k <= 9;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys,
+					 full ? nbits + k : 0,
+					 do_tail, recursive, NULL, NULL,
+					 NULL, NULL);
+    unsigned int i, pass, num_errs, exp_errs, nerrs = 0, rv = 0;
+
+    printf("Reduced test k=%u %s %s max states %u threshold %u"
+	   " polys={ 0%o", k, do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive", max_states, threshold,
+	   polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(in && enc && out && uncertainties && llrs && ce);
+    if (convdecode_reduced(ce, enc, enc_nbits, NULL, out, NULL) == 0) {
+	printf("  reduced decode didn't fail without max states set\n");
+	rv++;
+	goto out;
+    }
+    if (full) {
+	set_decode_reduced_states(ce, max_states, threshold, 0);
+    } else {
+	if (!set_decode_reduced_states(ce, max_states, threshold, 0)) {
+	    printf("  no max_decode_len_bits didn't fail\n");
+	    rv++;
+	    goto out;
+	}
+	/* Not enough room for the data. */
+	set_decode_reduced_states(ce, max_states, threshold, nbits / 2);
+	if (convdecode_reduced(ce, enc, enc_nbits, NULL, out, NULL) == 0) {
+	    printf("  reduced decode didn't fail with too much data\n");
+	    rv++;
+	    goto out;
+	}
+	set_decode_reduced_states(ce, max_states, threshold, nbits);
+    }
+
+    for (i = 0; i < nbits; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    convencode_block(ce, in, nbits, enc);
+    if (!do_tail)
+	enc_nbits = nbits * npolys;
+    for (i = 0; i < enc_nbits; i += 61) {
+	enc[i / 8] ^= 1 << (i % 8);
+	nerrs++;
+    }
+    if (convdecode_reduced(ce, enc, enc_nbits, NULL, out, &num_errs)) {
+	printf("  reduced decode error return\n");
+	rv++;
+	goto out;
+    }
+    if (num_errs != nerrs) {
+	printf("  got %u errors, expected %u\n", num_errs, nerrs);
+	rv++;
+    }
+    for (i = 0; i < nbits; i++) {
+	if (((in[i / 8] ^ out[i / 8]) >> (i % 8)) & 1) {
+	    printf("  reduced decode failure at bit %u\n", i);
+	    rv++;
+	    break;
+	}
+    }
+
+    /* convdecode_llr() needs too much memory for big codes. */
+    for (pass = 0; full && pass < 4; pass++) {
+	const uint8_t *u = (pass & 1) ? uncertainties : NULL;
+
+	convencode_block(ce, in, nbits, enc);
+	for (i = 0; i < enc_nbits; i++) {
+	    uncertainties[i] = rand() % 51;
+	    if (rand() % 12 == 0)
+		enc[i / 8] ^= 1 << (i % 8);
+	}
+	if (convdecode_reduced(ce, enc, enc_nbits, u, out, &num_errs) ||
+	    convdecode_llr(ce, enc, enc_nbits, u, llrs, NULL, &exp_errs)) {
+	    printf("  decode error return\n");
+	    rv++;
+	    break;
+	}
+	if (num_errs < exp_errs ||
+	    (max_states == 0 && threshold == 0 && num_errs != exp_errs)) {
+	    printf("  got %u errors, best path has %u\n", num_errs, exp_errs);
+	    rv++;
+	    break;
+	}
+    }
+
+ out:
+    free_convcode(ce);
+    free(in);
+    free(enc);
+    free(out);
+    free(uncertainties);
+    free(llrs);
+    return rv;
+}
+
+struct turbo_check_data {
+    const unsigned char *expected;
+    unsigned int ncalls;
+};
+
+static bool
+turbo_test_check(void *check_data, const unsigned char *bytes,
+		 unsigned int nbits)
+{
+    struct turbo_check_data *c = check_data;
+
+    c->ncalls++;
+    return memcmp(bytes, c->expected, nbits / 8) == 0 &&
+	((bytes[nbits / 8] ^ c->expected[nbits / 8]) &
+	 ((1 << (nbits % 8)) - 1)) == 0;
+}
+
+/*
+ * Encoded bit to received LLR, with Gaussian noise of the given
+ * standard deviation (in 1/100ths, the signal is +-1) made by adding
+ * up uniform random numbers.
+ */
+static int8_t
+turbo_test_llr(unsigned int bit, unsigned int sigma)
+{
+    int v = 0, i;
+
+    for (i = 0; i < 12; i++)
+	v += rand() % 1001;
+    v = (v - 6000) * (int) sigma / 1000 + (bit ? -100 : 100);
+    v = v * 32 / 100;
+    if (v > 127)
+	v = 127;
+    else if (v < -127)
+	v = -127;
+    return v;
+}
+
+/*
+ * Check the turbo encoder output against the constituent coders run
+ * by hand.  Then decode without noise, with the check function and
+ * without, and with a lot of noise.
+ */
+static unsigned int
+turbo_test(unsigned int k, convcode_state *polys, unsigned int npolys)
+{
+    const unsigned int n = 1024, nout = 2 * npolys - 1;
+    unsigned int *perm = malloc(sizeof(*perm) * n);
+    unsigned char *in = calloc(1, n / 8 + 1);
+    unsigned char *inter = calloc(1, n / 8 + 1);
+    unsigned char *enc = calloc(1, n * nout / 8 + 1);
+    unsigned char *ref[2];
+    unsigned char *out = calloc(1, n / 8 + 1);
+    int8_t *llrs = malloc(n * nout);
+    struct convcode_turbo *t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 0, false, true,
+					 NULL, NULL, NULL, NULL);
+    struct turbo_check_data c;
+    unsigned int i, j, v, pass, iters, nerrs, single_errs = 0, rv = 0;
+
+    printf("Turbo test k=%u polys={ 0%o", k, polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    ref[0] = calloc(1, n * npolys / 8 + 1);
+    ref[1] = calloc(1, n * npolys / 8 + 1);
+    assert(perm && in && inter && enc && ref[0] && ref[1] && out && llrs &&
+	   ce);
+
+    for (i = 0; i < n; i++)
+	perm[i] = i;
+    perm[1] = 0;
+    t = alloc_convcode_turbo(o, k, polys, npolys, n, perm);
+    if (t) {
+	printf("  allocated with a bad interleaver\n");
+	free_convcode_turbo(t);
+	rv++;
+	goto out;
+    }
+    perm[1] = 1;
+    for (i = n - 1; i > 0; i--) {
+	j = rand() % (i + 1);
+	v = perm[i];
+	perm[i] = perm[j];
+	perm[j] = v;
+    }
+    t = alloc_convcode_turbo(o, k, polys, npolys, n, perm);
+    assert(t);
+
+    for (i = 0; i < n; i++)
+	in[i / 8] |= (rand() & 1) << (i % 8);
+    for (i = 0; i < n; i++)
+	inter[i / 8] |= ((in[perm[i] / 8] >> (perm[i] % 8)) & 1) << (i % 8);
+    convencode_turbo(t, in, enc);
+    convencode_block(ce, in, n, ref[0]);
+    reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+    convencode_block(ce, inter, n, ref[1]);
+    for (i = 0; i < n; i++) {
+	v = extract_bits(ref[0], i * npolys, npolys);
+	v |= (extract_bits(ref[1], i * npolys, npolys) >> 1) << npolys;
+	if (extract_bits(enc, i * nout, nout) != v) {
+	    printf("  encode mismatch at bit %u\n", i);
+	    rv++;
+	    goto out_free;
+	}
+    }
+
+    for (i = 0; i < n * nout; i++)
+	llrs[i] = ((enc[i / 8] >> (i % 8)) & 1) ? -100 : 100;
+    if (convdecode_turbo(t, llrs, out, NULL, 0, &iters) ||
+	memcmp(in, out, n / 8) != 0 || iters != 2) {
+	printf("  noiseless decode failed, %u iterations\n", iters);
+	rv++;
+	goto out_free;
+    }
+    c.expected = in;
+    c.ncalls = 0;
+    set_turbo_check(t, turbo_test_check, &c);
+    if (convdecode_turbo(t, llrs, out, NULL, 0, &iters) ||
+	iters != 1 || c.ncalls != 1) {
+	printf("  check function didn't stop the decode\n");
+	rv++;
+	goto out_free;
+    }
+    set_turbo_check(t, NULL, NULL);
+
+    /*
+     * About 1.8dB Eb/N0 at rate 1/3, sigma = 1 / sqrt(2 * rate * Eb/N0).
+     * A single pass gets a lot of errors there, the full decode
+     * should get almost none.
+     */
+    for (nerrs = 0, pass = 0; pass < 10; pass++) {
+	for (i = 0; i < n * nout; i++)
+	    llrs[i] = turbo_test_llr((enc[i / 8] >> (i % 8)) & 1, 100);
+	convdecode_turbo(t, llrs, out, NULL, 1, NULL);
+	for (i = 0; i < n; i++)
+	    single_errs += ((in[i / 8] ^ out[i / 8]) >> (i % 8)) & 1;
+	convdecode_turbo(t, llrs, out, NULL, 0, NULL);
+	for (i = 0; i < n; i++)
+	    nerrs += ((in[i / 8] ^ out[i / 8]) >> (i % 8)) & 1;
+    }
+    if (nerrs * 10 >= single_errs) {
+	printf("  %u errors from turbo decoding, %u from a single pass\n",
+	       nerrs, single_errs);
+	rv++;
+    }
+
+ out_free:
+    free_convcode_turbo(t);
+ out:
+    free_convcode(ce);
+    free(perm);
+    free(in);
+    free(inter);
+    free(enc);
+    free(ref[0]);
+    free(ref[1]);
+    free(out);
+    free(llrs);
+    return rv;
+}
+
+/*
+ * Encode random data with a puncturing pattern and make sure it
+ * matches encoding without puncturing and taking the bits out by
+ * hand.  Then put in some errors, spread out enough for the punctured
+ * code, and make sure convdecode_block(), convdecode_data() fed in
+ * odd-sized pieces, and convdecode_llr() all get the data back, hard
+ * and soft.
+ */
+static unsigned int
+puncture_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	      bool do_tail, const uint16_t *pattern, unsigned int period)
+{
+    struct stream_test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 1024,
+					 do_tail, false,
+					 handle_stream_test_output, &t,
+					 handle_stream_test_output, &t);
+    unsigned char dec_bytes[64], full_bytes[256], exp_bytes[256];
+    unsigned char out_bytes[256], piece[4];
+    unsigned int out_uncertainties[512];
+    uint8_t uncertainties[2048];
+    int32_t llrs[512];
+    uint16_t bad[2] = { 0, 1 << npolys };
+    unsigned int i, j, pass, nbits, nsym, enc_nbits, pos, len, split;
+    unsigned int total_bits, num_errs, nerrs, rv = 0;
+
+    printf("Puncture test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" } pattern={ %u", pattern[0]);
+    for (i = 1; i < period; i++)
+	printf(", %u", pattern[i]);
+    printf(" }\n");
+
+    assert(ce);
+    if (!set_puncture_pattern(ce, bad, 1) ||
+	!set_puncture_pattern(ce, bad + 1, 1)) {
+	printf("  invalid pattern accepted\n");
+	rv++;
+	goto out;
+    }
+
+    for (pass = 0; pass < 20; pass++) {
+	const uint8_t *u = (pass & 1) ? uncertainties : NULL;
+
+	nbits = 8 + rand() % 400;
+	memset(dec_bytes, 0, sizeof(dec_bytes));
+	for (i = 0; i < nbits; i++)
+	    dec_bytes[i / 8] |= (rand() & 1) << (i % 8);
+	nsym = nbits;
+	if (do_tail)
+	    nsym += k - 1;
+
+	set_puncture_pattern(ce, NULL, 0);
+	memset(full_bytes, 0, sizeof(full_bytes));
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_block(ce, dec_bytes, nbits, full_bytes);
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	enc_nbits = 0;
+	for (i = 0; i < nsym; i++) {
+	    for (j = 0; j < npolys; j++) {
+		pos = i * npolys + j;
+		if (!(pattern[i % period] & (1 << j)))
+		    continue;
+		exp_bytes[enc_nbits / 8] |= (((full_bytes[pos / 8] >> (pos % 8))
+					      & 1) << (enc_nbits % 8));
+		enc_nbits++;
+	    }
+	}
+
+	if (set_puncture_pattern(ce, pattern, period)) {
+	    printf("  unable to set pattern\n");
+	    rv++;
+	    goto out;
+	}
+	memset(out_bytes, 0, sizeof(out_bytes));
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_block(ce, dec_bytes, nbits, out_bytes);
+	if (memcmp(exp_bytes, out_bytes, sizeof(out_bytes)) != 0) {
+	    printf("  block encode mismatch, %u bits\n", nbits);
+	    rv++;
+	    goto out;
+	}
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	t.bytes = out_bytes;
+	t.nbits = 0;
+	t.max_bits = sizeof(out_bytes) * 8;
+	split = (rand() % nbits) / 8 * 8;
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_data(ce, dec_bytes, split);
+	convencode_data(ce, dec_bytes + split / 8, nbits - split);
+	convencode_finish(ce, &total_bits);
+	if (total_bits != enc_nbits ||
+	    memcmp(exp_bytes, out_bytes, sizeof(out_bytes)) != 0) {
+	    printf("  data encode mismatch, %u bits split at %u\n",
+		   nbits, split);
+	    rv++;
+	    goto out;
+	}
+
+	/*
+	 * The 7/8 code has some long low weight paths, so keep the errors
+	 * well apart, and leave the end alone, it is weak without a tail.
+	 */
+	nerrs = 0;
+	for (i = 0; i < enc_nbits; i++)
+	    uncertainties[i] = rand() % 20;
+	for (i = rand() % 20; i + 100 < enc_nbits; i += 131) {
+	    exp_bytes[i / 8] ^= 1 << (i % 8);
+	    uncertainties[i] = 40 + rand() % 11;
+	    nerrs++;
+	}
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	if (convdecode_block(ce, exp_bytes, enc_nbits, u, out_bytes,
+			     out_uncertainties, &num_errs)) {
+	    printf("  block decode error return\n");
+	    rv++;
+	    goto out;
+	}
+	if (memcmp(dec_bytes, out_bytes, sizeof(dec_bytes)) != 0 ||
+	    (!u && num_errs != nerrs)) {
+	    printf("  block decode failure, %u bits %u errors, expected %u\n",
+		   nbits, num_errs, nerrs);
+	    rv++;
+	    goto out;
+	}
+	for (i = 0; i < nbits; i++) {
+	    if (out_uncertainties[i] > num_errs ||
+		(i > 0 && out_uncertainties[i] < out_uncertainties[i - 1])) {
+		printf("  block decode bad uncertainty at bit %u\n", i);
+		rv++;
+		goto out;
+	    }
+	}
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	t.bytes = out_bytes;
+	t.nbits = 0;
+	t.max_bits = nbits;
+	reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	/* Pieces that don't line up with anything. */
+	for (pos = 0; pos < enc_nbits; pos += len) {
+	    len = 1 + rand() % (sizeof(piece) * 8);
+	    if (len > enc_nbits - pos)
+		len = enc_nbits - pos;
+	    memset(piece, 0, sizeof(piece));
+	    for (i = 0; i < len; i++)
+		piece[i / 8] |= (((exp_bytes[(pos + i) / 8] >> ((pos + i) % 8))
+				  & 1) << (i % 8));
+	    if (convdecode_data(ce, piece, len, u ? u + pos : NULL)) {
+		printf("  data decode error return\n");
+		rv++;
+		goto out;
+	    }
+	}
+	convdecode_finish(ce, &total_bits, &num_errs);
+	if (total_bits != nbits ||
+	    memcmp(dec_bytes, out_bytes, sizeof(dec_bytes)) != 0 ||
+	    (!u && num_errs != nerrs)) {
+	    printf("  data decode failure, %u bits %u errors, expected %u\n",
+		   nbits, num_errs, nerrs);
+	    rv++;
+	    goto out;
+	}
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	if (convdecode_llr(ce, exp_bytes, enc_nbits, u, llrs, out_bytes,
+			   &num_errs)) {
+	    printf("  llr decode error return\n");
+	    rv++;
+	    goto out;
+	}
+	if (memcmp(dec_bytes, out_bytes, sizeof(dec_bytes)) != 0 ||
+	    (!u && num_errs != nerrs)) {
+	    printf("  llr decode failure, %u bits %u errors, expected %u\n",
+		   nbits, num_errs, nerrs);
+	    rv++;
+	    goto out;
+	}
+    }
+
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+/*
+ * Encode random tail-biting blocks, put in some errors, and make sure
+ * convdecode_tailbiting() gets the data back for each path value
+ * width, hard and soft.
+ */
+static unsigned int
+tailbiting_test(unsigned int k, convcode_state *polys, unsigned int npolys)
+{
+    static const unsigned int widths[] = { 32, 16, 8 };
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 512,
+					 false, false,
+					 NULL, NULL, NULL, NULL);
+    unsigned char dec_bytes[64], enc_bytes[256], out_bytes[64];
+    unsigned int out_uncertainties[512];
+    uint8_t uncertainties[2048];
+    unsigned int i, w, pass, nbits, enc_nbits, start, passes, maxpasses = 0;
+    unsigned int num_errs, nerrs, rv = 0;
+
+    printf("Tail-biting test k=%u polys={ 0%o", k, polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }:");
+
+    assert(ce);
+    for (w = 0; w < sizeof(widths) / sizeof(*widths); w++) {
+	printf(" %u", widths[w]);
+	set_decode_metric_width(ce, widths[w]);
+	for (pass = 0; pass < 40; pass++) {
+	    const uint8_t *u = (pass & 1) ? uncertainties : NULL;
+
+	    nbits = 4 * k + rand() % 300;
+	    memset(dec_bytes, 0, sizeof(dec_bytes));
+	    for (i = 0; i < nbits; i++)
+		dec_bytes[i / 8] |= (rand() & 1) << (i % 8);
+
+	    /* Start in the state the last k - 1 bits leave it in. */
+	    start = 0;
+	    for (i = nbits - (k - 1); i < nbits; i++)
+		start = (start << 1) | ((dec_bytes[i / 8] >> (i % 8)) & 1);
+	    memset(enc_bytes, 0, sizeof(enc_bytes));
+	    reinit_convencode(ce, start);
+	    convencode_block(ce, dec_bytes, nbits, enc_bytes);
+	    enc_nbits = nbits * npolys;
+
+	    nerrs = 0;
+	    for (i = 0; i < enc_nbits; i++)
+		uncertainties[i] = rand() % 20;
+	    for (i = rand() % 40; i < enc_nbits; i += 31 + rand() % 20) {
+		enc_bytes[i / 8] ^= 1 << (i % 8);
+		uncertainties[i] = 40 + rand() % 11;
+		nerrs++;
+	    }
+
+	    memset(out_bytes, 0, sizeof(out_bytes));
+	    if (convdecode_tailbiting(ce, enc_bytes, enc_nbits, u, out_bytes,
+				      out_uncertainties, &num_errs, 0,
+				      &passes)) {
+		printf("\n  tail-biting decode error return\n");
+		rv++;
+		goto out;
+	    }
+	    if (passes == 0 ||
+		memcmp(dec_bytes, out_bytes, sizeof(dec_bytes)) != 0) {
+		printf("\n  %u bit tail-biting decode failure, %u bits, "
+		       "%u passes\n", widths[w], nbits, passes);
+		rv++;
+		goto out;
+	    }
+	    if ((!u && num_errs != nerrs) ||
+		out_uncertainties[nbits - 1] != num_errs) {
+		printf("\n  %u bit tail-biting decode got %u errors, "
+		       "expected %u\n", widths[w], num_errs, nerrs);
+		rv++;
+		goto out;
+	    }
+	    if (passes > maxpasses)
+		maxpasses = passes;
+	}
+    }
+    printf(", up to %u passes\n", maxpasses);
+
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+static int
+handle_buffer_test_output(struct convcode *ce, void *output_data,
+			  unsigned char *buf, unsigned int nbits)
+{
+    struct stream_test_data *t = output_data;
+    unsigned int i;
+
+    for (i = 0; i < nbits; i++) {
+	assert(t->nbits < t->max_bits);
+	t->bytes[t->nbits / 8] |= (((buf[i / 8] >> (i % 8)) & 1)
+				   << (t->nbits % 8));
+	t->nbits++;
+    }
+    return 0;
+}
+
+/*
+ * Encode and decode random data with output buffers, small ones that
+ * keep filling up and ones big enough for everything, and make sure
+ * the output is the same as with the output functions.
+ */
+static unsigned int
+buffer_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	    bool do_tail)
+{
+    struct stream_test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 1024,
+					 do_tail, false,
+					 handle_stream_test_output, &t,
+					 handle_stream_test_output, &t);
+    unsigned char dec_bytes[128], exp_bytes[512], out_bytes[512];
+    unsigned char buf[512];
+    unsigned int i, pass, nbits, enc_nbits, exp_nbits, total_bits, size;
+    unsigned int rv = 0;
+
+    printf("Buffer test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(ce);
+    if (!set_encode_output_buffer(ce, buf, 12, NULL, NULL)) {
+	printf("  odd buffer size accepted\n");
+	rv++;
+	goto out;
+    }
+    for (pass = 0; pass < 20; pass++) {
+	/* Odd passes use a buffer that holds everything. */
+	size = (pass & 1) ? sizeof(buf) : 8 * (1 + rand() % 3);
+
+	nbits = rand() % 1000;
+	for (i = 0; i < sizeof(dec_bytes); i++)
+	    dec_bytes[i] = rand();
+
+	set_encode_output_buffer(ce, NULL, 0, NULL, NULL);
+	memset(exp_bytes, 0, sizeof(exp_bytes));
+	t.bytes = exp_bytes;
+	t.nbits = 0;
+	t.max_bits = sizeof(exp_bytes) * 8;
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	convencode_data(ce, dec_bytes, nbits);
+	convencode_finish(ce, &enc_nbits);
+
+	memset(out_bytes, 0, sizeof(out_bytes));
+	memset(buf, 0, sizeof(buf));
+	t.bytes = out_bytes;
+	t.nbits = 0;
+	t.max_bits = sizeof(out_bytes) * 8;
+	reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+	if (pass & 1)
+	    set_encode_output_buffer(ce, buf, size, NULL, NULL);
+	else
+	    set_encode_output_buffer(ce, buf, size,
+				     handle_buffer_test_output, &t);
+	convencode_data(ce, dec_bytes, nbits / 16 * 8);
+	convencode_data(ce, dec_bytes + nbits / 16, nbits - nbits / 16 * 8);
+	if (convencode_finish(ce, &total_bits)) {
+	    printf("  buffer encode error return\n");
+	    rv++;
+	    goto out;
+	}
+	if (pass & 1) {
+	    memcpy(out_bytes, buf, sizeof(buf));
+	    t.nbits = total_bits;
+	}
+	if (total_bits != enc_nbits || t.nbits != enc_nbits ||
+	    memcmp(exp_bytes, out_bytes, (enc_nbits + 7) / 8) != 0) {
+	    printf("  %u byte buffer encode mismatch, %u bits\n", size, nbits);
+	    rv++;
+	    goto out;
+	}
+
+	/* Now decode it back the same way. */
+	exp_nbits = nbits;
+	memset(out_bytes, 0, sizeof(out_bytes));
+	memset(buf, 0, sizeof(buf));
+	t.nbits = 0;
+	reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	if (pass & 1)
+	    set_decode_output_buffer(ce, buf, size, NULL, NULL);
+	else
+	    set_decode_output_buffer(ce, buf, size,
+				     handle_buffer_test_output, &t);
+	convdecode_data(ce, exp_bytes, enc_nbits, NULL);
+	if (convdecode_finish(ce, &total_bits, NULL)) {
+	    printf("  buffer decode error return\n");
+	    rv++;
+	    goto out;
+	}
+	if (pass & 1) {
+	    memcpy(out_bytes, buf, sizeof(buf));
+	    t.nbits = total_bits;
+	}
+	for (i = 0; i < exp_nbits; i++) {
+	    if (((dec_bytes[i / 8] ^ out_bytes[i / 8]) >> (i % 8)) & 1)
+		break;
+	}
+	if (total_bits != exp_nbits || t.nbits != exp_nbits ||
+	    i != exp_nbits) {
+	    printf("  %u byte buffer decode mismatch, %u bits\n", size, nbits);
+	    rv++;
+	    goto out;
+	}
+	set_decode_output_buffer(ce, NULL, 0, NULL, NULL);
+    }
+
+    /* A buffer that is too small without a full function. */
+    set_encode_output_buffer(ce, buf, 8, NULL, NULL);
+    reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+    convencode_data(ce, dec_bytes, 200);
+    if (!convencode_finish(ce, &total_bits)) {
+	printf("  buffer overrun not reported\n");
+	rv++;
+    }
+
+ out:
+    free_convcode(ce);
+    return rv;
+}
+
+static bool
+array_in_block(void *mem, unsigned long size, void *array)
+{
+    unsigned char *a = array;
+
+    if ((uintptr_t) a % CONVCODE_ALIGN)
+	return false;
+    return a >= (unsigned char *) mem && a < (unsigned char *) mem + size;
+}
+
+static int
+init_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	  bool do_tail)
+{
+    unsigned long size = convcode_size(k, npolys, 1024);
+    unsigned char *mem = aligned_alloc(CONVCODE_ALIGN,
+				       (size + CONVCODE_ALIGN) &
+				       ~(CONVCODE_ALIGN - 1UL));
+    struct convcode *ce = NULL, *ace;
+    unsigned char dec_bytes[128], enc_bytes[512];
+    unsigned char out_bytes[128], aout_bytes[128];
+    unsigned int i, nbits, enc_nbits, errs, aerrs;
+    int32_t llrs[8];
+    unsigned int rv = 0;
+
+    printf("Init test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
     for (i = 1; i < npolys; i++)
 	printf(", 0%o", polys[i]);
     printf(" }\n");
-    t.outpos = 0;
-    if (expected_errs == 0) {
-	do_encode_data(ce, decoded, &enc_nbits);
-	t.output[t.outpos] = '\0';
-	if (strcmp(encoded, t.output) != 0) {
-	    printf("  encode failure, expected\n    %s\n  got\n    %s\n",
-		   encoded, t.output);
-	    rv = 1;
-	    goto out;
-	}
-	if (enc_nbits != strlen(encoded)) {
-	    printf("  encode failure, got %u output bits, expected %u\n",
-		   enc_nbits, (unsigned int) strlen(encoded));
-	    rv++;
-	}
-	t.outpos = 0;
+
+    ace = alloc_convcode(o, k, polys, npolys, 1024, do_tail, false,
+			 NULL, NULL, NULL, NULL);
+    assert(ace && mem && size);
+
+    if (init_convcode(mem + 8, NULL, k, polys, npolys, 1024, do_tail, false,
+		      NULL, NULL, NULL, NULL)) {
+	printf("  misaligned memory accepted\n");
+	rv++;
+	goto out;
     }
-    do_decode_data(ce, encoded, &dec_nbits, &num_errs, uncertainty);
-    t.output[t.outpos] = '\0';
-    if (strcmp(decoded, t.output) != 0) {
-	printf("  decode failure, expected\n    %s\n  got\n    %s\n",
-	       decoded, t.output);
+
+    /* Make sure nothing depends on the memory being zeroed. */
+    memset(mem, 0xa5, size);
+    ce = init_convcode(mem, NULL, k, polys, npolys, 1024, do_tail, false,
+		       NULL, NULL, NULL, NULL);
+    if (!ce) {
+	printf("  init_convcode failed\n");
 	rv++;
+	goto out;
     }
-    if (num_errs != expected_errs) {
-	printf("  decode failure, got %u errors, expected %u\n",
-	       num_errs, expected_errs);
+    if (!array_in_block(mem, size, ce->trellis) ||
+	!array_in_block(mem, size, ce->curr_path_values) ||
+	!array_in_block(mem, size, ce->next_path_values) ||
+	!array_in_block(mem, size, ce->prev_convert[0]) ||
+	!array_in_block(mem, size, ce->prev_convert[1]) ||
+	!array_in_block(mem, size, ce->convert[0]) ||
+	!array_in_block(mem, size, ce->next_state[1]) ||
+	!array_in_block(mem, size, ce->byte_next_state[1])) {
+	printf("  array misplaced\n");
 	rv++;
+	goto out;
     }
-    if (dec_nbits != strlen(decoded)) {
-	printf("  decode failure, got %u output bits, expected %u\n",
-	       dec_nbits, (unsigned int) strlen(decoded));
+
+    for (i = 0; i < sizeof(dec_bytes); i++)
+	dec_bytes[i] = rand();
+    nbits = 1 + rand() % 1000;
+    memset(enc_bytes, 0, sizeof(enc_bytes));
+    convencode_block(ce, dec_bytes, nbits, enc_bytes);
+    enc_nbits = (nbits + (do_tail ? k - 1 : 0)) * npolys;
+    for (i = 0; i < 10; i++) {
+	unsigned int bit = rand() % enc_nbits;
+
+	enc_bytes[bit / 8] ^= 1 << (bit % 8);
+    }
+
+    memset(out_bytes, 0, sizeof(out_bytes));
+    memset(aout_bytes, 0, sizeof(aout_bytes));
+    if (convdecode_block(ce, enc_bytes, enc_nbits, NULL, out_bytes, NULL,
+			 &errs) ||
+	convdecode_block(ace, enc_bytes, enc_nbits, NULL, aout_bytes, NULL,
+			 &aerrs)) {
+	printf("  decode error return\n");
 	rv++;
+	goto out;
     }
-    if (rv)
+    if (errs != aerrs || memcmp(out_bytes, aout_bytes, (nbits + 7) / 8)) {
+	printf("  decode differs from alloc_convcode, %u bits\n", nbits);
+	rv++;
 	goto out;
+    }
 
-    reinit_convcode(ce);
-    memset(t.enc_bytes, 0, sizeof(t.enc_bytes));
-    if (expected_errs == 0) {
-	memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
-	for (i = 0, dec_nbits = 0; decoded[i]; i++, dec_nbits++) {
-	    unsigned int bit = decoded[i] == '0' ? 0 : 1;
-	    t.dec_bytes[i / 8] |= bit << (i % 8);
-	}
-	enc_nbits = dec_nbits;
-	if (do_tail)
-	    enc_nbits += k - 1;
-	enc_nbits *= npolys;
+    /* Without os funcs there's nothing to allocate LLR memory from. */
+    if (!convdecode_llr(ce, enc_bytes, npolys * 8, NULL, llrs, NULL, NULL)) {
+	printf("  LLR decode without memory succeeded\n");
+	rv++;
+    }
 
-	convencode_block(ce, t.dec_bytes, dec_nbits, t.enc_bytes);
-	for (i = 0; i < enc_nbits; i++) {
-	    unsigned int bit = encoded[i] == '0' ? 0 : 1;
+ out:
+    if (ce)
+	free_convcode(ce);
+    free_convcode(ace);
+    free(mem);
+    return rv;
+}
 
-	    if (((t.enc_bytes[i / 8] >> (i % 8)) & 1) != bit) {
-		printf("  block encode failure at bit %u\n", i);
-		rv++;
-		goto out;
-	    }
-	}
-    } else {
-	for (i = 0, enc_nbits = 0; encoded[i]; i++, enc_nbits++) {
-	    unsigned int bit = encoded[i] == '0' ? 0 : 1;
-	    t.enc_bytes[i / 8] |= bit << (i % 8);
-	}
-    }
+static int
+shared_code_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+		 bool do_tail, bool recursive)
+{
+    struct convcode_code *code = alloc_convcode_code(o, k, polys, npolys,
+						     recursive);
+    struct convcode *ce[3] = { NULL, NULL, NULL }, *ace;
+    unsigned char dec_bytes[128], enc_bytes[3][1024];
+    unsigned char out_bytes[3][128];
+    unsigned int i, j, nbits, enc_nbits, errs[3];
+    unsigned int rv = 0;
 
-    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
-    if (convdecode_block(ce, t.enc_bytes, enc_nbits, uncertainty,
-			 t.dec_bytes, t.uncertainties, &num_errs)) {
-	printf("  block decode error return\n");
+    printf("Shared code test k=%u %s %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail",
+	   recursive ? "recursive" : "non-recursive", polys[0]);
+    for (i = 1; i < npolys; i++)
+	printf(", 0%o", polys[i]);
+    printf(" }\n");
+
+    assert(code);
+    ace = alloc_convcode(o, k, polys, npolys, 1024, do_tail, recursive,
+			 NULL, NULL, NULL, NULL);
+    assert(ace);
+    ce[0] = ace;
+    ce[1] = alloc_convcode_from_code(o, code, 1024, do_tail,
+				     NULL, NULL, NULL, NULL);
+    /* An encode-only channel. */
+    ce[2] = alloc_convcode_from_code(o, code, 0, do_tail,
+				     NULL, NULL, NULL, NULL);
+    assert(ce[1] && ce[2]);
+
+    /* The channels keep the code around. */
+    free_convcode_code(code);
+    if (code->refcount != 2) {
+	printf("  refcount is %u, expected 2\n", code->refcount);
 	rv++;
 	goto out;
     }
-    if (num_errs != expected_errs) {
-	printf("  decode failure, got %u errors, expected %u\n",
-	       num_errs, expected_errs);
+    if (ce[1]->convert[1] != code->convert[1] ||
+	ce[2]->next_state[0] != code->next_state[0] ||
+	ce[1]->prev_convert[0] != code->prev_convert[0] ||
+	ce[2]->prev_convert[0] || ce[2]->trellis) {
+	printf("  tables not shared\n");
 	rv++;
+	goto out;
+    }
+    if (convcode_size_from_code(code, 1024) >=
+					convcode_size(k, npolys, 1024)) {
+	printf("  shared coder is not smaller\n");
+	rv++;
+	goto out;
     }
-    for (i = 0; i < dec_nbits; i++) {
-	unsigned int bit = decoded[i] == '0' ? 0 : 1;
 
-	if (((t.dec_bytes[i / 8] >> (i % 8)) & 1) != bit) {
-	    printf("  block decode failure at bit %u\n", i);
-	    rv++;
-	    goto out;
-	}
-	if (out_uncertainties && (t.uncertainties[i] != out_uncertainties[i])) {
-	    printf("  block decode invalid uncertainty at bit %u\n", i);
+    for (i = 0; i < sizeof(dec_bytes); i++)
+	dec_bytes[i] = rand();
+    nbits = 1 + rand() % 1000;
+    enc_nbits = (nbits + (do_tail ? k - 1 : 0)) * npolys;
+    for (i = 0; i < 3; i++) {
+	memset(enc_bytes[i], 0, sizeof(enc_bytes[i]));
+	convencode_block(ce[i], dec_bytes, nbits, enc_bytes[i]);
+    }
+    if (memcmp(enc_bytes[0], enc_bytes[1], (enc_nbits + 7) / 8) ||
+	memcmp(enc_bytes[0], enc_bytes[2], (enc_nbits + 7) / 8)) {
+	printf("  encode differs from alloc_convcode, %u bits\n", nbits);
+	rv++;
+	goto out;
+    }
+
+    for (i = 0; i < 10; i++) {
+	unsigned int bit = rand() % enc_nbits;
+
+	enc_bytes[0][bit / 8] ^= 1 << (bit % 8);
+    }
+    for (i = 0; i < 2; i++) {
+	memset(out_bytes[i], 0, sizeof(out_bytes[i]));
+	if (convdecode_block(ce[i], enc_bytes[0], enc_nbits, NULL,
+			     out_bytes[i], NULL, &errs[i])) {
+	    printf("  decode error return\n");
 	    rv++;
 	    goto out;
 	}
     }
+    if (errs[0] != errs[1] ||
+	memcmp(out_bytes[0], out_bytes[1], (nbits + 7) / 8)) {
+	printf("  decode differs from alloc_convcode, %u bits\n", nbits);
+	rv++;
+	goto out;
+    }
 
  out:
-    free_convcode(ce);
+    for (j = 0; j < 3; j++)
+	free_convcode(ce[j]);
     return rv;
 }
 
-static unsigned int
-rand_block_test(struct convcode *ce,
-		const char *encoded, const char *decoded)
+static int
+count_test_output(struct convcode *ce, void *output_data,
+		  unsigned char byte, unsigned int nbits)
 {
-    struct test_data t;
-    unsigned int i, dec_nbits, enc_nbits;
-    unsigned int rv;
+    unsigned int *count = output_data;
 
-    reinit_convcode(ce);
-    memset(t.enc_bytes, 0, sizeof(t.enc_bytes));
-    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
-    for (i = 0, dec_nbits = 0; decoded[i]; i++, dec_nbits++) {
-	unsigned int bit = decoded[i] == '0' ? 0 : 1;
-	t.dec_bytes[i / 8] |= bit << (i % 8);
+    (*count)++;
+    return 0;
+}
+
+static int
+stats_test(bool do_tail)
+{
+    convcode_state polys[2] = { 0171, 0133 };
+    unsigned int ncalls = 0;
+    struct convcode *ce = alloc_convcode(o, 7, polys, 2, 1024,
+					 do_tail, false,
+					 count_test_output, &ncalls,
+					 NULL, NULL);
+    struct convcode_stats st, zero;
+    unsigned char dec_bytes[128], enc_bytes[512], out_bytes[128];
+    unsigned int i, nbits, nsym, total_bits, errs;
+    unsigned int rv = 0;
+    uint32_t x;
+
+    printf("Stats test %s\n", do_tail ? "tail" : "notail");
+    assert(ce);
+    memset(&zero, 0, sizeof(zero));
+#ifndef CONVCODE_STATS
+    if (!get_convcode_stats(ce, &st)) {
+	printf("  stats returned without CONVCODE_STATS\n");
+	rv++;
     }
-    enc_nbits = dec_nbits;
-    if (ce->do_tail)
-	enc_nbits += ce->k - 1;
-    enc_nbits *= ce->num_polys;
+    goto out;
+#endif
 
-    convencode_block(ce, t.dec_bytes, dec_nbits, t.enc_bytes);
-    for (i = 0; i < enc_nbits; i++) {
-	unsigned int bit = encoded[i] == '0' ? 0 : 1;
+    if (get_convcode_stats(ce, &st) || memcmp(&st, &zero, sizeof(st))) {
+	printf("  stats not zero at start\n");
+	rv++;
+	goto out;
+    }
 
-	if (((t.enc_bytes[i / 8] >> (i % 8)) & 1) != bit) {
-	    printf("  block encode failure at bit %u\n", i);
-	    rv++;
-	    goto out;
-	}
+    for (i = 0; i < sizeof(dec_bytes); i++)
+	dec_bytes[i] = rand();
+    nbits = 100 + rand() % 900;
+    convencode_data(ce, dec_bytes, nbits);
+    convencode_finish(ce, &total_bits);
+    get_convcode_stats(ce, &st);
+    if (st.output_calls != ncalls) {
+	printf("  %llu output calls counted, expected %u\n",
+	       (unsigned long long) st.output_calls, ncalls);
+	rv++;
+	goto out;
     }
 
-    memset(t.dec_bytes, 0, sizeof(t.dec_bytes));
-    if (convdecode_block(ce, t.enc_bytes, enc_nbits, NULL,
-			 t.dec_bytes, NULL, NULL)) {
-	printf("  block decode error return\n");
+    reset_convcode_stats(ce);
+    get_convcode_stats(ce, &st);
+    if (memcmp(&st, &zero, sizeof(st))) {
+	printf("  stats not zero after reset\n");
 	rv++;
 	goto out;
     }
-    for (i = 0; i < dec_nbits; i++) {
-	unsigned int bit = decoded[i] == '0' ? 0 : 1;
 
-	if (((t.dec_bytes[i / 8] >> (i % 8)) & 1) != bit) {
-	    printf("  block decode failure at bit %u\n", i);
-	    rv++;
-	    goto out;
-	}
+    /* Time it if we can, it's fine if there's no cycle counter. */
+    set_convcode_stats_timing(ce, true);
+    memset(enc_bytes, 0, sizeof(enc_bytes));
+    memset(out_bytes, 0, sizeof(out_bytes));
+    convencode_block(ce, dec_bytes, nbits, enc_bytes);
+    nsym = nbits + (do_tail ? 6 : 0);
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    convdecode_block(ce, enc_bytes, nsym * 2, NULL, out_bytes, NULL, &errs);
+    get_convcode_stats(ce, &st);
+    if (st.symbols_decoded != nsym || st.acs_butterflies != nsym * 32 ||
+	st.traceback_steps != nsym || st.trellis_overflows != 0 ||
+	st.output_calls != 0) {
+	printf("  bad decode counts\n");
+	rv++;
+	goto out;
+    }
+    if (ce->stats_timing && (!st.decode_cycles || !st.traceback_cycles ||
+			     !st.encode_cycles)) {
+	printf("  no cycles counted\n");
+	rv++;
+	goto out;
+    }
+    set_convcode_stats_timing(ce, false);
+
+    /* Too much data for the trellis. */
+    reset_convcode_stats(ce);
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    convdecode_data(ce, enc_bytes, 512 * 8, NULL);
+    get_convcode_stats(ce, &st);
+    if (st.trellis_overflows != 1 ||
+	st.symbols_decoded != ce->trellis_size - 1) {
+	printf("  bad trellis overflow counts\n");
+	rv++;
+	goto out;
+    }
+
+    /*
+     * 8-bit path values fill up fast on noise.  Use a fixed sequence
+     * so this doesn't depend on the seed.
+     */
+    for (i = 0, x = 1; i < sizeof(enc_bytes); i++) {
+	x = x * 1103515245 + 12345;
+	enc_bytes[i] = x >> 16;
+    }
+    reset_convcode_stats(ce);
+    set_decode_metric_width(ce, 8);
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    convdecode_data(ce, enc_bytes, 512 * 2, NULL);
+    get_convcode_stats(ce, &st);
+    if (st.renormalizations == 0) {
+	printf("  no renormalizations counted\n");
+	rv++;
     }
+
  out:
+    free_convcode(ce);
     return rv;
 }
 
-static unsigned int
-rand_test(unsigned int k, convcode_state *polys, unsigned int npolys,
-	  bool do_tail, bool recursive)
+/*
+ * Finishing a decode with a tail before the whole tail has come in
+ * has nothing to output, and must not run off the trellis.
+ */
+static int
+short_tail_test(void)
 {
-    struct test_data t;
-    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 128,
-					 do_tail, recursive,
-					 handle_test_output, &t,
-					 handle_test_output, &t);
-    unsigned int i, j, bit, total_bits, num_errs, rv = 0;
-    char decoded[33];
-    char encoded[1024];
+    convcode_state polys[2] = { 0171, 0133 };
+    unsigned int ncalls = 0;
+    struct convcode *ce = alloc_convcode(o, 7, polys, 2, 128, true, false,
+					 NULL, NULL,
+					 count_test_output, &ncalls);
+    unsigned char bytes[2] = { 0, 0 };
+    unsigned int nsym, total_bits, errs;
+    int rv = 0;
 
-    if (recursive)
-	set_encode_output_per_symbol(ce, true);
+    printf("Short tail test\n");
+    assert(ce);
+    for (nsym = 0; nsym < 6; nsym++) {
+	reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL);
+	total_bits = 1;
+	if (convdecode_data(ce, bytes, nsym * 2, NULL) ||
+	    convdecode_finish(ce, &total_bits, &errs) ||
+	    total_bits != 0 || ncalls != 0) {
+	    printf("  bad finish after %u symbols\n", nsym);
+	    rv++;
+	}
+    }
+    free_convcode(ce);
+    return rv;
+}
 
-    printf("Random test k=%u %s %s polys={ 0%o", k,
-	   do_tail ? "tail" : "notail",
-	   recursive ? "recursive" : "non-recursive",
-	   polys[0]);
+/*
+ * LLR input should decode exactly like bits and uncertainties with a
+ * max uncertainty of 254, 127 - |llr| is the uncertainty.
+ */
+static int
+llr_input_test(unsigned int k, convcode_state *polys, unsigned int npolys,
+	       bool do_tail, const uint16_t *pattern, unsigned int period)
+{
+    struct stream_test_data t;
+    struct convcode *ce = alloc_convcode(o, k, polys, npolys, 1024,
+					 do_tail, false,
+					 NULL, NULL,
+					 handle_stream_test_output, &t);
+    unsigned char dec_bytes[128], enc_bytes[1024];
+    unsigned char out_bytes[128], llr_out_bytes[128], stream_bytes[128];
+    unsigned int out_unc[1024], llr_out_unc[1024];
+    uint8_t uncertainty[8192];
+    int8_t llrs[8192];
+    unsigned int i, j, nbits, nout, enc_nbits, errs, llr_errs, total_bits;
+    unsigned int rv = 0;
+    int mag;
+
+    printf("LLR input test k=%u %s polys={ 0%o", k,
+	   do_tail ? "tail" : "notail", polys[0]);
     for (i = 1; i < npolys; i++)
 	printf(", 0%o", polys[i]);
-    printf(" }\n");
+    printf(" }");
+    if (period) {
+	printf(" pattern={ %u", pattern[0]);
+	for (i = 1; i < period; i++)
+	    printf(", %u", pattern[i]);
+	printf(" }");
+    }
+    printf("\n");
 
-    for (i = 8; i < 32; i++) {
-	for (j = 0; j < 10; j++) {
-	    for (bit = 0; bit < i; bit++)
-		decoded[bit] = rand() & 1 ? '1' : '0';
-	    decoded[bit] = 0;
-	    t.outpos = 0;
-	    reinit_convcode(ce);
-	    do_encode_data(ce, decoded, &total_bits);
-	    memcpy(encoded, t.output, t.outpos);
-	    encoded[t.outpos] = '\0';
-	    t.outpos = 0;
-	    do_decode_data(ce, encoded, &total_bits, &num_errs, NULL);
-	    t.output[t.outpos] = '\0';
-	    if (strcmp(t.output, decoded) != 0) {
-		printf("  decode failure, expected\n    %s\n  got\n    %s\n",
-		       decoded, t.output);
-		rv++;
-	    }
-	    rv += rand_block_test(ce, encoded, decoded);
+    assert(ce);
+    if (set_puncture_pattern(ce, pattern, period)) {
+	printf("  bad puncture pattern\n");
+	rv++;
+	goto out;
+    }
+    set_decode_max_uncertainty(ce, 254);
+
+    for (i = 0; i < sizeof(dec_bytes); i++)
+	dec_bytes[i] = rand();
+    nbits = 100 + rand() % 900;
+    nout = nbits + (do_tail ? k - 1 : 0);
+    memset(enc_bytes, 0, sizeof(enc_bytes));
+    reinit_convencode(ce, CONVCODE_DEFAULT_START_STATE);
+    convencode_block(ce, dec_bytes, nbits, enc_bytes);
+    enc_nbits = nout * npolys;
+    if (period) {
+	enc_nbits = 0;
+	for (i = 0; i < nout; i++)
+	    enc_nbits += num_bits_set(pattern[i % period]);
+    }
+    assert(enc_nbits <= sizeof(llrs));
+
+    for (i = 0; i < enc_nbits; i++) {
+	mag = rand() % 129;
+	/* Some of them are wrong. */
+	if (rand() % 20 == 0)
+	    mag = -(rand() % 40);
+	if ((enc_bytes[i / 8] >> (i % 8)) & 1)
+	    mag = -mag;
+	if (mag < -127)
+	    mag = -128;
+	if (mag > 127)
+	    mag = 127;
+	llrs[i] = mag;
+	if (llrs[i] < 0) {
+	    enc_bytes[i / 8] |= 1 << (i % 8);
+	    uncertainty[i] = 127 + (llrs[i] < -127 ? -127 : llrs[i]);
+	} else {
+	    enc_bytes[i / 8] &= ~(1 << (i % 8));
+	    uncertainty[i] = 127 - llrs[i];
+	}
+    }
+
+    memset(out_bytes, 0, sizeof(out_bytes));
+    memset(llr_out_bytes, 0, sizeof(llr_out_bytes));
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (convdecode_block(ce, enc_bytes, enc_nbits, uncertainty,
+			 out_bytes, out_unc, &errs)) {
+	printf("  block decode error return\n");
+	rv++;
+	goto out;
+    }
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    if (convdecode_block_llr(ce, llrs, enc_nbits, llr_out_bytes,
+			     llr_out_unc, &llr_errs)) {
+	printf("  LLR block decode error return\n");
+	rv++;
+	goto out;
+    }
+    if (errs != llr_errs ||
+	memcmp(out_bytes, llr_out_bytes, (nbits + 7) / 8) ||
+	memcmp(out_unc, llr_out_unc, nbits * sizeof(out_unc[0]))) {
+	printf("  LLR block decode mismatch, %u bits\n", nbits);
+	rv++;
+	goto out;
+    }
+
+    /* Now stream it in odd-sized pieces. */
+    memset(stream_bytes, 0, sizeof(stream_bytes));
+    t.bytes = stream_bytes;
+    t.nbits = 0;
+    t.max_bits = sizeof(stream_bytes) * 8;
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    for (i = 0; i < enc_nbits; i += j) {
+	j = 1 + rand() % 7;
+	if (j > enc_nbits - i)
+	    j = enc_nbits - i;
+	if (convdecode_data_llr(ce, llrs + i, j)) {
+	    printf("  LLR stream decode error return\n");
+	    rv++;
+	    goto out;
 	}
     }
+    convdecode_finish(ce, &total_bits, &llr_errs);
+    if (total_bits != nbits || errs != llr_errs ||
+	memcmp(out_bytes, stream_bytes, (nbits + 7) / 8)) {
+	printf("  LLR stream decode mismatch, %u bits\n", nbits);
+	rv++;
+    }
+
+    /* 8-bit path values can't hold LLR costs. */
+    reinit_convdecode(ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    set_decode_metric_width(ce, 8);
+    if (!convdecode_data_llr(ce, llrs, enc_nbits) ||
+	!convdecode_block_llr(ce, llrs, enc_nbits, llr_out_bytes,
+			      NULL, &llr_errs)) {
+	printf("  LLR decode with 8-bit path values didn't fail\n");
+	rv++;
+    }
+
+ out:
     free_convcode(ce);
     return rv;
 }
@@ -1288,6 +9767,330 @@ run_tests(bool do_tail)
 	errs += rand_test(5, polys, 2, do_tail, true);
     }
 
+    {
+	convcode_state polys[2] = { 5, 7 };
+	errs += kernel_test(3, polys, 2, do_tail, false);
+    }
+    { /* More outputs than states, no branch metric table */
+	convcode_state polys[4] = { 7, 5, 3, 6 };
+	errs += kernel_test(3, polys, 4, do_tail, false);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += kernel_test(7, polys, 2, do_tail, false);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += kernel_test(7, polys, 3, do_tail, false);
+    }
+    { /* IS-95 */
+	convcode_state polys[2] = { 0753, 0561 };
+	errs += kernel_test(9, polys, 2, do_tail, false);
+    }
+    { /* CDMA 2000 */
+	convcode_state polys[4] = { 0671, 0645, 0473, 0537 };
+	errs += kernel_test(9, polys, 4, do_tail, false);
+    }
+    { /* Cassini / Mars Pathfinder */
+	convcode_state polys[7] = { 074000, 046321, 051271, 070535,
+	    063667, 073277, 076513 };
+	errs += kernel_test(15, polys, 7, do_tail, false);
+    }
+    { /* Big enough that the path values don't fit in L1 */
+	convcode_state polys[2] = { 046321, 051271 };
+	errs += kernel_test(15, polys, 2, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += kernel_test(4, polys, 2, do_tail, true);
+    }
+    {
+	convcode_state polys[2] = { 022, 021 };
+	errs += kernel_test(5, polys, 2, do_tail, true);
+    }
+
+    errs += kernel_tune_test();
+    {
+	convcode_state polys[2] = { 5, 7 };
+	errs += batch_test(3, polys, 2, do_tail, false);
+    }
+    { /* More outputs than states */
+	convcode_state polys[4] = { 7, 5, 3, 6 };
+	errs += batch_test(3, polys, 4, do_tail, false);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += batch_test(7, polys, 2, do_tail, false);
+    }
+    { /* CDMA 2000 */
+	convcode_state polys[4] = { 0671, 0645, 0473, 0537 };
+	errs += batch_test(9, polys, 4, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += batch_test(4, polys, 2, do_tail, true);
+    }
+    {
+	convcode_state polys[2] = { 5, 7 };
+	errs += bitslice_test(3, polys, 2, do_tail, false);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += bitslice_test(7, polys, 2, do_tail, false);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += bitslice_test(7, polys, 3, do_tail, false);
+    }
+    { /* CDMA 2000 */
+	convcode_state polys[4] = { 0671, 0645, 0473, 0537 };
+	errs += bitslice_test(9, polys, 4, do_tail, false);
+    }
+    { /* 8 outputs */
+	convcode_state polys[8] = { 023, 035, 027, 031, 037, 025, 033, 021 };
+	errs += bitslice_test(5, polys, 8, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += bitslice_test(4, polys, 2, do_tail, true);
+    }
+    if (do_tail) {
+	errs += sched_test(1);
+	errs += sched_test(4);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += encode_test(7, polys, 2, do_tail, false);
+    }
+    { /* CDMA 2000 */
+	convcode_state polys[4] = { 0671, 0645, 0473, 0537 };
+	errs += encode_test(9, polys, 4, do_tail, false);
+    }
+    { /* Cassini / Mars Pathfinder */
+	convcode_state polys[7] = { 074000, 046321, 051271, 070535,
+	    063667, 073277, 076513 };
+	errs += encode_test(15, polys, 7, do_tail, false);
+    }
+    { /* 8 outputs, fills the whole 64 bits per byte */
+	convcode_state polys[8] = { 023, 035, 027, 031, 037, 025, 033, 021 };
+	errs += encode_test(5, polys, 8, do_tail, false);
+    }
+    { /* Too many outputs for a byte at a time */
+	convcode_state polys[9] = { 023, 035, 027, 031, 037, 025, 033, 021,
+	    036 };
+	errs += encode_test(5, polys, 9, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += encode_test(4, polys, 2, do_tail, true);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += stream_test(7, polys, 2, do_tail, 32, false);
+	errs += stream_test(7, polys, 2, do_tail, 16, false);
+	errs += stream_test(7, polys, 2, do_tail, 8, false);
+	errs += stream_test(7, polys, 2, do_tail, 32, true);
+	errs += stream_test(7, polys, 2, do_tail, 8, true);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += stream_test(7, polys, 3, do_tail, 32, false);
+	errs += stream_test(7, polys, 3, do_tail, 8, false);
+	errs += stream_test(7, polys, 3, do_tail, 16, true);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	uint16_t r34[3] = { 3, 1, 2 };
+
+	errs += packed_test(7, polys, 2, do_tail, 4, NULL, 0);
+	errs += packed_test(7, polys, 2, do_tail, 3, NULL, 0);
+	errs += packed_test(7, polys, 2, do_tail, 3, r34, 3);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += packed_test(7, polys, 3, do_tail, 4, NULL, 0);
+	errs += packed_test(7, polys, 3, do_tail, 3, NULL, 0);
+	errs += packed_test(7, polys, 3, do_tail, 5, NULL, 0);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += growth_test(7, polys, 2, do_tail);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += growth_test(7, polys, 3, do_tail);
+    }
+    {
+	convcode_state polys[2] = { 046321, 051271 };
+	errs += growth_test(15, polys, 2, do_tail);
+    }
+    {
+	convcode_state polys[2] = { 5, 7 };
+	errs += merge_test(3, polys, 2, do_tail, 8);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += merge_test(7, polys, 2, do_tail, 35);
+	errs += merge_test(7, polys, 2, do_tail, 400);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += merge_test(7, polys, 3, do_tail, 70);
+    }
+
+    {
+	convcode_state polys[2] = { 5, 7 };
+	errs += llr_test(3, polys, 2, do_tail, false);
+    }
+    { /* More outputs than states, no branch metric table */
+	convcode_state polys[4] = { 7, 5, 3, 6 };
+	errs += llr_test(3, polys, 4, do_tail, false);
+    }
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += llr_test(7, polys, 2, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += llr_test(4, polys, 2, do_tail, true);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += reduced_test(7, polys, 2, do_tail, false, 0, 0);
+	errs += reduced_test(7, polys, 2, do_tail, false, 16, 0);
+	errs += reduced_test(7, polys, 2, do_tail, false, 0, 4);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 013, 015 };
+	errs += reduced_test(4, polys, 2, do_tail, true, 0, 0);
+	errs += reduced_test(4, polys, 2, do_tail, true, 4, 0);
+    }
+    { /* Cassini */
+	convcode_state polys[7] = { 074000, 046321, 051271, 070535,
+	    063667, 073277, 076513 };
+	errs += reduced_test(15, polys, 7, do_tail, false, 256, 0);
+	errs += reduced_test(15, polys, 7, do_tail, false, 1024, 20);
+    }
+    if (!do_tail) { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 013, 015 };
+	errs += turbo_test(4, polys, 2);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += parallel_test(7, polys, 2, do_tail);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += parallel_test(7, polys, 3, do_tail);
+    }
+    { /* Voyager, and rate 3/4 */
+	convcode_state polys[2] = { 0171, 0133 };
+	static const uint16_t pattern[3] = { 3, 1, 2 };
+	errs += parallel_encode_test(7, polys, 2, do_tail, NULL, 0);
+	errs += parallel_encode_test(7, polys, 2, do_tail, pattern, 3);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += parallel_encode_test(7, polys, 3, do_tail, NULL, 0);
+    }
+    { /* Too many outputs for a byte at a time */
+	convcode_state polys[9] = { 023, 035, 027, 031, 037, 025, 033, 021,
+	    036 };
+	errs += parallel_encode_test(5, polys, 9, do_tail, NULL, 0);
+    }
+    {
+	convcode_state polys[2] = { 046321, 051271 };
+	errs += parallel_encode_test(15, polys, 2, do_tail, NULL, 0);
+    }
+
+    { /* Voyager, rate 2/3, 3/4 and 7/8 */
+	convcode_state polys[2] = { 0171, 0133 };
+	uint16_t r23[2] = { 3, 1 }, r34[3] = { 3, 1, 2 };
+	uint16_t r78[7] = { 3, 2, 2, 2, 1, 2, 1 };
+
+	errs += puncture_test(7, polys, 2, do_tail, r23, 2);
+	errs += puncture_test(7, polys, 2, do_tail, r34, 3);
+	errs += puncture_test(7, polys, 2, do_tail, r78, 7);
+    }
+    { /* LTE, rate 1/2 */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	uint16_t r12[3] = { 5, 3, 6 };
+
+	errs += puncture_test(7, polys, 3, do_tail, r12, 3);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += buffer_test(7, polys, 2, do_tail);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += buffer_test(7, polys, 3, do_tail);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += init_test(7, polys, 2, do_tail);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += init_test(7, polys, 3, do_tail);
+    }
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	errs += shared_code_test(7, polys, 2, do_tail, false);
+    }
+
+    errs += stats_test(do_tail);
+    if (do_tail)
+	errs += short_tail_test();
+
+    { /* Voyager */
+	convcode_state polys[2] = { 0171, 0133 };
+	uint16_t r34[3] = { 3, 1, 2 };
+
+	errs += llr_input_test(7, polys, 2, do_tail, NULL, 0);
+	errs += llr_input_test(7, polys, 2, do_tail, r34, 3);
+    }
+    { /* LTE */
+	convcode_state polys[3] = { 0117, 0127, 0155 };
+	errs += llr_input_test(7, polys, 3, do_tail, NULL, 0);
+    }
+    { /* Cassini / Mars Pathfinder */
+	convcode_state polys[7] = { 074000, 046321, 051271, 070535,
+	    063667, 073277, 076513 };
+	errs += llr_input_test(15, polys, 7, do_tail, NULL, 0);
+    }
+    { /* Cassini / Mars Pathfinder */
+	convcode_state polys[7] = { 074000, 046321, 051271, 070535,
+	    063667, 073277, 076513 };
+	errs += shared_code_test(15, polys, 7, do_tail, false);
+    }
+    { /* Constituent code in 3GPP 25.212 Turbo Code */
+	convcode_state polys[2] = { 012, 015 };
+	errs += shared_code_test(4, polys, 2, do_tail, true);
+    }
+
+    if (!do_tail) {
+	{ /* Voyager */
+	    convcode_state polys[2] = { 0171, 0133 };
+	    errs += tailbiting_test(7, polys, 2);
+	}
+	{ /* LTE */
+	    convcode_state polys[3] = { 0133, 0171, 0165 };
+	    errs += tailbiting_test(7, polys, 3);
+	}
+	{
+	    convcode_state polys[2] = { 5, 7 };
+	    errs += tailbiting_test(3, polys, 2);
+	}
+    }
+
     printf("%u errors\n", errs);
     return !!errs;
 }
@@ -1302,6 +10105,9 @@ main(int argc, char *argv[])
     unsigned int arg, total_bits, num_errs = 0;
     bool decode = false, test = false, do_tail = true, recursive = false;
     unsigned int start_state = 0, init_val = CONVCODE_DEFAULT_INIT_VAL;
+    const char *infile = NULL, *llrfile = NULL, *outfile = NULL;
+    unsigned int depth = 0, window = 0;
+    unsigned long long nbits = 0;
 
     for (arg = 1; arg < argc; arg++) {
 	if (argv[arg][0] != '-')
@@ -1341,6 +10147,48 @@ main(int argc, char *argv[])
 		return 1;
 	    }
 	    polys[num_polys++] = strtoul(argv[arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-f") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -f\n");
+		return 1;
+	    }
+	    infile = argv[arg];
+	} else if (strcmp(argv[arg], "-l") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -l\n");
+		return 1;
+	    }
+	    llrfile = argv[arg];
+	} else if (strcmp(argv[arg], "-o") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -o\n");
+		return 1;
+	    }
+	    outfile = argv[arg];
+	} else if (strcmp(argv[arg], "-n") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -n\n");
+		return 1;
+	    }
+	    nbits = strtoull(argv[arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-D") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -D\n");
+		return 1;
+	    }
+	    depth = strtoul(argv[arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-w") == 0) {
+	    arg++;
+	    if (arg >= argc) {
+		fprintf(stderr, "No data supplied for -w\n");
+		return 1;
+	    }
+	    window = strtoul(argv[arg], NULL, 0);
 	} else {
 	    fprintf(stderr, "unknown option: %s\n", argv[arg]);
 	    return 1;
@@ -1367,14 +10215,45 @@ main(int argc, char *argv[])
 	return 1;
     }
 
-    ce = alloc_convcode(o, k, polys, num_polys, 128, do_tail, recursive,
+    if (llrfile && !decode) {
+	fprintf(stderr, "-l only works for decoding\n");
+	return 1;
+    }
+    if (infile || llrfile) {
+	if (!depth)
+	    depth = 5 * k;
+	if (!window)
+	    window = 8 * depth;
+    } else {
+	window = 128;
+    }
+
+    ce = alloc_convcode(o, k, polys, num_polys, window, do_tail, recursive,
 			handle_output, NULL,
 			handle_output, NULL);
+    if (!ce) {
+	fprintf(stderr, "Unable to allocate the coder\n");
+	return 1;
+    }
     if (start_state)
 	reinit_convencode(ce, start_state);
     if (start_state || init_val != CONVCODE_DEFAULT_INIT_VAL)
 	reinit_convdecode(ce, start_state, init_val);
 
+    if (infile || llrfile) {
+	int rv;
+
+	if (decode && set_decode_traceback_depth(ce, depth)) {
+	    fprintf(stderr, "Traceback depth must be from k to less than"
+		    " the window size\n");
+	    rv = 1;
+	} else {
+	    rv = process_file(ce, decode, infile, llrfile, outfile, nbits);
+	}
+	free_convcode(ce);
+	return rv;
+    }
+
     if (arg >= argc) {
 	fprintf(stderr, "No data given\n");
 	return 1;
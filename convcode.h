@@ -25,12 +25,12 @@
 #define CONVCODE_MAX_POLYNOMIALS 16
 
 struct convcode;
+struct convcode_code;
 
 /*
  * This is the size of the polynomials and thus the maximum state
- * machine size, and the value to hold the state.  Keep it as small as
- * possible to reduce the trellis size.  Size of K is limited by this
- * value.
+ * machine size, and the value to hold the state.  Size of K is
+ * limited by this value.
  */
 typedef uint16_t convcode_state;
 #define CONVCODE_MAX_K 16
@@ -41,6 +41,13 @@ typedef uint16_t convcode_state;
 typedef int (*convcode_output)(struct convcode *ce, void *user_data,
 			       unsigned char byte, unsigned int nbits);
 
+/*
+ * Used to hand over a buffer full of output bits, see
+ * set_encode_output_buffer().
+ */
+typedef int (*convcode_output_buffer)(struct convcode *ce, void *user_data,
+				      unsigned char *buf, unsigned int nbits);
+
 /*
  * Allocate a convolutional coder for coding or decoding.
  *
@@ -53,8 +60,11 @@ typedef int (*convcode_output)(struct convcode *ce, void *user_data,
  * expect.  There may be up to CONVCODE_MAX_POLYNOMIALS polynomials.
  *
  * max_decode_len_bits is the maximum number of bits that can be
- * decoded.  You can get a pretty big matrix from this.  If you say 0
- * here, you can only use the coder for encoding.
+ * decoded.  That's the decoded bits, not the received bits; the
+ * trellis has a column per symbol, max_decode_len_bits + k *
+ * num_polynomials of them.  You can get a pretty big matrix from
+ * this, see set_decode_trellis_growth() for a way around that.  If
+ * you say 0 here, you can only use the coder for encoding.
  *
  * See the discussion below on tails for what do_tail does.
  *
@@ -85,11 +95,108 @@ struct convcode *alloc_convcode(convcode_os_funcs *o,
 				void *dec_out_user_data);
 
 
+/*
+ * All the tables for a coder live in a single block of memory, with
+ * each table starting on a CONVCODE_ALIGN byte boundary so the hot
+ * decoder arrays don't share cache lines with anything else.
+ */
+#define CONVCODE_ALIGN 64
+
+/*
+ * Return the number of bytes of memory a coder with the given
+ * parameters needs, for use with init_convcode().  Returns 0 if the
+ * parameters are invalid.  This does not include the memory that
+ * batch, LLR, or parallel decoding allocates the first time they are
+ * used.
+ */
+unsigned long convcode_size(unsigned int k, unsigned int num_polynomials,
+			    unsigned int max_decode_len_bits);
+
+/*
+ * Like alloc_convcode(), but the coder is built in memory you
+ * provide.  mem must be at least convcode_size() bytes and aligned
+ * on a CONVCODE_ALIGN boundary, otherwise NULL is returned.  The
+ * memory need not be zeroed.
+ *
+ * o may be NULL, it is only used for the memory that batch, LLR, and
+ * parallel decoding allocate when they are first used.  If it is NULL
+ * those return 1 unless you have set up their memory yourself, see
+ * the discussion at the end of this file.
+ *
+ * You can call free_convcode() to free that extra memory, mem itself
+ * is yours to free after that.
+ */
+struct convcode *init_convcode(void *mem, convcode_os_funcs *o,
+			       unsigned int k, convcode_state *polynomials,
+			       unsigned int num_polynomials,
+			       unsigned int max_decode_len_bits,
+			       bool do_tail, bool recursive,
+			       convcode_output enc_output,
+			       void *enc_out_user_data,
+			       convcode_output dec_output,
+			       void *dec_out_user_data);
+
 /*
  * Free an allocated coder.
  */
 void free_convcode(struct convcode *ce);
 
+/*
+ * Shared code tables
+ *
+ * The tables for encoding and decoding depend only on k, the
+ * polynomials, and whether the code is recursive, and a coder never
+ * changes them.  If you have a lot of channels using the same code,
+ * you can build the tables once in a struct convcode_code and create
+ * each channel's coder from it.  The coder then only has its own
+ * trellis, path values, and output state, which makes it smaller and
+ * a lot quicker to create.
+ *
+ * The code is reference counted.  alloc_convcode_code() returns it
+ * with one reference, each coder created from it holds another until
+ * free_convcode(), and free_convcode_code() drops one, freeing it
+ * when the last one goes.  Only the reference count changes after
+ * it's created, so coders using it may run in different threads.
+ *
+ * The parameters have the same meaning as for alloc_convcode().
+ */
+struct convcode_code *alloc_convcode_code(convcode_os_funcs *o,
+					  unsigned int k,
+					  convcode_state *polynomials,
+					  unsigned int num_polynomials,
+					  bool recursive);
+
+/* Add a reference to the code. */
+void convcode_code_ref(struct convcode_code *code);
+
+/* Drop a reference to the code, freeing it if it is the last one. */
+void free_convcode_code(struct convcode_code *code);
+
+/*
+ * Like alloc_convcode(), convcode_size(), and init_convcode(), but
+ * take the code parameters and tables from code.  The coder holds a
+ * reference to code until free_convcode() is called on it, so it's
+ * fine to free your reference to code right after this.
+ */
+unsigned long convcode_size_from_code(struct convcode_code *code,
+				      unsigned int max_decode_len_bits);
+struct convcode *alloc_convcode_from_code(convcode_os_funcs *o,
+					  struct convcode_code *code,
+					  unsigned int max_decode_len_bits,
+					  bool do_tail,
+					  convcode_output enc_output,
+					  void *enc_out_user_data,
+					  convcode_output dec_output,
+					  void *dec_out_user_data);
+struct convcode *init_convcode_from_code(void *mem, convcode_os_funcs *o,
+					 struct convcode_code *code,
+					 unsigned int max_decode_len_bits,
+					 bool do_tail,
+					 convcode_output enc_output,
+					 void *enc_out_user_data,
+					 convcode_output dec_output,
+					 void *dec_out_user_data);
+
 /*
  * Convolutional tail
  *
@@ -123,7 +230,9 @@ void free_convcode(struct convcode *ce);
  * On the decode side, first run with the start_state to 0 and
  * init_other_paths to a smaller number like 256.  Then determine the
  * last bits and use those for start_state and
- * CONVCODE_DEFAULT_INIT_VAL for init_other_states.
+ * CONVCODE_DEFAULT_INIT_VAL for init_other_states.  Or use
+ * convdecode_tailbiting(), which does all this for you and is
+ * usually faster.
  */
 
 /*
@@ -167,6 +276,38 @@ void reinit_convcode(struct convcode *ce);
  */
 void set_encode_output_per_symbol(struct convcode *ce, bool val);
 
+/*
+ * Output buffers
+ *
+ * Calling the output function for every byte is a lot of overhead at
+ * high data rates.  Instead you can give the encoder or the decoder a
+ * buffer, and the output bits are stored straight into it, 64 bits
+ * at a time, in the normal bit format.  When the buffer is full and
+ * there is more output, the full function is called with the buffer
+ * and the number of bits in it (size * 8) and the buffer is used
+ * again from the start.  convencode_finish() and convdecode_finish()
+ * call it with whatever is left, if there is anything.  If full
+ * returns an error, the operation is stopped and the error returned,
+ * like the output function.
+ *
+ * full may be NULL if the buffer is big enough for all the output.
+ * Then the output is just left in the buffer, total_out_bits from the
+ * finish function says how much there is, and running out of room
+ * is an error that returns 1.
+ *
+ * size is in bytes and must be a multiple of 8, this returns 1 if
+ * not.  This starts output at the beginning of the buffer, so set it
+ * before encoding or decoding or after a reinit.  Setting buf to NULL
+ * goes back to the output function.  The per-symbol output setting
+ * has no effect with a buffer.
+ */
+int set_encode_output_buffer(struct convcode *ce, unsigned char *buf,
+			     unsigned int size, convcode_output_buffer full,
+			     void *user_data);
+int set_decode_output_buffer(struct convcode *ce, unsigned char *buf,
+			     unsigned int size, convcode_output_buffer full,
+			     void *user_data);
+
 /*
  * This is for handling soft decoding.  Soft decoding takes into
  * account how certain (or, in this case, uncertain) a particular bit
@@ -193,6 +334,204 @@ void set_encode_output_per_symbol(struct convcode *ce, bool val);
  */
 void set_decode_max_uncertainty(struct convcode *ce, uint8_t max_uncertainty);
 
+/*
+ * The decoder's inner loop (the add-compare-select over all the
+ * states for each symbol) has several implementations.  The scalar
+ * one works everywhere, the others use SIMD instructions and need a
+ * processor that supports them and at least as many states as the
+ * vector has lanes (4 for SSE4.1 and NEON, 8 for AVX2, 16 for
+ * AVX-512).  All of them give exactly the same results.
+ *
+ * By default (CONVCODE_KERNEL_AUTO) the widest one available is
+ * chosen when the coder is allocated.  You can force a specific one
+ * with set_decode_kernel(), which returns 1 if the kernel is not
+ * available on this processor or for this code, and leaves the
+ * current kernel in place.  get_decode_kernel() returns the one in
+ * use, never CONVCODE_KERNEL_AUTO or CONVCODE_KERNEL_TUNE.
+ *
+ * The widest isn't always the fastest, that depends on k, the rate,
+ * the path value width and the processor.  CONVCODE_KERNEL_TUNE times
+ * each usable kernel running the decoder for this coder, which takes
+ * a few milliseconds, and uses the fastest.  Timing them throws away
+ * any decode in progress and reinitializes the decoder with the start
+ * state and init value last passed to reinit_convdecode().  The
+ * winner is remembered (for all coders in the process) by k, number
+ * of polynomials and path value width, so it is only timed once, and
+ * CONVCODE_KERNEL_AUTO uses it too once it is known.  Changing the
+ * path value width picks the kernel again the same way.
+ * Timing needs a cycle counter, so this is only done on x86 and ARM64,
+ * elsewhere it's the same as CONVCODE_KERNEL_AUTO.
+ *
+ * If the CONVCODE_KERNEL environment variable is set to a kernel name
+ * (see convcode_kernel_name()) the automatic choice uses that kernel
+ * instead, if it's usable.  Set it to "tune" to make
+ * CONVCODE_KERNEL_AUTO tune, including when a coder is allocated.
+ *
+ * Compile with -DCONVCODE_NO_SIMD to leave out all the SIMD kernels.
+ */
+enum convcode_kernel {
+    CONVCODE_KERNEL_AUTO,
+    CONVCODE_KERNEL_SCALAR,
+    CONVCODE_KERNEL_SSE41,
+    CONVCODE_KERNEL_AVX2,
+    CONVCODE_KERNEL_AVX512,
+    CONVCODE_KERNEL_NEON,
+    CONVCODE_KERNEL_TUNE,
+};
+
+int set_decode_kernel(struct convcode *ce, enum convcode_kernel kernel);
+enum convcode_kernel get_decode_kernel(struct convcode *ce);
+
+/*
+ * The names of the kernels: "auto", "scalar", "sse41", "avx2",
+ * "avx512", "neon" and "tune".  convcode_kernel_name() returns NULL
+ * for an invalid kernel, convcode_kernel_from_name() returns 1 for an
+ * unknown name.
+ */
+const char *convcode_kernel_name(enum convcode_kernel kernel);
+int convcode_kernel_from_name(const char *name, enum convcode_kernel *kernel);
+
+/*
+ * Save and restore the tuned kernels, so you can keep them in a file
+ * and not have to tune again every time your program starts.
+ *
+ * get_convcode_kernel_tuning() writes them into buf as text, one line
+ * of "<k> <number of polynomials> <path value width> <kernel name>"
+ * each, nul terminated.  Like snprintf() it returns the length of the
+ * whole thing, not counting the nul, even if it didn't fit in size.
+ *
+ * set_convcode_kernel_tuning() replaces the tuned kernels with the
+ * ones in str, in the same format, so an empty string clears them.
+ * It returns 1, without changing anything, if str is not valid.  A
+ * kernel that isn't usable on this processor is just ignored.
+ */
+unsigned int get_convcode_kernel_tuning(char *buf, unsigned int size);
+int set_convcode_kernel_tuning(const char *str);
+
+/*
+ * Path metric width
+ *
+ * The decoder keeps a running path value (the total errors or
+ * uncertainty along the best path) for each state.  By default these
+ * are 32 bits.  They can also be 16 or 8 bits, which lets the SIMD
+ * kernels do two or four times as many states per instruction, and
+ * uses less memory.  The 8-bit SIMD kernels can only handle codes with
+ * up to 4 polynomials.
+ *
+ * Whatever the width, when the path values get too big the minimum
+ * value is subtracted from all of them, so they can't overflow on
+ * long streams.  The amount subtracted is remembered, num_errs and
+ * the output uncertainties are the same as if it was never done.
+ *
+ * The 16 and 8-bit path values saturate at their maximum value.  As
+ * long as the range between the best and worst paths fits in about
+ * half the width, that never happens and you get the same results as
+ * 32 bits.  For 16 bits that's basically always true.  For 8 bits it
+ * is true for hard decoding of the common codes, but not with soft
+ * decoding with the default max uncertainty of 100; use something
+ * like set_decode_max_uncertainty(ce, 7) for that.  Saturation makes
+ * the decoding a little worse, it doesn't break it.  The init value
+ * for the other states given to reinit_convdecode() is limited to a
+ * quarter of the width's maximum value.
+ *
+ * bits must be 8, 16, or 32, this returns 1 if it's not.  This
+ * selects the decode kernel again as if CONVCODE_KERNEL_AUTO was set,
+ * and you must call reinit_convdecode() after this.
+ */
+int set_decode_metric_width(struct convcode *ce, unsigned int bits);
+
+/*
+ * Statistics
+ *
+ * If compiled with -DCONVCODE_STATS, each coder keeps counts of what
+ * it has done, to see where the time goes.  Without it the counting
+ * code isn't there and get_convcode_stats() returns 1.  The counts
+ * are:
+ *
+ *   symbols_decoded - Symbols run through the trellis, for every
+ *     frame in convdecode_batch().
+ *   acs_butterflies - Add-compare-select butterflies done, two states
+ *     each.
+ *   traceback_steps - Trellis columns traced back through.
+ *   output_calls - Calls to the encoder and decoder output functions,
+ *     including the output buffer full functions.
+ *   renormalizations - Times the path values were renormalized, see
+ *     set_decode_metric_width().
+ *   trellis_overflows - Times decoding failed because the data was
+ *     bigger than max_decode_len_bits.
+ *   merged_bits - Bits output early because all the survivors had
+ *     merged, see set_decode_merge_interval().
+ *
+ * convdecode_block_parallel() adds in the counts from all its
+ * segments.  convdecode_llr() isn't counted.
+ *
+ * Reading the cycle counter for every symbol isn't free, so timing is
+ * off until set_convcode_stats_timing() turns it on.  It returns 1 if
+ * stats aren't compiled in or there's no cycle counter for this
+ * processor (the TSC on x86, the virtual counter on ARM64).  Then
+ * the cycles spent are added to:
+ *
+ *   decode_cycles - Processing each symbol, branch metrics, the
+ *     add-compare-select, and renormalization.
+ *   traceback_cycles - Tracing back through the trellis and
+ *     generating the output, for convdecode_finish(),
+ *     convdecode_block(), convdecode_batch(), and streaming.
+ *   encode_cycles - The encoding loops in convencode_data() and
+ *     convencode_block() and friends.
+ *
+ * The counts start at 0 when the coder is allocated and are only
+ * cleared by reset_convcode_stats(), not by reinit.  Output function
+ * time is in whatever it was called from.
+ */
+struct convcode_stats {
+    uint64_t symbols_decoded;
+    uint64_t acs_butterflies;
+    uint64_t traceback_steps;
+    uint64_t output_calls;
+    uint64_t renormalizations;
+    uint64_t trellis_overflows;
+    uint64_t merged_bits;
+    uint64_t decode_cycles;
+    uint64_t traceback_cycles;
+    uint64_t encode_cycles;
+};
+
+int get_convcode_stats(struct convcode *ce, struct convcode_stats *stats);
+void reset_convcode_stats(struct convcode *ce);
+int set_convcode_stats_timing(struct convcode *ce, bool enable);
+
+/*
+ * Puncturing
+ *
+ * A punctured code leaves some of the encoded bits out to get a
+ * higher rate from the same code.  The pattern is an array of period
+ * entries, one for each symbol (input bit), repeated over and over.
+ * Bit n of an entry is set if the output of polynomial n is sent.
+ * For instance, the common rate 3/4 code from the rate 1/2 Voyager
+ * code sends both bits of the first symbol, the first bit of the
+ * second, and the second bit of the third, which is { 3, 1, 2 }.
+ *
+ * The encoder leaves the punctured bits out of its output, so the
+ * output is only the bits that are sent, and with per-symbol output
+ * each symbol only has its sent bits.  The decoder takes the
+ * punctured data as it comes, nbits is the number of bits received
+ * and the uncertainty array has an entry for each of them.  The
+ * missing bits are treated as erasures, they cost nothing whatever
+ * the encoded output was.  The tail is punctured like everything
+ * else.  The pattern starts over at the first entry on a reinit.
+ *
+ * Every entry must have at least one bit set and no bits for
+ * polynomials that don't exist, and period must be no more than
+ * CONVCODE_MAX_PUNCTURE_PERIOD; this returns 1 if not.  A period of 0
+ * (the default) turns puncturing off.  convdecode_batch() and
+ * convdecode_block_parallel() can't handle puncturing and will return
+ * 1 if it is on.
+ */
+#define CONVCODE_MAX_PUNCTURE_PERIOD 32
+
+int set_puncture_pattern(struct convcode *ce, const uint16_t *pattern,
+			 unsigned int period);
+
 /*
  * Feed some data into encoder.  The size is given in bits, the data
  * goes in low bit first.  The last byte does not have to be completely
@@ -218,7 +557,8 @@ int convencode_finish(struct convcode *ce, unsigned int *total_out_bits);
  * outbytes, which must be large enough to hold the full encoded
  * output.  If tail is set, then this will be ((nbits + k - 1) *
  * num_polynomials).  If tail is not set, this will be (nbits *
- * num_polynomials).  The output function is not used in this case.
+ * num_polynomials).  With puncturing it is only the bits that are
+ * sent.  The output function is not used in this case.
  * If doing partial blocks, outbitpos is the current output bit position.
  * Pass in 0 if not using partial blocks, pass in the output of outbitpos
  * if you are.
@@ -240,6 +580,30 @@ void convencode_block_final(struct convcode *ce,
 			    const unsigned char *bytes, unsigned int nbits,
 			    unsigned char *outbytes, unsigned int outbitpos);
 
+/*
+ * Parallel block encoding
+ *
+ * With a non-recursive code the encoder state at any point in the
+ * input is just the k - 1 input bits before it.  So
+ * convencode_block_parallel() splits a block into nsegments pieces,
+ * starts each one from the bits before it, and encodes them at the
+ * same time with the run_parallel() function in the coder's OS
+ * functions, each straight into its place in outbytes.  The output is
+ * the same as convencode_block()'s, starting from the state given to
+ * reinit_convencode(), so outbytes must be zeroed and big enough for
+ * the whole thing, and the encoder is left in the state at the end.
+ *
+ * Segments are rounded to a multiple of 8 input bits (8 puncture
+ * periods with puncturing) so every segment starts on a byte in both
+ * the input and the output and they don't share any bytes.  So you
+ * may get fewer segments than you ask for.  Returns 1, without
+ * encoding anything, for a recursive code, if nsegments is 0, or if
+ * memory can't be allocated.
+ */
+int convencode_block_parallel(struct convcode *ce,
+			      const unsigned char *bytes, unsigned int nbits,
+			      unsigned char *outbytes, unsigned int nsegments);
+
 /*
  * Feed some data into decoder.  The size is given in bits, the data
  * goes in low bit first.  The last byte may not be completely full,
@@ -256,6 +620,29 @@ int convdecode_data(struct convcode *ce,
 		    const unsigned char *bytes, unsigned int nbits,
 		    const uint8_t *uncertainty);
 
+/*
+ * Like convdecode_data(), but the uncertainties are packed width bits
+ * each, low bit first like the data, so with a width of 4 there are
+ * two per byte and with 3, eight in every three bytes.  Demodulators
+ * rarely have more than a few bits of real soft information, and a
+ * byte per bit can be more memory traffic than the decoding.  The
+ * uncertainties are unpacked as each symbol is decoded.
+ *
+ * The values go from 0 to set_decode_max_uncertainty(), like always,
+ * so you'll want to set that to something that fits.  For instance,
+ * with 4 bits setting it to 30 makes 15 50% uncertain.
+ *
+ * Like bytes, uncertainty starts over for each call, its first value
+ * is for the first bit of bytes, so if you split a packed array
+ * across calls, split it where a value starts a byte.  Symbols split
+ * across calls are fine, like convdecode_data().  width may be from 1 to
+ * 8, this returns 1 if it's not; 8 is the same as convdecode_data().
+ * There is no block version, use this and convdecode_finish().
+ */
+int convdecode_data_packed(struct convcode *ce,
+			   const unsigned char *bytes, unsigned int nbits,
+			   const uint8_t *uncertainty, unsigned int width);
+
 /*
  * Once all the data has been fed for decoding, you must call this to
  * finish the operation.  Output will be done from here.  The total
@@ -278,13 +665,15 @@ int convdecode_finish(struct convcode *ce, unsigned int *total_out_bits,
  * The output data is stored in outbits, in the normal bit format
  * everything else uses.  With a tail, the output array must be at
  * least (nbits / num_polynomials - k - 1) *bits* long.  If tail is
- * off, it must be (nbits / num_polynomials) long.
+ * off, it must be (nbits / num_polynomials) long.  If puncturing,
+ * it is one bit for each symbol, not each num_polynomials bits.
  *
  * If output_uncertainty is not NULL, the uncertainty of each output
  * bit is stored in this array.  It must be the same length as the
- * number of bits in outbytes.  This is basically a full BCJR
- * algorithm; the output uncertainty can be used to compute the
- * probabilities of each output bit.  (Output uncertainties are not
+ * number of bits in outbytes.  This is a cheap stand-in for BCJR;
+ * the output uncertainty can be used to estimate the probabilities
+ * of each output bit.  See convdecode_llr() for real per-bit soft
+ * outputs.  (Output uncertainties are not
  * provided in the standard output routine because that would require
  * keeping a lot of extra data in the convcode structure.  You would
  * only really use this if you were using blocks, anyway, so there's
@@ -306,6 +695,510 @@ int convdecode_block(struct convcode *ce, const unsigned char *bytes,
 		     unsigned char *outbytes, unsigned int *output_uncertainty,
 		     unsigned int *num_errs);
 
+/*
+ * LLR input
+ *
+ * Many demodulators give a signed 8-bit log likelihood ratio for each
+ * received bit instead of a hard bit and an uncertainty.  These take
+ * an array of those, one per received bit, instead of bytes and
+ * uncertainty, and are otherwise the same as convdecode_data() and
+ * convdecode_block().  Positive means the bit is more likely a 0,
+ * negative a 1, 0 means no idea, the same as the llrs from
+ * convdecode_llr().  -128 is treated as -127.
+ *
+ * Expecting a 0 costs 127 - llr and expecting a 1 costs 127 + llr,
+ * so path values, num_errs and the output uncertainties are on a
+ * scale of 254 per bit, and set_decode_max_uncertainty() doesn't
+ * apply.  That's too much for 8-bit path values, these return 1 if
+ * the path values are 8 bits, use 16 or 32.  With puncturing, the
+ * array only has entries for the bits that are sent.
+ *
+ * You can feed convdecode_data_llr() in multiple calls like
+ * convdecode_data(), but don't mix the two in one decode.
+ */
+int convdecode_data_llr(struct convcode *ce, const int8_t *llrs,
+			unsigned int nbits);
+int convdecode_block_llr(struct convcode *ce, const int8_t *llrs,
+			 unsigned int nbits, unsigned char *outbytes,
+			 unsigned int *output_uncertainty,
+			 unsigned int *num_errs);
+
+/*
+ * Decode a tail-biting block (see the discussion of tails above) with
+ * the wrap-around Viterbi algorithm.  The first pass starts with
+ * every state equally likely.  If the best path at the end finishes
+ * in the state it started in, that's the answer.  If not, the path
+ * values at the end are used as the starting path values for another
+ * pass over the data, as if the block was repeated, which pushes the
+ * best path toward one that wraps around properly.  That usually only
+ * takes one or two passes.  The trellis is reused for each pass.
+ *
+ * max_passes is the most passes to do, 0 gives the default of
+ * CONVCODE_DEFAULT_TAILBITING_PASSES.  If no pass finds a tail-biting
+ * path, the best path of the last pass is used.  passes (may be NULL)
+ * is set to the number of passes it took to find it, or 0 if it
+ * didn't.
+ *
+ * Otherwise this works like convdecode_block() on a freshly
+ * reinitialized coder.  The coder must be allocated with do_tail
+ * false, and num_errs and the output uncertainties don't include
+ * the starting path value.  Returns 1 if the data is too large, in
+ * streaming mode, or if do_tail is set.
+ */
+#define CONVCODE_DEFAULT_TAILBITING_PASSES 4
+
+int convdecode_tailbiting(struct convcode *ce, const unsigned char *bytes,
+			  unsigned int nbits, const uint8_t *uncertainty,
+			  unsigned char *outbytes,
+			  unsigned int *output_uncertainty,
+			  unsigned int *num_errs, unsigned int max_passes,
+			  unsigned int *passes);
+
+/*
+ * Soft output decoding
+ *
+ * Decode a full block with the Max-Log-MAP (BCJR in the log domain
+ * with the max approximation) algorithm.  A forward pass computes the
+ * best path cost from the start to each state at each symbol, a
+ * backward pass the best path cost from each state to the end, and
+ * for each bit the best complete path with that bit a 1 is compared
+ * to the best one with it a 0.  The decoding starts at
+ * CONVCODE_DEFAULT_START_STATE, and with a tail the tail input bits
+ * are known to be 0.  The parameters are the same as
+ * convdecode_block(), except:
+ *
+ * llrs gets one value per output bit: the cost of the best path with
+ * the bit set to 1 minus the cost of the best path with it set to 0.
+ * So it is positive if the bit is more likely a 0, negative if it is
+ * more likely a 1, and 0 if it can't tell, and the magnitude is how
+ * sure it is.  The costs are the same as num_errs, the number of
+ * errors for hard decoding or the uncertainty for soft decoding, so
+ * to get a real log likelihood ratio scale it for your channel.
+ *
+ * outbytes may be NULL, if not it gets the hard decisions from the
+ * llrs, with 0 for llrs that are 0.  num_errs (may be NULL) is the
+ * cost of the best path.  Without a tail, the bits with non-zero
+ * llrs and num_errs are the same as convdecode_block() gives.  With
+ * one they can differ when there are a lot of errors, because
+ * convdecode_block() doesn't use the tail inputs being 0.
+ *
+ * This needs a path value for each state for each symbol, so the
+ * first time it is called it allocates 32 times the trellis memory.
+ * It doesn't touch the state of the normal decoder.  Returns 1 if the
+ * data is too large for max_decode_len_bits or the memory can't be
+ * allocated.
+ */
+int convdecode_llr(struct convcode *ce, const unsigned char *bytes,
+		   unsigned int nbits, const uint8_t *uncertainty,
+		   int32_t *llrs, unsigned char *outbytes,
+		   unsigned int *num_errs);
+
+/*
+ * Reduced-state decoding
+ *
+ * Viterbi decoding works on every state for every symbol, which gets
+ * slow for big k; k=15 has 16384 states.  Most of those paths are
+ * hopeless and don't need to be followed.  convdecode_reduced() only
+ * keeps the best max_states paths (the M-algorithm), and/or only the
+ * paths whose cost is within threshold of the best one (the
+ * T-algorithm).  The work per symbol is proportional to the number
+ * of paths kept instead of the number of states.  The price is that
+ * sometimes the right path gets dropped when there are a lot of
+ * errors, so it doesn't correct quite as well as the full decoder.
+ *
+ * max_states of 0 means no limit (num_states), a threshold of 0 means
+ * no threshold.  The threshold is in the same units as num_errs, the
+ * number of hard bit errors or the total uncertainty for soft
+ * decoding.  It's per decoder, and must be set before
+ * convdecode_reduced() is used.
+ *
+ * The parameters to convdecode_reduced() are the same as
+ * convdecode_block(), without the output uncertainty.  It always
+ * starts at CONVCODE_DEFAULT_START_STATE.  With a tail, the tail input
+ * bits are known to be 0, like convencode_finish() feeds in; for a
+ * recursive code that doesn't take the encoder back to state 0, so
+ * the best of whatever states those inputs lead to is used.  It
+ * doesn't use or touch the state of the normal decoder.
+ *
+ * Instead of the trellis it keeps a 16-bit entry per kept path for
+ * each symbol.  With ce->o set, the memory for that is allocated the
+ * first time convdecode_reduced() is used, and again if max_states or
+ * max_decode_len_bits is changed.  max_decode_len_bits is the biggest
+ * block convdecode_reduced() can decode, like for alloc_convcode(); 0
+ * uses the coder's.  If you only do reduced decoding, allocate the
+ * coder with a max_decode_len_bits of 0 and give it here instead.
+ * Then the coder has no trellis or path values at all, which is most
+ * of the memory for big k, only the kept paths.
+ *
+ * set_decode_reduced_states() returns 1 if neither it nor the coder
+ * has a max_decode_len_bits.  convdecode_reduced() returns 1 if
+ * max_states isn't set, or the data is too large for
+ * max_decode_len_bits, or the memory can't be allocated.
+ */
+int set_decode_reduced_states(struct convcode *ce, unsigned int max_states,
+			      unsigned int threshold,
+			      unsigned int max_decode_len_bits);
+int convdecode_reduced(struct convcode *ce, const unsigned char *bytes,
+		       unsigned int nbits, const uint8_t *uncertainty,
+		       unsigned char *outbytes, unsigned int *num_errs);
+
+/*
+ * Turbo codes
+ *
+ * A turbo coder is two copies of a recursive code (see recursive
+ * above) working on the same block of data, the second one on the
+ * data in the order given by an interleaver.  The encoded output for
+ * each bit is the input bit, then the other outputs of the first
+ * coder, then the other outputs of the second coder, so
+ * 2 * num_polynomials - 1 bits per data bit, rate 1/3 for the usual
+ * two polynomials.  The codes are not terminated, so there's no
+ * tail.
+ *
+ * interleaver is block_bits entries, the second coder's input bit n
+ * is data bit interleaver[n].  It's copied, and it must have each
+ * value from 0 to block_bits - 1 once or this returns NULL.  Every
+ * block is block_bits long, all the memory for decoding is
+ * allocated here.  num_polynomials can be 2 to
+ * CONVCODE_TURBO_MAX_POLYNOMIALS.
+ */
+#define CONVCODE_TURBO_MAX_POLYNOMIALS 4
+#define CONVCODE_DEFAULT_TURBO_ITERATIONS 8
+
+struct convcode_turbo;
+
+struct convcode_turbo *alloc_convcode_turbo(convcode_os_funcs *o,
+					    unsigned int k,
+					    convcode_state *polynomials,
+					    unsigned int num_polynomials,
+					    unsigned int block_bits,
+					    const unsigned int *interleaver);
+void free_convcode_turbo(struct convcode_turbo *t);
+
+/*
+ * Encode block_bits of bytes into outbytes, which must have room for
+ * block_bits * (2 * num_polynomials - 1) bits.
+ */
+void convencode_turbo(struct convcode_turbo *t, const unsigned char *bytes,
+		      unsigned char *outbytes);
+
+/*
+ * If set, after each iteration the decoder calls this with the hard
+ * decisions so far.  Return true if they are good (say the CRC
+ * matches) and decoding will stop there.
+ */
+typedef bool (*convcode_turbo_check)(void *check_data,
+				     const unsigned char *bytes,
+				     unsigned int nbits);
+void set_turbo_check(struct convcode_turbo *t, convcode_turbo_check check,
+		     void *check_data);
+
+/*
+ * Decode one block.  llrs is the received encoded bits in the order
+ * convencode_turbo() generates them, as 8-bit LLRs like
+ * convdecode_data_llr() takes.  Each iteration runs Max-Log-MAP (see
+ * convdecode_llr()) on the first code, then the second, each one
+ * using what the other one found about each bit as its a-priori
+ * information.
+ *
+ * This stops after max_iterations (0 means
+ * CONVCODE_DEFAULT_TURBO_ITERATIONS), when the check function says
+ * the data is good, or when an iteration doesn't change any hard
+ * decisions.  At high SNR that is usually only two or three
+ * iterations.  The number of iterations done is returned in
+ * iterations if it is not NULL.
+ *
+ * The hard decisions go in outbytes, block_bits long.  If out_llrs
+ * isn't NULL, it gets the output LLR for each bit, in the same form
+ * as convdecode_llr() (positive means a 0).  Returns 0 if the check
+ * function passed or there isn't one, 1 if the check function never
+ * passed.
+ */
+int convdecode_turbo(struct convcode_turbo *t, const int8_t *llrs,
+		     unsigned char *outbytes, int32_t *out_llrs,
+		     unsigned int max_iterations, unsigned int *iterations);
+
+/*
+ * Streaming decoding
+ *
+ * Normally the decoder holds the whole message in the trellis and
+ * nothing comes out until convdecode_finish(), so a message can't be
+ * longer than max_decode_len_bits.  That doesn't work for continuous
+ * streams that never end.
+ *
+ * If you set a traceback depth, the trellis is instead used as a
+ * sliding window.  When it fills up, the decoder traces back from the
+ * best state at the end of the window.  By the time you get depth
+ * symbols back all the paths have almost certainly merged, so the
+ * bits before that are final; they are sent to the decoder output
+ * function and dropped from the window.  So convdecode_data() will
+ * generate output as it goes, memory is bounded by
+ * max_decode_len_bits and output latency by the window size.
+ * convdecode_finish() will output whatever is left.
+ *
+ * The usual rule of thumb is a depth of 5 * k, more if the code is
+ * punctured.  A window of a few times the depth keeps the traceback
+ * cost per output bit down.  The depth must be at least k and less
+ * than the window size, this returns 1 if it's not.  A depth of 0
+ * (the default) turns streaming off.  convdecode_block() cannot be
+ * used in streaming mode, it will return 1.
+ */
+int set_decode_traceback_depth(struct convcode *ce, unsigned int depth);
+
+/*
+ * Growable trellis
+ *
+ * The trellis normally comes with the coder, sized for
+ * max_decode_len_bits, so every coder holds the memory for the
+ * longest message it might ever get.  With a lot of decoders and
+ * mostly short messages, that's a lot of memory doing nothing.
+ *
+ * Instead, the trellis can grow in chunks of chunk_symbols symbols
+ * (rounded up to a power of 2) as the decoder gets to them, up to
+ * max_symbols symbols.  The coder's own trellis is used for as many
+ * of the first chunks as fit in it, the rest are allocated from the
+ * coder's OS functions.  Chunks are kept for the following messages,
+ * so a coder holds the memory for its own trellis plus the longest
+ * message it has actually gotten.  So allocate the coder with a
+ * max_decode_len_bits for the messages you usually get, or 1 if
+ * there's no usual size.  If you want the chunks to come from a pool,
+ * give the coder OS functions whose zalloc() takes from it.
+ *
+ * The sizes here are in symbols, one per decoded bit plus k - 1 for
+ * the tail.
+ *
+ * This replaces the trellis for convdecode_data(), convdecode_block(),
+ * streaming, and tail-biting decoding.  Batch, bit-sliced, LLR, and
+ * reduced-state decoding allocate their own, for max_symbols, when
+ * they are first used.  In streaming mode the window is max_symbols,
+ * so set this before set_decode_traceback_depth().
+ *
+ * Calling this again frees the chunks, a chunk_symbols of 0 goes back
+ * to the coder's own trellis.  Do it before decoding or after a
+ * reinit.  This returns 1 if the coder has no OS functions or isn't
+ * for decoding, if max_symbols is 0 or doesn't leave room for the
+ * traceback depth (for a chunk_symbols of 0, if the coder's own
+ * trellis doesn't), or if the memory can't be allocated.  Nothing is
+ * changed if it fails this way, turn off streaming with
+ * set_decode_traceback_depth(ce, 0) first.  If a chunk can't be
+ * allocated while decoding, the decode function returns 1.
+ */
+int set_decode_trellis_growth(struct convcode *ce, unsigned int chunk_symbols,
+			      unsigned int max_symbols);
+
+/*
+ * Survivor merge detection
+ *
+ * A traceback depth is a guess, the paths usually merge much sooner
+ * than that and occasionally later.  If you set a merge interval,
+ * every interval symbols the decoder follows the survivors of all the
+ * states back through the trellis.  If they all come together in one
+ * state, the path before that is the same no matter which state ends
+ * up best, so it is final.  Those bits are sent to the decoder output
+ * function and their columns are dropped from the trellis.  Unlike
+ * streaming, this never changes the result; the output is the same
+ * as if the whole message had been decoded and traced back by
+ * convdecode_finish().
+ *
+ * The check is also done when the trellis fills up, so a message can
+ * be longer than max_decode_len_bits as long as the survivors keep
+ * merging.  If they haven't merged by then, convdecode_data() returns
+ * 1 like it normally would.
+ *
+ * Each check costs something like a traceback for each state that is
+ * still separate, so don't make the interval too small; a few times
+ * the traceback depth is usually a good tradeoff between cost and
+ * latency.  This can be used with a traceback depth, too.  An interval
+ * of 0 (the default) turns it off.  This returns 1 if the coder can't
+ * decode.  convdecode_block() and convdecode_tailbiting() need the
+ * whole trellis and will return 1 if this is on.
+ */
+int set_decode_merge_interval(struct convcode *ce, unsigned int interval);
+
+/*
+ * Register exchange
+ *
+ * For small k there is another way to keep the survivors.  Instead of
+ * storing decisions in the trellis and tracing them back, each state
+ * keeps the last 64 bits of its survivor path in a word, and after
+ * each symbol every state's word becomes its predecessor's shifted
+ * left with the new bit on the bottom.  That's num_states words
+ * copied per symbol, so it gets expensive as k grows, but there is no
+ * traceback at all and only one trellis column is ever used.  So you
+ * can allocate the coder with a max_decode_len_bits of 1 and decode
+ * messages of any length.
+ *
+ * Once delay symbols have been decoded, every symbol sends the bit
+ * delay symbols back on the best state's path to the decoder output
+ * function, so output comes out at a fixed latency.  Like a traceback
+ * depth, 5 * k is the usual rule of thumb.  convdecode_finish()
+ * outputs the rest of the best final state's path.
+ *
+ * The delay must be at least k and no more than 63, this returns 1 if
+ * it's not, or if the coder can't decode or the histories (allocated
+ * with ce->o the first time) can't be allocated.  A delay of 0 (the
+ * default) turns it off.  Set it before you start decoding.  The
+ * traceback depth and merge interval are ignored in this mode, and
+ * convdecode_block() and convdecode_tailbiting() will return 1.
+ */
+int set_decode_register_exchange(struct convcode *ce, unsigned int delay);
+
+/*
+ * Batch decoding
+ *
+ * Decoding a lot of short frames with the same code one at a time
+ * can't keep the SIMD units busy, especially for small k where there
+ * aren't many states to work on.  convdecode_batch() decodes an array
+ * of independent frames CONVCODE_BATCH_LANES at a time in lockstep,
+ * each frame in its own SIMD lane, so the vector width doesn't depend
+ * on the number of states.
+ *
+ * Each frame is decoded like convdecode_block() on a freshly
+ * reinitialized coder.  Fill in bytes, nbits, uncertainty (may be
+ * NULL), outbytes, which must be zeroed, and output_uncertainty (may
+ * be NULL) like you would for convdecode_block(); num_errs is set on
+ * return.  The frames can be different lengths, but the frames
+ * decoded together take as long as the longest one, so it works best
+ * if they are about the same size.
+ *
+ * The decoding always starts from CONVCODE_DEFAULT_START_STATE and
+ * uses 32-bit path values, no matter what was given to
+ * reinit_convdecode() and set_decode_metric_width(), and it doesn't
+ * touch the state of the normal decoder.  It uses the same kind of
+ * SIMD instructions as the kernel given to set_decode_kernel(), or
+ * the best available for CONVCODE_KERNEL_AUTO.  The first time it is
+ * called it allocates CONVCODE_BATCH_LANES times the trellis memory
+ * and the coder keeps it, see convdecode_batch_with_mem() for a way
+ * around that.
+ *
+ * This returns 1, without decoding anything, if any frame is too
+ * large for max_decode_len_bits, the code has more than 8
+ * polynomials, memory can't be allocated, in streaming mode, or with
+ * puncturing.
+ */
+#define CONVCODE_BATCH_LANES 16
+
+struct convdecode_frame {
+    const unsigned char *bytes;
+    unsigned int nbits;
+    const uint8_t *uncertainty;
+    unsigned char *outbytes;
+    unsigned int *output_uncertainty;
+    unsigned int num_errs;
+};
+
+int convdecode_batch(struct convcode *ce, struct convdecode_frame *frames,
+		     unsigned int nframes);
+
+/*
+ * Like convdecode_batch(), but the batch memory comes from mem
+ * instead of the coder, so the coder never allocates it.  If you
+ * decode batches for a lot of coders, one of these per thread can be
+ * used for all of them, whatever their code, instead of each coder
+ * keeping its own.  Zero it and set o before the first use; it is
+ * allocated from o, and grown, as a coder needs more than it has.
+ * free_convdecode_batch_mem() frees the memory, the struct is yours.
+ *
+ * Only one thread can use a mem at a time.  This returns 1 for the
+ * same reasons convdecode_batch() does.
+ */
+struct convdecode_batch_mem {
+    convcode_os_funcs *o;
+    uint16_t *trellis;
+    uint32_t *curr_path_values;
+    uint32_t *next_path_values;
+    uint32_t *branch_metrics;
+
+    /* How much is allocated, in bytes. */
+    unsigned long trellis_size, values_size, branch_metrics_size;
+};
+
+int convdecode_batch_with_mem(struct convcode *ce,
+			      struct convdecode_batch_mem *mem,
+			      struct convdecode_frame *frames,
+			      unsigned int nframes);
+void free_convdecode_batch_mem(struct convdecode_batch_mem *mem);
+
+/*
+ * Bit-sliced decoding
+ *
+ * For hard decisions the branch costs are just counts of mismatched
+ * bits, so the whole add-compare-select can be done with bitwise
+ * logic.  convdecode_bitsliced() decodes frames CONVCODE_BITSLICE_LANES
+ * at a time with frame n in bit n of a uint64_t: each path value is
+ * stored as a set of bit planes, and adding, comparing and selecting
+ * is done with ands, ors and xors on the planes, 64 frames at a time.
+ * This needs no SIMD instructions, and for small k it is faster than
+ * convdecode_batch() even with them.  The work per state grows with
+ * k, though, so for k much above 7 convdecode_batch() is better.
+ *
+ * It works like convdecode_batch() with hard decisions and gives the
+ * same results as convdecode_block() on a freshly reinitialized coder,
+ * including output_uncertainty.  The path values only keep enough bits
+ * to tell the states apart, so num_errs is counted from the received
+ * data along the decoded path, which is the same thing.  The first
+ * time it is called it allocates CONVCODE_BITSLICE_LANES times the
+ * trellis memory.
+ *
+ * This returns 1, without decoding anything, if any frame has
+ * uncertainty values, any frame is too large for max_decode_len_bits,
+ * the code has more than 8 polynomials, memory can't be allocated, in
+ * streaming mode, or with puncturing.
+ */
+#define CONVCODE_BITSLICE_LANES 64
+
+/*
+ * The most bit planes a path value needs, enough to hold the spread
+ * between the path values (see convdecode_bitsliced()) for
+ * CONVCODE_MAX_K and 8 polynomials.
+ */
+#define CONVCODE_BITSLICE_MAX_PLANES 10
+
+int convdecode_bitsliced(struct convcode *ce, struct convdecode_frame *frames,
+			 unsigned int nframes);
+
+/*
+ * Parallel block decoding
+ *
+ * convdecode_block() decodes the whole thing in one go, so a long
+ * block is stuck on one core.  convdecode_block_parallel() splits it
+ * into nsegments pieces and decodes them at the same time with the
+ * run_parallel() function in the coder's OS functions, which you can
+ * point at your own thread pool.  Each piece is decoded starting
+ * overlap symbols before it, with every starting state equally
+ * likely, and traced back from overlap symbols after it.  If the
+ * input has no errors, the output and num_errs are exactly the same
+ * as convdecode_block()'s for a non-catastrophic code as long as
+ * overlap is at least 2 * k.  With errors, the paths have usually
+ * merged with the ones the full decode would have taken by then, but
+ * not always, so a few bits near the edges of the segments may come
+ * out different, and num_errs with them.  That gets rarer as overlap
+ * gets bigger, make it bigger if you have a lot of errors; 0 gives
+ * the default of 10 * k.
+ *
+ * This works like convdecode_block() on a freshly reinitialized
+ * coder, except:
+ *  * Each segment gets its own coder with a trellis for its piece,
+ *    so the block doesn't have to fit in max_decode_len_bits, but
+ *    the coder must have OS functions so the memory can be
+ *    allocated.  The segment coders share the coder's code tables if
+ *    it has them (see alloc_convcode_from_code()) and are kept for
+ *    the next call, until free_convcode(); more or bigger ones are
+ *    only allocated when a call needs them.
+ *  * There are no output uncertainties.  num_errs is the distance
+ *    between the input and the decoded path, which is the same thing
+ *    unless the path values saturated.
+ *  * The decode uses the coder's path value width, kernel and max
+ *    uncertainty.
+ *
+ * Segments are rounded to a multiple of 8 symbols and made at least
+ * as large as overlap, so you may get fewer than you ask for.  Returns
+ * 1 if memory can't be allocated, nsegments is 0, or with puncturing.
+ */
+int convdecode_block_parallel(struct convcode *ce, const unsigned char *bytes,
+			      unsigned int nbits, const uint8_t *uncertainty,
+			      unsigned char *outbytes, unsigned int *num_errs,
+			      unsigned int nsegments, unsigned int overlap);
+
     
 /***********************************************************************
  * Here and below is more internal stuff.  You can sort of use this,
@@ -339,10 +1232,62 @@ struct convcode_outdata {
      */
     bool output_symbol_size;
 
+    /*
+     * If buf is set, output goes into it instead of to output, see
+     * set_encode_output_buffer().  Bits are collected in buf_bits
+     * until there are 64 of them, then stored at byte buf_pos.
+     */
+    unsigned char *buf;
+    unsigned int buf_size;
+    unsigned int buf_pos;
+    uint64_t buf_bits;
+    unsigned int buf_nbits;
+    convcode_output_buffer buf_full;
+    void *buf_user_data;
+
     /* Total number of output bits we have generated. */
     unsigned int total_out_bits;
 };
 
+/*
+ * Processes one received symbol through the trellis, see decode_bits().
+ * The branch metrics for the symbol are given by base and delta, see
+ * branch_costs().
+ */
+typedef void (*convcode_decode_kernel)(struct convcode *ce, unsigned int base,
+				       const unsigned int *delta);
+
+/*
+ * Like convcode_decode_kernel, but for convdecode_batch().  bm is the
+ * branch metric for each encoded output value for each lane, the
+ * decision bits for each state are stored in decisions.
+ */
+typedef void (*convcode_batch_kernel)(struct convcode *ce, const uint32_t *bm,
+				      uint16_t *decisions);
+
+/*
+ * The tables shared by coders created with alloc_convcode_from_code(),
+ * see the struct convcode entries with the same names.  polys is as
+ * passed in, not reversed like in struct convcode.
+ */
+struct convcode_code {
+    unsigned int refcount;
+    convcode_os_funcs *o;
+    void *alloc_mem;
+
+    unsigned int k;
+    convcode_state polys[CONVCODE_MAX_POLYNOMIALS];
+    unsigned int num_polys;
+    bool recursive;
+    bool butterfly;
+
+    unsigned int *convert[2];
+    convcode_state *next_state[2];
+    uint64_t *byte_convert[2];
+    convcode_state *byte_next_state[2];
+    uint16_t *prev_convert[2];
+};
+
 /*
  * The data structure for encoding and decoding.  Note that if you use
  * alloc_convcode(), you don't need to mess with this.  But you can
@@ -387,29 +1332,135 @@ struct convcode {
      */
     convcode_state *next_state[2];
 
+    /*
+     * For encoding a byte at a time.  The code is linear, so encoding
+     * a byte from a state gives the same output and next state as
+     * encoding 8 zero bits from that state xor encoding the byte from
+     * state 0.  Index 0 is indexed by state and gives the results of
+     * encoding 8 zero bits, index 1 is indexed by the input byte and
+     * gives the results of encoding it from state 0.  The output bits
+     * are packed like encoding the byte a bit at a time would.  These
+     * are NULL if there are more than 8 polynomials, the output
+     * wouldn't fit.
+     */
+    uint64_t *byte_convert[2];
+    convcode_state *byte_next_state[2];
+
+    /*
+     * For the given state, what is the encoded output of the
+     * transition into it from each of its possible previous states?
+     * Index 0 is for the previous state with the top bit clear
+     * (state >> 1), index 1 is for the previous state with the top
+     * bit set.  These index branch_metrics when decoding.
+     */
+    uint16_t *prev_convert[2];
+
+    /*
+     * If the code is non-recursive and every polynomial has its first
+     * and last taps set, the decoder can work a butterfly (the two
+     * states from the same two previous states) at a time with only
+     * convert[0], see decode_bits_scalar_bfly_n() in convcode.c.
+     */
+    bool butterfly;
+
     /*
      * Number of states in the state machine, 1 << (k - 1).
      */
     unsigned int num_states;
 
     /*
-     * The bit trellis matrix.  The first array is an array of
-     * pointers to arrays of convcode_state, one for each possible output
-     * bit on decoding.  It is trellis_size elements.  Each array in
-     * that is individually allocated and contains the state for a
-     * specific input.  Each is num_states elements.
+     * The bit trellis matrix.  It has trellis_size columns, one for
+     * each symbol decoded, each trellis_col_words 64-bit words long.
+     * A column holds one decision bit per state, state n's bit is bit
+     * n % 64 of word n / 64.  The previous state of a state is always
+     * state >> 1 with or without the top state bit set, the decision
+     * bit is set if it came from the one with the top bit set.
      */
-    convcode_state *trellis;
+    uint64_t *trellis;
     unsigned int trellis_size;
+    unsigned int trellis_col_words;
+
+    /*
+     * See set_decode_trellis_growth().  If trellis_chunks is set, the
+     * trellis is in chunks of 1 << trellis_chunk_shift columns,
+     * allocated when they are first used, instead of in trellis.
+     * fixed_trellis_size is the size of trellis.  The first
+     * trellis_fixed_chunks chunks are in trellis and not allocated.
+     */
+    uint64_t **trellis_chunks;
+    unsigned int trellis_chunk_shift;
+    unsigned int fixed_trellis_size;
+    unsigned int trellis_fixed_chunks;
     unsigned int ctrellis; /* Current trellis value */
 
+    /*
+     * In streaming mode (traceback_depth != 0) the trellis is a ring
+     * and trellis_start is where column 0 is.  Otherwise it is always
+     * 0.
+     */
+    unsigned int traceback_depth;
+    unsigned int trellis_start;
+
+    /*
+     * See set_decode_merge_interval().  merge_count is the number of
+     * symbols since the last check, merge_states is two sets of
+     * states, trellis_col_words each, for following the survivors.
+     */
+    unsigned int merge_interval;
+    unsigned int merge_count;
+    uint64_t *merge_states;
+
+    /*
+     * See set_decode_register_exchange().  regex_hist is two sets of
+     * num_states survivor histories, regex_curr says which one is
+     * current.  regex_symbols is the number of symbols decoded.
+     */
+    unsigned int regex_delay;
+    unsigned int regex_symbols;
+    unsigned int regex_curr;
+    uint64_t *regex_hist;
+
+    /*
+     * The segment coders for convdecode_block_parallel(), kept for
+     * the next call.  Any of the num_par_coders may be NULL.
+     */
+    struct convcode **par_coders;
+    unsigned int num_par_coders;
+
     /*
      * You don't need the whole path value matrix, you only need the
      * previous one and the next one (the one you are working on).
-     * Each of these is num_states elements.
+     * Each of these is num_states elements of metric_width bits.
+     */
+    void *curr_path_values;
+    void *next_path_values;
+
+    /*
+     * What reinit_convdecode() was last given, so the decoder can be
+     * put back the same way after kernel tuning uses it.
+     */
+    unsigned int dec_start_state;
+    unsigned int dec_init_val;
+
+    /*
+     * The path value width, the maximum value, when to renormalize,
+     * and how much has been subtracted by renormalization so far.  See
+     * set_decode_metric_width().
      */
-    unsigned int *curr_path_values;
-    unsigned int *next_path_values;
+    unsigned int metric_width;
+    unsigned int metric_max;
+    unsigned int metric_renorm;
+    unsigned int metric_offset;
+
+    /*
+     * The branch metric for each possible encoded output for the
+     * symbol being decoded, recomputed for each symbol.  It is
+     * branch_metrics_size (1 << num_polys) elements, or not used if
+     * branch_metrics_size is 0 because there are so many polynomials
+     * the table would be bigger than the state machine.
+     */
+    unsigned int *branch_metrics;
+    unsigned int branch_metrics_size;
 
     /*
      * The uncertainty that maps to 100% uncertain for soft decoding.
@@ -421,27 +1472,215 @@ struct convcode {
     /*
      * When reading bits for decoding, there may be some left over if
      * there weren't enough bits for the whole operation.  Store those
-     * here for use in the next decode call.
+     * here for use in the next decode call.  For convdecode_data_llr()
+     * the LLRs are stored in leftover_uncertainty.
      */
     unsigned int leftover_bits;
     convcode_state leftover_bits_data;
     uint8_t leftover_uncertainty[CONVCODE_MAX_POLYNOMIALS];
 
+    /*
+     * The puncturing pattern, see set_puncture_pattern().
+     * puncture_period is 0 if not puncturing.  puncture_offset[n] is
+     * the number of bits sent for the pattern entries before n, so
+     * puncture_offset[puncture_period] is the number for a whole
+     * period.  enc_puncture_pos and dec_puncture_pos are the entries
+     * for the next symbol encoded and decoded.
+     */
+    uint16_t puncture[CONVCODE_MAX_PUNCTURE_PERIOD];
+    unsigned int puncture_offset[CONVCODE_MAX_PUNCTURE_PERIOD + 1];
+    unsigned int puncture_period;
+    unsigned int enc_puncture_pos;
+    unsigned int dec_puncture_pos;
+
+    /*
+     * See get_convcode_stats().  These are here even without
+     * CONVCODE_STATS so the structure doesn't change with it.
+     */
+    struct convcode_stats stats;
+    bool stats_timing;
+
+    /* The add-compare-select implementation in use, see set_decode_kernel */
+    enum convcode_kernel kernel;
+    convcode_decode_kernel decode_kernel;
+    bool kernel_tune; /* Set with CONVCODE_KERNEL_TUNE */
+
+    /*
+     * For convdecode_batch(), allocated the first time it is used.
+     * These are like trellis, the path values and branch_metrics, but
+     * with CONVCODE_BATCH_LANES frames interleaved, so each state (or
+     * output value) has CONVCODE_BATCH_LANES consecutive entries, one
+     * per lane.  A batch_trellis column is num_states entries, bit n
+     * of an entry is the decision for lane n.  batch_branch_metrics is
+     * 1 << num_polys entries of lanes.
+     */
+    uint16_t *batch_trellis;
+    uint32_t *batch_curr_path_values;
+    uint32_t *batch_next_path_values;
+    uint32_t *batch_branch_metrics;
+    convcode_batch_kernel batch_kernel;
+
+    /*
+     * For convdecode_bitsliced(), allocated the first time it is used.
+     * A bitslice_trellis column is num_states entries, bit n of an
+     * entry is the decision for frame n.  The path values are
+     * CONVCODE_BITSLICE_MAX_PLANES bit planes for each state, bit n of
+     * plane m is bit m of frame n's value.
+     */
+    uint64_t *bitslice_trellis;
+    uint64_t *bitslice_curr_path_values;
+    uint64_t *bitslice_next_path_values;
+
+    /*
+     * For convdecode_llr(), allocated the first time it is used.
+     * llr_alpha is the forward path values, num_states for each of
+     * trellis_size + 1 columns.  llr_beta is the backward path values
+     * for the current and next symbol, num_states each.
+     */
+    uint32_t *llr_alpha;
+    uint32_t *llr_beta[2];
+
+    /*
+     * For convdecode_reduced(), see set_decode_reduced_states().
+     * reduced_paths has reduced_max_states entries for each trellis
+     * column, one for each path kept, holding the index of the path it
+     * came from in the previous column shifted left one with the input
+     * bit in bit 0.  reduced_work is the survivors and the candidates
+     * for the next symbol, see convdecode_reduced().  reduced_size is
+     * the number of columns in reduced_paths if it was given its own
+     * max_decode_len_bits, 0 if it uses trellis_size.
+     */
+    unsigned int reduced_max_states;
+    unsigned int reduced_threshold;
+    unsigned int reduced_size;
+    uint16_t *reduced_paths;
+    uint32_t *reduced_work;
+
+    convcode_os_funcs *o;
+
+    /*
+     * The block alloc_convcode() got from o, NULL if the memory came
+     * from init_convcode().
+     */
+    void *alloc_mem;
+
+    /*
+     * If created from a struct convcode_code, the code holding the
+     * convert, next_state, byte_convert, byte_next_state, and
+     * prev_convert tables.  NULL if they are in this coder's memory.
+     */
+    struct convcode_code *code;
+};
+
+/*
+ * A turbo coder, see alloc_convcode_turbo().  The two coders share
+ * one code and are only used for encoding, the decoder uses their
+ * tables.  Everything else is in the same block of memory as this,
+ * block_bits entries each unless noted.
+ */
+struct convcode_turbo {
     convcode_os_funcs *o;
+    void *alloc_mem;
+    struct convcode *coder[2];
+    unsigned int block_bits;
+    unsigned int num_polys;
+
+    convcode_turbo_check check;
+    void *check_data;
+
+    /* The interleaver, and the data in interleaved order for encoding. */
+    unsigned int *interleaver;
+    unsigned char *interleaved;
+
+    /* Each coder's own output while encoding, num_polys per bit. */
+    unsigned char *enc[2];
+
+    /*
+     * The received costs of a 1 minus the cost of a 0, two times the
+     * LLRs.  sys is the data bits for each coder (the second is
+     * interleaved), parity num_polys - 1 for each bit.
+     */
+    int32_t *sys[2];
+    int32_t *parity[2];
+
+    /*
+     * The extrinsic information each coder found for each bit, in the
+     * same form, in its own order, and the other's found information
+     * in its order as its a-priori information.
+     */
+    int32_t *apriori[2];
+    int32_t *extrinsic[2];
+    int32_t *llrs;
+
+    /* Max-Log-MAP path values, see convdecode_llr(). */
+    int32_t *alpha; /* (block_bits + 1) * num_states */
+    int32_t *beta[2]; /* num_states each */
+
+    /* The hard decisions from this and the last iteration. */
+    unsigned char *hard[2];
 };
 
 /*
- * If you want to manage all the memory yourself, then do the following:
+ * If you want to manage all the memory yourself, init_convcode() is
+ * usually what you want.  If you need to place each array yourself,
+ * then do the following:
  *  * Get your own copy of struct convcode.
  *  * Call setup_convcode1.  This will set up various data items you will
  *    need for allocation.
  *  * Set ce->output, ce->output_data
  *  * Allocate the following:
- *    ce->convert - sizeof(*ce->convert) * ce->convert_size
+ *    ce->convert[0,1] - sizeof(*ce->convert[0]) * ce->num_states
+ *    ce->next_state[0,1] - sizeof(*ce->next_state[0]) * ce->num_states
+ *  * If you want faster encoding and have 8 or fewer polynomials,
+ *    allocate the following, otherwise leave them NULL:
+ *    ce->byte_convert[0] - sizeof(*ce->byte_convert[0]) * ce->num_states
+ *    ce->byte_convert[1] - sizeof(*ce->byte_convert[1]) * 256
+ *    ce->byte_next_state[0] - sizeof(*ce->byte_next_state[0]) * ce->num_states
+ *    ce->byte_next_state[1] - sizeof(*ce->byte_next_state[1]) * 256
  *  * If you are doing decoding, allocate the following:
- *    ce->trellis - sizeof(*ce->trellis) * ce->trellis_size * ce->num_states
- *    ce->curr_paths_value - sizeof(*ce->curr_path_values) * ce->num_states
- *    ce->next_paths_value - sizeof(*ce->next_path_values) * ce->num_states
+ *    ce->trellis - (sizeof(*ce->trellis) * ce->trellis_size *
+ *                   ce->trellis_col_words)
+ *    ce->curr_paths_value - sizeof(uint32_t) * ce->num_states
+ *    ce->next_paths_value - sizeof(uint32_t) * ce->num_states
+ *    ce->prev_convert[0,1] - sizeof(*ce->prev_convert[0]) * ce->num_states
+ *    ce->merge_states - (sizeof(*ce->merge_states) * 2 *
+ *                        ce->trellis_col_words), if you are using
+ *                        set_decode_merge_interval()
+ *    ce->branch_metrics - (sizeof(*ce->branch_metrics) *
+ *                          ce->branch_metrics_size), if the size is not 0
+ *  * If you are doing batch decoding and didn't set ce->o, allocate the
+ *    following, otherwise convdecode_batch() will allocate them:
+ *    ce->batch_trellis - (sizeof(*ce->batch_trellis) * ce->trellis_size *
+ *                         ce->num_states)
+ *    ce->batch_curr_path_values - (sizeof(uint32_t) * ce->num_states *
+ *                                  CONVCODE_BATCH_LANES)
+ *    ce->batch_next_path_values - (sizeof(uint32_t) * ce->num_states *
+ *                                  CONVCODE_BATCH_LANES)
+ *    ce->batch_branch_metrics - (sizeof(uint32_t) * (1 << ce->num_polys) *
+ *                                CONVCODE_BATCH_LANES)
+ *  * If you are doing bit-sliced decoding and didn't set ce->o, allocate
+ *    the following, otherwise convdecode_bitsliced() will allocate them:
+ *    ce->bitslice_trellis - (sizeof(*ce->bitslice_trellis) *
+ *                            ce->trellis_size * ce->num_states)
+ *    ce->bitslice_curr_path_values - (sizeof(uint64_t) * ce->num_states *
+ *                                     CONVCODE_BITSLICE_MAX_PLANES)
+ *    ce->bitslice_next_path_values - (sizeof(uint64_t) * ce->num_states *
+ *                                     CONVCODE_BITSLICE_MAX_PLANES)
+ *  * If you are doing LLR decoding and didn't set ce->o, allocate the
+ *    following, otherwise convdecode_llr() will allocate them:
+ *    ce->llr_alpha - (sizeof(*ce->llr_alpha) * (ce->trellis_size + 1) *
+ *                     ce->num_states)
+ *    ce->llr_beta[0,1] - sizeof(*ce->llr_beta[0]) * ce->num_states
+ *  * If you are doing register exchange decoding and didn't set ce->o,
+ *    allocate the following before calling set_decode_register_exchange():
+ *    ce->regex_hist - sizeof(*ce->regex_hist) * 2 * ce->num_states
+ *  * If you are doing reduced-state decoding and didn't set ce->o, call
+ *    set_decode_reduced_states() and allocate the following, the size
+ *    is ce->reduced_size instead of ce->trellis_size if that is set:
+ *    ce->reduced_paths - (sizeof(*ce->reduced_paths) * ce->trellis_size *
+ *                         ce->reduced_max_states)
+ *    ce->reduced_work - (sizeof(*ce->reduced_work) *
+ *                        (ce->num_states + 10 * ce->reduced_max_states))
  *  * Call setup_convcode2(ce)
  *  * Call reinit_convcode(ce)
  *
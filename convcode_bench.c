@@ -0,0 +1,489 @@
+/*
+ * Copyright 2023 Corey Minyard
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Throughput benchmarks for the convolutional coder.
+ *
+ * This runs encoding and decoding over a matrix of codes, frame sizes,
+ * and modes and prints one CSV line for each, so the results can be
+ * saved and compared between versions.  The columns are:
+ *
+ *   op          - encode or decode
+ *   mode        - block (convencode_block(), convdecode_block(), or
+ *                 convdecode_tailbiting()) or stream
+ *                 (convencode_data() or convdecode_data() with a
+ *                 traceback depth)
+ *   k           - the constraint
+ *   rate        - 1/num_polys
+ *   recursive   - 0 or 1
+ *   term        - tail or tailbiting
+ *   input       - hard, soft, or llr (convdecode_data_llr() and
+ *                 convdecode_block_llr()) for decoding, - for encoding
+ *   width       - the path metric width, - for encoding
+ *   kernel      - the decode kernel, - for encoding
+ *   frame_bits  - the number of data bits in each frame
+ *   iterations  - how many frames were run
+ *   ns_per_bit  - nanoseconds per data bit
+ *   mbit_per_s  - millions of data bits per second
+ *
+ * Each case runs frames until at least the minimum time has passed,
+ * there is always at least one frame.  The encoded data has about 1%
+ * bit errors, soft and LLR decoding give those a high uncertainty.
+ * Tail-biting isn't run with LLRs, there's no LLR tail-biting decoder,
+ * and LLRs aren't run with -w 8, they need bigger path values.
+ *
+ * Tail-biting streams aren't supported by the decoder and tail-biting
+ * recursive codes need a more complicated start state, so those are
+ * not run.  Decode cases that would take more than about 2^31 state
+ * operations per frame or more than 512MB of trellis are not run,
+ * that leaves out big frames for k=15.
+ *
+ * Options:
+ *   -k <k>       Only run codes with the given constraint.
+ *   -n <bits>    Only run the given frame size.
+ *   -o <op>      Only run encode or decode.
+ *   -w <width>   Decode with the given path metric width, default 32.
+ *   -K <kernel>  Decode with the given kernel (scalar, sse41, avx2,
+ *                avx512, neon) instead of the automatic one, or tune
+ *                to time them and use the fastest for each code.
+ *   -T <file>    Read tuned kernels from the file, if it exists, and
+ *                write them back at the end, see
+ *                get_convcode_kernel_tuning().
+ *   -m <ms>      The minimum time for each case, default 50.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "convcode_os_funcs.h"
+#include "convcode.h"
+
+#define BENCH_MAX_POLYS 6
+
+struct bench_code {
+    unsigned int k;
+    unsigned int num_polys;
+    convcode_state polys[BENCH_MAX_POLYS];
+};
+
+static struct bench_code codes[] = {
+    { 3, 2, { 05, 07 } },
+    { 3, 3, { 05, 07, 07 } },
+    { 3, 6, { 05, 07, 07, 05, 07, 06 } },
+    { 7, 2, { 0171, 0133 } },
+    { 7, 3, { 0133, 0171, 0165 } },
+    { 7, 6, { 0173, 0151, 0135, 0135, 0163, 0117 } },
+    { 9, 2, { 0753, 0561 } },
+    { 9, 3, { 0557, 0663, 0711 } },
+    { 9, 6, { 0557, 0663, 0711, 0753, 0561, 0715 } },
+    { 15, 2, { 046321, 051271 } },
+    { 15, 3, { 046321, 051271, 070535 } },
+    { 15, 6, { 046321, 051271, 070535, 063667, 073277, 076513 } },
+};
+
+static unsigned int frame_sizes[] = { 64, 1024, 16384, 1048576 };
+
+/* Settings from the command line. */
+static unsigned int only_k;
+static unsigned int only_nbits;
+static const char *only_op;
+static unsigned int metric_width = 32;
+static enum convcode_kernel kernel = CONVCODE_KERNEL_AUTO;
+static const char *tuning_file;
+static double min_time = 0.05;
+
+enum bench_input {
+    BENCH_HARD,
+    BENCH_SOFT,
+    BENCH_LLR,
+    BENCH_NUM_INPUTS
+};
+
+static const char *input_names[] = { "hard", "soft", "llr" };
+
+/* One case being run. */
+struct bench {
+    struct bench_code *code;
+    bool recursive;
+    bool tailbiting;
+    enum bench_input input;
+    bool stream;
+    unsigned int nbits;
+    unsigned int enc_nbits;
+    unsigned int start_state;
+
+    struct convcode *ce;
+    unsigned char *dec_bytes;
+    unsigned char *enc_bytes;
+    unsigned char *out_bytes;
+    uint8_t *uncertainty;
+    int8_t *llrs;
+    unsigned char buf[4096];
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The streaming output just gets thrown away. */
+static int
+discard_output(struct convcode *ce, void *user_data,
+	       unsigned char *buf, unsigned int nbits)
+{
+    return 0;
+}
+
+static int
+run_encode_block(struct bench *b)
+{
+    reinit_convencode(b->ce, b->start_state);
+    convencode_block(b->ce, b->dec_bytes, b->nbits, b->enc_bytes);
+    return 0;
+}
+
+static int
+run_encode_stream(struct bench *b)
+{
+    unsigned int total_bits;
+
+    reinit_convencode(b->ce, b->start_state);
+    convencode_data(b->ce, b->dec_bytes, b->nbits);
+    return convencode_finish(b->ce, &total_bits);
+}
+
+static int
+run_decode_block(struct bench *b)
+{
+    unsigned int num_errs, passes;
+
+    if (b->tailbiting)
+	return convdecode_tailbiting(b->ce, b->enc_bytes, b->enc_nbits,
+				     b->uncertainty, b->out_bytes, NULL,
+				     &num_errs, 0, &passes);
+    if (reinit_convdecode(b->ce, CONVCODE_DEFAULT_START_STATE,
+			  CONVCODE_DEFAULT_INIT_VAL))
+	return 1;
+    if (b->llrs)
+	return convdecode_block_llr(b->ce, b->llrs, b->enc_nbits,
+				    b->out_bytes, NULL, &num_errs);
+    return convdecode_block(b->ce, b->enc_bytes, b->enc_nbits,
+			    b->uncertainty, b->out_bytes, NULL, &num_errs);
+}
+
+static int
+run_decode_stream(struct bench *b)
+{
+    unsigned int total_bits, num_errs;
+    int rv;
+
+    rv = reinit_convdecode(b->ce, CONVCODE_DEFAULT_START_STATE,
+			   CONVCODE_DEFAULT_INIT_VAL);
+    if (!rv && b->llrs)
+	rv = convdecode_data_llr(b->ce, b->llrs, b->enc_nbits);
+    else if (!rv)
+	rv = convdecode_data(b->ce, b->enc_bytes, b->enc_nbits,
+			     b->uncertainty);
+    if (!rv)
+	rv = convdecode_finish(b->ce, &total_bits, &num_errs);
+    return rv;
+}
+
+/*
+ * Make up the data, encode it, and add errors.
+ */
+static void
+setup_data(struct bench *b)
+{
+    struct bench_code *c = b->code;
+    unsigned int i, bit;
+
+    for (i = 0; i < (b->nbits + 7) / 8; i++)
+	b->dec_bytes[i] = rand();
+
+    if (b->tailbiting) {
+	/* Start in the state the last k - 1 bits leave it in. */
+	b->start_state = 0;
+	for (i = b->nbits - (c->k - 1); i < b->nbits; i++)
+	    b->start_state = ((b->start_state << 1) |
+			      ((b->dec_bytes[i / 8] >> (i % 8)) & 1));
+    }
+    run_encode_block(b);
+
+    for (i = 0; i < b->enc_nbits; i++) {
+	bit = rand() % 100 == 0;
+	b->enc_bytes[i / 8] ^= bit << (i % 8);
+	if (b->uncertainty)
+	    b->uncertainty[i] = bit ? 30 + rand() % 21 : rand() % 21;
+	if (b->llrs) {
+	    b->llrs[i] = bit ? rand() % 40 : 40 + rand() % 88;
+	    if ((b->enc_bytes[i / 8] >> (i % 8)) & 1)
+		b->llrs[i] = -b->llrs[i];
+	}
+    }
+}
+
+static int
+run_case(const char *op, struct bench *b)
+{
+    struct bench_code *c = b->code;
+    bool decode = strcmp(op, "decode") == 0;
+    unsigned int max_decode_len_bits = 0, depth = 0;
+    unsigned long work;
+    int (*run)(struct bench *b);
+    unsigned long iters = 0;
+    double start, elapsed;
+    char widthstr[16];
+    const char *kstr = "-";
+    int rv = 1;
+
+    if (only_op && strcmp(op, only_op) != 0)
+	return 0;
+    if (b->tailbiting && (b->recursive || b->nbits < c->k))
+	return 0;
+    if (decode) {
+	if (b->tailbiting && (b->stream || b->input == BENCH_LLR))
+	    return 0;
+	if (b->input == BENCH_LLR && metric_width == 8)
+	    return 0;
+	work = (1UL << (c->k - 1)) * (unsigned long) b->nbits;
+	if (work > (1UL << 31))
+	    return 0;
+	if (b->stream) {
+	    depth = 5 * c->k;
+	    max_decode_len_bits = 8 * depth;
+	} else {
+	    max_decode_len_bits = b->nbits;
+	    if ((unsigned long) (b->nbits + c->k * c->num_polys) / 8
+			* (1UL << (c->k - 1)) > (512UL << 20))
+		return 0;
+	}
+    }
+
+    b->enc_nbits = (b->nbits + (b->tailbiting ? 0 : c->k - 1)) * c->num_polys;
+    b->ce = alloc_convcode(o, c->k, c->polys, c->num_polys,
+			   max_decode_len_bits, !b->tailbiting, b->recursive,
+			   NULL, NULL, NULL, NULL);
+    b->dec_bytes = calloc(1, b->nbits / 8 + 8);
+    b->enc_bytes = calloc(1, b->enc_nbits / 8 + 8);
+    b->out_bytes = calloc(1, b->nbits / 8 + 8);
+    b->uncertainty = NULL;
+    b->llrs = NULL;
+    if (decode && b->input == BENCH_SOFT)
+	b->uncertainty = calloc(1, b->enc_nbits);
+    if (decode && b->input == BENCH_LLR)
+	b->llrs = calloc(1, b->enc_nbits);
+    if (!b->ce || !b->dec_bytes || !b->enc_bytes || !b->out_bytes ||
+		(decode && b->input == BENCH_SOFT && !b->uncertainty) ||
+		(decode && b->input == BENCH_LLR && !b->llrs)) {
+	fprintf(stderr, "Out of memory for k=%u frame_bits=%u\n",
+		c->k, b->nbits);
+	goto out;
+    }
+
+    if (decode) {
+	if (set_decode_metric_width(b->ce, metric_width)) {
+	    fprintf(stderr, "Invalid metric width: %u\n", metric_width);
+	    goto out;
+	}
+	if (kernel != CONVCODE_KERNEL_AUTO && set_decode_kernel(b->ce, kernel)) {
+	    /* Not available for this code, nothing to measure. */
+	    rv = 0;
+	    goto out;
+	}
+	kstr = convcode_kernel_name(get_decode_kernel(b->ce));
+	if (metric_width == 8)
+	    set_decode_max_uncertainty(b->ce, 7);
+    }
+
+    setup_data(b);
+
+    if (decode) {
+	if (b->stream) {
+	    set_decode_traceback_depth(b->ce, depth);
+	    set_decode_output_buffer(b->ce, b->buf, sizeof(b->buf),
+				     discard_output, NULL);
+	    run = run_decode_stream;
+	} else {
+	    run = run_decode_block;
+	}
+	snprintf(widthstr, sizeof(widthstr), "%u", metric_width);
+    } else {
+	if (b->stream) {
+	    set_encode_output_buffer(b->ce, b->buf, sizeof(b->buf),
+				     discard_output, NULL);
+	    run = run_encode_stream;
+	} else {
+	    run = run_encode_block;
+	}
+	strcpy(widthstr, "-");
+    }
+
+    start = now();
+    do {
+	if (run(b)) {
+	    fprintf(stderr, "%s error for k=%u frame_bits=%u\n", op,
+		    c->k, b->nbits);
+	    goto out;
+	}
+	iters++;
+	elapsed = now() - start;
+    } while (elapsed < min_time);
+
+    printf("%s,%s,%u,1/%u,%d,%s,%s,%s,%s,%u,%lu,%.3f,%.3f\n",
+	   op, b->stream ? "stream" : "block", c->k, c->num_polys,
+	   b->recursive, b->tailbiting ? "tailbiting" : "tail",
+	   decode ? input_names[b->input] : "-", widthstr, kstr,
+	   b->nbits, iters,
+	   elapsed * 1e9 / ((double) iters * b->nbits),
+	   (double) iters * b->nbits / elapsed / 1e6);
+    fflush(stdout);
+    rv = 0;
+
+ out:
+    if (b->ce)
+	free_convcode(b->ce);
+    free(b->dec_bytes);
+    free(b->enc_bytes);
+    free(b->out_bytes);
+    free(b->uncertainty);
+    free(b->llrs);
+    return rv;
+}
+
+static int
+run_benchmarks(void)
+{
+    struct bench b;
+    unsigned int c, n, recursive, tailbiting, stream, input;
+    int rv = 0;
+
+    printf("op,mode,k,rate,recursive,term,input,width,kernel,"
+	   "frame_bits,iterations,ns_per_bit,mbit_per_s\n");
+    for (c = 0; c < sizeof(codes) / sizeof(codes[0]); c++) {
+	if (only_k && codes[c].k != only_k)
+	    continue;
+	for (n = 0; n < sizeof(frame_sizes) / sizeof(frame_sizes[0]); n++) {
+	    if (only_nbits && frame_sizes[n] != only_nbits)
+		continue;
+	    for (recursive = 0; recursive < 2; recursive++) {
+		for (tailbiting = 0; tailbiting < 2; tailbiting++) {
+		    for (stream = 0; stream < 2; stream++) {
+			memset(&b, 0, sizeof(b));
+			b.code = &codes[c];
+			b.nbits = frame_sizes[n];
+			b.recursive = recursive;
+			b.tailbiting = tailbiting;
+			b.stream = stream;
+			rv |= run_case("encode", &b);
+			for (input = 0; input < BENCH_NUM_INPUTS; input++) {
+			    b.input = input;
+			    rv |= run_case("decode", &b);
+			}
+		    }
+		}
+	    }
+	}
+    }
+    return rv;
+}
+
+static int
+load_tuning(const char *file)
+{
+    char buf[4096];
+    size_t len;
+    FILE *f = fopen(file, "r");
+
+    if (!f)
+	return 0; /* Nothing saved yet */
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    if (set_convcode_kernel_tuning(buf)) {
+	fprintf(stderr, "Invalid tuning in %s\n", file);
+	return 1;
+    }
+    return 0;
+}
+
+static int
+save_tuning(const char *file)
+{
+    unsigned int len = get_convcode_kernel_tuning(NULL, 0);
+    char *buf = malloc(len + 1);
+    FILE *f;
+    int rv = 1;
+
+    if (!buf)
+	goto out;
+    get_convcode_kernel_tuning(buf, len + 1);
+    f = fopen(file, "w");
+    if (!f)
+	goto out;
+    if (fwrite(buf, 1, len, f) == len)
+	rv = 0;
+    if (fclose(f))
+	rv = 1;
+ out:
+    if (rv)
+	fprintf(stderr, "Unable to write tuning to %s\n", file);
+    free(buf);
+    return rv;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int arg;
+    int rv;
+
+    for (arg = 1; arg < argc; arg++) {
+	if (argv[arg][0] != '-')
+	    break;
+	if (arg + 1 >= argc) {
+	    fprintf(stderr, "No data supplied for %s\n", argv[arg]);
+	    return 1;
+	}
+	if (strcmp(argv[arg], "-k") == 0) {
+	    only_k = strtoul(argv[++arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-n") == 0) {
+	    only_nbits = strtoul(argv[++arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-o") == 0) {
+	    only_op = argv[++arg];
+	} else if (strcmp(argv[arg], "-w") == 0) {
+	    metric_width = strtoul(argv[++arg], NULL, 0);
+	} else if (strcmp(argv[arg], "-m") == 0) {
+	    min_time = strtoul(argv[++arg], NULL, 0) / 1000.0;
+	} else if (strcmp(argv[arg], "-K") == 0) {
+	    arg++;
+	    if (convcode_kernel_from_name(argv[arg], &kernel)) {
+		fprintf(stderr, "unknown kernel: %s\n", argv[arg]);
+		return 1;
+	    }
+	} else if (strcmp(argv[arg], "-T") == 0) {
+	    tuning_file = argv[++arg];
+	} else {
+	    fprintf(stderr, "unknown option: %s\n", argv[arg]);
+	    return 1;
+	}
+    }
+
+    if (tuning_file && load_tuning(tuning_file))
+	return 1;
+    srand(1);
+    rv = run_benchmarks();
+    if (tuning_file && save_tuning(tuning_file))
+	return 1;
+    return rv;
+}
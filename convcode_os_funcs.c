@@ -10,6 +10,8 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "convcode_os_funcs.h"
 
@@ -25,7 +27,7 @@ o_zalloc(convcode_os_funcs *o, unsigned long size)
     if (v) {
 	*v = size;
 	v++;
-	mem_alloced += size;
+	__atomic_add_fetch(&mem_alloced, size, __ATOMIC_RELAXED);
     }
     return v;
 }
@@ -38,13 +40,69 @@ o_free(convcode_os_funcs *o, void *to_free)
     assert(v);
     v--;
     assert(*v && *v <= mem_alloced);
-    mem_alloced -= *v;
+    __atomic_sub_fetch(&mem_alloced, *v, __ATOMIC_RELAXED);
     free(v);
 }
 
+/*
+ * run_parallel() with plain pthreads, not a thread pool.  Threads are
+ * created for each call, up to one per CPU, each one takes the next
+ * job until they are all done, and they are joined before returning.
+ * The calling thread does jobs, too.  Creating the threads costs some
+ * tens of microseconds a call, if you decode a lot of short blocks
+ * point run_parallel() at a real thread pool instead.
+ */
+#define O_MAX_THREADS 64
+
+struct o_parallel {
+    void (*func)(void *data, unsigned int i);
+    void *data;
+    unsigned int count;
+    unsigned int next;
+};
+
+static void *
+o_parallel_thread(void *arg)
+{
+    struct o_parallel *p = arg;
+    unsigned int i;
+
+    while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count)
+	p->func(p->data, i);
+    return NULL;
+}
+
+static void
+o_run_parallel(convcode_os_funcs *o,
+	       void (*func)(void *data, unsigned int i),
+	       void *data, unsigned int count)
+{
+    struct o_parallel p = { func, data, count, 0 };
+    pthread_t threads[O_MAX_THREADS];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i, nthreads;
+
+    if (ncpus < 1)
+	ncpus = 1;
+    if (ncpus > O_MAX_THREADS)
+	ncpus = O_MAX_THREADS;
+    if (count > ncpus)
+	count = ncpus;
+
+    /* This thread is one of them. */
+    for (nthreads = 0; nthreads + 1 < count; nthreads++) {
+	if (pthread_create(&threads[nthreads], NULL, o_parallel_thread, &p))
+	    break;
+    }
+    o_parallel_thread(&p);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+}
+
 convcode_os_funcs osfuncs = {
     .zalloc = o_zalloc,
     .free = o_free,
+    .run_parallel = o_run_parallel,
 };
 
 convcode_os_funcs *o = &osfuncs;
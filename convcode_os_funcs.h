@@ -15,8 +15,23 @@
 
 typedef struct convcode_os_funcs convcode_os_funcs;
 struct convcode_os_funcs {
+    /*
+     * These may be called from several threads at once by
+     * convdecode_block_parallel() and the scheduler in
+     * convcode_sched.c.
+     */
     void *(*zalloc)(convcode_os_funcs *f, unsigned long size);
     void (*free)(convcode_os_funcs *f, void *data);
+
+    /*
+     * Call func(data, i) for each i from 0 to count - 1, in parallel
+     * if you can, and return when they are all done.  This is only
+     * used by convdecode_block_parallel().  If NULL, they are just
+     * called one at a time.
+     */
+    void (*run_parallel)(convcode_os_funcs *f,
+			 void (*func)(void *data, unsigned int i),
+			 void *data, unsigned int count);
 };
 
 extern convcode_os_funcs osfuncs, *o;
@@ -0,0 +1,332 @@
+/*
+ * Copyright 2023 Corey Minyard
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * A work-stealing decode scheduler for the convolutional coder, see
+ * convcode_sched.h.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "convcode_sched.h"
+
+struct sched_queue {
+    pthread_mutex_t lock;
+    struct convcode_sched_job *head, *tail;
+};
+
+struct sched_worker {
+    struct convcode_sched *s;
+    unsigned int num;
+    pthread_t thread;
+    struct convdecode_batch_mem batch_mem;
+};
+
+struct convcode_sched {
+    convcode_os_funcs *o;
+
+    /*
+     * There's a queue for each worker, but maybe not all the threads
+     * started, the other workers will steal from their queues.
+     */
+    unsigned int nworkers;
+    unsigned int nthreads;
+    struct sched_queue queues[CONVCODE_SCHED_MAX_WORKERS];
+    struct sched_worker workers[CONVCODE_SCHED_MAX_WORKERS];
+
+    /*
+     * queued is the number of jobs in the queues and outstanding the
+     * number not done yet.  Idle workers wait on work, and
+     * convcode_sched_wait() on idle.  A job can be taken before
+     * convcode_sched_submit() counts it, so queued can briefly go
+     * negative.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    int queued;
+    unsigned int outstanding;
+    bool stopping;
+
+    /* Frames decoded with convdecode_batch(), under lock. */
+    unsigned long batched;
+};
+
+/*
+ * Can the job's coder be used with convdecode_batch()?  That always
+ * uses 32-bit path values, so narrower ones could come out different.
+ */
+static bool
+sched_batchable(struct convcode *ce)
+{
+    return ce->code && ce->trellis_size && ce->num_polys <= 8 &&
+	ce->metric_width == 32 && !ce->puncture_period &&
+	!ce->traceback_depth && !ce->merge_interval && !ce->regex_delay;
+}
+
+/*
+ * Can b's frames be decoded by convdecode_batch() on a and come out
+ * the same as convdecode_block() on b?
+ */
+static bool
+sched_same_code(struct convcode *a, struct convcode *b)
+{
+    return sched_batchable(b) && a->code == b->code &&
+	a->do_tail == b->do_tail && a->trellis_size == b->trellis_size &&
+	a->uncertainty_100 == b->uncertainty_100 && a->kernel == b->kernel;
+}
+
+static void
+queue_unlink(struct sched_queue *q, struct convcode_sched_job *job)
+{
+    if (job->prev)
+	job->prev->next = job->next;
+    else
+	q->head = job->next;
+    if (job->next)
+	job->next->prev = job->prev;
+    else
+	q->tail = job->prev;
+}
+
+/*
+ * Take a job from the front of the queue, or the back if stealing,
+ * and the jobs in the queue that can be batched with it.  Returns the
+ * number of jobs.
+ */
+static unsigned int
+queue_take(struct sched_queue *q, bool steal,
+	   struct convcode_sched_job **jobs)
+{
+    struct convcode_sched_job *job, *next;
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&q->lock);
+    job = steal ? q->tail : q->head;
+    if (!job)
+	goto out;
+    queue_unlink(q, job);
+    jobs[n++] = job;
+    if (!sched_batchable(job->ce))
+	goto out;
+    for (next = q->head; next && n < CONVCODE_BATCH_LANES; ) {
+	struct convcode_sched_job *j = next;
+
+	next = j->next;
+	if (sched_same_code(job->ce, j->ce)) {
+	    queue_unlink(q, j);
+	    jobs[n++] = j;
+	}
+    }
+ out:
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+static void
+decode_one(struct convcode_sched_job *job)
+{
+    struct convdecode_frame *f = &job->frame;
+
+    reinit_convdecode(job->ce, CONVCODE_DEFAULT_START_STATE,
+		      CONVCODE_DEFAULT_INIT_VAL);
+    job->rv = convdecode_block(job->ce, f->bytes, f->nbits, f->uncertainty,
+			       f->outbytes, f->output_uncertainty,
+			       &f->num_errs);
+}
+
+static void
+run_jobs(struct sched_worker *w, struct convcode_sched_job **jobs,
+	 unsigned int n)
+{
+    struct convcode_sched *s = w->s;
+    struct convdecode_frame frames[CONVCODE_BATCH_LANES];
+    unsigned int i;
+    bool batched = false;
+
+    if (n > 1) {
+	for (i = 0; i < n; i++)
+	    frames[i] = jobs[i]->frame;
+	if (convdecode_batch_with_mem(jobs[0]->ce, &w->batch_mem,
+				      frames, n) == 0) {
+	    for (i = 0; i < n; i++) {
+		jobs[i]->frame.num_errs = frames[i].num_errs;
+		jobs[i]->rv = 0;
+	    }
+	    batched = true;
+	}
+    }
+    for (i = 0; i < n; i++) {
+	if (!batched)
+	    decode_one(jobs[i]);
+	if (jobs[i]->done)
+	    jobs[i]->done(jobs[i]);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (batched)
+	s->batched += n;
+    s->outstanding -= n;
+    if (s->outstanding == 0)
+	pthread_cond_broadcast(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *
+sched_worker_thread(void *arg)
+{
+    struct sched_worker *w = arg;
+    struct convcode_sched *s = w->s;
+    struct convcode_sched_job *jobs[CONVCODE_BATCH_LANES];
+    unsigned int i, n;
+
+    for (;;) {
+	/* Our own queue first, then steal from the next ones over. */
+	n = queue_take(&s->queues[w->num], false, jobs);
+	for (i = 1; !n && i < s->nworkers; i++)
+	    n = queue_take(&s->queues[(w->num + i) % s->nworkers], true,
+			   jobs);
+
+	pthread_mutex_lock(&s->lock);
+	if (n) {
+	    s->queued -= n;
+	    pthread_mutex_unlock(&s->lock);
+	    run_jobs(w, jobs, n);
+	    continue;
+	}
+	/*
+	 * Somebody else may have taken the jobs and not counted them
+	 * yet, so only sleep if there really is nothing.
+	 */
+	while (s->queued <= 0 && !s->stopping)
+	    pthread_cond_wait(&s->work, &s->lock);
+	if (s->queued <= 0 && s->stopping) {
+	    pthread_mutex_unlock(&s->lock);
+	    return NULL;
+	}
+	pthread_mutex_unlock(&s->lock);
+    }
+}
+
+struct convcode_sched *
+alloc_convcode_sched(convcode_os_funcs *o, unsigned int nworkers)
+{
+    struct convcode_sched *s;
+    unsigned int i;
+
+    if (nworkers == 0) {
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nworkers = ncpus < 1 ? 1 : ncpus;
+    }
+    if (nworkers > CONVCODE_SCHED_MAX_WORKERS)
+	nworkers = CONVCODE_SCHED_MAX_WORKERS;
+
+    s = o->zalloc(o, sizeof(*s));
+    if (!s)
+	return NULL;
+    s->o = o;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    for (i = 0; i < CONVCODE_SCHED_MAX_WORKERS; i++)
+	pthread_mutex_init(&s->queues[i].lock, NULL);
+
+    /* Use however many threads we can get. */
+    s->nworkers = nworkers;
+    for (i = 0; i < nworkers; i++) {
+	s->workers[i].s = s;
+	s->workers[i].num = i;
+	s->workers[i].batch_mem.o = o;
+	if (pthread_create(&s->workers[i].thread, NULL, sched_worker_thread,
+			   &s->workers[i]))
+	    break;
+	s->nthreads++;
+    }
+    if (!s->nthreads) {
+	free_convcode_sched(s);
+	return NULL;
+    }
+    return s;
+}
+
+void
+free_convcode_sched(struct convcode_sched *s)
+{
+    convcode_os_funcs *o = s->o;
+    unsigned int i;
+
+    convcode_sched_wait(s);
+    pthread_mutex_lock(&s->lock);
+    s->stopping = true;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nthreads; i++) {
+	pthread_join(s->workers[i].thread, NULL);
+	free_convdecode_batch_mem(&s->workers[i].batch_mem);
+    }
+
+    for (i = 0; i < CONVCODE_SCHED_MAX_WORKERS; i++)
+	pthread_mutex_destroy(&s->queues[i].lock);
+    pthread_cond_destroy(&s->idle);
+    pthread_cond_destroy(&s->work);
+    pthread_mutex_destroy(&s->lock);
+    o->free(o, s);
+}
+
+unsigned int
+convcode_sched_num_queues(struct convcode_sched *s)
+{
+    return s->nworkers;
+}
+
+unsigned long
+convcode_sched_num_batched(struct convcode_sched *s)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&s->lock);
+    n = s->batched;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+void
+convcode_sched_submit(struct convcode_sched *s,
+		      struct convcode_sched_job *job, unsigned int queue)
+{
+    struct sched_queue *q = &s->queues[queue % s->nworkers];
+
+    /* Count it first so it can't finish before it's counted. */
+    pthread_mutex_lock(&s->lock);
+    s->outstanding++;
+    pthread_mutex_unlock(&s->lock);
+
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    job->prev = q->tail;
+    if (q->tail)
+	q->tail->next = job;
+    else
+	q->head = job;
+    q->tail = job;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&s->lock);
+    s->queued++;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void
+convcode_sched_wait(struct convcode_sched *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->outstanding)
+	pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2023 Corey Minyard
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * A decode scheduler for the convolutional coder.
+ *
+ * If you have a lot of channels, each with its own coder, decoding
+ * each channel's blocks on its own thread uses the CPUs unevenly.
+ * Instead, the channels can submit decode jobs here.  There is a
+ * queue for each worker thread; a channel should always submit to the
+ * same queue so its coder stays in that CPU's cache, and workers that
+ * run out of work steal jobs from the other queues.
+ *
+ * A worker takes jobs from the front of its own queue and the back of
+ * the others.  When it takes a job it also takes up to
+ * CONVCODE_BATCH_LANES - 1 more from the same queue that can be
+ * decoded with it by convdecode_batch(): coders made from the same
+ * struct convcode_code (see alloc_convcode_from_code()) with the same
+ * tail setting, max_decode_len_bits, max uncertainty and kernel, with
+ * 32-bit path values, and with no puncturing, streaming, merge
+ * detection, or register exchange.  Other jobs are decoded one at a
+ * time with convdecode_block().  Each worker has its own batch memory
+ * (see convdecode_batch_with_mem()), so the coders don't allocate any.
+ *
+ * This uses pthreads, like convcode_os_funcs.c.  Replace it with
+ * your own if that doesn't work for you, the library doesn't need it.
+ */
+
+#ifndef CONVCODE_SCHED_H
+#define CONVCODE_SCHED_H
+
+#include "convcode.h"
+
+#define CONVCODE_SCHED_MAX_WORKERS 64
+
+/*
+ * A decode job.  Fill in ce and the frame like you would for
+ * convdecode_batch() (outbytes must be zeroed); the frame is decoded
+ * like convdecode_block() on a freshly reinitialized coder.  When it
+ * is done, frame.num_errs and rv (the return from the decode
+ * function) are set and done is called, from a worker thread, if it
+ * is not NULL.  After that the job belongs to you again.
+ *
+ * A coder can only be in one job at a time, don't submit another job
+ * with it until done has been called.  next is for the scheduler.
+ */
+struct convcode_sched_job {
+    struct convcode *ce;
+    struct convdecode_frame frame;
+    int rv;
+    void (*done)(struct convcode_sched_job *job);
+    void *user_data;
+
+    struct convcode_sched_job *next, *prev;
+};
+
+struct convcode_sched;
+
+/*
+ * Allocate a scheduler and start nworkers threads for it, one per
+ * CPU if nworkers is 0, up to CONVCODE_SCHED_MAX_WORKERS.  Returns
+ * NULL if the memory can't be allocated or no threads can be started.
+ */
+struct convcode_sched *alloc_convcode_sched(convcode_os_funcs *o,
+					    unsigned int nworkers);
+
+/*
+ * Wait for all the jobs to finish, stop the threads, and free the
+ * scheduler.
+ */
+void free_convcode_sched(struct convcode_sched *s);
+
+/* The number of queues, one per worker thread. */
+unsigned int convcode_sched_num_queues(struct convcode_sched *s);
+
+/*
+ * The number of jobs so far that were decoded together with
+ * convdecode_batch(), to see how well batching is working.
+ */
+unsigned long convcode_sched_num_batched(struct convcode_sched *s);
+
+/*
+ * Add a job to the end of queue number queue % the number of queues.
+ */
+void convcode_sched_submit(struct convcode_sched *s,
+			   struct convcode_sched_job *job, unsigned int queue);
+
+/* Wait until every job submitted so far is done. */
+void convcode_sched_wait(struct convcode_sched *s);
+
+#endif /* CONVCODE_SCHED_H */